@@ -0,0 +1,64 @@
+# ==============================================================================
+# FindLz4.cmake
+#
+# Copyright (C) 2019  xcp-emu-manager
+# Copyright (C) 2019  Vates SAS
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+# ==============================================================================
+
+# Find the lz4 library.
+#
+# This will define the following variables:
+#   LZ4_FOUND
+#   LZ4_VERSION
+#   LZ4_INCLUDE_DIRS
+#   LZ4_LIBRARIES
+#
+# and the following imported targets:
+#   Lz4::Lz4
+
+find_package(PkgConfig)
+pkg_check_modules(PC_LZ4 QUIET liblz4)
+
+find_path(LZ4_INCLUDE_DIR
+  NAMES lz4.h
+  HINTS ${PC_LZ4_INCLUDE_DIRS}
+)
+
+find_library(LZ4_LIBRARY
+  NAMES lz4 liblz4
+  HINTS ${PC_LZ4_LIBRARY_DIRS}
+)
+
+set(LZ4_VERSION ${PC_LZ4_VERSION})
+
+mark_as_advanced(LZ4_FOUND LZ4_VERSION LZ4_INCLUDE_DIR LZ4_LIBRARY)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(LZ4
+  REQUIRED_VARS LZ4_INCLUDE_DIR LZ4_LIBRARY
+  VERSION_VAR LZ4_VERSION
+)
+
+set(LZ4_INCLUDE_DIRS ${LZ4_INCLUDE_DIR})
+set(LZ4_LIBRARIES ${LZ4_LIBRARY})
+
+if (LZ4_FOUND AND NOT TARGET Lz4::Lz4)
+  add_library(Lz4::Lz4 INTERFACE IMPORTED)
+  set_target_properties(Lz4::Lz4 PROPERTIES
+    INTERFACE_INCLUDE_DIRECTORIES "${LZ4_INCLUDE_DIRS}"
+    INTERFACE_LINK_LIBRARIES "${LZ4_LIBRARIES}"
+  )
+endif ()
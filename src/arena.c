@@ -0,0 +1,120 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "logger.h"
+
+// =============================================================================
+
+#define ARENA_CHUNK_SIZE (16 * 1024)
+
+// Larger allocations get their own chunk to not waste the current one.
+#define ARENA_MAX_SHARED_ALLOC_SIZE (ARENA_CHUNK_SIZE / 4)
+
+#define ARENA_ALIGNMENT alignof(max_align_t)
+
+typedef struct ArenaChunk {
+  struct ArenaChunk *next;
+  size_t size;
+  size_t used;
+  alignas(max_align_t) char data[];
+} ArenaChunk;
+
+// Per migration, see: daemon.c.
+static __thread struct {
+  ArenaChunk *chunks; // The first one is the current chunk.
+  ArenaStats stats;
+} Arena;
+
+// -----------------------------------------------------------------------------
+
+static ArenaChunk *arena_create_chunk (size_t size) {
+  ArenaChunk *chunk = calloc(1, sizeof *chunk + size);
+  if (!chunk) {
+    syslog(LOG_ERR, "Failed to allocate arena chunk of %zu bytes.", size);
+    return NULL;
+  }
+
+  chunk->size = size;
+  Arena.stats.peakBytes += sizeof *chunk + size;
+  return chunk;
+}
+
+// -----------------------------------------------------------------------------
+
+void *arena_alloc (size_t size) {
+  if (size > SIZE_MAX - ARENA_ALIGNMENT) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+  ArenaChunk *chunk = Arena.chunks;
+  if (!chunk || chunk->size - chunk->used < size) {
+    if (size > ARENA_MAX_SHARED_ALLOC_SIZE) {
+      if (!(chunk = arena_create_chunk(size)))
+        return NULL;
+
+      // Keep the current chunk first.
+      ArenaChunk **it = Arena.chunks ? &Arena.chunks->next : &Arena.chunks;
+      chunk->next = *it;
+      *it = chunk;
+    } else {
+      if (!(chunk = arena_create_chunk(ARENA_CHUNK_SIZE)))
+        return NULL;
+      chunk->next = Arena.chunks;
+      Arena.chunks = chunk;
+    }
+  }
+
+  void *ptr = chunk->data + chunk->used;
+  chunk->used += size;
+
+  ++Arena.stats.allocCount;
+  Arena.stats.allocatedBytes += size;
+  return ptr;
+}
+
+char *arena_strndup (const char *str, size_t len) {
+  char *copy = arena_alloc(len + 1);
+  if (copy)
+    memcpy(copy, str, len); // Already NUL-terminated.
+  return copy;
+}
+
+// -----------------------------------------------------------------------------
+
+void arena_get_stats (ArenaStats *stats) {
+  *stats = Arena.stats;
+}
+
+void arena_release () {
+  for (ArenaChunk *chunk = Arena.chunks, *next; chunk; chunk = next) {
+    next = chunk->next;
+    free(chunk);
+  }
+
+  Arena.chunks = NULL;
+  Arena.stats = (ArenaStats){ 0 };
+}
@@ -0,0 +1,44 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+// =============================================================================
+// Allocator of the migration run by the current thread: memory is taken from
+// large chunks and is only given back by arena_release, at the end of the
+// migration. Allocations are zeroed.
+// =============================================================================
+
+typedef struct ArenaStats {
+  size_t allocCount;
+  size_t allocatedBytes; // Requested sizes, aligned.
+  size_t peakBytes; // Size of the chunks, memory is never reused before release.
+} ArenaStats;
+
+void *arena_alloc (size_t size);
+char *arena_strndup (const char *str, size_t len);
+
+void arena_get_stats (ArenaStats *stats);
+
+// Free all the allocations of the current thread.
+void arena_release ();
+
+#endif // ifndef _ARENA_H_
@@ -15,68 +15,51 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#define _GNU_SOURCE
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <syslog.h>
 
+#include "arena.h"
 #include "arg-list.h"
+#include "logger.h"
 
 // =============================================================================
 
-static inline ArgNode *arg_list_create_node () {
-  ArgNode *node = calloc(1, sizeof *node);
-  if (!node)
-    syslog(LOG_ERR, "Unable to alloc list node.");
-  return node;
-}
-
-static inline void arg_list_append (ArgNode **head, ArgNode *node) {
-  if (*head) {
-    ArgNode *it = *head;
-    for (; it->next; it = it->next);
-    it->next = node;
-  } else
-    *head = node;
-}
-
-// -----------------------------------------------------------------------------
+#define ARG_LIST_MIN_CAPACITY 8
 
-void arg_list_free (ArgNode *head) {
-  for (ArgNode *next; head; head = next) {
-    next = head->next;
-    free(head->key);
-    free(head->value);
-    free(head);
+// Copy key and value in a single allocation, owned by the migration arena.
+static int arg_list_append (ArgList *list, const char *key, const char *value, bool isString) {
+  if (list->count == list->capacity) {
+    const size_t capacity = list->capacity ? list->capacity * 2 : ARG_LIST_MIN_CAPACITY;
+    Arg *args = arena_alloc(capacity * sizeof *args);
+    if (!args) {
+      syslog(LOG_ERR, "Unable to grow argument list.");
+      return -1;
+    }
+    if (list->count)
+      memcpy(args, list->args, list->count * sizeof *args);
+    list->args = args;
+    list->capacity = capacity;
   }
-}
 
-int arg_list_append_str (ArgNode **head, const char *key, const char *value) {
-  ArgNode *node = arg_list_create_node();
-  if (!node) return -1;
+  const size_t keyLen = strlen(key);
+  const size_t valueLen = strlen(value);
 
-  if (!(node->key = strdup(key)) || asprintf(&node->value, "\"%s\"", value) < 0) {
-    free(node->key);
-    free(node);
+  char *buf = arena_alloc(keyLen + valueLen + 2);
+  if (!buf) {
+    syslog(LOG_ERR, "Unable to alloc argument.");
     return -1;
   }
-  arg_list_append(head, node);
+  memcpy(buf, key, keyLen + 1);
+  memcpy(buf + keyLen + 1, value, valueLen + 1);
 
+  list->args[list->count++] = (Arg){ buf, buf + keyLen + 1, keyLen, valueLen, isString };
   return 0;
 }
 
-int arg_list_append_bool (ArgNode **head, const char *key, bool value) {
-  ArgNode *node = arg_list_create_node();
-  if (!node) return -1;
+// -----------------------------------------------------------------------------
 
-  if (!(node->key = strdup(key)) || !(node->value = strdup(value ? "true" : "false"))) {
-    free(node->key);
-    free(node);
-    return -1;
-  }
-  arg_list_append(head, node);
+int arg_list_append_str (ArgList *list, const char *key, const char *value) {
+  return arg_list_append(list, key, value, true);
+}
 
-  return 0;
+int arg_list_append_bool (ArgList *list, const char *key, bool value) {
+  return arg_list_append(list, key, value ? "true" : "false", false);
 }
@@ -19,17 +19,35 @@
 #define _ARG_LIST_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
 
 // =============================================================================
+// Command arguments: a contiguous vector of key/value pairs. Lengths are
+// computed once so a command can be written without formatting.
+// Appended arguments are allocated in the migration arena.
+// =============================================================================
+
+typedef struct Arg {
+  const char *key;
+  const char *value; // Raw JSON value, or string content if isString.
+  size_t keyLen;
+  size_t valueLen;
+  bool isString;
+} Arg;
+
+typedef struct ArgList {
+  Arg *args;
+  size_t count;
+  size_t capacity;
+} ArgList;
 
-typedef struct ArgNode {
-  struct ArgNode *next;
-  char *key;
-  char *value;
-} ArgNode;
+// Argument referencing the given strings, for lists built on the stack.
+static inline Arg arg_make_raw (const char *key, const char *value) {
+  return (Arg){ key, value, strlen(key), strlen(value), false };
+}
 
-void arg_list_free (ArgNode *head);
-int arg_list_append_str (ArgNode **head, const char *key, const char *value);
-int arg_list_append_bool (ArgNode **head, const char *key, bool value);
+int arg_list_append_str (ArgList *list, const char *key, const char *value);
+int arg_list_append_bool (ArgList *list, const char *key, bool value);
 
 #endif // ifndef _ARG_LIST_H_
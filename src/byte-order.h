@@ -0,0 +1,54 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _BYTE_ORDER_H_
+#define _BYTE_ORDER_H_
+
+#include <stdint.h>
+
+// =============================================================================
+// Little-endian integers of the stream frames.
+// =============================================================================
+
+static inline void byte_order_write_le32 (char *buf, uint32_t value) {
+  for (int i = 0; i < 4; ++i)
+    buf[i] = (char)((value >> (8 * i)) & 0xFF);
+}
+
+static inline void byte_order_write_le64 (char *buf, uint64_t value) {
+  for (int i = 0; i < 8; ++i)
+    buf[i] = (char)((value >> (8 * i)) & 0xFF);
+}
+
+static inline uint32_t byte_order_read_le32 (const char *buf) {
+  const unsigned char *bytes = (const unsigned char *)buf;
+  uint32_t value = 0;
+  for (int i = 0; i < 4; ++i)
+    value |= (uint32_t)bytes[i] << (8 * i);
+  return value;
+}
+
+static inline uint64_t byte_order_read_le64 (const char *buf) {
+  const unsigned char *bytes = (const unsigned char *)buf;
+  uint64_t value = 0;
+  for (int i = 0; i < 8; ++i)
+    value |= (uint64_t)bytes[i] << (8 * i);
+  return value;
+}
+
+#endif // ifndef _BYTE_ORDER_H_
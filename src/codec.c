@@ -0,0 +1,154 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+
+#include <lz4.h>
+#include <zlib.h>
+
+#include "byte-order.h"
+#include "codec.h"
+
+// =============================================================================
+
+#define CODEC_FRAME_MAGIC "EMZ1"
+
+// Raw.
+// -----------------------------------------------------------------------------
+
+static size_t codec_none_get_bound (size_t size) {
+  return size;
+}
+
+static size_t codec_none_compress (const char *src, size_t size, char *dst, size_t capacity) {
+  if (size > capacity)
+    return 0;
+  memcpy(dst, src, size);
+  return size;
+}
+
+static int codec_none_decompress (const char *src, size_t size, char *dst, size_t rawSize) {
+  if (size != rawSize)
+    return -1;
+  memcpy(dst, src, size);
+  return 0;
+}
+
+// LZ4: fast enough to keep up with a 10 GbE link with a few threads.
+// -----------------------------------------------------------------------------
+
+static size_t codec_lz4_get_bound (size_t size) {
+  return (size_t)LZ4_compressBound((int)size);
+}
+
+static size_t codec_lz4_compress (const char *src, size_t size, char *dst, size_t capacity) {
+  const int ret = LZ4_compress_default(src, dst, (int)size, (int)capacity);
+  return ret > 0 ? (size_t)ret : 0;
+}
+
+static int codec_lz4_decompress (const char *src, size_t size, char *dst, size_t rawSize) {
+  const int ret = LZ4_decompress_safe(src, dst, (int)size, (int)rawSize);
+  return ret >= 0 && (size_t)ret == rawSize ? 0 : -1;
+}
+
+// Zlib: better ratio for slower links. The fastest level is used, the
+// higher ones cost a lot of CPU for a small gain on guest RAM.
+// -----------------------------------------------------------------------------
+
+static size_t codec_zlib_get_bound (size_t size) {
+  return (size_t)compressBound((uLong)size);
+}
+
+static size_t codec_zlib_compress (const char *src, size_t size, char *dst, size_t capacity) {
+  uLongf dstSize = (uLongf)capacity;
+  if (compress2((Bytef *)dst, &dstSize, (const Bytef *)src, (uLong)size, Z_BEST_SPEED) != Z_OK)
+    return 0;
+  return (size_t)dstSize;
+}
+
+static int codec_zlib_decompress (const char *src, size_t size, char *dst, size_t rawSize) {
+  uLongf dstSize = (uLongf)rawSize;
+  if (uncompress((Bytef *)dst, &dstSize, (const Bytef *)src, (uLong)size) != Z_OK)
+    return -1;
+  return dstSize == rawSize ? 0 : -1;
+}
+
+// -----------------------------------------------------------------------------
+
+static const Codec Codecs[] = {
+  { "none", CodecIdNone, codec_none_get_bound, codec_none_compress, codec_none_decompress },
+  { "lz4", CodecIdLz4, codec_lz4_get_bound, codec_lz4_compress, codec_lz4_decompress },
+  { "zlib", CodecIdZlib, codec_zlib_get_bound, codec_zlib_compress, codec_zlib_decompress }
+};
+
+#define CODECS_COUNT (sizeof Codecs / sizeof Codecs[0])
+
+// =============================================================================
+
+const Codec *codec_from_name (const char *name) {
+  for (size_t i = 0; i < CODECS_COUNT; ++i)
+    if (!strcmp(Codecs[i].name, name))
+      return &Codecs[i];
+  return NULL;
+}
+
+const Codec *codec_from_id (int id) {
+  for (size_t i = 0; i < CODECS_COUNT; ++i)
+    if ((int)Codecs[i].id == id)
+      return &Codecs[i];
+  return NULL;
+}
+
+// -----------------------------------------------------------------------------
+
+void codec_write_frame_header (char *buf, const CodecFrameHeader *header) {
+  memcpy(buf, CODEC_FRAME_MAGIC, 4);
+  buf[4] = (char)header->codec;
+  buf[5] = (char)header->flags;
+  buf[6] = buf[7] = 0;
+  byte_order_write_le32(buf + 8, header->rawSize);
+  byte_order_write_le32(buf + 12, header->dataSize);
+}
+
+int codec_read_frame_header (const char *buf, CodecFrameHeader *header) {
+  if (memcmp(buf, CODEC_FRAME_MAGIC, 4))
+    return -1;
+
+  const Codec *codec = codec_from_id((unsigned char)buf[4]);
+  if (!codec)
+    return -1;
+
+  header->codec = codec->id;
+  header->flags = (unsigned char)buf[5];
+  header->rawSize = byte_order_read_le32(buf + 8);
+  header->dataSize = byte_order_read_le32(buf + 12);
+
+  if (header->flags & ~CODEC_FRAME_FLAG_CHECKSUM)
+    return -1;
+
+  if (codec_frame_is_end(header))
+    return header->dataSize == 0 && header->codec == CodecIdNone && !header->flags ? 0 : -1;
+
+  if (
+    header->rawSize > CODEC_FRAME_MAX_SIZE ||
+    header->dataSize == 0 ||
+    header->dataSize > codec->get_bound(header->rawSize)
+  )
+    return -1;
+  return 0;
+}
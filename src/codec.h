@@ -0,0 +1,90 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _CODEC_H_
+#define _CODEC_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// =============================================================================
+// Codecs of the compressed streams. A compressed stream is a sequence of
+// frames, each one starts with a CodecFrameHeader and the stream ends with
+// an empty frame. So the restore side never reads beyond the emu data.
+// =============================================================================
+
+typedef enum CodecId {
+  CodecIdNone = 0, // Raw data, used when compression does not pay.
+  CodecIdLz4 = 1,
+  CodecIdZlib = 2
+} CodecId;
+
+typedef struct Codec {
+  const char *name;
+  CodecId id;
+
+  // Max size of the compressed data.
+  size_t (*get_bound)(size_t size);
+
+  // Returns the compressed size, 0 on failure.
+  size_t (*compress)(const char *src, size_t size, char *dst, size_t capacity);
+
+  // rawSize is the exact size of the decompressed data. Returns -1 if the
+  // data is corrupted.
+  int (*decompress)(const char *src, size_t size, char *dst, size_t rawSize);
+} Codec;
+
+const Codec *codec_from_name (const char *name);
+const Codec *codec_from_id (int id);
+
+// -----------------------------------------------------------------------------
+
+#define CODEC_FRAME_HEADER_SIZE 16
+
+// Max raw size of a frame, the other side rejects bigger frames.
+#define CODEC_FRAME_MAX_SIZE (4 * 1024 * 1024)
+
+// The data is followed by the little-endian CRC-32C of the raw data.
+#define CODEC_FRAME_FLAG_CHECKSUM (1 << 0)
+
+#define CODEC_FRAME_CHECKSUM_SIZE 4
+
+// Little-endian on the wire: "EMZ1", codec, flags, 2 reserved bytes, raw size, data size.
+typedef struct CodecFrameHeader {
+  CodecId codec;
+  int flags;
+  uint32_t rawSize;
+  uint32_t dataSize;
+} CodecFrameHeader;
+
+void codec_write_frame_header (char *buf, const CodecFrameHeader *header);
+
+// Returns -1 if the header is invalid.
+int codec_read_frame_header (const char *buf, CodecFrameHeader *header);
+
+static inline bool codec_frame_is_end (const CodecFrameHeader *header) {
+  return header->rawSize == 0;
+}
+
+// Size of what follows the header.
+static inline size_t codec_frame_get_payload_size (const CodecFrameHeader *header) {
+  return header->dataSize + (header->flags & CODEC_FRAME_FLAG_CHECKSUM ? CODEC_FRAME_CHECKSUM_SIZE : 0);
+}
+
+#endif // ifndef _CODEC_H_
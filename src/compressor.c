@@ -0,0 +1,623 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "byte-order.h"
+#include "compressor.h"
+#include "crc32c.h"
+#include "emu.h"
+#include "logger.h"
+#include "monotonic-clock.h"
+
+// =============================================================================
+
+#define COMPRESSOR_CHUNK_SIZE (256 * 1024)
+#define COMPRESSOR_MAX_THREADS 16
+
+// A frame is sent raw if compression does not save at least 1/16 of it.
+#define COMPRESSOR_MIN_FRAME_GAIN 16
+
+// Bypass is reconsidered after each window of frames. While bypassed,
+// a frame out of COMPRESSOR_PROBE_INTERVAL is still compressed to measure
+// the codec.
+#define COMPRESSOR_WINDOW_SIZE 32
+#define COMPRESSOR_PROBE_INTERVAL 16
+
+// Above this ratio (compressed / raw), the codec is never worth it.
+#define COMPRESSOR_MAX_RATIO 0.9
+
+typedef enum CompressorSlotState {
+  CompressorSlotFree,
+  CompressorSlotFilling,
+  CompressorSlotQueued,
+  CompressorSlotProcessing,
+  CompressorSlotDone,
+  CompressorSlotError
+} CompressorSlotState;
+
+typedef struct CompressorSlot {
+  CompressorSlotState state;
+
+  char *in;
+  size_t inCapacity;
+  size_t inSize;
+  size_t expectedSize;
+
+  char *out;
+  size_t outCapacity;
+  size_t outSize;
+  size_t outBegin;
+
+  CodecFrameHeader header; // Read on restore, written on save.
+  bool compress;
+  bool isCorrupted; // The checksum does not match.
+
+  int64_t processTime; // In us.
+  int64_t outputStart;
+} CompressorSlot;
+
+struct Compressor {
+  const Codec *codec;
+  bool isSave;
+  bool useChecksum;
+  int eventFd;
+
+  pthread_t threads[COMPRESSOR_MAX_THREADS];
+  int threadsCount;
+
+  // Ring of slots, the used ones are in [head, head + used).
+  CompressorSlot *slots;
+  size_t slotsCount;
+  size_t head;
+  size_t used;
+  bool hasFillingSlot;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t queued;
+  bool stop;
+
+  // Bypass of the codec, save only.
+  bool isBypassed;
+  uint64_t submitted;
+  struct {
+    uint64_t frames;
+    uint64_t rawBytes;      // Of the compressed frames.
+    uint64_t dataBytes;     // Of the compressed frames.
+    int64_t processTime;    // Of the compressed frames.
+    uint64_t outputBytes;
+    int64_t outputTime;
+  } window;
+
+  CompressorStats stats;
+};
+
+// Per migration, see: daemon.c.
+static __thread struct {
+  const Codec *codec;
+  int threads;
+  bool useChecksum;
+} Config;
+
+// =============================================================================
+
+int compressor_set_codec (const char *name) {
+  const Codec *codec = codec_from_name(name);
+  if (!codec) {
+    syslog(LOG_ERR, "Unknown compression codec: `%s`.", name);
+    EmuError = EINVAL;
+    return -1;
+  }
+
+  Config.codec = codec->id == CodecIdNone ? NULL : codec;
+  return 0;
+}
+
+int compressor_set_threads (int threads) {
+  if (threads <= 0 || threads > COMPRESSOR_MAX_THREADS) {
+    syslog(LOG_ERR, "Compression threads count must be in [1, %d]: %d.", COMPRESSOR_MAX_THREADS, threads);
+    EmuError = EINVAL;
+    return -1;
+  }
+
+  Config.threads = threads;
+  return 0;
+}
+
+void compressor_enable_checksum () {
+  Config.useChecksum = true;
+}
+
+bool compressor_is_checksum_enabled () {
+  return Config.useChecksum;
+}
+
+const Codec *compressor_get_codec () {
+  return Config.codec;
+}
+
+int compressor_get_threads () {
+  if (Config.threads)
+    return Config.threads;
+
+  // By default, half of the CPUs: the emus and the other migrations need CPU too.
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus <= 2)
+    return 1;
+  return cpus / 2 > COMPRESSOR_MAX_THREADS ? COMPRESSOR_MAX_THREADS : (int)(cpus / 2);
+}
+
+// =============================================================================
+// Workers.
+// =============================================================================
+
+static inline CompressorSlot *compressor_get_slot (const Compressor *compressor, size_t index) {
+  return &compressor->slots[(compressor->head + index) % compressor->slotsCount];
+}
+
+// The oldest queued slot first, so the output is not delayed.
+static CompressorSlot *compressor_find_queued_slot (const Compressor *compressor) {
+  for (size_t i = 0; i < compressor->used; ++i) {
+    CompressorSlot *slot = compressor_get_slot(compressor, i);
+    if (slot->state == CompressorSlotQueued)
+      return slot;
+  }
+  return NULL;
+}
+
+static void compressor_compress_slot (const Compressor *compressor, CompressorSlot *slot) {
+  size_t dataSize = 0;
+  if (slot->compress) {
+    dataSize = compressor->codec->compress(
+      slot->in, slot->inSize, slot->out + CODEC_FRAME_HEADER_SIZE, slot->outCapacity - CODEC_FRAME_HEADER_SIZE
+    );
+    if (dataSize >= slot->inSize - slot->inSize / COMPRESSOR_MIN_FRAME_GAIN)
+      dataSize = 0;
+  }
+
+  slot->header.rawSize = (uint32_t)slot->inSize;
+  slot->header.flags = 0;
+  if (dataSize) {
+    slot->header.codec = compressor->codec->id;
+    slot->header.dataSize = (uint32_t)dataSize;
+  } else {
+    memcpy(slot->out + CODEC_FRAME_HEADER_SIZE, slot->in, slot->inSize);
+    slot->header.codec = CodecIdNone;
+    slot->header.dataSize = (uint32_t)slot->inSize;
+  }
+
+  slot->outSize = CODEC_FRAME_HEADER_SIZE + slot->header.dataSize;
+  if (compressor->useChecksum) {
+    slot->header.flags |= CODEC_FRAME_FLAG_CHECKSUM;
+    byte_order_write_le32(slot->out + slot->outSize, crc32c(0, slot->in, slot->inSize));
+    slot->outSize += CODEC_FRAME_CHECKSUM_SIZE;
+  }
+
+  codec_write_frame_header(slot->out, &slot->header);
+}
+
+static int compressor_decompress_slot (CompressorSlot *slot) {
+  const Codec *codec = codec_from_id(slot->header.codec);
+  assert(codec);
+
+  if (codec->decompress(slot->in, slot->header.dataSize, slot->out, slot->header.rawSize) < 0)
+    return -1;
+  slot->outSize = slot->header.rawSize;
+
+  // Verified after the decompression to detect codec bugs too.
+  if (
+    (slot->header.flags & CODEC_FRAME_FLAG_CHECKSUM) &&
+    crc32c(0, slot->out, slot->outSize) != byte_order_read_le32(slot->in + slot->header.dataSize)
+  ) {
+    slot->isCorrupted = true;
+    return -1;
+  }
+  return 0;
+}
+
+static void *compressor_worker (void *userData) {
+  Compressor *compressor = userData;
+
+  pthread_mutex_lock(&compressor->mutex);
+  for (;;) {
+    CompressorSlot *slot;
+    while (!compressor->stop && !(slot = compressor_find_queued_slot(compressor)))
+      pthread_cond_wait(&compressor->queued, &compressor->mutex);
+    if (compressor->stop)
+      break;
+
+    slot->state = CompressorSlotProcessing;
+    pthread_mutex_unlock(&compressor->mutex);
+
+    const int64_t start = monotonic_clock_us();
+    int ret = 0;
+    if (compressor->isSave)
+      compressor_compress_slot(compressor, slot);
+    else
+      ret = compressor_decompress_slot(slot);
+    slot->processTime = monotonic_clock_us() - start;
+
+    pthread_mutex_lock(&compressor->mutex);
+    slot->state = ret < 0 ? CompressorSlotError : CompressorSlotDone;
+
+    const uint64_t value = 1;
+    if (write(compressor->eventFd, &value, sizeof value) < 0 && errno != EAGAIN)
+      syslog(LOG_ERR, "Failed to notify processed chunk: `%s`.", strerror(errno));
+  }
+  pthread_mutex_unlock(&compressor->mutex);
+
+  return NULL;
+}
+
+// =============================================================================
+// Bypass.
+// =============================================================================
+
+// Called with the lock.
+static bool compressor_should_compress (Compressor *compressor) {
+  if (compressor->codec->id == CodecIdNone)
+    return false;
+
+  ++compressor->submitted;
+  return !compressor->isBypassed || compressor->submitted % COMPRESSOR_PROBE_INTERVAL == 0;
+}
+
+// Pipelined, the throughput is bounded by the codec or by the link. Without
+// codec, the link is the limit. The link rate is measured by the time taken
+// to write each frame, so it is overestimated if the link is idle: then the
+// compression is useless anyway.
+static void compressor_update_bypass (Compressor *compressor) {
+  if (compressor->window.frames < COMPRESSOR_WINDOW_SIZE)
+    return;
+
+  if (compressor->window.rawBytes && compressor->window.processTime > 0) {
+    const double ratio = (double)compressor->window.dataBytes / (double)compressor->window.rawBytes;
+    const double codecRate = (double)compressor->window.rawBytes / (double)compressor->window.processTime * compressor->threadsCount;
+    const double linkRate = compressor->window.outputTime > 0
+      ? (double)compressor->window.outputBytes / (double)compressor->window.outputTime
+      : codecRate * 2;
+
+    const double rawLinkRate = linkRate / ratio;
+    const bool isBypassed = ratio > COMPRESSOR_MAX_RATIO || (codecRate < rawLinkRate ? codecRate : rawLinkRate) <= linkRate;
+    if (isBypassed != compressor->isBypassed) {
+      syslog(
+        LOG_INFO, "Compression %s: ratio=%.2f codec=%.0fMiB/s link=%.0fMiB/s.",
+        isBypassed ? "bypassed" : "resumed", ratio, codecRate * 1e6 / (1024 * 1024), linkRate * 1e6 / (1024 * 1024)
+      );
+      compressor->isBypassed = isBypassed;
+    }
+  }
+
+  memset(&compressor->window, 0, sizeof compressor->window);
+}
+
+// =============================================================================
+
+static int compressor_reserve (char **buf, size_t *capacity, size_t size) {
+  if (*capacity >= size)
+    return 0;
+
+  char *newBuf = realloc(*buf, size);
+  if (!newBuf)
+    return -1;
+  *buf = newBuf;
+  *capacity = size;
+  return 0;
+}
+
+int compressor_create (Compressor **compressor, const Codec *codec, int threads, bool isSave) {
+  assert(threads > 0 && threads <= COMPRESSOR_MAX_THREADS);
+
+  Compressor *newCompressor = calloc(1, sizeof *newCompressor);
+  if (!newCompressor) {
+    syslog(LOG_ERR, "Failed to allocate compressor.");
+    EmuError = errno;
+    return -1;
+  }
+
+  newCompressor->codec = codec;
+  newCompressor->isSave = isSave;
+  newCompressor->useChecksum = Config.useChecksum;
+  newCompressor->eventFd = -1;
+  pthread_mutex_init(&newCompressor->mutex, NULL);
+  pthread_cond_init(&newCompressor->queued, NULL);
+
+  // Enough slots to keep the workers busy while the oldest one is written.
+  newCompressor->slotsCount = (size_t)threads * 2 + 1;
+  if (!(newCompressor->slots = calloc(newCompressor->slotsCount, sizeof *newCompressor->slots)))
+    goto fail;
+
+  // On restore, the buffers are allocated for each frame size.
+  if (isSave)
+    for (size_t i = 0; i < newCompressor->slotsCount; ++i) {
+      CompressorSlot *slot = &newCompressor->slots[i];
+      const size_t bound = codec->get_bound(COMPRESSOR_CHUNK_SIZE);
+      if (
+        compressor_reserve(&slot->in, &slot->inCapacity, COMPRESSOR_CHUNK_SIZE) < 0 ||
+        compressor_reserve(
+          &slot->out,
+          &slot->outCapacity,
+          CODEC_FRAME_HEADER_SIZE + (bound > COMPRESSOR_CHUNK_SIZE ? bound : COMPRESSOR_CHUNK_SIZE) + CODEC_FRAME_CHECKSUM_SIZE
+        ) < 0
+      )
+        goto fail;
+    }
+
+  if ((newCompressor->eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+    goto fail;
+
+  for (; newCompressor->threadsCount < threads; ++newCompressor->threadsCount) {
+    const int error = pthread_create(&newCompressor->threads[newCompressor->threadsCount], NULL, compressor_worker, newCompressor);
+    if (error) {
+      errno = error;
+      goto fail;
+    }
+  }
+
+  syslog(
+    LOG_INFO, "%s stream with %s codec and %d thread(s)%s.", isSave ? "Compressing" : "Decompressing", codec->name, threads,
+    newCompressor->useChecksum ? ", with CRC-32C checksums" : ""
+  );
+  *compressor = newCompressor;
+  return 0;
+
+fail:
+  syslog(LOG_ERR, "Failed to create compressor: `%s`.", strerror(errno));
+  EmuError = errno;
+  compressor_destroy(newCompressor);
+  return -1;
+}
+
+void compressor_destroy (Compressor *compressor) {
+  pthread_mutex_lock(&compressor->mutex);
+  compressor->stop = true;
+  pthread_cond_broadcast(&compressor->queued);
+  pthread_mutex_unlock(&compressor->mutex);
+
+  for (int i = 0; i < compressor->threadsCount; ++i)
+    pthread_join(compressor->threads[i], NULL);
+
+  if (compressor->slots)
+    for (size_t i = 0; i < compressor->slotsCount; ++i) {
+      free(compressor->slots[i].in);
+      free(compressor->slots[i].out);
+    }
+  free(compressor->slots);
+
+  if (compressor->eventFd > -1)
+    close(compressor->eventFd);
+
+  pthread_cond_destroy(&compressor->queued);
+  pthread_mutex_destroy(&compressor->mutex);
+  free(compressor);
+}
+
+// -----------------------------------------------------------------------------
+
+int compressor_get_event_fd (const Compressor *compressor) {
+  return compressor->eventFd;
+}
+
+void compressor_clear_event (Compressor *compressor) {
+  uint64_t value;
+  if (read(compressor->eventFd, &value, sizeof value) < 0 && errno != EAGAIN)
+    syslog(LOG_ERR, "Failed to clear compressor event: `%s`.", strerror(errno));
+}
+
+// -----------------------------------------------------------------------------
+
+// Called with the lock.
+static CompressorSlot *compressor_get_filling_slot (Compressor *compressor) {
+  if (compressor->hasFillingSlot)
+    return compressor_get_slot(compressor, compressor->used - 1);
+
+  if (compressor->used == compressor->slotsCount)
+    return NULL;
+
+  CompressorSlot *slot = compressor_get_slot(compressor, compressor->used);
+  slot->state = CompressorSlotFilling;
+  slot->inSize = 0;
+  slot->expectedSize = COMPRESSOR_CHUNK_SIZE;
+  ++compressor->used;
+  compressor->hasFillingSlot = true;
+  return slot;
+}
+
+// Called with the lock.
+static void compressor_submit (Compressor *compressor, CompressorSlot *slot) {
+  if (compressor->isSave)
+    slot->compress = compressor_should_compress(compressor);
+
+  slot->state = CompressorSlotQueued;
+  compressor->hasFillingSlot = false;
+  pthread_cond_signal(&compressor->queued);
+}
+
+char *compressor_get_input (Compressor *compressor, size_t *capacity) {
+  // On restore, a slot is filling only after compressor_set_frame.
+  if (!compressor->isSave && !compressor->hasFillingSlot)
+    return NULL;
+
+  pthread_mutex_lock(&compressor->mutex);
+  CompressorSlot *slot = compressor_get_filling_slot(compressor);
+  pthread_mutex_unlock(&compressor->mutex);
+  if (!slot)
+    return NULL;
+
+  *capacity = slot->expectedSize - slot->inSize;
+  return slot->in + slot->inSize;
+}
+
+void compressor_fill (Compressor *compressor, size_t size) {
+  assert(compressor->hasFillingSlot);
+
+  pthread_mutex_lock(&compressor->mutex);
+  CompressorSlot *slot = compressor_get_slot(compressor, compressor->used - 1);
+  assert(slot->inSize + size <= slot->expectedSize);
+  if ((slot->inSize += size) == slot->expectedSize)
+    compressor_submit(compressor, slot);
+  pthread_mutex_unlock(&compressor->mutex);
+}
+
+void compressor_flush (Compressor *compressor) {
+  assert(compressor->isSave);
+
+  pthread_mutex_lock(&compressor->mutex);
+  if (compressor->hasFillingSlot) {
+    CompressorSlot *slot = compressor_get_slot(compressor, compressor->used - 1);
+    if (slot->inSize)
+      compressor_submit(compressor, slot);
+    else {
+      // Nothing to send, the slot is released.
+      slot->state = CompressorSlotFree;
+      --compressor->used;
+      compressor->hasFillingSlot = false;
+    }
+  }
+  pthread_mutex_unlock(&compressor->mutex);
+}
+
+int compressor_set_frame (Compressor *compressor, const CodecFrameHeader *header) {
+  assert(!compressor->isSave && !compressor->hasFillingSlot);
+
+  pthread_mutex_lock(&compressor->mutex);
+  CompressorSlot *slot = compressor_get_filling_slot(compressor);
+  pthread_mutex_unlock(&compressor->mutex);
+  assert(slot);
+
+  // A stream without checksums is not accepted when they are expected.
+  if (compressor->useChecksum && !(header->flags & CODEC_FRAME_FLAG_CHECKSUM)) {
+    syslog(LOG_ERR, "Received a frame without checksum.");
+    EmuError = EBADMSG;
+    return -1;
+  }
+
+  // The slot is not visible by the workers until it is submitted.
+  const size_t payloadSize = codec_frame_get_payload_size(header);
+  if (
+    compressor_reserve(&slot->in, &slot->inCapacity, payloadSize) < 0 ||
+    compressor_reserve(&slot->out, &slot->outCapacity, header->rawSize) < 0
+  ) {
+    syslog(LOG_ERR, "Failed to allocate chunk of %u bytes.", header->rawSize);
+    EmuError = errno;
+    return -1;
+  }
+
+  slot->header = *header;
+  slot->expectedSize = payloadSize;
+  slot->isCorrupted = false;
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+int compressor_get_output (Compressor *compressor, const char **data, size_t *size) {
+  *data = NULL;
+  *size = 0;
+
+  pthread_mutex_lock(&compressor->mutex);
+  CompressorSlot *slot = compressor->used ? compressor_get_slot(compressor, 0) : NULL;
+  const CompressorSlotState state = slot ? slot->state : CompressorSlotFree;
+  pthread_mutex_unlock(&compressor->mutex);
+
+  if (state == CompressorSlotError) {
+    if (slot->isCorrupted)
+      syslog(LOG_ERR, "Checksum mismatch in a chunk of %u bytes.", slot->header.rawSize);
+    else
+      syslog(LOG_ERR, "Failed to decompress a chunk of %u bytes.", slot->header.dataSize);
+    EmuError = EBADMSG;
+    return -1;
+  }
+
+  if (state == CompressorSlotDone) {
+    if (slot->outBegin == 0)
+      slot->outputStart = monotonic_clock_us();
+    *data = slot->out + slot->outBegin;
+    *size = slot->outSize - slot->outBegin;
+  }
+  return 0;
+}
+
+void compressor_consume_output (Compressor *compressor, size_t size) {
+  CompressorSlot *slot = compressor_get_slot(compressor, 0);
+  assert(compressor->used && slot->state == CompressorSlotDone);
+  assert(slot->outBegin + size <= slot->outSize);
+
+  if ((slot->outBegin += size) < slot->outSize)
+    return;
+
+  pthread_mutex_lock(&compressor->mutex);
+
+  CompressorStats *stats = &compressor->stats;
+  ++stats->frames;
+  stats->rawBytes += slot->header.rawSize;
+  stats->dataBytes += slot->header.dataSize;
+  if (slot->header.codec == CodecIdNone)
+    ++stats->rawFrames;
+
+  if (compressor->isSave) {
+    ++compressor->window.frames;
+    if (slot->compress) {
+      compressor->window.rawBytes += slot->header.rawSize;
+      compressor->window.dataBytes += slot->header.dataSize;
+      compressor->window.processTime += slot->processTime;
+    }
+    compressor->window.outputBytes += slot->outSize;
+    compressor->window.outputTime += monotonic_clock_us() - slot->outputStart;
+    compressor_update_bypass(compressor);
+  }
+
+  slot->state = CompressorSlotFree;
+  slot->outBegin = 0;
+  compressor->head = (compressor->head + 1) % compressor->slotsCount;
+  --compressor->used;
+
+  pthread_mutex_unlock(&compressor->mutex);
+}
+
+// -----------------------------------------------------------------------------
+
+bool compressor_has_input (const Compressor *compressor) {
+  return compressor->hasFillingSlot;
+}
+
+bool compressor_is_full (const Compressor *compressor) {
+  return compressor->used == compressor->slotsCount;
+}
+
+bool compressor_is_empty (const Compressor *compressor) {
+  return !compressor->used;
+}
+
+bool compressor_is_idle (const Compressor *compressor) {
+  return compressor->used == (compressor->hasFillingSlot ? 1 : 0);
+}
+
+void compressor_get_stats (Compressor *compressor, CompressorStats *stats) {
+  pthread_mutex_lock(&compressor->mutex);
+  *stats = compressor->stats;
+  pthread_mutex_unlock(&compressor->mutex);
+}
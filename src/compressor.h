@@ -0,0 +1,100 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _COMPRESSOR_H_
+#define _COMPRESSOR_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "codec.h"
+
+// =============================================================================
+// Compression stage of the relay: chunks are (de)compressed in parallel by a
+// pool of workers and their output is returned in order. On save, the
+// compression is bypassed while it is a loss, see: compressor_should_compress.
+// Only the relay thread uses a Compressor.
+// =============================================================================
+
+typedef struct CompressorStats {
+  uint64_t frames;
+  uint64_t rawFrames; // Bypassed or incompressible.
+  uint64_t rawBytes;
+  uint64_t dataBytes; // Frame payloads.
+} CompressorStats;
+
+typedef struct Compressor Compressor;
+
+// -----------------------------------------------------------------------------
+
+// Per migration, see: daemon.c. The "none" codec disables the compression.
+int compressor_set_codec (const char *name);
+int compressor_set_threads (int threads);
+
+// Save: add a CRC-32C to each frame. Restore: require and verify them.
+void compressor_enable_checksum ();
+bool compressor_is_checksum_enabled ();
+
+// Returns NULL if the compression is disabled.
+const Codec *compressor_get_codec ();
+int compressor_get_threads ();
+
+// -----------------------------------------------------------------------------
+
+int compressor_create (Compressor **compressor, const Codec *codec, int threads, bool isSave);
+void compressor_destroy (Compressor *compressor);
+
+// Readable when a chunk is processed.
+int compressor_get_event_fd (const Compressor *compressor);
+void compressor_clear_event (Compressor *compressor);
+
+// Returns the free space of the chunk being filled or NULL if all the
+// chunks are used. On restore, the frame must be set first.
+char *compressor_get_input (Compressor *compressor, size_t *capacity);
+
+// A chunk is processed as soon as it is full.
+void compressor_fill (Compressor *compressor, size_t size);
+
+// Save: process the chunk being filled even if it is not full.
+void compressor_flush (Compressor *compressor);
+
+// Restore: the next chunk is the payload of this frame.
+// The compressor must not be full.
+int compressor_set_frame (Compressor *compressor, const CodecFrameHeader *header);
+
+// Returns the output of the oldest chunk, if processed. data is NULL
+// otherwise. Returns -1 if the chunk cannot be decompressed.
+int compressor_get_output (Compressor *compressor, const char **data, size_t *size);
+void compressor_consume_output (Compressor *compressor, size_t size);
+
+// A chunk is being filled.
+bool compressor_has_input (const Compressor *compressor);
+
+// All the chunks are used.
+bool compressor_is_full (const Compressor *compressor);
+
+// No chunk is used.
+bool compressor_is_empty (const Compressor *compressor);
+
+// No chunk is processed or waiting to be consumed.
+bool compressor_is_idle (const Compressor *compressor);
+
+void compressor_get_stats (Compressor *compressor, CompressorStats *stats);
+
+#endif // ifndef _COMPRESSOR_H_
@@ -17,61 +17,185 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
 #include <stdio.h>
-#include <syslog.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <xcp-ng/generic.h>
 
 #include "control.h"
 #include "emu-client.h"
 #include "emu.h"
+#include "io-buffer.h"
+#include "logger.h"
+#include "monotonic-clock.h"
 
 // =============================================================================
 
-static struct {
+#define CONTROL_BUF_SIZE 128
+#define CONTROL_MAX_BUF_SIZE (64 * 1024)
+
+#define CONTROL_DEFAULT_PROGRESS_INTERVAL 500
+
+#define CONTROL_FLUSH_TIMEOUT 120000
+
+// One extended progress per emu.
+#define CONTROL_MAX_PROGRESS_INFOS 4
+
+typedef struct ControlPendingInfo {
+  const char *emuName;
+  ControlProgressInfo info;
+  bool isPending;
+} ControlPendingInfo;
+
+// Per migration, see: daemon.c.
+static __thread struct {
   int fdIn;
   int fdOut;
+  int fdOutFlags; // Restored by control_clean.
 
-  char bufIn[128];
-  size_t bufSize;
+  IoBuffer bufIn;
   bool waitingAck;
+
+  // Messages not yet accepted by the non-blocking fdOut.
+  IoBuffer bufOut;
+
+  // Progress is coalesced: only the last value is sent, at most once per interval.
+  int progressInterval; // In ms.
+  int pendingProgress;
+  int sentProgress;
+  int64_t sentProgressTime; // In ms.
+
+  bool extendedProgress;
+  ControlPendingInfo infos[CONTROL_MAX_PROGRESS_INFOS];
+  bool hasPendingInfos;
 } Xenopsd;
 
 // -----------------------------------------------------------------------------
 
 // Low routine to receive messages.
 static inline int control_recv (int timeout) {
-  assert(Xenopsd.bufSize <= sizeof Xenopsd.bufIn);
-  if (Xenopsd.bufSize == sizeof Xenopsd.bufIn) {
-    syslog(LOG_ERR, "Not enough space to read from xenopsd.");
-    EmuError = ENOSPC;
-    return -1;
-  }
+  const int ret = io_buffer_wait_read(&Xenopsd.bufIn, Xenopsd.fdIn, timeout);
+  if (ret > 0)
+    return ret;
 
-  const XcpError ret = xcp_fd_wait_read(
-    Xenopsd.fdIn,
-    Xenopsd.bufIn + Xenopsd.bufSize,
-    sizeof Xenopsd.bufIn - Xenopsd.bufSize,
-    timeout
-  );
-  if (ret == XCP_ERR_TIMEOUT) {
+  if (ret == 0) {
+    syslog(LOG_ERR, "Failed to read from xenopsd. Broken pipe.");
+    EmuError = EPIPE;
+  } else if (errno == ETIME) {
     syslog(LOG_ERR, "Failed to read from xenopsd because timeout reached.");
     EmuError = ETIME;
-  } else if (ret == XCP_ERR_ERRNO) {
+  } else if (errno == EMSGSIZE) {
+    syslog(LOG_ERR, "Not enough space to read from xenopsd.");
+    EmuError = ENOSPC;
+  } else {
     syslog(LOG_ERR, "Failed to read from xenopsd: `%s`.", strerror(errno));
     EmuError = errno;
-  } else if (ret == 0) {
-    syslog(LOG_ERR, "Failed to read from xenopsd. Broken pipe.");
-    EmuError = EPIPE;
-  } else {
-    Xenopsd.bufSize += (size_t)ret;
-    return (int)ret;
   }
 
   return -1;
 }
 
-// Low routine to send a control message.
+// Write queued messages without blocking.
+static int control_write () {
+  while (io_buffer_size(&Xenopsd.bufOut)) {
+    const ssize_t ret = write(Xenopsd.fdOut, io_buffer_data(&Xenopsd.bufOut), io_buffer_size(&Xenopsd.bufOut));
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+        return 0;
+
+      syslog(LOG_ERR, "Failed to write to xenopsd: `%s`.", strerror(errno));
+      EmuError = errno;
+      return -1;
+    }
+    io_buffer_consume(&Xenopsd.bufOut, (size_t)ret);
+  }
+  return 0;
+}
+
+static int control_queue (const char *buf, int len) {
+  if (len < 0 || io_buffer_append(&Xenopsd.bufOut, buf, (size_t)len) < 0) {
+    syslog(LOG_ERR, "Failed to queue progress: `%s`.", strerror(errno));
+    EmuError = errno;
+    return -1;
+  }
+  return 0;
+}
+
+static int control_write_progress () {
+  const int progress = Xenopsd.pendingProgress;
+  if ((progress < 0 && !Xenopsd.hasPendingInfos) || io_buffer_size(&Xenopsd.bufOut))
+    return 0;
+
+  const int64_t now = monotonic_clock_us() / 1000;
+  if (Xenopsd.sentProgressTime && now - Xenopsd.sentProgressTime < Xenopsd.progressInterval)
+    return 0;
+
+  char buf[256];
+  if (progress > -1) {
+    if (control_queue(buf, snprintf(buf, sizeof buf, "info:\\b\\b\\b\\b%d\n", progress)) < 0)
+      return -1;
+    Xenopsd.pendingProgress = -1;
+    Xenopsd.sentProgress = progress;
+  }
+
+  ControlPendingInfo *pending;
+  foreach (pending, Xenopsd.infos) {
+    if (!pending->isPending)
+      continue;
+
+    const ControlProgressInfo *info = &pending->info;
+    if (control_queue(buf, snprintf(buf, sizeof buf, "info:emu %s rate=%" PRId64 " eta=%" PRId64 " dirty=%" PRId64 " iteration=%d phase=%s\n",
+      pending->emuName, info->transferRate, info->eta, info->dirtyRate, info->iteration, info->phase
+    )) < 0)
+      return -1;
+    pending->isPending = false;
+  }
+  Xenopsd.hasPendingInfos = false;
+
+  Xenopsd.sentProgressTime = now;
+  return control_write();
+}
+
+static void control_drop_progress () {
+  Xenopsd.pendingProgress = -1;
+
+  ControlPendingInfo *pending;
+  foreach (pending, Xenopsd.infos)
+    pending->isPending = false;
+  Xenopsd.hasPendingInfos = false;
+}
+
+// Wait until all the queued messages are written.
+static int control_flush (int timeout) {
+  const int64_t deadline = monotonic_clock_us() / 1000 + timeout;
+  while (io_buffer_size(&Xenopsd.bufOut)) {
+    struct pollfd pfd = { .fd = Xenopsd.fdOut, .events = POLLOUT };
+    const int remaining = (int)(deadline - monotonic_clock_us() / 1000);
+    const int ret = poll(&pfd, 1, remaining > 0 ? remaining : 0);
+    if (ret == 0) {
+      syslog(LOG_ERR, "Failed to write to xenopsd because timeout reached.");
+      EmuError = ETIME;
+      return -1;
+    }
+    if (ret < 0 && errno != EINTR) {
+      syslog(LOG_ERR, "Failed to poll xenopsd: `%s`.", strerror(errno));
+      EmuError = errno;
+      return -1;
+    }
+    if (control_write() < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Low routine to send a control message: it's queued before the pending
+// progress and written as soon as possible.
 static inline int control_send (const char *message) {
   syslog(LOG_DEBUG, "Sending to xenopsd `%s`...", message);
 
@@ -80,33 +204,30 @@ static inline int control_send (const char *message) {
     return -1;
   }
 
-  const size_t len = strlen(message);
-  size_t offset;
-  if (xcp_fd_write_all(Xenopsd.fdOut, message, len, &offset) == XCP_ERR_ERRNO) {
-    syslog(LOG_ERR, "Failed to write to xenopsd: `%s`.", strerror(errno));
+  if (io_buffer_append(&Xenopsd.bufOut, message, strlen(message)) < 0) {
+    syslog(LOG_ERR, "Failed to queue message for xenopsd: `%s`.", strerror(errno));
     EmuError = errno;
     return -1;
   }
-  return 0;
+  return control_write();
 }
 
 static inline int control_process_messages () {
   syslog(LOG_DEBUG, "Processing xenopsd messages...");
 
   static const char restore[] = "restore:";
+  static const char bandwidth[] = "bandwidth:";
 
   int error = 0;
 
-  char *nextMessage;
   int processedMessages = 0;
 
-  char *message = Xenopsd.bufIn;
   do {
     // 1. Read a message and replace new line char to NULL.
-    nextMessage = memchr(message, '\n', Xenopsd.bufSize);
+    char *message = io_buffer_data(&Xenopsd.bufIn);
+    char *nextMessage = memchr(message, '\n', io_buffer_size(&Xenopsd.bufIn));
     if (!nextMessage) {
-      memmove(Xenopsd.bufIn, message, Xenopsd.bufSize);
-      if (Xenopsd.bufSize == sizeof Xenopsd.bufIn) {
+      if (io_buffer_is_full(&Xenopsd.bufIn)) {
         syslog(LOG_ERR, "Unable to process xenopsd message. Buffer is so big!");
         EmuError = EMSGSIZE;
         return -1;
@@ -140,6 +261,12 @@ static inline int control_process_messages () {
         else
           error = EmuError;
       }
+    } else if (!strncmp(message, bandwidth, sizeof bandwidth - 1)) {
+      // Limits of the relayed save streams, can be sent at any time.
+      if (emu_manager_set_stream_bandwidth(message + sizeof bandwidth - 1) > -1)
+        ++processedMessages;
+      else
+        error = EmuError;
     } else if (!strcmp(message, "abort")) {
       syslog(LOG_DEBUG, "Received abort command from xenopsd.");
       error = ESHUTDOWN;
@@ -148,12 +275,10 @@ static inline int control_process_messages () {
       error = EINVAL;
     }
 
-    // 3. Set new message pointer.
-    Xenopsd.bufSize -= (size_t)(nextMessage - message);
-    message = nextMessage;
+    // 3. Release the message.
+    io_buffer_consume(&Xenopsd.bufIn, (size_t)(nextMessage - message));
   } while (!error);
 
-  memmove(Xenopsd.bufIn, nextMessage, Xenopsd.bufSize);
   if (error) {
     EmuError = error;
     return -1;
@@ -163,21 +288,76 @@ static inline int control_process_messages () {
 
 // -----------------------------------------------------------------------------
 
-int control_init (int fdIn, int fdOut) {
+int control_init (int fdIn, int fdOut, int progressInterval, bool extendedProgress) {
+  // Messages are queued when xenopsd is slow to read.
+  const int flags = fcntl(fdOut, F_GETFL);
+  if (flags < 0 || fcntl(fdOut, F_SETFL, flags | O_NONBLOCK) < 0) {
+    syslog(LOG_ERR, "Failed to set non-blocking control fd: `%s`.", strerror(errno));
+    EmuError = errno;
+    return -1;
+  }
+
   Xenopsd.fdIn = fdIn;
   Xenopsd.fdOut = fdOut;
-  Xenopsd.bufSize = 0;
+  Xenopsd.fdOutFlags = flags;
+  io_buffer_init(&Xenopsd.bufIn, CONTROL_BUF_SIZE, CONTROL_MAX_BUF_SIZE);
   Xenopsd.waitingAck = false;
 
+  io_buffer_init(&Xenopsd.bufOut, CONTROL_BUF_SIZE, CONTROL_MAX_BUF_SIZE);
+  Xenopsd.progressInterval = progressInterval < 0 ? CONTROL_DEFAULT_PROGRESS_INTERVAL : progressInterval;
+  Xenopsd.pendingProgress = -1;
+  Xenopsd.sentProgress = -1;
+  Xenopsd.sentProgressTime = 0;
+
+  Xenopsd.extendedProgress = extendedProgress;
+  memset(Xenopsd.infos, 0, sizeof Xenopsd.infos);
+  Xenopsd.hasPendingInfos = false;
+
   return 0;
 }
 
+void control_clean () {
+  if (io_buffer_size(&Xenopsd.bufOut))
+    syslog(LOG_ERR, "Dropping %zu bytes not sent to xenopsd.", io_buffer_size(&Xenopsd.bufOut));
+
+  io_buffer_free(&Xenopsd.bufIn);
+  io_buffer_free(&Xenopsd.bufOut);
+
+  // The fd can be shared with the caller, e.g. the stdout of xenopsd.
+  if (fcntl(Xenopsd.fdOut, F_SETFL, Xenopsd.fdOutFlags) < 0)
+    syslog(LOG_ERR, "Failed to restore flags of control fd: `%s`.", strerror(errno));
+}
+
 // -----------------------------------------------------------------------------
 
 int control_get_fd_in () {
   return Xenopsd.fdIn;
 }
 
+int control_get_fd_out () {
+  return Xenopsd.fdOut;
+}
+
+// -----------------------------------------------------------------------------
+
+bool control_has_pending_output () {
+  return io_buffer_size(&Xenopsd.bufOut);
+}
+
+int control_get_progress_delay () {
+  if (Xenopsd.pendingProgress < 0 && !Xenopsd.hasPendingInfos)
+    return -1;
+  if (!Xenopsd.sentProgressTime)
+    return 0;
+
+  const int64_t delay = Xenopsd.sentProgressTime + Xenopsd.progressInterval - monotonic_clock_us() / 1000;
+  return delay > 0 ? (int)delay : 0;
+}
+
+int control_process_output () {
+  return control_write() < 0 ? -1 : control_write_progress();
+}
+
 // -----------------------------------------------------------------------------
 
 int control_receive_and_process_messages (int timeout) {
@@ -201,7 +381,7 @@ int control_send_prepare (const char *emuName) {
   if (snprintf(buf, sizeof buf, "prepare:%s\n", emuName) < 0) {
     syslog(LOG_ERR, "Failed to fill control_send_prepare buffer: `%s`.", strerror(errno));
     EmuError = errno;
-  } else if (control_send(buf) > -1) {
+  } else if (control_send(buf) > -1 && control_flush(CONTROL_FLUSH_TIMEOUT) > -1) {
     Xenopsd.waitingAck = true;
     return control_receive_and_process_messages(120000);
   }
@@ -210,29 +390,43 @@ int control_send_prepare (const char *emuName) {
 }
 
 int control_send_suspend () {
-  if (control_send("suspend:\n") < 0)
+  if (control_send("suspend:\n") < 0 || control_flush(CONTROL_FLUSH_TIMEOUT) < 0)
     return -1;
   Xenopsd.waitingAck = true;
   return control_receive_and_process_messages(120000);
 }
 
 int control_send_progress (int progress) {
-  static int previousProgress = -1;
-  if (previousProgress != progress) {
-    int error = 0;
-    char buf[128];
-    if (snprintf(buf, sizeof buf, "info:\\b\\b\\b\\b%d\n", progress) < 0) {
-      syslog(LOG_ERR, "Failed to format progress buffer: `%s`.", strerror(errno));
-      error = errno;
-    } else
-      error = control_send(buf);
-
-    previousProgress = progress;
-    if (!error)
-      return progress;
+  if (progress != Xenopsd.sentProgress)
+    Xenopsd.pendingProgress = progress;
+  else
+    Xenopsd.pendingProgress = -1;
+
+  if (control_process_output() < 0)
+    return -1;
+  return progress;
+}
+
+int control_send_progress_info (const char *emuName, const ControlProgressInfo *info) {
+  if (!Xenopsd.extendedProgress)
+    return 0;
+
+  ControlPendingInfo *pending;
+  foreach (pending, Xenopsd.infos)
+    if (!pending->emuName || !strcmp(pending->emuName, emuName))
+      break;
+  if (pending == Xenopsd.infos + XCP_ARRAY_LEN(Xenopsd.infos)) {
+    syslog(LOG_ERR, "Too many emus for extended progress.");
+    EmuError = ENOSPC;
+    return -1;
   }
 
-  return previousProgress;
+  pending->emuName = emuName;
+  pending->info = *info;
+  pending->isPending = true;
+  Xenopsd.hasPendingInfos = true;
+
+  return control_process_output();
 }
 
 int control_send_result (const char *emuName, const char *result) {
@@ -262,28 +456,45 @@ int control_send_result (const char *emuName, const char *result) {
 }
 
 int control_send_final_result () {
-  if (control_send("result:0 0\n") < 0)
+  // Progress is useless now.
+  control_drop_progress();
+  if (control_send("result:0 0\n") < 0 || control_flush(CONTROL_FLUSH_TIMEOUT) < 0)
     return -1;
   return 0;
 }
 
+int control_flush_results () {
+  control_drop_progress();
+  return control_flush(CONTROL_FLUSH_TIMEOUT);
+}
+
 int control_report_error (int emuErrorCode) {
   const char *emuName = NULL;
+  char status[32] = "";
   Emu *emu = emu_manager_find_first_failed();
   if (emu) {
     emuErrorCode = emu->errorCode;
     emuName = emu->name;
+
+    // Exact exit status of a dead emu.
+    if (emu->hasExited && emuErrorCode == EmuErrorExitedWithErr)
+      snprintf(status, sizeof status, " (code %d)", WEXITSTATUS(emu->exitStatus));
+    else if (emu->hasExited && emuErrorCode == EmuErrorKilled)
+      snprintf(status, sizeof status, " (signal %d)", WTERMSIG(emu->exitStatus));
   }
 
   if (!emuName)
     emuName = "";
 
   char buf[128];
-  if (snprintf(buf, sizeof buf, "error:%s%s%s\n", emuName, *emuName ? " " : "", emu_error_code_to_str(emuErrorCode)) < 0) {
+  if (snprintf(buf, sizeof buf, "error:%s%s%s%s\n", emuName, *emuName ? " " : "", emu_error_code_to_str(emuErrorCode), status) < 0) {
     syslog(LOG_ERR, "Unable to report error: `%s`.", strerror(errno));
     EmuError = errno;
     return -1;
   }
   syslog(LOG_INFO, "Reporting: `%s`...", buf);
-  return control_send(buf);
+  control_drop_progress();
+  if (control_send(buf) < 0)
+    return -1;
+  return control_flush(CONTROL_FLUSH_TIMEOUT);
 }
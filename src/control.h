@@ -18,15 +18,38 @@
 #ifndef _CONTROL_H_
 #define _CONTROL_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+
 // =============================================================================
 // Xenopsd client.
 // See: https://wiki.xenproject.org/wiki/Xenopsd
 // See: https://github.com/xapi-project/xenopsd
 // =============================================================================
 
-int control_init (int fdIn, int fdOut);
+// Extended progress of an emu: rates are in the unit of the `sent` values
+// of the emu per second. Unknown values are -1.
+typedef struct ControlProgressInfo {
+  int64_t transferRate;
+  int64_t dirtyRate;
+  int64_t eta; // In s.
+  int iteration;
+  const char *phase;
+} ControlProgressInfo;
+
+// Progress interval in ms, < 0 for the default. Extended progress messages
+// are only sent if enabled.
+int control_init (int fdIn, int fdOut, int progressInterval, bool extendedProgress);
+void control_clean ();
 
 int control_get_fd_in ();
+int control_get_fd_out ();
+
+// Messages are written without blocking: the output must be processed
+// when fdOut is writable and when the pending progress delay expires.
+bool control_has_pending_output ();
+int control_get_progress_delay (); // In ms, -1 if no progress is pending.
+int control_process_output ();
 
 // Receive and process messages. Waiting ACK if needed.
 int control_receive_and_process_messages (int timeout);
@@ -34,9 +57,16 @@ int control_receive_and_process_messages (int timeout);
 int control_send_prepare (const char *emuName);
 int control_send_suspend ();
 int control_send_progress (int progress);
+
+// Coalesced with the progress: the last info of each emu is sent with it as
+// `info:emu <name> rate=<n> eta=<s> dirty=<n> iteration=<n> phase=<phase>`.
+int control_send_progress_info (const char *emuName, const ControlProgressInfo *info);
 int control_send_result (const char *emuName, const char *result);
 int control_send_final_result ();
 
+// End of a restore: wait until the results of the emus are written.
+int control_flush_results ();
+
 int control_report_error (int emuErrorCode);
 
 #endif // ifndef _CONTROL_H_
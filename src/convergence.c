@@ -0,0 +1,314 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+
+#include <xcp-ng/generic.h>
+
+#include "convergence.h"
+#include "emu.h"
+#include "logger.h"
+#include "monotonic-clock.h"
+
+// =============================================================================
+
+// Weight of the last measure in the smoothed rates.
+#define RATE_SMOOTH_RATIO 0.5
+
+// Legacy threshold values.
+#define THRESHOLD_REMAINING 50
+#define THRESHOLD_ITERATIONS 4
+
+// An iteration without at least 10% of remaining reduction is a stalled iteration.
+#define STALLED_PROGRESS_RATIO 0.9
+#define STALLED_ITERATIONS 2
+
+// Auto-converge steps, in percentage of guest CPU time.
+#define THROTTLE_INITIAL 20
+#define THROTTLE_INCREMENT 10
+#define THROTTLE_MAX 99
+#define THROTTLE_OVERRUN_ITERATIONS 2
+
+typedef ConvergenceVerdict (*ConvergencePolicyCb)(const ConvergenceModel *model);
+
+// Per migration, see: daemon.c.
+static __thread struct {
+  unsigned int policies; // ConvergencePolicy flags.
+
+  // Accepted duration of the stop-and-copy stage.
+  int64_t targetDowntime; // In ms.
+  bool hasDowntimeBudget;
+
+  // Live stage is always stopped after this iteration.
+  int maxIterations;
+
+  bool autoConverge;
+
+  // Pre-copy iterations before post-copy, 0 if disabled.
+  int postCopyIterations;
+} Convergence = {
+  .policies = ConvergencePolicyRate | ConvergencePolicyNoProgress,
+  .targetDowntime = 300,
+  .maxIterations = 8
+};
+
+// =============================================================================
+// Policies.
+// =============================================================================
+
+// Old rule: few dirty pages or too many iterations.
+static ConvergenceVerdict convergence_policy_threshold (const ConvergenceModel *model) {
+  return model->remaining <= THRESHOLD_REMAINING || model->iteration >= THRESHOLD_ITERATIONS
+    ? ConvergenceVerdictDone
+    : ConvergenceVerdictContinue;
+}
+
+// Stop when the remaining dirty set can be sent in the accepted downtime.
+static ConvergenceVerdict convergence_policy_rate (const ConvergenceModel *model) {
+  const int64_t downtime = convergence_model_predict_downtime(model);
+  return downtime > -1 && downtime <= Convergence.targetDowntime
+    ? ConvergenceVerdictDone
+    : ConvergenceVerdictContinue;
+}
+
+// Stop when the guest dirties pages as fast as we can send them.
+static ConvergenceVerdict convergence_policy_no_progress (const ConvergenceModel *model) {
+  return model->stalledIterations >= STALLED_ITERATIONS
+    ? ConvergenceVerdictStalled
+    : ConvergenceVerdictContinue;
+}
+
+static const struct {
+  const char *name;
+  ConvergencePolicy flag;
+  ConvergencePolicyCb cb;
+} Policies[] = {
+  { "threshold", ConvergencePolicyThreshold, convergence_policy_threshold },
+  { "rate", ConvergencePolicyRate, convergence_policy_rate },
+  { "no-progress", ConvergencePolicyNoProgress, convergence_policy_no_progress }
+};
+
+// -----------------------------------------------------------------------------
+
+static inline double convergence_smooth (double previous, double value) {
+  return previous > 0.0 ? previous + (value - previous) * RATE_SMOOTH_RATIO : value;
+}
+
+// =============================================================================
+
+int convergence_set_policies (const char *names) {
+  char *buf = strdup(names);
+  if (!buf) {
+    syslog(LOG_ERR, "Failed to copy convergence policies.");
+    EmuError = errno;
+    return -1;
+  }
+
+  unsigned int policies = 0;
+  char *savePtr;
+  for (char *name = strtok_r(buf, ",", &savePtr); name; name = strtok_r(NULL, ",", &savePtr)) {
+    size_t i = 0;
+    for (; i < XCP_ARRAY_LEN(Policies) && strcmp(name, Policies[i].name); ++i);
+    if (i == XCP_ARRAY_LEN(Policies)) {
+      syslog(LOG_ERR, "Unknown convergence policy: `%s`.", name);
+      free(buf);
+      EmuError = EINVAL;
+      return -1;
+    }
+    policies |= Policies[i].flag;
+  }
+  free(buf);
+
+  if (!policies) {
+    syslog(LOG_ERR, "At least one convergence policy must be used.");
+    EmuError = EINVAL;
+    return -1;
+  }
+
+  Convergence.policies = policies;
+  return 0;
+}
+
+int convergence_set_max_downtime (int downtime) {
+  if (downtime <= 0) {
+    syslog(LOG_ERR, "Max downtime must be positive: %d.", downtime);
+    EmuError = EINVAL;
+    return -1;
+  }
+
+  Convergence.targetDowntime = downtime;
+  Convergence.hasDowntimeBudget = true;
+  return 0;
+}
+
+void convergence_enable_auto_converge () {
+  Convergence.autoConverge = true;
+}
+
+int convergence_set_postcopy (int iterations) {
+  if (iterations <= 0) {
+    syslog(LOG_ERR, "Post-copy iterations count must be positive: %d.", iterations);
+    EmuError = EINVAL;
+    return -1;
+  }
+
+  Convergence.postCopyIterations = iterations;
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+void convergence_model_reset (ConvergenceModel *model) {
+  *model = (ConvergenceModel){
+    .lastSent = -1,
+    .iteration = -1,
+    .remaining = -1
+  };
+}
+
+void convergence_model_update (ConvergenceModel *model, int iteration, int64_t sent, int64_t remaining) {
+  const int64_t now = monotonic_clock_us();
+
+  // 1. Transfer rate. Sent value can be reset by the emu, in this case
+  // the new value is the amount of data sent since the reset.
+  if (sent > -1) {
+    if (model->lastTime && model->lastSent > -1 && now > model->lastTime) {
+      const int64_t delta = sent >= model->lastSent ? sent - model->lastSent : sent;
+      if (delta > 0)
+        model->transferRate = convergence_smooth(
+          model->transferRate, (double)delta * 1e6 / (double)(now - model->lastTime)
+        );
+    }
+    model->lastSent = sent;
+  }
+  model->lastTime = now;
+
+  if (iteration < 0 || remaining < 0)
+    return;
+
+  // 2. Dirty rate. At the start of a new iteration, the remaining value is the
+  // amount of data dirtied during the previous one.
+  if (iteration > model->iteration) {
+    if (model->iteration > -1 && now > model->iterationStartTime) {
+      model->dirtyRate = convergence_smooth(
+        model->dirtyRate, (double)remaining * 1e6 / (double)(now - model->iterationStartTime)
+      );
+
+      // The first iteration sends all the memory, so the reduction between
+      // the first and second one is not significant.
+      if (model->iteration > 0 && (double)remaining >= (double)model->remaining * STALLED_PROGRESS_RATIO)
+        ++model->stalledIterations;
+      else
+        model->stalledIterations = 0;
+
+      // The throttle is increased at each iteration where the guest still
+      // dirties memory faster than we can send it.
+      if (model->dirtyRate > model->transferRate)
+        ++model->overrunIterations;
+      else
+        model->overrunIterations = 0;
+
+      if (
+        Convergence.autoConverge &&
+        model->overrunIterations >= THROTTLE_OVERRUN_ITERATIONS &&
+        model->throttle < THROTTLE_MAX
+      ) {
+        model->throttle = model->throttle ? model->throttle + THROTTLE_INCREMENT : THROTTLE_INITIAL;
+        if (model->throttle > THROTTLE_MAX)
+          model->throttle = THROTTLE_MAX;
+      }
+    }
+
+    model->iteration = iteration;
+    model->iterationStartTime = now;
+  }
+
+  model->remaining = remaining;
+}
+
+int64_t convergence_model_predict_downtime (const ConvergenceModel *model) {
+  if (model->remaining < 0 || !(model->transferRate > 0.0))
+    return -1;
+  return (int64_t)((double)model->remaining * 1e3 / model->transferRate);
+}
+
+// -----------------------------------------------------------------------------
+
+static ConvergenceVerdict convergence_check_pre_copy (const ConvergenceModel *model) {
+  // Nothing to decide during the first (full) iteration.
+  if (model->iteration <= 0)
+    return ConvergenceVerdictContinue;
+
+  // With a budget, the predicted downtime is the only accepted criterion.
+  if (Convergence.hasDowntimeBudget) {
+    if (convergence_policy_rate(model) == ConvergenceVerdictDone)
+      return ConvergenceVerdictDone;
+    return model->iteration >= Convergence.maxIterations
+      ? ConvergenceVerdictOverBudget
+      : ConvergenceVerdictContinue;
+  }
+
+  for (size_t i = 0; i < XCP_ARRAY_LEN(Policies); ++i) {
+    if (!(Convergence.policies & Policies[i].flag))
+      continue;
+
+    ConvergenceVerdict verdict = (*Policies[i].cb)(model);
+
+    // Let a chance to the throttle to reduce the dirty rate.
+    if (verdict == ConvergenceVerdictStalled && Convergence.autoConverge && model->throttle < THROTTLE_MAX)
+      verdict = ConvergenceVerdictContinue;
+
+    if (verdict != ConvergenceVerdictContinue) {
+      syslog(LOG_DEBUG, "Convergence policy `%s` returns `%s`.", Policies[i].name, convergence_verdict_to_str(verdict));
+      return verdict;
+    }
+  }
+
+  // Pre-copy did not converge in time.
+  return model->iteration >= Convergence.maxIterations
+    ? ConvergenceVerdictStalled
+    : ConvergenceVerdictContinue;
+}
+
+ConvergenceVerdict convergence_check (const ConvergenceModel *model) {
+  const ConvergenceVerdict verdict = convergence_check_pre_copy(model);
+  if (!Convergence.postCopyIterations || verdict == ConvergenceVerdictDone)
+    return verdict;
+
+  if (
+    verdict == ConvergenceVerdictStalled ||
+    verdict == ConvergenceVerdictOverBudget ||
+    model->iteration >= Convergence.postCopyIterations
+  )
+    return ConvergenceVerdictPostCopy;
+
+  return verdict;
+}
+
+const char *convergence_verdict_to_str (ConvergenceVerdict verdict) {
+  static const char *verdicts[] = {
+    "continue",
+    "done",
+    "stalled",
+    "over budget",
+    "post-copy"
+  };
+  return verdicts[verdict];
+}
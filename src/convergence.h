@@ -0,0 +1,108 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CONVERGENCE_H_
+#define _CONVERGENCE_H_
+
+#include <stdint.h>
+
+// =============================================================================
+// Convergence engine: decide when the live stage of an emu must be stopped.
+// See: https://www.usenix.org/legacy/event/nsdi05/tech/full_papers/clark/clark.pdf
+// =============================================================================
+
+typedef enum ConvergenceVerdict {
+  // Continue to iterate, the remaining dirty set is not small enough.
+  ConvergenceVerdictContinue,
+
+  // The remaining dirty set can be copied in the stop-and-copy stage.
+  ConvergenceVerdictDone,
+
+  // More iterations do not reduce the remaining dirty set.
+  ConvergenceVerdictStalled,
+
+  // The downtime budget cannot be met in the max iterations count.
+  ConvergenceVerdictOverBudget,
+
+  // Pre-copy cannot finish in time, the remaining pages must be post-copied.
+  ConvergenceVerdictPostCopy
+} ConvergenceVerdict;
+
+// Flags of the pre-copy policies, see: convergence_set_policies.
+typedef enum ConvergencePolicy {
+  // Few dirty pages or too many iterations.
+  ConvergencePolicyThreshold = 1 << 0,
+
+  // The remaining dirty set can be sent in the accepted downtime.
+  ConvergencePolicyRate = 1 << 1,
+
+  // The guest dirties pages as fast as we can send them.
+  ConvergencePolicyNoProgress = 1 << 2
+} ConvergencePolicy;
+
+// Rates are expressed in the unit of the `sent`/`remaining` values
+// given by the emu, per second.
+typedef struct ConvergenceModel {
+  int64_t lastTime; // In us, 0 if no event was received.
+  int64_t lastSent;
+
+  int iteration;
+  int64_t iterationStartTime;
+  int64_t remaining;
+
+  // Smoothed rates.
+  double transferRate;
+  double dirtyRate;
+
+  // Count of consecutive iterations without significant progress.
+  int stalledIterations;
+
+  // Auto-converge: count of consecutive iterations where the dirty rate
+  // is greater than the transfer rate and the wanted guest throttle (%).
+  int overrunIterations;
+  int throttle;
+} ConvergenceModel;
+
+// -----------------------------------------------------------------------------
+
+// Enable the given policies. List of names separated by commas.
+// Supported: threshold, rate, no-progress.
+int convergence_set_policies (const char *names);
+
+// Only stop the live stage when the predicted downtime fits in this budget.
+int convergence_set_max_downtime (int downtime);
+
+// Throttle the guest when it dirties memory faster than it can be sent.
+void convergence_enable_auto_converge ();
+
+// Switch to post-copy after this count of pre-copy iterations, or before if
+// pre-copy cannot converge.
+int convergence_set_postcopy (int iterations);
+
+void convergence_model_reset (ConvergenceModel *model);
+
+// Update model with a MIGRATION event. Negative values are unknown.
+void convergence_model_update (ConvergenceModel *model, int iteration, int64_t sent, int64_t remaining);
+
+// Estimated duration of the stop-and-copy stage in ms or -1 if unknown.
+int64_t convergence_model_predict_downtime (const ConvergenceModel *model);
+
+ConvergenceVerdict convergence_check (const ConvergenceModel *model);
+
+const char *convergence_verdict_to_str (ConvergenceVerdict verdict);
+
+#endif // ifndef _CONVERGENCE_H_
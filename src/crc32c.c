@@ -0,0 +1,516 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+  #include <immintrin.h>
+#elif defined(__aarch64__)
+  #include <arm_acle.h>
+  #include <arm_neon.h>
+  #include <sys/auxv.h>
+#endif
+
+#include "crc32c.h"
+
+// =============================================================================
+
+// Reflected polynomial.
+#define CRC32C_POLY 0x82F63B78
+#define CRC32C_NORMAL_POLY 0x1EDC6F41
+
+// Block sizes of the interleaved streams. The CRCs of the streams are
+// combined by shifting them over the following blocks, see: crc32c_shift.
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+// The 512-bit lanes pay only on large buffers: below, their setup and the
+// lower clock of some CPUs running AVX-512 cost more than the 128-bit lanes.
+#define CRC32C_FOLD_512_MIN_SIZE (64 * 1024)
+
+#define CRC32C_AUTO_NAME "auto"
+
+#define CRC32C_MAX_IMPLEMENTATIONS 5
+
+typedef uint32_t (*Crc32cUpdate)(uint32_t crc, const unsigned char *data, size_t size);
+
+static struct {
+  uint32_t table[8][256];
+  uint32_t longShift[4][256];
+  uint32_t shortShift[4][256];
+  uint64_t fold128[2];
+  uint64_t fold512[2];
+  uint64_t fold2048[2];
+  Crc32cUpdate update;
+  const char *implementation;
+
+  // Chosen by size by the auto implementation.
+  Crc32cUpdate smallUpdate;
+  Crc32cUpdate largeUpdate;
+
+  // Supported by the CPU, the selected one last.
+  const char *names[CRC32C_MAX_IMPLEMENTATIONS + 1];
+  Crc32cUpdate updates[CRC32C_MAX_IMPLEMENTATIONS];
+  int count;
+} Crc32c;
+
+static pthread_once_t Crc32cOnce = PTHREAD_ONCE_INIT;
+
+// =============================================================================
+// Slicing-by-8.
+// =============================================================================
+
+static inline uint64_t crc32c_read_u64 (const unsigned char *data) {
+  uint64_t value;
+  memcpy(&value, data, sizeof value);
+  return value;
+}
+
+static uint32_t crc32c_update_table (uint32_t crc, const unsigned char *data, size_t size) {
+  for (; size && ((uintptr_t)data & 7); --size)
+    crc = Crc32c.table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+  for (; size >= 8; size -= 8, data += 8) {
+    // Little-endian only, like all the hosts of XCP-ng.
+    const uint64_t value = crc32c_read_u64(data) ^ crc;
+    crc = Crc32c.table[7][value & 0xFF] ^
+      Crc32c.table[6][(value >> 8) & 0xFF] ^
+      Crc32c.table[5][(value >> 16) & 0xFF] ^
+      Crc32c.table[4][(value >> 24) & 0xFF] ^
+      Crc32c.table[3][(value >> 32) & 0xFF] ^
+      Crc32c.table[2][(value >> 40) & 0xFF] ^
+      Crc32c.table[1][(value >> 48) & 0xFF] ^
+      Crc32c.table[0][value >> 56];
+  }
+
+  for (; size; --size)
+    crc = Crc32c.table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
+
+// =============================================================================
+// Shift of a CRC over zeros, computed with matrices over GF(2).
+// =============================================================================
+
+static uint32_t crc32c_matrix_times (const uint32_t *matrix, uint32_t vector) {
+  uint32_t sum = 0;
+  for (; vector; vector >>= 1, ++matrix)
+    if (vector & 1)
+      sum ^= *matrix;
+  return sum;
+}
+
+static void crc32c_matrix_square (uint32_t *square, const uint32_t *matrix) {
+  for (int i = 0; i < 32; ++i)
+    square[i] = crc32c_matrix_times(matrix, matrix[i]);
+}
+
+// Operator to append size zero bytes to a CRC, size is a power of 2.
+static void crc32c_zeros_operator (uint32_t *even, size_t size) {
+  // One zero bit.
+  uint32_t odd[32];
+  odd[0] = CRC32C_POLY;
+  for (int i = 1; i < 32; ++i)
+    odd[i] = 1u << (i - 1);
+
+  crc32c_matrix_square(even, odd); // 2 bits.
+  crc32c_matrix_square(odd, even); // 4 bits.
+
+  // The first square gives one byte in even, then each square doubles it.
+  for (;;) {
+    crc32c_matrix_square(even, odd);
+    if (!(size >>= 1))
+      return;
+    crc32c_matrix_square(odd, even);
+    if (!(size >>= 1))
+      break;
+  }
+  memcpy(even, odd, sizeof odd);
+}
+
+static void crc32c_init_shift (uint32_t shift[4][256], size_t size) {
+  uint32_t operator[32];
+  crc32c_zeros_operator(operator, size);
+  for (uint32_t i = 0; i < 256; ++i)
+    for (int j = 0; j < 4; ++j)
+      shift[j][i] = crc32c_matrix_times(operator, i << (8 * j));
+}
+
+static inline uint32_t crc32c_shift (const uint32_t shift[4][256], uint32_t crc) {
+  return shift[0][crc & 0xFF] ^ shift[1][(crc >> 8) & 0xFF] ^ shift[2][(crc >> 16) & 0xFF] ^ shift[3][crc >> 24];
+}
+
+// =============================================================================
+// CRC instructions.
+// =============================================================================
+
+#if defined(__x86_64__)
+  #define CRC32C_HW_TARGET __attribute__((target("sse4.2")))
+  #define CRC32C_HW_NAME "sse4.2"
+
+  static inline CRC32C_HW_TARGET uint32_t crc32c_hw_u8 (uint32_t crc, unsigned char value) {
+    return _mm_crc32_u8(crc, value);
+  }
+
+  static inline CRC32C_HW_TARGET uint32_t crc32c_hw_u64 (uint32_t crc, uint64_t value) {
+    return (uint32_t)_mm_crc32_u64(crc, value);
+  }
+
+  static bool crc32c_hw_is_supported () {
+    return __builtin_cpu_supports("sse4.2");
+  }
+#elif defined(__aarch64__)
+  #define CRC32C_HW_TARGET __attribute__((target("+crc")))
+  #define CRC32C_HW_NAME "armv8-crc"
+
+  static inline CRC32C_HW_TARGET uint32_t crc32c_hw_u8 (uint32_t crc, unsigned char value) {
+    return __crc32cb(crc, value);
+  }
+
+  static inline CRC32C_HW_TARGET uint32_t crc32c_hw_u64 (uint32_t crc, uint64_t value) {
+    return __crc32cd(crc, value);
+  }
+
+  static bool crc32c_hw_is_supported () {
+    return getauxval(AT_HWCAP) & HWCAP_CRC32;
+  }
+#endif
+
+#ifdef CRC32C_HW_TARGET
+
+// Three independent streams keep the CRC unit busy: one instruction per
+// cycle instead of one per latency.
+static inline CRC32C_HW_TARGET uint32_t crc32c_update_hw_blocks (
+  uint32_t crc, const unsigned char **data, size_t *size, size_t blockSize, const uint32_t shift[4][256]
+) {
+  const unsigned char *it = *data;
+  for (; *size >= 3 * blockSize; *size -= 3 * blockSize) {
+    uint32_t crc1 = 0;
+    uint32_t crc2 = 0;
+    for (const unsigned char *end = it + blockSize; it < end; it += 8) {
+      crc = crc32c_hw_u64(crc, crc32c_read_u64(it));
+      crc1 = crc32c_hw_u64(crc1, crc32c_read_u64(it + blockSize));
+      crc2 = crc32c_hw_u64(crc2, crc32c_read_u64(it + 2 * blockSize));
+    }
+    crc = crc32c_shift(shift, crc) ^ crc1;
+    crc = crc32c_shift(shift, crc) ^ crc2;
+    it += 2 * blockSize;
+  }
+  *data = it;
+  return crc;
+}
+
+static CRC32C_HW_TARGET uint32_t crc32c_update_hw (uint32_t crc, const unsigned char *data, size_t size) {
+  for (; size && ((uintptr_t)data & 7); --size)
+    crc = crc32c_hw_u8(crc, *data++);
+
+  crc = crc32c_update_hw_blocks(crc, &data, &size, CRC32C_LONG, Crc32c.longShift);
+  crc = crc32c_update_hw_blocks(crc, &data, &size, CRC32C_SHORT, Crc32c.shortShift);
+
+  for (; size >= 8; size -= 8, data += 8)
+    crc = crc32c_hw_u64(crc, crc32c_read_u64(data));
+
+  for (; size; --size)
+    crc = crc32c_hw_u8(crc, *data++);
+  return crc;
+}
+
+#endif // ifdef CRC32C_HW_TARGET
+
+// -----------------------------------------------------------------------------
+// Folding of 128-bit lanes with carry-less multiplications: it is not bounded
+// by the CRC unit. The last lane is reduced by the CRC instructions.
+// -----------------------------------------------------------------------------
+
+#if defined(__x86_64__)
+  #define CRC32C_FOLD_TARGET __attribute__((target("sse4.2,pclmul")))
+  #define CRC32C_FOLD_NAME "sse4.2-pclmulqdq"
+
+  typedef __m128i Crc32cLane;
+
+  static inline CRC32C_FOLD_TARGET __m128i crc32c_fold_128 (__m128i value, __m128i constants, __m128i next) {
+    return _mm_xor_si128(
+      _mm_xor_si128(_mm_clmulepi64_si128(value, constants, 0x00), _mm_clmulepi64_si128(value, constants, 0x11)), next
+    );
+  }
+
+  static inline CRC32C_FOLD_TARGET __m128i crc32c_load_lane (const unsigned char *data) {
+    return _mm_loadu_si128((const __m128i *)(const void *)data);
+  }
+
+  static inline CRC32C_FOLD_TARGET __m128i crc32c_load_fold_constants (const uint64_t constants[2]) {
+    return _mm_set_epi64x((long long)constants[1], (long long)constants[0]);
+  }
+
+  // The CRC is the xor of the first 32 bits of the data with a null CRC.
+  static inline CRC32C_FOLD_TARGET __m128i crc32c_xor_lane_crc (__m128i value, uint32_t crc) {
+    return _mm_xor_si128(value, _mm_cvtsi32_si128((int)crc));
+  }
+
+  static inline CRC32C_FOLD_TARGET uint32_t crc32c_reduce_lane (__m128i value) {
+    const uint32_t crc = crc32c_hw_u64(0, (uint64_t)_mm_cvtsi128_si64(value));
+    return crc32c_hw_u64(crc, (uint64_t)_mm_extract_epi64(value, 1));
+  }
+
+  static bool crc32c_fold_is_supported () {
+    return crc32c_hw_is_supported() && __builtin_cpu_supports("pclmul");
+  }
+#elif defined(__aarch64__)
+  #define CRC32C_FOLD_TARGET __attribute__((target("+crc+crypto")))
+  #define CRC32C_FOLD_NAME "armv8-pmull"
+
+  typedef uint64x2_t Crc32cLane;
+
+  static inline CRC32C_FOLD_TARGET uint64x2_t crc32c_fold_128 (uint64x2_t value, uint64x2_t constants, uint64x2_t next) {
+    const poly64x2_t a = vreinterpretq_p64_u64(value);
+    const poly64x2_t b = vreinterpretq_p64_u64(constants);
+    const poly128_t low = vmull_p64(vgetq_lane_p64(a, 0), vgetq_lane_p64(b, 0));
+    const poly128_t high = vmull_high_p64(a, b);
+    return veorq_u64(veorq_u64(vreinterpretq_u64_p128(low), vreinterpretq_u64_p128(high)), next);
+  }
+
+  static inline CRC32C_FOLD_TARGET uint64x2_t crc32c_load_lane (const unsigned char *data) {
+    return vreinterpretq_u64_u8(vld1q_u8(data));
+  }
+
+  static inline CRC32C_FOLD_TARGET uint64x2_t crc32c_load_fold_constants (const uint64_t constants[2]) {
+    return vld1q_u64(constants);
+  }
+
+  static inline CRC32C_FOLD_TARGET uint64x2_t crc32c_xor_lane_crc (uint64x2_t value, uint32_t crc) {
+    return veorq_u64(value, vsetq_lane_u64(crc, vdupq_n_u64(0), 0));
+  }
+
+  static inline CRC32C_FOLD_TARGET uint32_t crc32c_reduce_lane (uint64x2_t value) {
+    const uint32_t crc = crc32c_hw_u64(0, vgetq_lane_u64(value, 0));
+    return crc32c_hw_u64(crc, vgetq_lane_u64(value, 1));
+  }
+
+  static bool crc32c_fold_is_supported () {
+    return crc32c_hw_is_supported() && (getauxval(AT_HWCAP) & HWCAP_PMULL);
+  }
+#endif
+
+#ifdef CRC32C_FOLD_TARGET
+
+// 4 lanes per iteration hide the latency of the multiplications.
+static CRC32C_FOLD_TARGET uint32_t crc32c_update_fold (uint32_t crc, const unsigned char *data, size_t size) {
+  if (size < 64)
+    return crc32c_update_hw(crc, data, size);
+
+  const Crc32cLane k512 = crc32c_load_fold_constants(Crc32c.fold512);
+  const Crc32cLane k128 = crc32c_load_fold_constants(Crc32c.fold128);
+
+  Crc32cLane x0 = crc32c_xor_lane_crc(crc32c_load_lane(data), crc);
+  Crc32cLane x1 = crc32c_load_lane(data + 16);
+  Crc32cLane x2 = crc32c_load_lane(data + 32);
+  Crc32cLane x3 = crc32c_load_lane(data + 48);
+  data += 64;
+  size -= 64;
+
+  for (; size >= 64; data += 64, size -= 64) {
+    x0 = crc32c_fold_128(x0, k512, crc32c_load_lane(data));
+    x1 = crc32c_fold_128(x1, k512, crc32c_load_lane(data + 16));
+    x2 = crc32c_fold_128(x2, k512, crc32c_load_lane(data + 32));
+    x3 = crc32c_fold_128(x3, k512, crc32c_load_lane(data + 48));
+  }
+
+  x0 = crc32c_fold_128(x0, k128, x1);
+  x0 = crc32c_fold_128(x0, k128, x2);
+  x0 = crc32c_fold_128(x0, k128, x3);
+  for (; size >= 16; data += 16, size -= 16)
+    x0 = crc32c_fold_128(x0, k128, crc32c_load_lane(data));
+
+  return crc32c_update_hw(crc32c_reduce_lane(x0), data, size);
+}
+
+// x^n mod P, with the bit of x^d at 63 - d like the reflected data.
+static uint64_t crc32c_get_fold_constant (uint32_t n) {
+  uint32_t value = 1;
+  while (n--)
+    value = (value << 1) ^ (value & 0x80000000 ? CRC32C_NORMAL_POLY : 0);
+
+  uint64_t reflected = 0;
+  for (int i = 0; i < 32; ++i)
+    if (value & (1u << i))
+      reflected |= (uint64_t)1 << (63 - i);
+  return reflected;
+}
+
+// A lane is moved forward by distance bits: its first half by x^(distance + 64)
+// and its second half by x^distance. The product of two reflected values is
+// multiplied by x, so each exponent is decremented.
+static void crc32c_init_fold (uint64_t constants[2], uint32_t distance) {
+  constants[0] = crc32c_get_fold_constant(distance + 63);
+  constants[1] = crc32c_get_fold_constant(distance - 1);
+}
+
+#endif // ifdef CRC32C_FOLD_TARGET
+
+// -----------------------------------------------------------------------------
+
+// Same with 4 lanes per instruction.
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 8)
+  #define CRC32C_FOLD_512_TARGET __attribute__((target("sse4.2,pclmul,avx512f,vpclmulqdq")))
+
+static inline CRC32C_FOLD_512_TARGET __m512i crc32c_fold_512 (__m512i value, __m512i constants, __m512i next) {
+  return _mm512_ternarylogic_epi64(
+    _mm512_clmulepi64_epi128(value, constants, 0x00), _mm512_clmulepi64_epi128(value, constants, 0x11), next, 0x96
+  );
+}
+
+static CRC32C_FOLD_512_TARGET uint32_t crc32c_update_fold_512 (uint32_t crc, const unsigned char *data, size_t size) {
+  if (size < 256)
+    return crc32c_update_fold(crc, data, size);
+
+  const __m512i k2048 = _mm512_broadcast_i32x4(crc32c_load_fold_constants(Crc32c.fold2048));
+  const __m512i k512 = _mm512_broadcast_i32x4(crc32c_load_fold_constants(Crc32c.fold512));
+  const __m128i k128 = crc32c_load_fold_constants(Crc32c.fold128);
+
+  __m512i z0 = _mm512_xor_si512(
+    _mm512_loadu_si512(data), _mm512_inserti32x4(_mm512_setzero_si512(), _mm_cvtsi32_si128((int)crc), 0)
+  );
+  __m512i z1 = _mm512_loadu_si512(data + 64);
+  __m512i z2 = _mm512_loadu_si512(data + 128);
+  __m512i z3 = _mm512_loadu_si512(data + 192);
+  data += 256;
+  size -= 256;
+
+  for (; size >= 256; data += 256, size -= 256) {
+    z0 = crc32c_fold_512(z0, k2048, _mm512_loadu_si512(data));
+    z1 = crc32c_fold_512(z1, k2048, _mm512_loadu_si512(data + 64));
+    z2 = crc32c_fold_512(z2, k2048, _mm512_loadu_si512(data + 128));
+    z3 = crc32c_fold_512(z3, k2048, _mm512_loadu_si512(data + 192));
+  }
+
+  z0 = crc32c_fold_512(z0, k512, z1);
+  z0 = crc32c_fold_512(z0, k512, z2);
+  z0 = crc32c_fold_512(z0, k512, z3);
+  for (; size >= 64; data += 64, size -= 64)
+    z0 = crc32c_fold_512(z0, k512, _mm512_loadu_si512(data));
+
+  __m128i x = _mm512_extracti32x4_epi32(z0, 0);
+  x = crc32c_fold_128(x, k128, _mm512_extracti32x4_epi32(z0, 1));
+  x = crc32c_fold_128(x, k128, _mm512_extracti32x4_epi32(z0, 2));
+  x = crc32c_fold_128(x, k128, _mm512_extracti32x4_epi32(z0, 3));
+  for (; size >= 16; data += 16, size -= 16)
+    x = crc32c_fold_128(x, k128, _mm_loadu_si128((const __m128i *)(const void *)data));
+
+  return crc32c_update_hw(crc32c_reduce_lane(x), data, size);
+}
+
+static bool crc32c_fold_512_is_supported () {
+  return crc32c_fold_is_supported() && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("vpclmulqdq");
+}
+
+#endif
+
+// =============================================================================
+
+// A large only implementation is selected by the auto one, see: CRC32C_FOLD_512_MIN_SIZE.
+static void crc32c_add_implementation (const char *name, Crc32cUpdate update, bool isLargeOnly) {
+  Crc32c.names[Crc32c.count] = name;
+  Crc32c.updates[Crc32c.count++] = update;
+  if (isLargeOnly)
+    Crc32c.largeUpdate = update;
+  else {
+    Crc32c.update = update;
+    Crc32c.implementation = name;
+  }
+}
+
+static uint32_t crc32c_update_auto (uint32_t crc, const unsigned char *data, size_t size) {
+  return size < CRC32C_FOLD_512_MIN_SIZE
+    ? Crc32c.smallUpdate(crc, data, size)
+    : Crc32c.largeUpdate(crc, data, size);
+}
+
+static void crc32c_init () {
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; ++j)
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    Crc32c.table[0][i] = crc;
+  }
+  for (int i = 0; i < 256; ++i)
+    for (int j = 1; j < 8; ++j)
+      Crc32c.table[j][i] = Crc32c.table[0][Crc32c.table[j - 1][i] & 0xFF] ^ (Crc32c.table[j - 1][i] >> 8);
+
+  crc32c_add_implementation("table", crc32c_update_table, false);
+
+#ifdef CRC32C_HW_TARGET
+  if (crc32c_hw_is_supported()) {
+    crc32c_init_shift(Crc32c.longShift, CRC32C_LONG);
+    crc32c_init_shift(Crc32c.shortShift, CRC32C_SHORT);
+    crc32c_add_implementation(CRC32C_HW_NAME, crc32c_update_hw, false);
+  }
+#endif
+
+#ifdef CRC32C_FOLD_TARGET
+  if (crc32c_fold_is_supported()) {
+    crc32c_init_fold(Crc32c.fold128, 128);
+    crc32c_init_fold(Crc32c.fold512, 512);
+    crc32c_add_implementation(CRC32C_FOLD_NAME, crc32c_update_fold, false);
+  }
+#endif
+
+#ifdef CRC32C_FOLD_512_TARGET
+  if (crc32c_fold_512_is_supported()) {
+    crc32c_init_fold(Crc32c.fold2048, 2048);
+    crc32c_add_implementation("avx512-vpclmulqdq", crc32c_update_fold_512, true);
+  }
+#endif
+
+  if (Crc32c.largeUpdate) {
+    Crc32c.smallUpdate = Crc32c.update;
+    crc32c_add_implementation(CRC32C_AUTO_NAME, crc32c_update_auto, false);
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+uint32_t crc32c (uint32_t crc, const void *data, size_t size) {
+  pthread_once(&Crc32cOnce, crc32c_init);
+  return ~Crc32c.update(~crc, data, size);
+}
+
+const char *crc32c_get_implementation () {
+  pthread_once(&Crc32cOnce, crc32c_init);
+  return Crc32c.implementation;
+}
+
+const char *const *crc32c_get_implementations () {
+  pthread_once(&Crc32cOnce, crc32c_init);
+  return Crc32c.names;
+}
+
+int crc32c_set_implementation (const char *name) {
+  pthread_once(&Crc32cOnce, crc32c_init);
+  for (int i = 0; i < Crc32c.count; ++i)
+    if (!strcmp(Crc32c.names[i], name)) {
+      Crc32c.update = Crc32c.updates[i];
+      Crc32c.implementation = Crc32c.names[i];
+      return 0;
+    }
+
+  errno = ENOTSUP;
+  return -1;
+}
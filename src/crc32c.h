@@ -0,0 +1,47 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// =============================================================================
+// CRC-32C (Castagnoli) of the stream frames. Folds the data with the carry-less
+// multiplications of AVX-512 (VPCLMULQDQ), SSE (PCLMULQDQ) or ARMv8 (PMULL)
+// when the CPU supports them, otherwise uses the CRC instructions of SSE 4.2
+// or ARMv8 with three interleaved streams to hide their latency, otherwise a
+// slicing-by-8 table. The 512-bit lanes are only used for large buffers.
+// =============================================================================
+
+// Chained like zlib's crc32: starts with crc = 0.
+uint32_t crc32c (uint32_t crc, const void *data, size_t size);
+
+// Name of the implementation selected for this CPU, "auto" when it depends on
+// the size of the data.
+const char *crc32c_get_implementation ();
+
+// Names of the implementations supported by this CPU, NULL-terminated, from
+// the slowest to the selected one.
+const char *const *crc32c_get_implementations ();
+
+// For the tests and the benchmarks only, not thread-safe.
+int crc32c_set_implementation (const char *name);
+
+#endif // ifndef _CRC32C_H_
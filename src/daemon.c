@@ -0,0 +1,301 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <xcp-ng/generic.h>
+
+#include "daemon.h"
+#include "emu.h"
+#include "logger.h"
+#include "migration.h"
+
+// =============================================================================
+
+#define DAEMON_BACKLOG 16
+#define DAEMON_REQUEST_TIMEOUT 10000
+#define DAEMON_MAX_REQUEST_SIZE 4096
+#define DAEMON_MAX_ARGS 64
+
+typedef struct DaemonRequest {
+  int fd;
+
+  int fds[MIGRATION_MAX_FDS];
+  size_t fdsCount;
+
+  char buf[DAEMON_MAX_REQUEST_SIZE];
+  size_t bufSize;
+} DaemonRequest;
+
+// getopt is not reentrant.
+static pthread_mutex_t ParseMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// -----------------------------------------------------------------------------
+
+// Fill argv with the arguments of the request. Returns the count of arguments
+// or 0 if the request is not complete.
+static int daemon_request_get_args (DaemonRequest *request, char *argv[], int maxArgs) {
+  int argc = 0;
+  argv[argc++] = "emu-manager";
+
+  size_t offset = 0;
+  while (offset < request->bufSize) {
+    char *arg = request->buf + offset;
+    const char *end = memchr(arg, '\0', request->bufSize - offset);
+    if (!end)
+      return 0;
+
+    if (end == arg) {
+      argv[argc] = NULL;
+      return argc;
+    }
+
+    if (argc == maxArgs - 1) {
+      syslog(LOG_ERR, "Too many arguments in daemon request.");
+      EmuError = E2BIG;
+      return -1;
+    }
+    argv[argc++] = arg;
+    offset += (size_t)(end - arg) + 1;
+  }
+
+  return 0;
+}
+
+static int daemon_request_receive (DaemonRequest *request, char *argv[], int maxArgs) {
+  for (;;) {
+    int argc = daemon_request_get_args(request, argv, maxArgs);
+    if (argc)
+      return argc;
+
+    if (request->bufSize == sizeof request->buf) {
+      syslog(LOG_ERR, "Daemon request is too big.");
+      EmuError = EMSGSIZE;
+      return -1;
+    }
+
+    struct pollfd pfd = { .fd = request->fd, .events = POLLIN };
+    const int ret = poll(&pfd, 1, DAEMON_REQUEST_TIMEOUT);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      EmuError = errno;
+      return -1;
+    }
+    if (ret == 0) {
+      syslog(LOG_ERR, "Failed to receive daemon request because timeout reached.");
+      EmuError = ETIME;
+      return -1;
+    }
+
+    union {
+      char buf[CMSG_SPACE(sizeof request->fds)];
+      struct cmsghdr align;
+    } control;
+    struct iovec iov = {
+      .iov_base = request->buf + request->bufSize,
+      .iov_len = sizeof request->buf - request->bufSize
+    };
+    struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof control.buf
+    };
+
+    const ssize_t size = recvmsg(request->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (size < 0) {
+      if (errno == EINTR) continue;
+      syslog(LOG_ERR, "Failed to receive daemon request: `%s`.", strerror(errno));
+      EmuError = errno;
+      return -1;
+    }
+
+    // Keep received fds before any check: they must be closed by the caller.
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+
+      const int *fds = (const int *)CMSG_DATA(cmsg);
+      const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (size_t i = 0; i < count; ++i) {
+        if (request->fdsCount < XCP_ARRAY_LEN(request->fds))
+          request->fds[request->fdsCount++] = fds[i];
+        else
+          xcp_fd_close(fds[i]);
+      }
+    }
+
+    if (msg.msg_flags & MSG_CTRUNC) {
+      syslog(LOG_ERR, "Too many fds in daemon request.");
+      EmuError = EMSGSIZE;
+      return -1;
+    }
+
+    if (size == 0) {
+      syslog(LOG_ERR, "Daemon request connection closed.");
+      EmuError = EPIPE;
+      return -1;
+    }
+    request->bufSize += (size_t)size;
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+static void daemon_run_migration (DaemonRequest *request) {
+  char *argv[DAEMON_MAX_ARGS];
+  const int argc = daemon_request_receive(request, argv, DAEMON_MAX_ARGS);
+  if (argc < 0)
+    return;
+
+  // Without control fd arguments, the connection is the control channel.
+  MigrationConfig config = {
+    .domId = (uint)-1,
+    .controlInFd = request->fd,
+    .controlOutFd = request->fd,
+    .progressInterval = -1,
+    .isDaemonRequest = true,
+    .fds = request->fds,
+    .fdsCount = request->fdsCount
+  };
+
+  pthread_mutex_lock(&ParseMutex);
+  int ret = migration_parse_args(&config, argc, argv);
+  pthread_mutex_unlock(&ParseMutex);
+
+  if (ret == 0 && config.printHelp) {
+    syslog(LOG_ERR, "Help option cannot be used in a daemon request.");
+    ret = -1;
+  }
+
+  if (ret == 0) {
+    logger_set_domain(config.domId);
+    syslog(LOG_INFO, "Starting migration of domain %u.", config.domId);
+    ret = migration_run(&config);
+    syslog(LOG_INFO, "Migration of domain %u %s.", config.domId, ret < 0 ? "failed" : "is done");
+    logger_clear_domain();
+  }
+
+  // Release the resources of a failed parse. It's a no-op after migration_run.
+  emu_manager_disconnect();
+  emu_manager_clean();
+
+  // Streams close their fds, the others are closed here.
+  for (size_t i = 0; i < request->fdsCount; ++i)
+    if (!(config.streamFds & (1u << i)))
+      xcp_fd_close(request->fds[i]);
+  request->fdsCount = 0;
+}
+
+static void *daemon_migration_thread (void *userData) {
+  DaemonRequest *request = userData;
+
+  daemon_run_migration(request);
+
+  for (size_t i = 0; i < request->fdsCount; ++i)
+    xcp_fd_close(request->fds[i]);
+  xcp_fd_close(request->fd);
+  free(request);
+
+  return NULL;
+}
+
+// -----------------------------------------------------------------------------
+
+static int daemon_listen (const char *path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof addr.sun_path) {
+    syslog(LOG_ERR, "Daemon socket path is too long: `%s`.", path);
+    EmuError = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    syslog(LOG_ERR, "Unable to create daemon socket: `%s`.", strerror(errno));
+    EmuError = errno;
+    return -1;
+  }
+
+  // Remove the socket of a previous daemon.
+  if (unlink(path) < 0 && errno != ENOENT)
+    syslog(LOG_ERR, "Failed to remove `%s`: `%s`.", path, strerror(errno));
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(fd, DAEMON_BACKLOG) < 0) {
+    syslog(LOG_ERR, "Unable to listen on `%s`: `%s`.", path, strerror(errno));
+    EmuError = errno;
+    xcp_fd_close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int daemon_run (const char *path) {
+  const int fd = daemon_listen(path);
+  if (fd < 0)
+    return -1;
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  syslog(LOG_INFO, "Waiting for migration requests on `%s`...", path);
+  for (;;) {
+    const int clientFd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (clientFd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      syslog(LOG_ERR, "Failed to accept migration request: `%s`.", strerror(errno));
+      EmuError = errno;
+      break;
+    }
+
+    DaemonRequest *request = malloc(sizeof *request);
+    if (!request) {
+      syslog(LOG_ERR, "Failed to allocate migration request.");
+      xcp_fd_close(clientFd);
+      continue;
+    }
+    request->fd = clientFd;
+    request->fdsCount = 0;
+    request->bufSize = 0;
+
+    pthread_t thread;
+    const int error = pthread_create(&thread, &attr, daemon_migration_thread, request);
+    if (error) {
+      syslog(LOG_ERR, "Failed to create migration thread: `%s`.", strerror(error));
+      xcp_fd_close(clientFd);
+      free(request);
+    }
+  }
+
+  pthread_attr_destroy(&attr);
+  xcp_fd_close(fd);
+  return -1;
+}
@@ -0,0 +1,34 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+// =============================================================================
+// Persistent mode: migrations are requested on a UNIX socket and each one is
+// run by its own thread.
+//
+// A request is the list of the emu-manager arguments, each one terminated by a
+// NUL char, and ended by an empty argument. The fds used by the migration are
+// sent with SCM_RIGHTS and fd arguments (--fd, --dm, --controlinfd...) are
+// indexes in the received fds. Without control fd arguments, the request
+// connection is the control channel.
+// =============================================================================
+
+int daemon_run (const char *path);
+
+#endif // ifndef _DAEMON_H_
@@ -0,0 +1,37 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _EMP_EXT_H_
+#define _EMP_EXT_H_
+
+// =============================================================================
+// EMP commands not (yet) defined by libempserver.
+// They are only understood by a xenguest built with the matching extensions:
+// the stock xenguest replies with an error.
+// =============================================================================
+
+typedef enum EmpExtCommandNum {
+  EmpExtCommandNumMigrateThrottle,
+
+  // Requires a xenguest with post-copy support, which also sends the
+  // "postcopy" status in the MIGRATION events of the restore.
+  EmpExtCommandNumMigratePostcopy
+} EmpExtCommandNum;
+
+const char *emp_ext_command_from_num (EmpExtCommandNum num);
+
+#endif // ifndef _EMP_EXT_H_
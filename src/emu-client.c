@@ -17,93 +17,227 @@
 
 #include <assert.h>
 #include <errno.h>
-#include <stdarg.h>
-#include <stdio.h>
-#include <syslog.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <xcp-ng/generic.h>
 
+#include "arena.h"
 #include "arg-list.h"
 #include "emu-client.h"
+#include "emu-event.h"
 #include "emu.h"
+#include "logger.h"
 
 // =============================================================================
 
-static int format_message (char *buf, size_t size, const char *format, ...) {
-  va_list args;
-  va_start(args, format);
-  int ret = vsnprintf(buf, size, format, args);
-  va_end(args);
+// Commands are written with scatter/gather I/O: the frame references the
+// command name and the argument strings, nothing is formatted.
+#define EMU_CLIENT_IOV_COUNT 64
+
+typedef struct EmuClientWriter {
+  int sock;
+  int sharedFd; // Sent with the first bytes, then -1.
+  struct iovec iov[EMU_CLIENT_IOV_COUNT];
+  int iovCount;
+} EmuClientWriter;
+
+static int emu_client_writer_flush (EmuClientWriter *writer) {
+  struct iovec *iov = writer->iov;
+  size_t count = (size_t)writer->iovCount;
+  writer->iovCount = 0;
+
+  while (count) {
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+
+    char control[CMSG_SPACE(sizeof(int))];
+    if (writer->sharedFd >= 0) {
+      memset(control, 0, sizeof control);
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof control;
+
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &writer->sharedFd, sizeof(int));
+    }
 
-  if (ret < 0) {
-    syslog(LOG_ERR, "Failed to format command.");
-    EmuError = errno;
-    return -1;
+    ssize_t ret = sendmsg(writer->sock, &msg, MSG_NOSIGNAL);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    writer->sharedFd = -1;
+
+    // Partial write: skip the sent iovecs.
+    for (; count && (size_t)ret >= iov->iov_len; --count)
+      ret -= (ssize_t)(iov++)->iov_len;
+    if (count) {
+      iov->iov_base = (char *)iov->iov_base + ret;
+      iov->iov_len -= (size_t)ret;
+    }
   }
 
-  if ((size_t)ret >= size) {
-    syslog(LOG_ERR, "Failed to format command. Truncated buffer!");
-    EmuError = EMSGSIZE;
-    return -1;
-  }
+  return 0;
+}
 
-  return ret;
+static inline int emu_client_writer_push (EmuClientWriter *writer, const char *buf, size_t len) {
+  if (!len)
+    return 0;
+  if (writer->iovCount == EMU_CLIENT_IOV_COUNT && emu_client_writer_flush(writer) < 0)
+    return -1;
+  writer->iov[writer->iovCount++] = (struct iovec){ (void *)buf, len };
+  return 0;
 }
 
-static inline int emu_client_send_cmd (EmuClient *client, const char *command, int fd, const ArgNode *arguments) {
-  syslog(LOG_DEBUG, "Sending command `%s` to emu client `%s`.", command, client->emu->name);
+#define PUSH_LITERAL(WRITER, STR) emu_client_writer_push(WRITER, STR, sizeof STR - 1)
 
-  // 1. Create a command string.
-  const char *format = arguments
-    ? "{ \"execute\" : \"%s\", \"arguments\" : { "
-    : "{ \"execute\" : \"%s\" }";
+static int emu_client_write_cmd (EmuClient *client, const char *command, int fd, const ArgList *arguments) {
+  EmuClientWriter writer = { .sock = client->fd, .sharedFd = fd };
 
-  char buf[1024];
-  int ret;
-  if ((ret = format_message(buf, sizeof buf, format, command)) < 0)
+  const bool hasArguments = arguments && arguments->count;
+  if (
+    PUSH_LITERAL(&writer, "{ \"execute\" : \"") < 0 ||
+    emu_client_writer_push(&writer, command, strlen(command)) < 0 ||
+    (hasArguments
+      ? PUSH_LITERAL(&writer, "\", \"arguments\" : { ")
+      : PUSH_LITERAL(&writer, "\" }")) < 0
+  )
     return -1;
 
-  // 2. Format arguments.
-  if (arguments) {
-    size_t remaining = sizeof buf - (size_t)ret;
-    char *pos = buf + ret;
-
-    do {
-      const char *separator = arguments->next ? "," : "";
-      if ((ret = format_message(pos, remaining, "\"%s\":%s%s ", arguments->key, arguments->value, separator)) < 0)
+  if (hasArguments) {
+    for (size_t i = 0; i < arguments->count; ++i) {
+      const Arg *arg = &arguments->args[i];
+      const bool isLast = i == arguments->count - 1;
+
+      if (
+        PUSH_LITERAL(&writer, "\"") < 0 ||
+        emu_client_writer_push(&writer, arg->key, arg->keyLen) < 0 ||
+        (arg->isString ? PUSH_LITERAL(&writer, "\":\"") : PUSH_LITERAL(&writer, "\":")) < 0 ||
+        emu_client_writer_push(&writer, arg->value, arg->valueLen) < 0
+      )
         return -1;
 
-      arguments = arguments->next;
-      remaining -= (size_t)ret;
-      pos += ret;
-    } while (arguments);
+      int ret;
+      if (arg->isString)
+        ret = isLast ? PUSH_LITERAL(&writer, "\" ") : PUSH_LITERAL(&writer, "\", ");
+      else
+        ret = isLast ? PUSH_LITERAL(&writer, " ") : PUSH_LITERAL(&writer, ", ");
+      if (ret < 0)
+        return -1;
+    }
 
-    if (format_message(pos, remaining, "} }") < 0)
+    if (PUSH_LITERAL(&writer, "} }") < 0)
       return -1;
   }
 
-  // 3. Send the command.
-  if (fd < 0) {
-    syslog(LOG_DEBUG, "Sending message \'%s\' to emu client.", buf);
-    size_t offset;
-    ret = (int)xcp_fd_write_all(client->fd, buf, strlen(buf), &offset);
-  } else {
-    syslog(LOG_DEBUG, "Sending message \'%s\' to emu client with shared socket: %d.", buf, fd);
-    ret = (int)xcp_sock_send_shared_fd(client->fd, buf, strlen(buf), fd);
+  return emu_client_writer_flush(&writer);
+}
+
+#undef PUSH_LITERAL
+
+static inline int emu_client_submit_cmd (
+  EmuClient *client,
+  const char *command,
+  int fd,
+  const ArgList *arguments,
+  EmuClientCmdCb cb,
+  void *userData
+) {
+  if (fd < 0)
+    syslog(LOG_DEBUG, "Sending command `%s` to emu client `%s`.", command, client->emu->name);
+  else
+    syslog(LOG_DEBUG, "Sending command `%s` to emu client `%s` with shared socket: %d.", command, client->emu->name, fd);
+
+  if (client->pendingCmdsCount == EMU_CLIENT_MAX_PENDING_CMDS) {
+    syslog(LOG_ERR, "Too many pending commands for emu client `%s`.", client->emu->name);
+    EmuError = EBUSY;
+    return -1;
   }
 
-  if (ret == XCP_ERR_ERRNO) {
+  // 1. Send the command.
+  if (emu_client_write_cmd(client, command, fd, arguments) < 0) {
     syslog(LOG_ERR, "Error sending message to emu client: `%s`.", strerror(errno));
     EmuError = errno;
     return -1;
   }
 
-  // 4. Waiting for ACK...
-  client->waitingAck = true;
-  while (client->waitingAck)
-    if (emu_client_receive_events(client, 30000) < 0 || emu_client_process_events(client) < 0)
+  // 2. Waiting for ACK in the queue...
+  EmuClientCmd *cmd = &client->pendingCmds[
+    (client->pendingCmdsHead + client->pendingCmdsCount++) % EMU_CLIENT_MAX_PENDING_CMDS
+  ];
+  cmd->cb = cb;
+  cmd->userData = userData;
+
+  return 0;
+}
+
+// Pop the oldest pending command and give it its reply.
+static int emu_client_complete_cmd (EmuClient *client, int error) {
+  assert(client->pendingCmdsCount);
+
+  const EmuClientCmd cmd = client->pendingCmds[client->pendingCmdsHead];
+  client->pendingCmdsHead = (client->pendingCmdsHead + 1) % EMU_CLIENT_MAX_PENDING_CMDS;
+  --client->pendingCmdsCount;
+
+  if (cmd.cb)
+    return (*cmd.cb)(client, error, cmd.userData);
+
+  if (error) {
+    EmuError = error;
+    return -1;
+  }
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+typedef struct EmuClientSyncCmd {
+  bool done;
+  int error;
+} EmuClientSyncCmd;
+
+static int emu_client_sync_cmd_cb (EmuClient *client, int error, void *userData) {
+  XCP_UNUSED(client);
+
+  EmuClientSyncCmd *sync = userData;
+  sync->done = true;
+  sync->error = error;
+  return 0;
+}
+
+static int emu_client_ignore_cmd_cb (EmuClient *client, int error, void *userData) {
+  XCP_UNUSED(client);
+  XCP_UNUSED(error);
+  XCP_UNUSED(userData);
+  return 0;
+}
+
+static inline int emu_client_send_cmd (EmuClient *client, const char *command, int fd, const ArgList *arguments) {
+  EmuClientSyncCmd sync = { false, 0 };
+  if (emu_client_submit_cmd(client, command, fd, arguments, emu_client_sync_cmd_cb, &sync) < 0)
+    return -1;
+
+  while (!sync.done)
+    if (emu_client_receive_events(client, 30000) < 0 || emu_client_process_events(client) < 0) {
+      // The reply can be received later, the sync object must not be used.
+      for (size_t i = 0; i < client->pendingCmdsCount; ++i) {
+        EmuClientCmd *cmd = &client->pendingCmds[(client->pendingCmdsHead + i) % EMU_CLIENT_MAX_PENDING_CMDS];
+        if (cmd->userData == &sync) {
+          cmd->cb = emu_client_ignore_cmd_cb;
+          cmd->userData = NULL;
+        }
+      }
       return -1;
+    }
 
+  if (sync.error) {
+    EmuError = sync.error;
+    return -1;
+  }
   return 0;
 }
 
@@ -120,25 +254,25 @@ static int emu_client_json_check_type (const char *key, json_object *value, json
 // -----------------------------------------------------------------------------
 
 int emu_client_create (EmuClient **client, EmuClientCb eventCb, Emu *emu) {
-  if (!(*client = malloc(sizeof **client)))
+  if (!(*client = arena_alloc(sizeof **client)))
     goto fail;
 
-  if (!((*client)->tokener = json_tokener_new())) {
-    free(*client);
+  if (!((*client)->tokener = json_tokener_new()))
     goto fail;
-  }
 
   (*client)->fd = -1;
+  (*client)->isConnecting = false;
   (*client)->emu = emu;
   (*client)->eventCb = eventCb;
-  (*client)->bufSize = 0;
-  (*client)->waitingAck = false;
+  io_buffer_init(&(*client)->buf, EMU_CLIENT_BUF_SIZE, EMU_CLIENT_MAX_BUF_SIZE);
+  (*client)->pendingCmdsHead = 0;
+  (*client)->pendingCmdsCount = 0;
 
   return 0;
 
 fail:
   syslog(LOG_ERR, "Not enough memory to create EmuClient.");
-  free(*client);
+  *client = NULL;
   EmuError = errno;
   return -1;
 }
@@ -149,7 +283,7 @@ int emu_client_destroy (EmuClient *client) {
     error = errno;
 
   json_tokener_free(client->tokener);
-  free(client);
+  io_buffer_free(&client->buf);
 
   if (error) {
     EmuError = error;
@@ -166,7 +300,7 @@ int emu_client_connect (EmuClient *client, const char *path) {
     return -1;
   }
 
-  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if (fd < 0) {
     syslog(LOG_ERR, "Unable to create socket: `%s`.", strerror(errno));
     EmuError = errno;
@@ -178,45 +312,63 @@ int emu_client_connect (EmuClient *client, const char *path) {
   addr.sun_family = AF_UNIX;
   strcpy(addr.sun_path, path);
 
-  if (xcp_sock_connect(fd, (struct sockaddr *)&addr, sizeof addr) == XCP_ERR_ERRNO) {
-    syslog(LOG_ERR, "Unable to connect socket: `%s`.", strerror(errno));
-    EmuError = errno;
-    xcp_fd_close(fd);
-    return -1;
+  client->fd = fd;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+    if (errno != EINPROGRESS && errno != EINTR) {
+      syslog(LOG_ERR, "Unable to connect socket: `%s`.", strerror(errno));
+      EmuError = errno;
+      client->fd = -1;
+      xcp_fd_close(fd);
+      return -1;
+    }
+    client->isConnecting = true;
+    return 0;
   }
 
-  client->fd = fd;
+  return emu_client_finish_connect(client);
+}
+
+int emu_client_finish_connect (EmuClient *client) {
+  int error = 0;
+  socklen_t len = sizeof error;
+  if (getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+    error = errno;
+
+  // Commands are written synchronously, so restore the blocking mode.
+  int flags;
+  if (!error && ((flags = fcntl(client->fd, F_GETFL)) < 0 || fcntl(client->fd, F_SETFL, flags & ~O_NONBLOCK) < 0))
+    error = errno;
+
+  client->isConnecting = false;
+  if (error) {
+    syslog(LOG_ERR, "Unable to connect socket: `%s`.", strerror(error));
+    EmuError = error;
+    return -1;
+  }
   return 0;
 }
 
 // -----------------------------------------------------------------------------
 
 int emu_client_receive_events (EmuClient *client, int timeout) {
-  assert(client->bufSize <= sizeof client->buf);
-  if (client->bufSize == sizeof client->buf) {
-    syslog(LOG_ERR, "Not enough space to read from EmuClient.");
-    EmuError = ENOSPC;
-    return -1;
-  }
+  const int ret = io_buffer_wait_read(&client->buf, client->fd, timeout);
+  if (ret > 0)
+    return ret;
 
-  const XcpError ret = xcp_fd_wait_read(
-    client->fd,
-    client->buf + client->bufSize,
-    sizeof client->buf - client->bufSize,
-    timeout
-  );
-  if (ret == XCP_ERR_TIMEOUT) {
-    syslog(LOG_ERR, "EmuClient `%s` failed to read because timeout reached.", client->emu->name);
-    EmuError = ETIME;
-  } else if (ret == XCP_ERR_ERRNO) {
-    syslog(LOG_ERR, "EmuClient `%s` failed to read from %d: `%s`.", client->emu->name, client->fd, strerror(errno));
-    EmuError = errno;
-  } else if (ret == 0) {
+  if (ret == 0) {
     syslog(LOG_ERR, "EmuClient `%s` unexpectedly disconnected. Broken pipe.", client->emu->name);
     EmuError = EPIPE;
+  } else if (errno == ETIME) {
+    // Without timeout, the caller only checks for pending events.
+    if (timeout)
+      syslog(LOG_ERR, "EmuClient `%s` failed to read because timeout reached.", client->emu->name);
+    EmuError = ETIME;
+  } else if (errno == EMSGSIZE) {
+    syslog(LOG_ERR, "Not enough space to read from EmuClient.");
+    EmuError = ENOSPC;
   } else {
-    client->bufSize += (size_t)ret;
-    return (int)ret;
+    syslog(LOG_ERR, "EmuClient `%s` failed to read from %d: `%s`.", client->emu->name, client->fd, strerror(errno));
+    EmuError = errno;
   }
 
   return -1;
@@ -224,99 +376,157 @@ int emu_client_receive_events (EmuClient *client, int timeout) {
 
 // -----------------------------------------------------------------------------
 
+// Reply or event decoded without allocation.
+static int emu_client_process_message (EmuClient *client, const EmuMessage *message) {
+  if (message->isReturn) {
+    if (!client->pendingCmdsCount) {
+      syslog(LOG_ERR, "Unexpected `return` event from emu client.");
+      EmuError = EINVAL;
+      return -1;
+    }
+    return emu_client_complete_cmd(client, 0);
+  }
+
+  return client->eventCb ? (*client->eventCb)(client, &message->event) : 0;
+}
+
+// Other messages (errors, QMP greeting, timestamps, escaped strings...).
+static int emu_client_process_json (EmuClient *client, json_object *obj) {
+  const json_type type = json_object_get_type(obj);
+  if (type != json_type_object) {
+    syslog(LOG_ERR, "Expected JSON object from emu client but got type: %d.", type);
+    return 0;
+  }
+
+  int error = 0;
+  const json_object *eventType = NULL;
+  const json_object *data = NULL;
+  const json_object *qmpValue = NULL;
+
+  const struct lh_entry *head = json_object_get_object(obj)->head;
+  for (const struct lh_entry *entry = head; entry && !error; entry = entry->next) {
+    const char *key = entry->k;
+    json_object *value = (json_object *)entry->v;
+
+    if (!strcmp(key, "return")) {
+      if (!client->pendingCmdsCount) {
+        syslog(LOG_ERR, "Unexpected `return` event from emu client.");
+        error = EINVAL;
+      } else if (emu_client_complete_cmd(client, 0) < 0)
+        error = EmuError;
+    } else if (!strcmp(key, "error")) {
+      if (!json_object_is_type(value, json_type_string))
+        syslog(LOG_ERR, "Unknown error from emu client: `%s`", json_object_to_json_string(value));
+      else
+        syslog(LOG_ERR, "Error from emu client: `%s`.", json_object_get_string(value));
+
+      if (!client->pendingCmdsCount)
+        error = EINVAL;
+      else if (emu_client_complete_cmd(client, EINVAL) < 0)
+        error = EmuError;
+    } else if (!strcmp(key, "event")) {
+      if (emu_client_json_check_type(key, value, json_type_string) > -1)
+        eventType = value;
+    } else if (!strcmp(key, "data")) {
+      data = value;
+    } else if (!strcmp(key, "QMP")) {
+      if (emu_client_json_check_type(key, value, json_type_object) > -1)
+        qmpValue = value;
+    } else if (!strcmp(key, "timestamp")) {
+      syslog(LOG_DEBUG, "Ignoring QMP timestamp.");
+    } else {
+      syslog(LOG_ERR, "Unexpected key from emu client: `%s`.", key);
+      error = EINVAL;
+    }
+  }
+
+  // If object contains keys and if there is no error, we can call eventCb.
+  if (head && !error) {
+    EmuEvent event;
+    if (!eventType) {
+      if (data) {
+        syslog(LOG_ERR, "Emu client sent data without event!");
+        error = EINVAL;
+      } else if (qmpValue && client->eventCb) {
+        emu_event_from_json(&event, "QMP", NULL);
+        if ((*client->eventCb)(client, &event) < 0)
+          error = EmuError;
+      }
+    } else if (client->eventCb) {
+      emu_event_from_json(&event, json_object_get_string((json_object *)eventType), data);
+      if ((*client->eventCb)(client, &event) < 0)
+        error = EmuError;
+    }
+  }
+
+  if (error) {
+    EmuError = error;
+    return -1;
+  }
+  return 0;
+}
+
 int emu_client_process_events (EmuClient *client) {
-  if (!client->bufSize) return 0;
+  IoBuffer *buf = &client->buf;
+  if (!io_buffer_size(buf)) return 0;
 
   syslog(LOG_DEBUG, "Processing emu client events from `%s`...", client->emu->name);
 
   int error = 0;
-  char *jsonBuf = client->buf;
   do {
+    // Messages are parsed in the receive buffer.
+    const char *jsonBuf = io_buffer_data(buf);
+    const size_t bufSize = io_buffer_size(buf);
+
+    // 1. Usual replies and events.
+    EmuMessage message;
+    int size = emu_event_parse(jsonBuf, bufSize, &message);
+    if (size > 0) {
+      syslog(LOG_DEBUG, "Processing emu client event: `%.*s`.", size, jsonBuf);
+
+      // The views are valid until the next read.
+      io_buffer_consume(buf, (size_t)size);
+      if (emu_client_process_message(client, &message) < 0)
+        error = EmuError;
+      continue;
+    }
+
+    if (size == 0) {
+      if (io_buffer_is_full(buf)) {
+        syslog(LOG_ERR, "Unable to process emu client events. Buffer is so big!");
+        error = EMSGSIZE;
+      }
+      break; // No complete event to read for the moment.
+    }
+
+    // 2. Fallback.
     json_tokener_reset(client->tokener);
-    json_object *obj = json_tokener_parse_ex(client->tokener, jsonBuf, (int)client->bufSize);
+    json_object *obj = json_tokener_parse_ex(client->tokener, jsonBuf, (int)bufSize);
     const enum json_tokener_error tokenError = json_tokener_get_error(client->tokener);
     if (tokenError == json_tokener_continue) {
-      if (client->bufSize == sizeof client->buf) {
+      if (io_buffer_is_full(buf)) {
         syslog(LOG_ERR, "Unable to process emu client events. Buffer is so big!");
         error = EMSGSIZE;
       }
       break; // Error or no complete event to read for the moment.
     }
     if (tokenError != json_tokener_success) {
-      memmove(client->buf, jsonBuf, client->bufSize);
       syslog(LOG_ERR, "Error from tokener: `%s`.", json_tokener_error_desc(tokenError));
       error = EINVAL;
       break;
     }
     assert(obj);
 
-    {
-      const int charOffset = client->tokener->char_offset;
-      syslog(LOG_DEBUG, "Processing emu client event: `%.*s`.", charOffset, jsonBuf);
-
-      jsonBuf += charOffset;
-      client->bufSize -= (size_t)charOffset;
-    }
-
-    const json_type type = json_object_get_type(obj);
-    if (type != json_type_object) {
-      syslog(LOG_ERR, "Expected JSON object from emu client but got type: %d.", type);
-      break;
-    }
-
-    const json_object *eventType = NULL;
-    const json_object *data = NULL;
-    const json_object *qmpValue = NULL;
-
-    const struct lh_entry *head = json_object_get_object(obj)->head;
-    for (const struct lh_entry *entry = head; entry && !error; entry = entry->next) {
-      const char *key = entry->k;
-      json_object *value = (json_object *)entry->v;
-
-      if (!strcmp(key, "return")) {
-        if (!client->waitingAck) {
-          syslog(LOG_ERR, "Unexpected `return` event from emu client.");
-          error = EINVAL;
-        } else
-        client->waitingAck = false;
-      } else if (!strcmp(key, "error")) {
-        if (!json_object_is_type(value, json_type_string))
-          syslog(LOG_ERR, "Unknown error from emu client: `%s`", json_object_to_json_string(value));
-        else
-          syslog(LOG_ERR, "Error from emu client: `%s`.", json_object_get_string(value));
-        error = EINVAL;
-      } else if (!strcmp(key, "event")) {
-        if (emu_client_json_check_type(key, value, json_type_string) > -1)
-          eventType = value;
-      } else if (!strcmp(key, "data")) {
-        data = value;
-      } else if (!strcmp(key, "QMP")) {
-        if (emu_client_json_check_type(key, value, json_type_object) > -1)
-          qmpValue = value;
-      } else if (!strcmp(key, "timestamp")) {
-        syslog(LOG_DEBUG, "Ignoring QMP timestamp.");
-      } else {
-        syslog(LOG_ERR, "Unexpected key from emu client: `%s`.", key);
-        error = EINVAL;
-      }
-    }
-
-    // If object contains keys and if there is no error, we can call eventCb.
-    if (head && !error) {
-      if (!eventType) {
-        if (data) {
-          syslog(LOG_ERR, "Emu client sent data without event!");
-          error = EINVAL;
-        } else if (qmpValue && client->eventCb)
-          (*client->eventCb)(client, "QMP", qmpValue);
-      } else if (client->eventCb)
-        (*client->eventCb)(client, json_object_get_string((json_object *)eventType), data);
-    }
+    size = client->tokener->char_offset;
+    syslog(LOG_DEBUG, "Processing emu client event: `%.*s`.", size, jsonBuf);
+    io_buffer_consume(buf, (size_t)size);
 
+    // Event strings are owned by obj.
+    if (emu_client_process_json(client, obj) < 0)
+      error = EmuError;
     json_object_put(obj);
-  } while (client->bufSize && !error);
+  } while (io_buffer_size(buf) && !error);
 
-  memmove(client->buf, jsonBuf, client->bufSize);
   if (error) {
     EmuError = error;
     return -1;
@@ -326,18 +536,44 @@ int emu_client_process_events (EmuClient *client) {
 
 // -----------------------------------------------------------------------------
 
-int emu_client_send_emp_cmd (EmuClient *client, EmpCommandNum cmdNum, const ArgNode *arguments) {
+int emu_client_send_emp_cmd (EmuClient *client, EmpCommandNum cmdNum, const ArgList *arguments) {
   const struct command *cmd = command_from_num(cmdNum);
   assert(!cmd->needs_fd);
   return emu_client_send_cmd(client, cmd->name, -1, arguments);
 }
 
-int emu_client_send_emp_cmd_with_fd (EmuClient *client, EmpCommandNum cmdNum, int fd, const ArgNode *arguments) {
+int emu_client_send_emp_cmd_with_fd (EmuClient *client, EmpCommandNum cmdNum, int fd, const ArgList *arguments) {
   const struct command *cmd = command_from_num(cmdNum);
   assert(!cmd->needs_fd || fd >= 0);
   return emu_client_send_cmd(client, cmd->name, cmd->needs_fd ? fd : -1, arguments);
 }
 
-int emu_client_send_qmp_cmd (EmuClient *client, QmpCommandNum cmdNum, const ArgNode *arguments) {
+int emu_client_send_emp_ext_cmd (EmuClient *client, EmpExtCommandNum cmdNum, const ArgList *arguments) {
+  return emu_client_send_cmd(client, emp_ext_command_from_num(cmdNum), -1, arguments);
+}
+
+int emu_client_send_qmp_cmd (EmuClient *client, QmpCommandNum cmdNum, const ArgList *arguments) {
   return emu_client_send_cmd(client, qmp_command_from_num(cmdNum), -1, arguments);
 }
+
+// -----------------------------------------------------------------------------
+
+int emu_client_send_emp_cmd_async (EmuClient *client, EmpCommandNum cmdNum, const ArgList *arguments, EmuClientCmdCb cb, void *userData) {
+  const struct command *cmd = command_from_num(cmdNum);
+  assert(!cmd->needs_fd);
+  return emu_client_submit_cmd(client, cmd->name, -1, arguments, cb, userData);
+}
+
+int emu_client_send_emp_cmd_with_fd_async (EmuClient *client, EmpCommandNum cmdNum, int fd, const ArgList *arguments, EmuClientCmdCb cb, void *userData) {
+  const struct command *cmd = command_from_num(cmdNum);
+  assert(!cmd->needs_fd || fd >= 0);
+  return emu_client_submit_cmd(client, cmd->name, cmd->needs_fd ? fd : -1, arguments, cb, userData);
+}
+
+int emu_client_send_emp_ext_cmd_async (EmuClient *client, EmpExtCommandNum cmdNum, const ArgList *arguments, EmuClientCmdCb cb, void *userData) {
+  return emu_client_submit_cmd(client, emp_ext_command_from_num(cmdNum), -1, arguments, cb, userData);
+}
+
+int emu_client_send_qmp_cmd_async (EmuClient *client, QmpCommandNum cmdNum, const ArgList *arguments, EmuClientCmdCb cb, void *userData) {
+  return emu_client_submit_cmd(client, qmp_command_from_num(cmdNum), -1, arguments, cb, userData);
+}
@@ -21,27 +21,50 @@
 #include <emp.h>
 #include <json-c/json.h>
 
+#include "emp-ext.h"
+#include "io-buffer.h"
 #include "qmp.h"
 
 // =============================================================================
 
 typedef enum command_num EmpCommandNum;
-typedef struct ArgNode ArgNode;
+typedef struct ArgList ArgList;
 typedef struct Emu Emu;
 typedef struct EmuClient EmuClient;
+typedef struct EmuEvent EmuEvent;
 
-typedef int (*EmuClientCb)(EmuClient *client, const char *eventType, const json_object *obj);
+// The event and its strings are only valid during the call.
+typedef int (*EmuClientCb)(EmuClient *client, const EmuEvent *event);
+
+// Called when the reply of a command is received: error is 0 or an errno value.
+// Must not send synchronous commands to the same client.
+typedef int (*EmuClientCmdCb)(EmuClient *client, int error, void *userData);
+
+#define EMU_CLIENT_MAX_PENDING_CMDS 16
+
+// Receive buffer: large results and bursts of events make it grow.
+#define EMU_CLIENT_BUF_SIZE 1024
+#define EMU_CLIENT_MAX_BUF_SIZE (1024 * 1024)
+
+typedef struct EmuClientCmd {
+  EmuClientCmdCb cb; // If NULL, a command error is an event processing error.
+  void *userData;
+} EmuClientCmd;
 
 typedef struct EmuClient {
   Emu *emu;
 
-  char buf[1024];
-  size_t bufSize;
+  IoBuffer buf;
 
   int fd;
-  bool waitingAck;
+  bool isConnecting;
   json_tokener *tokener;
   EmuClientCb eventCb;
+
+  // Sent commands waiting for a reply. Replies are received in order.
+  EmuClientCmd pendingCmds[EMU_CLIENT_MAX_PENDING_CMDS];
+  size_t pendingCmdsHead;
+  size_t pendingCmdsCount;
 } EmuClient;
 
 // -----------------------------------------------------------------------------
@@ -49,14 +72,25 @@ typedef struct EmuClient {
 int emu_client_create (EmuClient **client, EmuClientCb eventCb, Emu *emu);
 int emu_client_destroy (EmuClient *client);
 
+// Connect without blocking. If isConnecting is set after the call,
+// emu_client_finish_connect must be called when the fd is writable.
 int emu_client_connect (EmuClient *client, const char *path);
+int emu_client_finish_connect (EmuClient *client);
 
 int emu_client_receive_events (EmuClient *client, int timeout);
 
 int emu_client_process_events (EmuClient *client);
 
-int emu_client_send_emp_cmd (EmuClient *client, EmpCommandNum cmdNum, const ArgNode *arguments);
-int emu_client_send_emp_cmd_with_fd (EmuClient *client, EmpCommandNum cmdNum, int fd, const ArgNode *arguments);
-int emu_client_send_qmp_cmd (EmuClient *client, QmpCommandNum cmdNum, const ArgNode *arguments);
+// Synchronous commands: wait for the reply.
+int emu_client_send_emp_cmd (EmuClient *client, EmpCommandNum cmdNum, const ArgList *arguments);
+int emu_client_send_emp_cmd_with_fd (EmuClient *client, EmpCommandNum cmdNum, int fd, const ArgList *arguments);
+int emu_client_send_emp_ext_cmd (EmuClient *client, EmpExtCommandNum cmdNum, const ArgList *arguments);
+int emu_client_send_qmp_cmd (EmuClient *client, QmpCommandNum cmdNum, const ArgList *arguments);
+
+// Asynchronous commands: cb is called by emu_client_process_events when the reply is received.
+int emu_client_send_emp_cmd_async (EmuClient *client, EmpCommandNum cmdNum, const ArgList *arguments, EmuClientCmdCb cb, void *userData);
+int emu_client_send_emp_cmd_with_fd_async (EmuClient *client, EmpCommandNum cmdNum, int fd, const ArgList *arguments, EmuClientCmdCb cb, void *userData);
+int emu_client_send_emp_ext_cmd_async (EmuClient *client, EmpExtCommandNum cmdNum, const ArgList *arguments, EmuClientCmdCb cb, void *userData);
+int emu_client_send_qmp_cmd_async (EmuClient *client, QmpCommandNum cmdNum, const ArgList *arguments, EmuClientCmdCb cb, void *userData);
 
 #endif // ifndef _EMU_CLIENT_H_
@@ -0,0 +1,388 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <xcp-ng/generic.h>
+
+#include "emu-event.h"
+#include "logger.h"
+
+// =============================================================================
+
+// Results of the parse routines.
+#define PARSE_OK 1
+#define PARSE_INCOMPLETE 0
+#define PARSE_UNSUPPORTED -1 // Let json-c do the job.
+
+#define PARSE_MAX_DEPTH 16
+
+typedef enum EmuEventKey {
+  EmuEventKeyUnknown,
+  EmuEventKeyReturn,
+  EmuEventKeyError,
+  EmuEventKeyEvent,
+  EmuEventKeyData,
+  EmuEventKeyQmp,
+  EmuEventKeyTimestamp,
+  EmuEventKeyStatus,
+  EmuEventKeyResult,
+  EmuEventKeySent,
+  EmuEventKeyRemaining,
+  EmuEventKeyIteration
+} EmuEventKey;
+
+typedef struct EmuEventParser {
+  const char *pos;
+  const char *end;
+} EmuEventParser;
+
+// -----------------------------------------------------------------------------
+// Keys: perfect hash of all the known keys.
+// -----------------------------------------------------------------------------
+
+#define KEY_HASH(str, len) (((len) + (size_t)(unsigned char)(str)[0] + ((size_t)(unsigned char)(str)[(len) - 1] << 2)) & 31)
+
+static const struct {
+  const char *name;
+  EmuEventKey key;
+} Keys[32] = {
+  [5] = { "status", EmuEventKeyStatus },
+  [7] = { "sent", EmuEventKeySent },
+  [8] = { "result", EmuEventKeyResult },
+  [10] = { "iteration", EmuEventKeyIteration },
+  [12] = { "data", EmuEventKeyData },
+  [16] = { "return", EmuEventKeyReturn },
+  [18] = { "error", EmuEventKeyError },
+  [20] = { "QMP", EmuEventKeyQmp },
+  [23] = { "remaining", EmuEventKeyRemaining },
+  [26] = { "event", EmuEventKeyEvent },
+  [29] = { "timestamp", EmuEventKeyTimestamp }
+};
+
+static EmuEventKey emu_event_key_from_string (const EmuEventString *string) {
+  if (!string->len)
+    return EmuEventKeyUnknown;
+
+  const size_t hash = KEY_HASH(string->str, string->len);
+  return Keys[hash].name && emu_event_string_equals(string, Keys[hash].name)
+    ? Keys[hash].key
+    : EmuEventKeyUnknown;
+}
+
+// -----------------------------------------------------------------------------
+// Scanner.
+// -----------------------------------------------------------------------------
+
+static inline int parser_skip_spaces (EmuEventParser *parser) {
+  while (parser->pos != parser->end) {
+    const char c = *parser->pos;
+    if (c != ' ' && c != '\t' && c != '\n' && c != '\r')
+      return PARSE_OK;
+    ++parser->pos;
+  }
+  return PARSE_INCOMPLETE;
+}
+
+static inline int parser_expect (EmuEventParser *parser, char c) {
+  const int ret = parser_skip_spaces(parser);
+  if (ret != PARSE_OK)
+    return ret;
+  if (*parser->pos != c)
+    return PARSE_UNSUPPORTED;
+  ++parser->pos;
+  return PARSE_OK;
+}
+
+// Strings with escape sequences are not supported.
+static int parser_read_string (EmuEventParser *parser, EmuEventString *string) {
+  const int ret = parser_expect(parser, '"');
+  if (ret != PARSE_OK)
+    return ret;
+
+  const char *start = parser->pos;
+  for (; parser->pos != parser->end; ++parser->pos) {
+    const unsigned char c = (unsigned char)*parser->pos;
+    if (c == '"') {
+      string->str = start;
+      string->len = (size_t)(parser->pos++ - start);
+      return PARSE_OK;
+    }
+    if (c == '\\' || c < 0x20)
+      return PARSE_UNSUPPORTED;
+  }
+  return PARSE_INCOMPLETE;
+}
+
+static int parser_read_int (EmuEventParser *parser, int64_t *value) {
+  const int ret = parser_skip_spaces(parser);
+  if (ret != PARSE_OK)
+    return ret;
+
+  bool negative = false;
+  if (*parser->pos == '-') {
+    negative = true;
+    if (++parser->pos == parser->end)
+      return PARSE_INCOMPLETE;
+  }
+
+  const char *start = parser->pos;
+  uint64_t result = 0;
+  for (; parser->pos != parser->end; ++parser->pos) {
+    const char c = *parser->pos;
+    if (c < '0' || c > '9')
+      break;
+    if (result > (UINT64_MAX - 9) / 10)
+      return PARSE_UNSUPPORTED;
+    result = result * 10 + (uint64_t)(c - '0');
+  }
+
+  // The last digit can be followed by other digits in the next read.
+  if (parser->pos == parser->end)
+    return PARSE_INCOMPLETE;
+
+  const char c = *parser->pos;
+  if (parser->pos == start || c == '.' || c == 'e' || c == 'E' || result > INT64_MAX)
+    return PARSE_UNSUPPORTED;
+
+  *value = negative ? -(int64_t)result : (int64_t)result;
+  return PARSE_OK;
+}
+
+static int parser_skip_value (EmuEventParser *parser, int depth) {
+  int ret = parser_skip_spaces(parser);
+  if (ret != PARSE_OK)
+    return ret;
+
+  const char c = *parser->pos;
+  if (c == '"') {
+    EmuEventString string;
+    return parser_read_string(parser, &string);
+  }
+
+  if (c == '{' || c == '[') {
+    if (depth == PARSE_MAX_DEPTH)
+      return PARSE_UNSUPPORTED;
+
+    const char close = c == '{' ? '}' : ']';
+    ++parser->pos;
+    if ((ret = parser_skip_spaces(parser)) != PARSE_OK)
+      return ret;
+    if (*parser->pos == close) {
+      ++parser->pos;
+      return PARSE_OK;
+    }
+
+    for (;;) {
+      if (c == '{') {
+        EmuEventString key;
+        if ((ret = parser_read_string(parser, &key)) != PARSE_OK || (ret = parser_expect(parser, ':')) != PARSE_OK)
+          return ret;
+      }
+      if ((ret = parser_skip_value(parser, depth + 1)) != PARSE_OK || (ret = parser_skip_spaces(parser)) != PARSE_OK)
+        return ret;
+
+      const char next = *parser->pos++;
+      if (next == close)
+        return PARSE_OK;
+      if (next != ',')
+        return PARSE_UNSUPPORTED;
+    }
+  }
+
+  if (c == '-' || (c >= '0' && c <= '9')) {
+    int64_t value;
+    return parser_read_int(parser, &value);
+  }
+
+  static const char *literals[] = { "true", "false", "null" };
+  const char **literal;
+  foreach (literal, literals) {
+    const size_t len = strlen(*literal);
+    const size_t available = (size_t)(parser->end - parser->pos);
+    if (strncmp(parser->pos, *literal, available < len ? available : len))
+      continue;
+    if (available < len)
+      return PARSE_INCOMPLETE;
+    parser->pos += len;
+    return PARSE_OK;
+  }
+
+  return PARSE_UNSUPPORTED;
+}
+
+// Read `{ "key": value, ... }` and give each key to cb.
+static int parser_read_object (
+  EmuEventParser *parser,
+  int (*cb)(EmuEventParser *parser, EmuEventKey key, EmuMessage *message),
+  EmuMessage *message
+) {
+  int ret = parser_expect(parser, '{');
+  if (ret != PARSE_OK || (ret = parser_skip_spaces(parser)) != PARSE_OK)
+    return ret;
+  if (*parser->pos == '}') {
+    ++parser->pos;
+    return PARSE_OK;
+  }
+
+  for (;;) {
+    EmuEventString key;
+    if (
+      (ret = parser_read_string(parser, &key)) != PARSE_OK ||
+      (ret = parser_expect(parser, ':')) != PARSE_OK ||
+      (ret = (*cb)(parser, emu_event_key_from_string(&key), message)) != PARSE_OK ||
+      (ret = parser_skip_spaces(parser)) != PARSE_OK
+    )
+      return ret;
+
+    const char next = *parser->pos++;
+    if (next == '}')
+      return PARSE_OK;
+    if (next != ',')
+      return PARSE_UNSUPPORTED;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// EMP schema.
+// -----------------------------------------------------------------------------
+
+static int parser_read_data_field (EmuEventParser *parser, EmuEventKey key, EmuMessage *message) {
+  EmuEvent *event = &message->event;
+
+  int field;
+  switch (key) {
+    case EmuEventKeyStatus: field = EMU_EVENT_FIELD_STATUS; break;
+    case EmuEventKeyResult: field = EMU_EVENT_FIELD_RESULT; break;
+    case EmuEventKeySent: field = EMU_EVENT_FIELD_SENT; break;
+    case EmuEventKeyRemaining: field = EMU_EVENT_FIELD_REMAINING; break;
+    case EmuEventKeyIteration: field = EMU_EVENT_FIELD_ITERATION; break;
+    default: return PARSE_UNSUPPORTED;
+  }
+  if (event->fields & field)
+    return PARSE_UNSUPPORTED;
+  event->fields |= field;
+
+  if (key == EmuEventKeyStatus)
+    return parser_read_string(parser, &event->status);
+  if (key == EmuEventKeyResult)
+    return parser_read_string(parser, &event->result);
+
+  int64_t value;
+  const int ret = parser_read_int(parser, &value);
+  if (ret != PARSE_OK)
+    return ret;
+
+  if (key == EmuEventKeySent)
+    event->sent = value;
+  else if (key == EmuEventKeyRemaining)
+    event->remaining = value;
+  else if (value >= INT32_MIN && value <= INT32_MAX)
+    event->iteration = (int)value;
+  else
+    return PARSE_UNSUPPORTED;
+
+  return PARSE_OK;
+}
+
+static int parser_read_message_field (EmuEventParser *parser, EmuEventKey key, EmuMessage *message) {
+  switch (key) {
+    case EmuEventKeyReturn:
+      if (message->isReturn)
+        return PARSE_UNSUPPORTED;
+      message->isReturn = true;
+      return parser_skip_value(parser, 0);
+    case EmuEventKeyEvent:
+      if (message->isEvent)
+        return PARSE_UNSUPPORTED;
+      message->isEvent = true;
+      return parser_read_string(parser, &message->event.name);
+    case EmuEventKeyData:
+      if (message->event.fields)
+        return PARSE_UNSUPPORTED;
+      return parser_read_object(parser, parser_read_data_field, message);
+    default:
+      // Errors, QMP greeting and timestamps are rare.
+      return PARSE_UNSUPPORTED;
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+int emu_event_parse (const char *buf, size_t size, EmuMessage *message) {
+  *message = (EmuMessage){
+    .event = { .sent = -1, .remaining = -1, .iteration = -1 }
+  };
+
+  EmuEventParser parser = { buf, buf + size };
+  const int ret = parser_read_object(&parser, parser_read_message_field, message);
+  if (ret != PARSE_OK)
+    return ret;
+
+  // Data without event, or reply and event in the same message.
+  if (message->isReturn == message->isEvent)
+    return PARSE_UNSUPPORTED;
+
+  return (int)(parser.pos - buf);
+}
+
+// -----------------------------------------------------------------------------
+
+void emu_event_from_json (EmuEvent *event, const char *name, const json_object *data) {
+  *event = (EmuEvent){
+    .name = { name, strlen(name) },
+    .sent = -1,
+    .remaining = -1,
+    .iteration = -1
+  };
+  if (!data || !json_object_is_type((json_object *)data, json_type_object))
+    return;
+
+  for (const struct lh_entry *entry = json_object_get_object((json_object *)data)->head; entry; entry = entry->next) {
+    const char *key = entry->k;
+    json_object *value = (json_object *)entry->v;
+    const json_type type = json_object_get_type(value);
+
+    if (type == json_type_string && (!strcmp(key, "status") || !strcmp(key, "result"))) {
+      const EmuEventString string = { json_object_get_string(value), (size_t)json_object_get_string_len(value) };
+      if (*key == 's') {
+        event->status = string;
+        event->fields |= EMU_EVENT_FIELD_STATUS;
+      } else {
+        event->result = string;
+        event->fields |= EMU_EVENT_FIELD_RESULT;
+      }
+    } else if (type == json_type_int && !strcmp(key, "remaining")) {
+      event->remaining = json_object_get_int64(value);
+      event->fields |= EMU_EVENT_FIELD_REMAINING;
+    } else if (type == json_type_int && !strcmp(key, "sent")) {
+      event->sent = json_object_get_int64(value);
+      event->fields |= EMU_EVENT_FIELD_SENT;
+    } else if (type == json_type_int && !strcmp(key, "iteration")) {
+      event->iteration = json_object_get_int(value);
+      event->fields |= EMU_EVENT_FIELD_ITERATION;
+    } else {
+      // Not an error here: only the EMP client knows the schema of its events.
+      syslog(LOG_DEBUG, "Unexpected event data key: `%s` (type=%d).", key, type);
+      event->fields |= EMU_EVENT_FIELD_UNKNOWN;
+    }
+  }
+}
+
+bool emu_event_string_equals (const EmuEventString *string, const char *value) {
+  return !strncmp(string->str, value, string->len) && !value[string->len];
+}
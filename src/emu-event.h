@@ -0,0 +1,74 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _EMU_EVENT_H_
+#define _EMU_EVENT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <json-c/json.h>
+
+// =============================================================================
+// Messages received from emus: command replies and events.
+// The usual EMP shapes are decoded in place without allocation, the others
+// must be parsed with json-c.
+// =============================================================================
+
+// String in the receive buffer, not NUL-terminated.
+typedef struct EmuEventString {
+  const char *str;
+  size_t len;
+} EmuEventString;
+
+#define EMU_EVENT_FIELD_STATUS (1 << 0)
+#define EMU_EVENT_FIELD_RESULT (1 << 1)
+#define EMU_EVENT_FIELD_SENT (1 << 2)
+#define EMU_EVENT_FIELD_REMAINING (1 << 3)
+#define EMU_EVENT_FIELD_ITERATION (1 << 4)
+#define EMU_EVENT_FIELD_UNKNOWN (1 << 5) // Unexpected key or type in data.
+
+typedef struct EmuEvent {
+  EmuEventString name;
+
+  // Decoded fields of the MIGRATION event data.
+  int fields;
+  EmuEventString status;
+  EmuEventString result;
+  int64_t sent;
+  int64_t remaining;
+  int iteration;
+} EmuEvent;
+
+// Reply or event read by emu_event_parse.
+typedef struct EmuMessage {
+  bool isReturn;
+  bool isEvent;
+  EmuEvent event;
+} EmuMessage;
+
+// Returns the size of the parsed message, 0 if the message is not complete
+// and -1 if it must be parsed with json-c.
+int emu_event_parse (const char *buf, size_t size, EmuMessage *message);
+
+// Decode the data of an event parsed by json-c.
+void emu_event_from_json (EmuEvent *event, const char *name, const json_object *data);
+
+bool emu_event_string_equals (const EmuEventString *string, const char *value);
+
+#endif // ifndef _EMU_EVENT_H_
@@ -20,26 +20,43 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <libempserver.h>
 #include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
-#include <syslog.h>
 #include <unistd.h>
 
 #include <xcp-ng/generic.h>
 
+#include "arena.h"
 #include "arg-list.h"
 #include "control.h"
 #include "emu-client.h"
+#include "emu-event.h"
 #include "emu.h"
+#include "file-writer.h"
+#include "logger.h"
+#include "monotonic-clock.h"
+#include "prefetcher.h"
+#include "reactor.h"
+#include "relay.h"
+#include "scheduler.h"
+#include "stream-inspector.h"
+#include "telemetry.h"
 
 // =============================================================================
 
 #define EMU_LOG_PHASE() syslog(LOG_DEBUG, "Phase: %s", __func__)
 
 static int emu_manager_process (bool (*cb)(Emu *emu));
+static void emu_handle_error (Emu *emu, int errorCode, const char *label);
+static int emu_manager_handle_client (int fd, uint32_t events, void *userData);
+static void emu_manager_apply_stream_bandwidth ();
 
 // =============================================================================
 
@@ -48,19 +65,37 @@ typedef struct EmuStream {
   bool isBusy;
   int remainingUses;
   int refCount;
+  bool isFile; // Suspend case.
+  Prefetcher *prefetcher; // Restore from a file.
+  Relay *relay; // If set, fd is the pipe end given to the emus.
+  bool isRelayWatched; // Its errors are handled by the event loop.
+  bool isLimited; // Save relays are limited by StreamBandwidth.
+  StreamInspector *inspector; // Records of a xenguest stream, fed by the relay.
+
+  // Other connections of the stream, they are striped by the relay.
+  int extraFds[RELAY_MAX_STREAM_FDS - 1];
+  int extraFdsCount;
 } EmuStream;
 
 // =============================================================================
 
 __thread int EmuError;
 
+#define XENGUEST_DEFAULT_PATH "/usr/libexec/xen/bin/xenguest"
+
+// Shared by all migrations, see: emu_manager_configure.
+static const char *XenguestPathName = XENGUEST_DEFAULT_PATH;
+
 // All supported and used emus.
 // By default only xenguest is enabled.
 // qemu is enabled here: https://github.com/xapi-project/xenopsd/blob/ddc965e3d5bcdb2a77c387237a9ea77eddfc3b43/xc/domain.ml#L874
-static Emu Emus[] = {
+// Each migration thread has its own table, see: daemon.c.
+static __thread Emu Emus[] = {
   {
     .name = "xenguest",
-    .pathName = "/usr/libexec/xen/bin/xenguest",
+    .pathName = XENGUEST_DEFAULT_PATH,
+    .readyFd = -1,
+    .pidFd = -1,
     .type = EmuTypeEmp,
     .flags =
       EMU_FLAG_ENABLED |
@@ -69,10 +104,13 @@ static Emu Emus[] = {
       EMU_FLAG_MIGRATE_PAUSE |
       EMU_FLAG_MIGRATE_PAUSED,
     .state = EMU_STATE_INITIALIZED,
-    .progress = { .fakeTotal = 1024 * 1024 }
+    // Unknown until the first progress event, see: emu_get_stream_progress.
+    .progress = { .iteration = -1, .fakeTotal = 1024 * 1024 }
   }, {
     .name = "qemu",
     .pathName = NULL,
+    .readyFd = -1,
+    .pidFd = -1,
     .type = EmuTypeQmpLibxl,
     .flags =
       EMU_FLAG_MIGRATE_LIVE |
@@ -83,23 +121,79 @@ static Emu Emus[] = {
   }
 };
 
-static volatile sig_atomic_t WaitEmusTermination;
+// Max duration to wait for the exit of the emus.
+#define EMU_TERMINATION_TIMEOUT 60000
+#define EMU_TERMINATION_POLL_INTERVAL 100
+
+// Interval of the event loop wake up when nothing happens. Used to report progress.
+#define EMU_HEARTBEAT_INTERVAL 30000
+
+static __thread int HeartbeatTimerFd = -1;
+static __thread bool HeartbeatExpired;
+
+// Max duration to wait for the replies of asynchronous commands.
+#define EMU_COMMANDS_TIMEOUT 30000
+
+// Max duration to wait for the start of all emus.
+#define EMU_START_TIMEOUT (180 * 1000)
+
+// Deadline of the current wait. emu_manager_poll fails with ETIMEDOUT when it's reached.
+static __thread int DeadlineTimerFd = -1;
+static __thread bool DeadlineExpired;
+
+// Coalesced progress is sent by the event loop when this timer expires.
+static __thread int ProgressTimerFd = -1;
+
+// The control fdOut is polled for EPOLLOUT only when messages are queued.
+static __thread bool ControlOutputWanted;
+
+static __thread uint DomId;
+
+static __thread bool PauseGranted;
+
+// Exits of children are expected after emu_manager_wait_termination call.
+static __thread bool IsTerminating;
+
+// Limits of the relayed save streams in bytes/s, 0 for no limit.
+static __thread struct {
+  int64_t live;
+  int64_t stopAndCopy;
+  bool isStopAndCopy;
+  int64_t share; // Given by the scheduler, it changes with the count of running migrations.
+} StreamBandwidth;
+
+#ifndef SYS_pidfd_open
+  #define SYS_pidfd_open 434
+#endif
+
+static const char EmuReadyMessage[] = "Ready\n";
 
 // =============================================================================
 // Emu.
 // =============================================================================
 
-static int emu_json_check_type (const char *key, json_object *value, json_type expectedType) {
-  const json_type currentType = json_object_get_type(value);
-  if (currentType != expectedType) {
-    syslog(LOG_ERR, "Unexpected event type for key `%s`. (Current=%d, Expected=%d)", key, currentType, expectedType);
-    EmuError = EINVAL;
-    return -1;
+#define SENT_SMOOTH_RATIO (80.f / 100.f)
+
+// Without progress events, the pages counted in an inspected stream are used.
+// Only if the size of the guest is known: it is in the P2M record of a PV
+// stream. The pages of a HVM stream cannot be compared to the fake total.
+static void emu_get_stream_progress (const Emu *emu, int64_t *total, int64_t *amount) {
+  const EmuMigrationProgress *progress = &emu->progress;
+
+  StreamInspectorStats stats;
+  if (emu_get_stream_stats(emu, &stats) < 0 || !stats.pages || !stats.p2mPages) {
+    *total = progress->fakeTotal;
+    *amount = 0;
+    return;
   }
-  return 0;
-}
 
-#define SENT_SMOOTH_RATIO (80.f / 100.f)
+  int64_t remaining = 0;
+  if (!stats.isComplete && stats.p2mPages > stats.uniquePages)
+    remaining = (int64_t)((stats.p2mPages - stats.uniquePages) * stats.pageSize);
+
+  *amount = (int64_t)(stats.uniquePages * stats.pageSize);
+  *total = *amount + remaining;
+}
 
 static int emu_manager_compute_progress () {
   int64_t total = 0;
@@ -111,9 +205,11 @@ static int emu_manager_compute_progress () {
 
     const EmuMigrationProgress *progress = &emu->progress;
     if (progress->iteration < 0) {
-      total += progress->fakeTotal;
-      if (emu->state > EMU_STATE_LIVE_STAGE_DONE)
-        amount += progress->fakeTotal;
+      int64_t emuTotal;
+      int64_t emuAmount;
+      emu_get_stream_progress(emu, &emuTotal, &emuAmount);
+      total += emuTotal;
+      amount += emu->state > EMU_STATE_LIVE_STAGE_DONE ? emuTotal : emuAmount;
     } else {
       total += progress->sent + progress->remaining;
       amount += progress->sent +
@@ -129,30 +225,43 @@ static int emu_manager_send_progress () {
   return control_send_progress(progress) > -1 ? progress : -1;
 }
 
+// Extended progress, only sent if enabled by the control channel options.
+static int emu_send_progress_info (const Emu *emu) {
+  const ConvergenceModel *model = &emu->convergence;
+
+  // During the live stage, the guest dirties pages while they are sent.
+  const double rate = emu->phase == EmuPhaseLive ? model->transferRate - model->dirtyRate : model->transferRate;
+
+  const ControlProgressInfo info = {
+    .transferRate = model->lastTime ? (int64_t)model->transferRate : -1,
+    .dirtyRate = model->lastTime ? (int64_t)model->dirtyRate : -1,
+    .eta = model->remaining > -1 && rate > 0 ? (int64_t)((double)model->remaining / rate) : -1,
+    .iteration = model->iteration,
+    .phase = emu_phase_to_str(emu->phase)
+  };
+  return control_send_progress_info(emu->name, &info);
+}
+
 // -----------------------------------------------------------------------------
 // Emu process callbacks.
 // -----------------------------------------------------------------------------
 
-static bool emu_process_cb_wait_qmp_libxl_initialization (Emu *emu) {
-  if (emu->type != EmuTypeQmpLibxl)
-    return false; // Initialized because it's not a QMP libxl emu.
+static bool emu_process_cb_wait_started (Emu *emu) {
+  if (!emu->flags)
+    return false;
 
-  if (emu->qmpConnectionEstablished) {
-    // QMP connection is established but we must execute "qmp_capabilities"
-    // to enter command mode.
-    if (emu->state == EMU_STATE_UNINITIALIZED) {
-      // It's not necessary to check the return, after the next send command
-      // an error must be returned.
-      emu_client_send_qmp_cmd(emu->client, QmpCommandNumCapabilities, NULL);
-      emu->state = EMU_STATE_INITIALIZED;
-    }
+  // Not ready, not connected or init commands not acknowledged.
+  const EmuClient *client = emu->client;
+  if (!client || client->isConnecting || client->pendingCmdsCount)
+    return true;
 
-    // Initialized. \o/
-    return false;
-  }
+  // QMP libxl emu is initialized when "qmp_capabilities" is acknowledged.
+  return emu->state == EMU_STATE_UNINITIALIZED;
+}
 
-  // Not initialized.
-  return true;
+static bool emu_process_cb_wait_pause_granted (Emu *emu) {
+  XCP_UNUSED(emu);
+  return !PauseGranted;
 }
 
 static bool emu_process_cb_wait_live_stage_done (Emu *emu) {
@@ -167,69 +276,54 @@ static bool emu_process_cb_wait_migrate_live_finished (Emu *emu) {
 // Emu client event callbacks.
 // -----------------------------------------------------------------------------
 
-static int emu_client_event_cb_emp (EmuClient *client, const char *eventType, const json_object *obj) {
-  if (strcmp(eventType, "MIGRATION")) {
-    syslog(LOG_ERR, "Unknown event type: `%s`.", eventType);
+static int emu_client_event_cb_emp (EmuClient *client, const EmuEvent *event) {
+  if (!emu_event_string_equals(&event->name, "MIGRATION")) {
+    syslog(LOG_ERR, "Unknown event type: `%.*s`.", (int)event->name.len, event->name.str);
     EmuError = EINVAL;
     return -1;
   }
 
-  const struct lh_entry *entry = json_object_get_object((json_object *)obj)->head;
-  if (!entry) return 0; // Ignore empty object.
-
-  int iterationValue = -1;
-  int64_t remainingValue = -1;
-  int64_t sentValue = -1;
-
-  EmuMigrationProgress *progress = &client->emu->progress;
+  if (!event->fields) return 0; // Ignore empty object.
 
-  for (; entry; entry = entry->next) {
-    const char *key = entry->k;
-    json_object *value = (json_object *)entry->v;
+  if (event->fields & EMU_EVENT_FIELD_UNKNOWN) {
+    syslog(LOG_ERR, "Unexpected key or type in `%s` event data.", client->emu->name);
+    EmuError = EINVAL;
+    return -1;
+  }
 
-    if (!strcmp(key, "status")) {
-      if (emu_json_check_type(key, value, json_type_string) < 0)
-        return -1;
+  int iterationValue = event->iteration;
+  int64_t remainingValue = event->remaining;
+  int64_t sentValue = event->sent;
 
-      const char *status = json_object_get_string(value);
-      if (strcmp(status, "completed")) {
-        syslog(LOG_ERR, "Invalid emu `%s` event status: `%s`.", client->emu->name, status);
-        EmuError = EREMOTEIO;
-        return -1;
-      }
+  EmuMigrationProgress *progress = &client->emu->progress;
 
+  if (event->fields & EMU_EVENT_FIELD_STATUS) {
+    // Extension of the EMP protocol, see: emp-ext.h.
+    if (emu_event_string_equals(&event->status, "postcopy")) {
+      syslog(LOG_INFO, "Emu `%s` is in post-copy.", client->emu->name);
+      client->emu->state = EMU_STATE_POSTCOPY;
+    } else if (!emu_event_string_equals(&event->status, "completed")) {
+      syslog(LOG_ERR, "Invalid emu `%s` event status: `%.*s`.",
+        client->emu->name, (int)event->status.len, event->status.str
+      );
+      EmuError = EREMOTEIO;
+      return -1;
+    } else {
       syslog(LOG_INFO, "Emu `%s` is completed.", client->emu->name);
       client->emu->state = EMU_STATE_MIGRATION_DONE;
       if (emu_set_stream_busy(client->emu, false) < 0)
         return -1;
-    } else if (!strcmp(key, "result")) {
-      if (emu_json_check_type(key, value, json_type_string) < 0)
-        return -1;
+    }
+  }
 
-      const char *result = json_object_get_string(value);
-      syslog(LOG_DEBUG, "Emu %s received result: `%s`.", client->emu->name, result);
+  if (event->fields & EMU_EVENT_FIELD_RESULT) {
+    syslog(LOG_DEBUG, "Emu %s received result: `%.*s`.", client->emu->name, (int)event->result.len, event->result.str);
 
-      free(progress->result);
-      if (!(progress->result = strdup(result))) {
-        syslog(LOG_ERR, "Failed to copy event result buffer.");
-        EmuError = errno;
-        return -1;
-      }
-    } else {
-      if (emu_json_check_type(key, value, json_type_int) < 0)
-        return -1;
-
-      if (!strcmp(key, "remaining"))
-        remainingValue = json_object_get_int64(value);
-      else if (!strcmp(key, "sent"))
-        sentValue = json_object_get_int64(value);
-      else if (!strcmp(key, "iteration"))
-        iterationValue = json_object_get_int(value);
-      else {
-        syslog(LOG_ERR, "Unexpected event data key: `%s`", key);
-        EmuError = EINVAL;
-        return -1;
-      }
+    // The previous result stays in the arena until the end of the migration.
+    if (!(progress->result = arena_strndup(event->result.str, event->result.len))) {
+      syslog(LOG_ERR, "Failed to copy event result buffer.");
+      EmuError = errno;
+      return -1;
     }
   }
 
@@ -245,10 +339,16 @@ static int emu_client_event_cb_emp (EmuClient *client, const char *eventType, co
   }
   progress->sentMidIteration = sentValue;
 
+  convergence_model_update(&client->emu->convergence, iterationValue, sentValue, remainingValue);
+  telemetry_write(client->emu);
+
+  if (emu_send_progress_info(client->emu) < 0)
+    return -1;
+
   const int sentProgress = emu_manager_send_progress();
   if (sentProgress < 0) return -1;
 
-  syslog(LOG_INFO, "Event for `%s`: rem %ld, sent %ld, iter %d, %s. Progress = %d",
+  syslog(LOG_INFO, "Event for `%s`: rem %" PRId64 ", sent %" PRId64 ", iter %d, %s. Progress = %d",
     client->emu->name,
     remainingValue,
     sentValue,
@@ -257,27 +357,63 @@ static int emu_client_event_cb_emp (EmuClient *client, const char *eventType, co
     sentProgress
   );
 
-  // TODO: Check better remaining value.
-  if (
-    iterationValue > 0 &&
-    (remainingValue <= 50 || iterationValue >= 4) &&
-    client->emu->state != EMU_STATE_LIVE_STAGE_DONE
-  ) {
-    syslog(LOG_INFO, "`%s` live stage is done!", client->emu->name);
+  // The end of the live stage is only decided once.
+  if (client->emu->phase != EmuPhaseLive || client->emu->state >= EMU_STATE_LIVE_STAGE_DONE)
+    return 0;
+
+  const ConvergenceModel *model = &client->emu->convergence;
+  const ConvergenceVerdict verdict = convergence_check(model);
+  if (verdict == ConvergenceVerdictOverBudget) {
+    syslog(LOG_ERR, "`%s` cannot meet the downtime budget after %d iterations. (downtime ~%" PRId64 " ms)",
+      client->emu->name,
+      model->iteration,
+      convergence_model_predict_downtime(model)
+    );
+    emu_handle_error(client->emu, EmuErrorDowntimeBudget, "convergence_check");
+    EmuError = EmuErrorDowntimeBudget;
+    return -1;
+  }
+
+  if (verdict == ConvergenceVerdictPostCopy)
+    client->emu->flags |= EMU_FLAG_MIGRATE_POSTCOPY;
+
+  if (verdict != ConvergenceVerdictContinue) {
+    syslog(LOG_INFO, "`%s` live stage is done! (%s: transfer %.0f/s, dirty %.0f/s, downtime ~%" PRId64 " ms)",
+      client->emu->name,
+      convergence_verdict_to_str(verdict),
+      model->transferRate,
+      model->dirtyRate,
+      convergence_model_predict_downtime(model)
+    );
     client->emu->state = EMU_STATE_LIVE_STAGE_DONE;
   }
 
   return 0;
 }
 
-static int emu_client_event_cb_qmp_libxl (EmuClient *client, const char *eventType, const json_object *obj) {
-  XCP_UNUSED(obj);
+static int emu_qmp_capabilities_cb (EmuClient *client, int error, void *userData) {
+  XCP_UNUSED(userData);
+
+  if (error) {
+    EmuError = error;
+    return -1;
+  }
 
-  if (!strcmp(eventType, "QMP")) {
+  syslog(LOG_DEBUG, "QEMU is ready!");
+  client->emu->state = EMU_STATE_INITIALIZED;
+  return 0;
+}
+
+static int emu_client_event_cb_qmp_libxl (EmuClient *client, const EmuEvent *event) {
+  if (emu_event_string_equals(&event->name, "QMP")) {
     syslog(LOG_INFO, "Got QMP version negotiation.");
     client->emu->qmpConnectionEstablished = true;
+
+    // QMP connection is established but we must execute "qmp_capabilities"
+    // to enter command mode.
+    return emu_client_send_qmp_cmd_async(client, QmpCommandNumCapabilities, NULL, emu_qmp_capabilities_cb, NULL);
   } else
-    syslog(LOG_INFO, "Ignoring QMP event: `%s`.", eventType);
+    syslog(LOG_INFO, "Ignoring QMP event: `%.*s`.", (int)event->name.len, event->name.str);
 
   return 0;
 }
@@ -287,7 +423,7 @@ static int emu_client_event_cb_qmp_libxl (EmuClient *client, const char *eventTy
 static void emu_handle_error (Emu *emu, int errorCode, const char *label) {
   // Because many emus can fail, it's necessary to mark the first failed emu,
   // and then report it to xenopsd in the termination process.
-  static bool firstEmuError = true;
+  static __thread bool firstEmuError = true;
 
   syslog(LOG_ERR, "Error for emu `%s`: %s => %s", emu->name, label, emu_error_code_to_str(errorCode));
   if (errorCode && emu->errorCode == 0) {
@@ -301,14 +437,129 @@ static void emu_handle_error (Emu *emu, int errorCode, const char *label) {
 
 // -----------------------------------------------------------------------------
 
-static int emu_fork_emp_client (Emu *emu, uint domId) {
+static int emu_connect (Emu *emu);
+
+static void emu_close_pid_fd (Emu *emu) {
+  if (emu->pidFd <= -1)
+    return;
+
+  reactor_remove(emu->pidFd);
+  xcp_fd_close(emu->pidFd);
+  emu->pidFd = -1;
+}
+
+static int emu_exit_status_to_error (int status) {
+  if (WIFSIGNALED(status))
+    return EmuErrorKilled;
+  return WIFEXITED(status) && WEXITSTATUS(status) ? EmuErrorExitedWithErr : 0;
+}
+
+static void emu_reap (Emu *emu, int status) {
+  if (WIFEXITED(status)) {
+    const int code = WEXITSTATUS(status);
+    if (code == 0)
+      syslog(LOG_INFO, "Emu `%s` %s.", emu->name, "completed normally");
+    else
+      syslog(LOG_ERR, "Emu `%s` %s: %d.", emu->name, "exited with an error", code);
+  } else if (WIFSIGNALED(status))
+    syslog(LOG_ERR, "Child `%s` terminated by signal %d.", emu->name, WTERMSIG(status));
+
+  emu->pid = 0;
+  emu->hasExited = true;
+  emu->exitStatus = status;
+  emu_close_pid_fd(emu);
+}
+
+// Called when a spawned emu exits.
+static int emu_manager_handle_child (int fd, uint32_t events, void *userData) {
+  XCP_UNUSED(fd);
+  XCP_UNUSED(events);
+
+  Emu *emu = userData;
+
+  int status;
+  const pid_t pid = waitpid(emu->pid, &status, WNOHANG);
+  if (pid == 0 || (pid < 0 && errno == EINTR))
+    return 0;
+
+  if (pid < 0) {
+    syslog(LOG_ERR, "Failed to wait for `%s`: `%s`.", emu->name, strerror(errno));
+    EmuError = errno;
+    emu_close_pid_fd(emu);
+    return -1;
+  }
+
+  emu_reap(emu, status);
+  if (IsTerminating) {
+    if (!emu->errorCode)
+      emu->errorCode = emu_exit_status_to_error(status);
+    return 0;
+  }
+
+  // The migration cannot continue without this emu.
+  const int error = emu_exit_status_to_error(status);
+  EmuError = error ? error : EmuErrorDisconnected;
+  emu_handle_error(emu, EmuError, "child_exited");
+  return -1;
+}
+
+static void emu_close_ready_fd (Emu *emu) {
+  if (emu->readyFd <= -1)
+    return;
+
+  reactor_remove(emu->readyFd);
+  xcp_fd_close(emu->readyFd);
+  emu->readyFd = -1;
+}
+
+// Called when the output of a spawned emu is readable: it writes "Ready\n" once listening.
+static int emu_manager_handle_ready (int fd, uint32_t events, void *userData) {
+  XCP_UNUSED(events);
+
+  Emu *emu = userData;
+
+  char buf[sizeof EmuReadyMessage - 1];
+  const ssize_t ret = read(fd, buf, sizeof buf - emu->readySize);
+  if (ret < 0) {
+    if (errno == EINTR || errno == EAGAIN)
+      return 0;
+    syslog(LOG_ERR, "Failed to read from `%s`: `%s`.", emu->pathName, strerror(errno));
+    EmuError = errno;
+  } else if (ret == 0) {
+    syslog(LOG_ERR, "Failed to read from `%s`. Pipe is broken.", emu->pathName);
+    EmuError = EPIPE;
+  } else if (memcmp(buf, EmuReadyMessage + emu->readySize, (size_t)ret)) {
+    syslog(LOG_ERR, "Invalid output given by `%s`.", emu->pathName);
+    EmuError = EINVAL;
+  } else {
+    emu->readySize += (size_t)ret;
+    if (emu->readySize < sizeof buf)
+      return 0;
+
+    syslog(LOG_INFO, "Emu `%s` is ready.", emu->name);
+    emu_close_ready_fd(emu);
+    if (emu_connect(emu) == 0)
+      return 0;
+  }
+
+  emu_handle_error(emu, EmuError, "wait_ready");
+  return -1;
+}
+
+// Start an emu without waiting for it: emu_manager_handle_ready connects it when it's ready.
+static int emu_spawn (Emu *emu) {
   assert(emu->pathName);
 
+  // Other migrations can run in this process, so the child must only call
+  // async-signal-safe functions before exec: everything is prepared here.
+  char domIdStr[16];
+  snprintf(domIdStr, sizeof domIdStr, "%u", DomId);
+
   char *argv[] = {
     (char *)emu->pathName,
     "-debug",
     "-domid",
-    NULL,
+    domIdStr,
     "-controloutfd",
     "2",
     "-controlinfd",
@@ -318,11 +569,17 @@ static int emu_fork_emp_client (Emu *emu, uint domId) {
     NULL
   };
 
+  char *envp[] = {
+    "LD_PRELOAD=/usr/libexec/coreutils/libstdbuf.so",
+    "_STDBUF_O=0",
+    NULL
+  };
+
   syslog(LOG_INFO, "Starting `%s`...\n", *argv);
 
   // Exec!
   int pipefd[2];
-  if (pipe(pipefd) < 0) {
+  if (pipe2(pipefd, O_CLOEXEC) < 0) {
     syslog(LOG_ERR, "Unable to create pipe: `%s`.", strerror(errno));
     EmuError = errno;
     return -1;
@@ -337,78 +594,54 @@ static int emu_fork_emp_client (Emu *emu, uint domId) {
     return -1;
   }
 
-  // Child process.
+  // Child process. A failure is reported by the broken pipe and the exit status.
   if (pid == 0) {
-    if (xcp_fd_dup(pipefd[1], STDOUT_FILENO) < 0) {
-      syslog(LOG_ERR, "Failed to dup.\n");
-      exit(EXIT_FAILURE);
-    }
-
-    xcp_fd_close(pipefd[0]);
-    xcp_fd_close(pipefd[1]);
-    clearenv();
-
-    if (
-      putenv("LD_PRELOAD=/usr/libexec/coreutils/libstdbuf.so") ||
-      putenv("_STDBUF_O=0")
-    ) {
-      syslog(LOG_ERR, "Failed to putenv.\n");
-      exit(EXIT_FAILURE);
-    }
-
-    if (asprintf(&argv[3], "%u", domId) < 0) {
-      syslog(LOG_ERR, "Unable to format domId: `%s`.", strerror(errno));
-      exit(EXIT_FAILURE);
-    }
+    if (dup2(pipefd[1], STDOUT_FILENO) < 0)
+      _exit(EXIT_FAILURE);
 
-    if (execvp(*argv, argv) < 0) {
-      syslog(LOG_ERR, "Failed to start `%s` process.", *argv);
-      exit(EXIT_FAILURE);
-    }
+    execve(*argv, argv, envp);
+    _exit(EXIT_FAILURE);
   }
 
   // Main process.
   emu->pid = pid;
+  emu->hasExited = false;
   xcp_fd_close(pipefd[1]);
 
-  static const char ready[] = "Ready\n";
-
-  char buf[sizeof ready - 1];
-  size_t offset;
-  const XcpError ret = xcp_fd_read_all(pipefd[0], buf, sizeof buf, 180 * 1000, &offset);
-  xcp_fd_close(pipefd[0]);
+  emu->readyFd = pipefd[0];
+  emu->readySize = 0;
+  if (reactor_add(emu->readyFd, EPOLLIN, emu_manager_handle_ready, emu) < 0)
+    return -1;
 
-  if (ret == XCP_ERR_TIMEOUT) {
-    syslog(LOG_ERR, "Failed to read from `%s` because timeout reached.", *argv);
-    EmuError = ETIME;
-  } else if (ret == XCP_ERR_ERRNO) {
-    syslog(LOG_ERR, "Failed to read from `%s`: `%s`.", *argv, strerror(errno));
-    EmuError = errno;
-  } else if (ret == 0) {
-    syslog(LOG_ERR, "Failed to read from `%s`. Pipe is broken.", *argv);
-    EmuError = EPIPE;
-  } else if (memcmp(buf, ready, sizeof ready - 1)) {
-    syslog(LOG_ERR, "Invalid output given by `%s`.", *argv);
-    EmuError = EINVAL;
-  } else
+  // Without pidfd (Linux < 5.3), a crash is only noticed by the hangup of the emu socket.
+  if ((emu->pidFd = (int)syscall(SYS_pidfd_open, pid, 0)) < 0) {
+    if (errno != ENOSYS) {
+      syslog(LOG_ERR, "Failed to open pidfd of `%s`: `%s`.", emu->name, strerror(errno));
+      EmuError = errno;
+      return -1;
+    }
+    syslog(LOG_DEBUG, "pidfd is not supported, `%s` is not tracked.", emu->name);
     return 0;
-
-  return -1;
+  }
+  return reactor_add(emu->pidFd, EPOLLIN, emu_manager_handle_child, emu);
 }
 
 // -----------------------------------------------------------------------------
 
-static int emu_connect (Emu *emu, uint domId) {
+static int emu_init (Emu *emu);
+
+// Connection is asynchronous: emu_init is called when the socket is connected.
+static int emu_connect (Emu *emu) {
   if (!emu->flags) return 0;
 
   char buf[PATH_MAX];
   EmuClientCb eventCb = NULL;
   int path_len = 0;
   if (emu->type == EmuTypeEmp) {
-    path_len = emp_get_default_path(buf, sizeof buf, emu->name, (int)domId);
+    path_len = emp_get_default_path(buf, sizeof buf, emu->name, (int)DomId);
     eventCb = emu_client_event_cb_emp;
   } else if (emu->type == EmuTypeQmpLibxl) {
-    path_len = snprintf(buf, sizeof buf, "/var/run/xen/qmp-libxl-%d", domId);
+    path_len = snprintf(buf, sizeof buf, "/var/run/xen/qmp-libxl-%u", DomId);
     eventCb = emu_client_event_cb_qmp_libxl;
   }
 
@@ -431,7 +664,11 @@ static int emu_connect (Emu *emu, uint domId) {
   if (emu_client_connect(emu->client, buf) < 0)
     goto fail;
 
-  return 0;
+  const bool isConnecting = emu->client->isConnecting;
+  if (reactor_add(emu->client->fd, isConnecting ? EPOLLOUT : EPOLLIN, emu_manager_handle_client, emu) < 0)
+    goto fail;
+
+  return isConnecting ? 0 : emu_init(emu);
 
 fail:
   syslog(LOG_ERR, "Failed to connect to `%s`!", emu->name);
@@ -442,9 +679,14 @@ static int emu_disconnect (Emu *emu) {
   int error = 0;
 
   // 1. Destroying client...
+  emu_close_ready_fd(emu);
+
   EmuClient *client = emu->client;
   if (client) {
-    if (emu->pathName && client->fd > -1 && emu_client_send_emp_cmd(client, cmd_quit, NULL) < 0)
+    if (emu->pathName && client->fd > -1 && !client->isConnecting && emu_client_send_emp_cmd(client, cmd_quit, NULL) < 0)
+      error = EmuError;
+
+    if (client->fd > -1 && reactor_remove(client->fd) < 0 && !error)
       error = EmuError;
 
     if (emu_client_destroy(client) < 0 && !error)
@@ -458,13 +700,27 @@ static int emu_disconnect (Emu *emu) {
     emu->stream = NULL;
 
     assert(stream->refCount > 0);
+    // The stream memory is owned by the arena.
     if (--stream->refCount == 0) {
+      // Uses the file until it is stopped.
+      if (stream->prefetcher)
+        prefetcher_destroy(stream->prefetcher);
       if (stream->fd > -1) {
-        syslog(LOG_DEBUG, "Closing fd %d, before freeing for `%s`...", stream->fd, emu->name);
+        syslog(LOG_DEBUG, "Closing fd %d, before releasing stream of `%s`...", stream->fd, emu->name);
         if (xcp_fd_close(stream->fd) == XCP_ERR_ERRNO)
           syslog(LOG_ERR, "Failed to close stream fd for emu `%s`: `%s`.", emu->name, strerror(errno));
       }
-      free(stream);
+      // Owned by the relay once it is started.
+      for (int i = 0; i < stream->extraFdsCount; ++i)
+        if (xcp_fd_close(stream->extraFds[i]) == XCP_ERR_ERRNO)
+          syslog(LOG_ERR, "Failed to close stream fd for emu `%s`: `%s`.", emu->name, strerror(errno));
+      if (stream->relay) {
+        reactor_remove(relay_get_event_fd(stream->relay));
+        relay_destroy(stream->relay);
+      }
+      // Fed until the relay is stopped.
+      if (stream->inspector)
+        stream_inspector_destroy(stream->inspector);
     }
   }
 
@@ -489,16 +745,15 @@ static int emu_init (Emu *emu) {
     return -1;
   }
 
+  // QMP libxl emu is initialized when its greeting is received.
   if (emu->type == EmuTypeQmpLibxl) {
     syslog(LOG_DEBUG, "Waiting for QEMU...");
-    if (emu_manager_process(emu_process_cb_wait_qmp_libxl_initialization) < 0)
-      return -1;
-    syslog(LOG_DEBUG, "QEMU is ready!");
     return 0;
   }
 
+  // Replies are processed by the event loop, see: emu_process_cb_wait_started.
   if (stream) {
-    if (emu_client_send_emp_cmd_with_fd(emu->client, cmd_migrate_init, stream->fd, NULL) < 0)
+    if (emu_client_send_emp_cmd_with_fd_async(emu->client, cmd_migrate_init, stream->fd, NULL, NULL, NULL) < 0)
       return -1;
 
     // Check if we can use stream with a valid state.
@@ -528,7 +783,7 @@ static int emu_init (Emu *emu) {
     }
   }
 
-  if (emu->arguments && emu_client_send_emp_cmd(emu->client, cmd_set_args, emu->arguments) < 0)
+  if (emu->arguments.count && emu_client_send_emp_cmd_async(emu->client, cmd_set_args, &emu->arguments, NULL, NULL) < 0)
     return -1;
 
   return 0;
@@ -536,13 +791,48 @@ static int emu_init (Emu *emu) {
 
 // -----------------------------------------------------------------------------
 
+static int emu_throttle_cb (EmuClient *client, int error, void *userData) {
+  Emu *emu = client->emu;
+  emu->isThrottling = false;
+
+  if (error) {
+    syslog(LOG_ERR, "Failed to throttle `%s` guest: `%s`.", emu->name, emu_error_code_to_str(error));
+    EmuError = error;
+    return -1;
+  }
+
+  emu->throttle = (int)(intptr_t)userData;
+  return 0;
+}
+
+// The reply is processed by the event loop, see: emu_throttle_cb.
+static int emu_set_throttle (Emu *emu, int throttle) {
+  syslog(LOG_INFO, "Throttling `%s` guest: %d%% => %d%%.", emu->name, emu->throttle, throttle);
+
+  char value[16];
+  snprintf(value, sizeof value, "%d", throttle);
+
+  Arg arg = arg_make_raw("percentage", value);
+  const ArgList arguments = { &arg, 1, 1 };
+  if (emu_client_send_emp_ext_cmd_async(
+    emu->client, EmpExtCommandNumMigrateThrottle, &arguments, emu_throttle_cb, (void *)(intptr_t)throttle
+  ) < 0)
+    return -1;
+
+  emu->isThrottling = true;
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
 #define EMU_ERROR_OFFSET -2
 
 const char *emu_error_code_to_str (int errorCode) {
   static const char *errors[] = {
     "unexpectedly disconnected",
     "was killed by a signal",
-    "exited with an error"
+    "exited with an error",
+    "cannot meet the downtime budget"
   };
 
   if (errorCode >= 1)
@@ -552,6 +842,18 @@ const char *emu_error_code_to_str (int errorCode) {
   return "erroneous";
 }
 
+const char *emu_phase_to_str (EmuPhase phase) {
+  static const char *phases[] = {
+    "none",
+    "live",
+    "stop-and-copy",
+    "non-live",
+    "post-copy"
+  };
+  assert(phase >= 0 && phase < XCP_ARRAY_LEN(phases));
+  return phases[phase];
+}
+
 Emu *emu_from_name (const char *name) {
   Emu *emu;
   foreach (emu, Emus)
@@ -564,15 +866,39 @@ Emu *emu_from_name (const char *name) {
 // EmuStream.
 // =============================================================================
 
-int emu_create_stream (Emu *emu, int fd) {
-  assert(fd > -1);
-
-  if (emu->stream) {
-    syslog(LOG_ERR, "Emu `%s` cannot have more then one stream: (first=%d, second=%d).", emu->name, emu->stream->fd, fd);
+// The other fds of a stream are connections to the same host.
+static int emu_add_stream_fd (Emu *emu, int fd) {
+  EmuStream *stream = emu->stream;
+  if (stream->extraFdsCount == RELAY_MAX_STREAM_FDS - 1) {
+    syslog(LOG_ERR, "Emu `%s` cannot have more than %d stream fds.", emu->name, RELAY_MAX_STREAM_FDS);
     EmuError = EINVAL;
     return -1;
   }
 
+  struct stat buf;
+  if (fstat(fd, &buf) < 0) {
+    syslog(LOG_ERR, "Failed to validate stream %d for `%s`: `%s`.", fd, emu->name, strerror(errno));
+    EmuError = errno;
+    return -1;
+  }
+
+  if (!S_ISSOCK(buf.st_mode)) {
+    syslog(LOG_ERR, "Emu `%s` can only stripe its stream over sockets, %d is not one.", emu->name, fd);
+    EmuError = ENOTSOCK;
+    return -1;
+  }
+
+  stream->extraFds[stream->extraFdsCount++] = fd;
+  syslog(LOG_INFO, "Stream %d of `%s` is striped over %d fds.", stream->fd, emu->name, stream->extraFdsCount + 1);
+  return 0;
+}
+
+int emu_create_stream (Emu *emu, int fd) {
+  assert(fd > -1);
+
+  if (emu->stream)
+    return emu_add_stream_fd(emu, fd);
+
   // Check if descriptor already exists on other emu.
   Emu *otherEmu;
   foreach (otherEmu, Emus)
@@ -584,7 +910,7 @@ int emu_create_stream (Emu *emu, int fd) {
     }
 
   // Otherwise create new stream.
-  EmuStream *newStream = malloc(sizeof *newStream);
+  EmuStream *newStream = arena_alloc(sizeof *newStream);
   if (!newStream) {
     syslog(LOG_ERR, "Failed to allocate stream.");
     EmuError = errno;
@@ -607,6 +933,7 @@ int emu_create_stream (Emu *emu, int fd) {
   // we have finished creating the stream, otherwise we must check the write flags
   // of the fd file.
   if (!S_ISSOCK(buf.st_mode) && !S_ISFIFO(buf.st_mode)) {
+    newStream->isFile = S_ISREG(buf.st_mode);
     const int flags = fcntl(fd, F_GETFL);
     if (flags < 0) {
       EmuError = errno;
@@ -625,10 +952,97 @@ int emu_create_stream (Emu *emu, int fd) {
 
 fail:
   syslog(LOG_ERR, "Failed to validate stream %d for `%s`: `%s`.", fd, emu->name, strerror(EmuError));
-  free(newStream);
   return -1;
 }
 
+static int emu_stream_set_cloexec (const EmuStream *stream) {
+  if (xcp_fd_set_close_on_exec(stream->fd, true) != XCP_ERR_OK)
+    return -1;
+  for (int i = 0; i < stream->extraFdsCount; ++i)
+    if (xcp_fd_set_close_on_exec(stream->extraFds[i], true) != XCP_ERR_OK)
+      return -1;
+  return 0;
+}
+
+// Not fatal, the restore is only slower without it.
+static void emu_stream_start_prefetcher (EmuStream *stream, EmuMode mode) {
+  if (
+    stream->prefetcher ||
+    stream->relay ||
+    !stream->isFile ||
+    (mode != EmuModeRestore && mode != EmuModeHvmRestore)
+  )
+    return;
+
+  if (prefetcher_create(&stream->prefetcher, stream->fd) < 0)
+    stream->prefetcher = NULL;
+}
+
+static void emu_stream_inspect (void *userData, const char *data, size_t size) {
+  stream_inspector_feed(userData, data, size);
+}
+
+// The lowest limit between the one of the current phase and the share of the scheduler.
+static int64_t emu_get_stream_rate_limit () {
+  const int64_t limit = StreamBandwidth.isStopAndCopy ? StreamBandwidth.stopAndCopy : StreamBandwidth.live;
+  return !limit || (StreamBandwidth.share && StreamBandwidth.share < limit) ? StreamBandwidth.share : limit;
+}
+
+static int emu_stream_start_relay (EmuStream *stream, EmuMode mode, bool inspect) {
+  if (stream->relay || stream->fd <= -1)
+    return 0;
+
+  const RelayDirection direction = mode == EmuModeSave || mode == EmuModeHvmSave
+    ? RelayDirectionSave
+    : RelayDirectionRestore;
+
+  // The stream can be shared with xenopsd: without end frame, the relay would
+  // read the data after the one of the emus.
+  if (direction == RelayDirectionRestore && !relay_can_restore(stream->extraFdsCount + 1)) {
+    syslog(LOG_INFO, "Restore stream %d is not relayed: it has no frames, the emus read it directly.", stream->fd);
+    return 0;
+  }
+
+  int fds[RELAY_MAX_STREAM_FDS] = { stream->fd };
+  for (int i = 0; i < stream->extraFdsCount; ++i)
+    fds[i + 1] = stream->extraFds[i];
+
+  RelayHooks hooks = { 0 };
+  if (inspect) {
+    if (stream_inspector_create(&stream->inspector, stream->fd) < 0)
+      return -1;
+    hooks.onData = emu_stream_inspect;
+    hooks.userData = stream->inspector;
+  }
+
+  int emuFd;
+  if (relay_create(&stream->relay, fds, stream->extraFdsCount + 1, direction, &hooks, &emuFd) < 0) {
+    if (stream->inspector) {
+      stream_inspector_destroy(stream->inspector);
+      stream->inspector = NULL;
+    }
+    return -1;
+  }
+
+  stream->isLimited = direction == RelayDirectionSave;
+  if (stream->isLimited)
+    relay_set_rate_limit(stream->relay, emu_get_stream_rate_limit());
+
+  // The real stream is now owned by the relay.
+  stream->fd = emuFd;
+  stream->extraFdsCount = 0;
+  return 0;
+}
+
+int emu_get_stream_stats (const Emu *emu, StreamInspectorStats *stats) {
+  // The data of the other emus of a shared stream is after the END record.
+  if (emu->type != EmuTypeEmp || !emu->stream || !emu->stream->inspector)
+    return -1;
+
+  stream_inspector_get_stats(emu->stream->inspector, stats);
+  return 0;
+}
+
 int emu_set_stream_busy (Emu *emu, bool status) {
   EmuStream *stream = emu->stream;
   assert(stream);
@@ -648,91 +1062,263 @@ int emu_set_stream_busy (Emu *emu, bool status) {
 // EmuManager.
 // =============================================================================
 
-static void emu_manager_termination_timeout_handler () { WaitEmusTermination = false; }
+static int emu_manager_handle_heartbeat (int fd, uint32_t events, void *userData) {
+  XCP_UNUSED(fd);
+  XCP_UNUSED(events);
+  XCP_UNUSED(userData);
 
-static int emu_manager_poll () {
-  // 1. Constructs fds array to poll.
-  uint fdCount = 0;
-  struct pollfd fds[8] = { { 0 } };
-  Emu *emusToCheck[8];
+  HeartbeatExpired = true;
+  return 0;
+}
 
-  fds[fdCount].fd = control_get_fd_in();
-  fds[fdCount++].events = POLLIN;
+// E.g. a checksum mismatch: the migration is aborted without waiting for
+// the emus to notice the end of their stream.
+static int emu_manager_handle_relay (int fd, uint32_t events, void *userData) {
+  XCP_UNUSED(events);
 
-  Emu *emu;
-  foreach (emu, Emus)
-    if (emu->flags) {
-      const int fd = emu->client->fd;
-      if (fd <= -1) {
-        syslog(LOG_ERR, "Unable to poll with invalid fd in emu `%s`.", emu->name);
-        EmuError = EINVAL;
-        return -1;
-      }
+  const EmuStream *stream = userData;
+  reactor_remove(fd);
 
-      fds[fdCount].fd = fd;
-      fds[fdCount].events = POLLIN;
-      emusToCheck[fdCount++] = emu;
-    }
+  EmuError = relay_get_error(stream->relay);
+  syslog(LOG_ERR, "Aborting migration after a relay failure: `%s`.", strerror(EmuError));
+  return -1;
+}
 
-  if (fdCount > XCP_ARRAY_LEN(fds)) {
-    syslog(LOG_ERR, "Too many fds to poll!");
-    EmuError = EINVAL;
+static int emu_manager_handle_deadline (int fd, uint32_t events, void *userData) {
+  XCP_UNUSED(fd);
+  XCP_UNUSED(events);
+  XCP_UNUSED(userData);
+
+  DeadlineExpired = true;
+  return 0;
+}
+
+static int emu_manager_handle_progress (int fd, uint32_t events, void *userData) {
+  XCP_UNUSED(fd);
+  XCP_UNUSED(events);
+  XCP_UNUSED(userData);
+
+  return control_process_output();
+}
+
+static int emu_manager_handle_pause_granted (int fd, uint32_t events, void *userData) {
+  XCP_UNUSED(events);
+  XCP_UNUSED(userData);
+
+  uint64_t value;
+  if (read(fd, &value, sizeof value) < 0 && errno != EAGAIN) {
+    EmuError = errno;
     return -1;
   }
 
-  syslog(LOG_DEBUG, "Polling %d socks...", fdCount);
+  PauseGranted = true;
+  return 0;
+}
 
-  // 2. Poll!
-  const XcpError ret = xcp_poll(fds, fdCount, 30000);
-  if (ret == XCP_ERR_TIMEOUT) {
-    EmuError = ETIME;
+static int emu_manager_handle_control (int fd, uint32_t events, void *userData) {
+  XCP_UNUSED(fd);
+  XCP_UNUSED(userData);
+
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    syslog(LOG_ERR, "poll failed because revents=0x%x for `xenopsd`.", events);
+    EmuError = EINVAL;
     return -1;
   }
-  if (ret == XCP_ERR_ERRNO) {
-    EmuError = errno;
+
+  if ((events & EPOLLOUT) && control_process_output() < 0)
     return -1;
+
+  if (events & EPOLLIN)
+    return control_receive_and_process_messages(0) < 0 ? -1 : 0;
+  return 0;
+}
+
+static int emu_manager_handle_client (int fd, uint32_t events, void *userData) {
+  Emu *emu = userData;
+
+  if (emu->client->isConnecting) {
+    if (
+      emu_client_finish_connect(emu->client) < 0 ||
+      reactor_modify(fd, EPOLLIN) < 0 ||
+      emu_init(emu) < 0
+    ) {
+      emu_handle_error(emu, EmuError, "emu_connect");
+      return -1;
+    }
+    return 0;
   }
 
-  for (uint i = 0; i < fdCount; ++i)
-    if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL | POLLRDHUP)) {
-      Emu *emu = emusToCheck[i];
-      syslog(LOG_ERR, "poll failed because revents=0x%x for `%s`.", fds[i].revents, i == 0 ? "xenopsd" : emu->name);
-      EmuError = EINVAL;
-      if (i > 0)
-        emu_handle_error(emu, EmuError, "wait_for_event");
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    syslog(LOG_ERR, "poll failed because revents=0x%x for `%s`.", events, emu->name);
+    EmuError = EINVAL;
+    emu_handle_error(emu, EmuError, "wait_for_event");
+    return -1;
+  }
+
+  if (emu_client_receive_events(emu->client, 0) < 0) {
+    // Stale readiness: the events were read while waiting for the reply of a
+    // command sent by a previous handler of the same iteration.
+    if (EmuError == ETIME)
+      return 0;
+    if (EmuError == EPIPE) {
+      reactor_remove(fd);
+      emu->client->fd = -1;
+      EmuError = EPIPE;
+      emu_handle_error(emu, EmuErrorDisconnected, "emu_client_receive_events");
       return -1;
     }
+    emu_handle_error(emu, EmuError, "emu_client_receive_events");
+    return -1;
+  }
+
+  if (emu_client_process_events(emu->client) < 0) {
+    emu_handle_error(emu, EmuError, "emu_client_process_events");
+    return -1;
+  }
+
+  return 0;
+}
 
-  // 3. Process control in.
-  if ((fds[0].revents & POLLIN)) {
-    fds[0].revents = 0;
-    if (control_receive_and_process_messages(0) < 0)
+// Never block on xenopsd: poll fdOut while messages are queued and wake up
+// when the coalesced progress must be sent.
+static int emu_manager_update_control_output () {
+  const bool isWanted = control_has_pending_output();
+  if (isWanted != ControlOutputWanted) {
+    const int fdOut = control_get_fd_out();
+    const uint32_t events = (fdOut == control_get_fd_in() ? EPOLLIN : 0) | (isWanted ? EPOLLOUT : 0);
+    if (reactor_modify(fdOut, events) < 0)
       return -1;
+    ControlOutputWanted = isWanted;
   }
 
-  // 4. Process emus.
-  for (uint i = 1; i < fdCount; ++i) {
-    if (!(fds[i].revents & POLLIN)) continue;
+  const int delay = control_get_progress_delay();
+  return delay < 0 ? 0 : reactor_timer_arm(ProgressTimerFd, delay ? delay : 1, false);
+}
+
+// Wait and process events of xenopsd and emus.
+// Fails with ETIME when the heartbeat expires and ETIMEDOUT when the deadline is reached.
+static int emu_manager_poll () {
+  if (emu_manager_update_control_output() < 0)
+    return -1;
+
+  HeartbeatExpired = false;
+  if (reactor_dispatch(-1) < 0)
+    return -1;
+
+  if (DeadlineExpired) {
+    syslog(LOG_ERR, "Deadline reached.");
+    EmuError = ETIMEDOUT;
+    return -1;
+  }
+
+  if (HeartbeatExpired) {
+    EmuError = ETIME;
+    return -1;
+  }
+  return 0;
+}
+
+static int emu_manager_init_loop () {
+  if (reactor_init() < 0 || reactor_add(control_get_fd_in(), EPOLLIN, emu_manager_handle_control, NULL) < 0)
+    return -1;
+
+  if (control_get_fd_out() != control_get_fd_in() && reactor_add(control_get_fd_out(), 0, emu_manager_handle_control, NULL) < 0)
+    return -1;
+
+  if ((ProgressTimerFd = reactor_timer_create(emu_manager_handle_progress, NULL)) < 0)
+    return -1;
+
+  if ((DeadlineTimerFd = reactor_timer_create(emu_manager_handle_deadline, NULL)) < 0)
+    return -1;
+
+  if ((HeartbeatTimerFd = reactor_timer_create(emu_manager_handle_heartbeat, NULL)) < 0)
+    return -1;
 
-    Emu *emu = emusToCheck[i];
-    const int ret = emu_client_receive_events(emu->client, 0);
-    if (ret < 0) {
-      if (EmuError == EPIPE) {
-        emu->client->fd = -1;
-        emu_handle_error(emu, EmuErrorDisconnected, "emu_client_receive_events");
+  // Shared streams are added once.
+  Emu *emu;
+  foreach (emu, Emus) {
+    EmuStream *stream = emu->stream;
+    if (stream && stream->relay && !stream->isRelayWatched) {
+      if (reactor_add(relay_get_event_fd(stream->relay), EPOLLIN, emu_manager_handle_relay, stream) < 0)
         return -1;
+      stream->isRelayWatched = true;
+    }
+  }
+
+  return reactor_timer_arm(HeartbeatTimerFd, EMU_HEARTBEAT_INTERVAL, true);
+}
+
+static uint emu_manager_count_children (bool withPidFd) {
+  uint count = 0;
+  Emu *emu;
+  foreach (emu, Emus)
+    if (emu->pathName && emu->pid && (emu->pidFd > -1) == withPidFd)
+      ++count;
+  return count;
+}
+
+// Set the deadline of the next waits in ms, 0 to remove it.
+static int emu_manager_set_deadline (int timeout) {
+  DeadlineExpired = false;
+  return reactor_timer_arm(DeadlineTimerFd, timeout, false);
+}
+
+// Wait for the replies of all commands sent with emu_client_send_*_async.
+static int emu_manager_wait_commands () {
+  if (emu_manager_set_deadline(EMU_COMMANDS_TIMEOUT) < 0)
+    return -1;
+
+  for (;;) {
+    bool isPending = false;
+    Emu *emu;
+    foreach (emu, Emus)
+      if (emu->flags && emu->client && emu->client->pendingCmdsCount) {
+        isPending = true;
+        break;
       }
-      emu_handle_error(emu, EmuError, "emu_client_receive_events");
+    if (!isPending) break;
+
+    if (emu_manager_poll() < 0 && EmuError != ETIME) {
+      if (EmuError == ETIMEDOUT)
+        syslog(LOG_ERR, "Failed to receive command replies because timeout reached.");
       return -1;
     }
+  }
+
+  return emu_manager_set_deadline(0);
+}
+
+// Apply the throttles computed by the auto-converge controller. Commands cannot
+// be sent in the event callbacks, so it's done after each poll. The replies
+// are not waited for, except for the release: one command at a time per emu,
+// the next one is sent after a poll if the throttle changed again.
+static int emu_manager_update_throttles (bool release) {
+  Emu *emu;
+  foreach (emu, Emus) {
+    if (emu->type != EmuTypeEmp || !(emu->flags & EMU_FLAG_MIGRATE_LIVE) || emu->isThrottling)
+      continue;
+
+    // Once released, the throttle must not be applied again by the next waits.
+    if (!release && emu->phase != EmuPhaseLive)
+      continue;
 
-    if (emu_client_process_events(emu->client) < 0) {
-      emu_handle_error(emu, EmuError, "emu_client_process_events");
+    const int throttle = release ? 0 : emu->convergence.throttle;
+    if (throttle != emu->throttle && emu_set_throttle(emu, throttle) < 0)
       return -1;
-    }
   }
 
-  return 0;
+  return release ? emu_manager_wait_commands() : 0;
+}
+
+// Follow the bandwidth share given by the scheduler: it's applied by the save relays.
+static void emu_manager_update_bandwidth () {
+  const int64_t share = scheduler_get_bandwidth();
+  if (share == StreamBandwidth.share)
+    return;
+
+  syslog(LOG_INFO, "Bandwidth share of the save streams: %" PRId64 " => %" PRId64 " bytes/s.", StreamBandwidth.share, share);
+  StreamBandwidth.share = share;
+  emu_manager_apply_stream_bandwidth();
 }
 
 static int emu_manager_process (bool (*cb)(Emu *emu)) {
@@ -753,12 +1339,13 @@ static int emu_manager_process (bool (*cb)(Emu *emu)) {
         } else if (EmuError == ESHUTDOWN) {
           return -1;
         } else {
-          syslog(LOG_ERR, "Error waiting for events: `%s`.", strerror(EmuError));
+          syslog(LOG_ERR, "Error waiting for events: `%s`.", emu_error_code_to_str(EmuError));
           return -1;
         }
       }
 
-    if (emu_manager_send_progress() < 0)
+    emu_manager_update_bandwidth();
+    if (emu_manager_update_throttles(false) < 0 || emu_manager_send_progress() < 0)
       return -1;
   }
 
@@ -778,19 +1365,26 @@ static inline int emu_manager_request_track () {
       continue;
 
     if (emu->type == EmuTypeEmp) {
-      if (emu_client_send_emp_cmd(emu->client, cmd_track_dirty, NULL) < 0)
+      if (emu_client_send_emp_cmd_async(emu->client, cmd_track_dirty, NULL, NULL, NULL) < 0)
         return -1;
-      if (emu_client_send_emp_cmd(emu->client, cmd_migrate_progress, NULL) < 0)
+      if (emu_client_send_emp_cmd_async(emu->client, cmd_migrate_progress, NULL, NULL, NULL) < 0)
         return -1;
     } else if (emu->type == EmuTypeQmpLibxl) {
-      ArgNode node = { NULL, "enable", "true" };
-      if (emu_client_send_qmp_cmd(emu->client, QmpCommandNumXenSetGlobalDirtyLog, &node) < 0)
-        return -1;
-      if (emu_disconnect(emu) < 0)
+      Arg arg = arg_make_raw("enable", "true");
+      const ArgList arguments = { &arg, 1, 1 };
+      if (emu_client_send_qmp_cmd_async(emu->client, QmpCommandNumXenSetGlobalDirtyLog, &arguments, NULL, NULL) < 0)
         return -1;
     }
   }
 
+  if (emu_manager_wait_commands() < 0)
+    return -1;
+
+  // QMP emu is not used after that.
+  foreach (emu, Emus)
+    if (emu->flags && emu->type == EmuTypeQmpLibxl && emu_disconnect(emu) < 0)
+      return -1;
+
   return 0;
 }
 
@@ -811,11 +1405,12 @@ static inline int emu_manager_migrate_live () {
       return -1;
     }
 
-    if (emu_client_send_emp_cmd(emu->client, cmd_migrate_live, NULL) < 0)
+    if (emu_client_send_emp_cmd_async(emu->client, cmd_migrate_live, NULL, NULL, NULL) < 0)
       return -1;
+    emu->phase = EmuPhaseLive;
   }
 
-  return 0;
+  return emu_manager_wait_commands();
 }
 
 static inline int emu_manager_wait_live_stage_done () {
@@ -823,26 +1418,68 @@ static inline int emu_manager_wait_live_stage_done () {
   return emu_manager_process(emu_process_cb_wait_live_stage_done);
 }
 
+// Stop-and-copy phases of the migrations of the host are staggered by the scheduler.
+static inline int emu_manager_wait_pause_granted () {
+  EMU_LOG_PHASE();
+
+  const int ret = scheduler_request_pause();
+  if (ret != 0)
+    return ret;
+
+  syslog(LOG_INFO, "Waiting for the scheduler to pause the guest...");
+  const int fd = scheduler_get_pause_fd();
+  PauseGranted = false;
+  if (reactor_add(fd, EPOLLIN, emu_manager_handle_pause_granted, NULL) < 0)
+    return -1;
+
+  const int error = emu_manager_process(emu_process_cb_wait_pause_granted) < 0 ? EmuError : 0;
+  if (reactor_remove(fd) < 0 && !error)
+    return -1;
+
+  if (error) {
+    EmuError = error;
+    return -1;
+  }
+  return 0;
+}
+
 static inline int emu_manager_migrate_pause () {
   EMU_LOG_PHASE();
 
+  // Pause requests are sent to all emus at once.
   Emu *emu;
   foreach (emu, Emus)
-    if ((emu->flags & EMU_FLAG_MIGRATE_PAUSE) && emu_client_send_emp_cmd(emu->client, cmd_migrate_pause, NULL) < 0)
-      return -1;
+    if (emu->flags & EMU_FLAG_MIGRATE_PAUSE) {
+      if (emu_client_send_emp_cmd_async(emu->client, cmd_migrate_pause, NULL, NULL, NULL) < 0)
+        return -1;
+      emu->phase = EmuPhaseStopAndCopy;
+    }
 
-  return 0;
+  if (emu_manager_wait_commands() < 0)
+    return -1;
+
+  // Guest is paused, the throttle is useless now.
+  return emu_manager_update_throttles(true);
 }
 
 static inline int emu_manager_migrate_paused () {
   EMU_LOG_PHASE();
 
   Emu *emu;
-  foreach (emu, Emus)
-    if ((emu->flags & EMU_FLAG_MIGRATE_PAUSED) && emu_client_send_emp_cmd(emu->client, cmd_migrate_paused, NULL) < 0)
+  foreach (emu, Emus) {
+    if (!(emu->flags & EMU_FLAG_MIGRATE_PAUSED))
+      continue;
+
+    // In post-copy, only the guest state is sent before the resume on the destination.
+    if (emu->flags & EMU_FLAG_MIGRATE_POSTCOPY) {
+      if (emu_client_send_emp_ext_cmd_async(emu->client, EmpExtCommandNumMigratePostcopy, NULL, NULL, NULL) < 0)
+        return -1;
+      emu->phase = EmuPhasePostCopy;
+    } else if (emu_client_send_emp_cmd_async(emu->client, cmd_migrate_paused, NULL, NULL, NULL) < 0)
       return -1;
+  }
 
-  return 0;
+  return emu_manager_wait_commands();
 }
 
 static inline int emu_manager_wait_migrate_live_finished () {
@@ -864,12 +1501,14 @@ static inline int emu_manager_migrate_non_live () {
       emu_client_send_emp_cmd(emu->client, cmd_migrate_nonlive, NULL) < 0
     )
       return -1;
+    emu->phase = EmuPhaseNonLive;
 
     while (emu->state != EMU_STATE_MIGRATION_DONE) {
       if (emu_manager_poll() < 0 && EmuError != ETIME) {
         syslog(LOG_ERR, "Error waiting for events: `%s`.", strerror(EmuError));
         return -1;
       }
+      emu_manager_update_bandwidth();
       if (emu_manager_send_progress() < 0)
         return -1;
     }
@@ -880,13 +1519,20 @@ static inline int emu_manager_migrate_non_live () {
 
 // -----------------------------------------------------------------------------
 
+void emu_manager_set_xenguest_path (const char *pathName) {
+  XenguestPathName = pathName;
+}
+
 int emu_manager_configure (bool live, EmuMode mode) {
   EMU_LOG_PHASE();
 
+  // Called after the admission of the migration by the scheduler.
+  StreamBandwidth.share = scheduler_get_bandwidth();
+
   Emu *emu;
   foreach (emu, Emus) {
-    // Close automatically fd stream before call to emu_manager_fork.
-    if (emu->stream && xcp_fd_set_close_on_exec(emu->stream->fd, true) != XCP_ERR_OK) {
+    // Close automatically fd stream before call to emu_manager_start.
+    if (emu->stream && emu_stream_set_cloexec(emu->stream) < 0) {
       syslog(LOG_ERR, "Failed to set_cloexec flag on stream %d for `%s`: `%s`.", emu->stream->fd, emu->name, strerror(errno));
       EmuError = errno;
       return -1;
@@ -897,6 +1543,32 @@ int emu_manager_configure (bool live, EmuMode mode) {
       continue;
     }
     syslog(LOG_INFO, "Emu `%s` is enabled.", emu->name);
+    convergence_model_reset(&emu->convergence);
+
+    if (emu->type == EmuTypeEmp)
+      emu->pathName = XenguestPathName;
+
+    if (emu->stream)
+      emu_stream_start_prefetcher(emu->stream, mode);
+
+    // Only xenguest writes a libxc migration-v2 stream. When the stream is
+    // shared, its relay is started by xenguest, the first emu.
+    const bool inspect = emu->type == EmuTypeEmp && stream_inspector_is_enabled();
+
+    // A striped stream can only be used through the relay, like a file
+    // written by the FileWriter. The bandwidth share of the scheduler is
+    // applied by the relay too.
+    if (
+      emu->stream &&
+      (
+        relay_is_enabled() ||
+        emu->stream->extraFdsCount ||
+        (StreamBandwidth.share && (mode == EmuModeSave || mode == EmuModeHvmSave)) ||
+        (emu->stream->isFile && file_writer_is_enabled() && (mode == EmuModeSave || mode == EmuModeHvmSave))
+      ) &&
+      emu_stream_start_relay(emu->stream, mode, inspect) < 0
+    )
+      return -1;
 
     if (emu->type == EmuTypeEmp) {
       if (!live) {
@@ -910,24 +1582,27 @@ int emu_manager_configure (bool live, EmuMode mode) {
   return 0;
 }
 
-int emu_manager_fork (uint domId) {
+int emu_manager_start (uint domId) {
   EMU_LOG_PHASE();
 
-  Emu *emu;
-  foreach (emu, Emus)
-  if (emu->pathName && emu->type == EmuTypeEmp && emu_fork_emp_client(emu, domId) < 0)
+  DomId = domId;
+  if (emu_manager_init_loop() < 0)
     return -1;
-  return 0;
-}
-
-int emu_manager_connect (uint domId) {
-  EMU_LOG_PHASE();
 
+  // 1. Start all emus at once, each one is connected and initialized as soon as it's ready.
   Emu *emu;
-  foreach (emu, Emus)
-    if (emu_connect(emu, domId) < 0)
+  foreach (emu, Emus) {
+    if (!emu->flags)
+      continue;
+
+    if (emu->pathName && emu->type == EmuTypeEmp ? emu_spawn(emu) < 0 : emu_connect(emu) < 0)
       return -1;
-  return 0;
+  }
+
+  // 2. Wait for the end of the initialization of all emus.
+  if (emu_manager_set_deadline(EMU_START_TIMEOUT) < 0 || emu_manager_process(emu_process_cb_wait_started) < 0)
+    return -1;
+  return emu_manager_set_deadline(0);
 }
 
 int emu_manager_disconnect () {
@@ -941,84 +1616,68 @@ int emu_manager_disconnect () {
   return ret;
 }
 
-int emu_manager_init () {
-  EMU_LOG_PHASE();
-
-  Emu *emu;
-  foreach (emu, Emus)
-    if (emu_init(emu) < 0)
-      return -1;
-  return 0;
-}
-
 int emu_manager_wait_termination () {
   EMU_LOG_PHASE();
 
-  uint nChildrenToWait = 0;
-  Emu *emu;
-  foreach (emu, Emus)
-    if (emu->pathName && emu->pid)
-      ++nChildrenToWait;
-
-  struct sigaction sigact = { .sa_handler = emu_manager_termination_timeout_handler };
-  sigemptyset(&sigact.sa_mask);
-  if (sigaction(SIGALRM, &sigact, 0) < 0) {
-    syslog(LOG_ERR, "Failed to ignore SIGALRM: `%s`.", strerror(errno));
-    return -1;
+  IsTerminating = true;
+  const int64_t deadline = monotonic_clock_us() + EMU_TERMINATION_TIMEOUT * 1000;
+
+  // 1. Children tracked by a pidfd are reaped by the event loop.
+  if (emu_manager_count_children(true)) {
+    // xenopsd messages are not processed anymore.
+    reactor_remove(control_get_fd_in());
+    if (control_get_fd_out() != control_get_fd_in())
+      reactor_remove(control_get_fd_out());
+
+    if (emu_manager_set_deadline(EMU_TERMINATION_TIMEOUT) == 0) {
+      while (emu_manager_count_children(true)) {
+        syslog(LOG_DEBUG, "Waiting for children.");
+        if (reactor_dispatch(-1) < 0 || DeadlineExpired)
+          break;
+      }
+      emu_manager_set_deadline(0);
+    }
   }
 
-  WaitEmusTermination = true;
-
-  alarm(60);
-
-  syslog(LOG_DEBUG, "Children to wait: %d.", nChildrenToWait);
-  while (WaitEmusTermination && nChildrenToWait) {
-    syslog(LOG_DEBUG, "Waiting for children.");
-
-    int status;
-    pid_t pid = wait(&status);
-
-    Emu *terminatedEmu = NULL;
-    foreach (emu, Emus)
-      if (emu->pid == pid) {
-        terminatedEmu = emu;
-        break;
-      }
-    if (!terminatedEmu)
-      continue;
+  // 2. Without pidfd support, children are polled.
+  Emu *emu;
+  while (emu_manager_count_children(false) && monotonic_clock_us() < deadline) {
+    foreach (emu, Emus) {
+      if (!emu->pathName || !emu->pid || emu->pidFd > -1)
+        continue;
 
-    if (WIFEXITED(status)) {
-      const int code = WEXITSTATUS(status);
-      if (WEXITSTATUS(status) == 0)
-        syslog(LOG_INFO, "Emu `%s` %s.", terminatedEmu->name, "completed normally");
-      else {
-        syslog(LOG_ERR, "Emu `%s` %s: %d.", terminatedEmu->name, "exited with an error", code);
-        if (!terminatedEmu->errorCode) terminatedEmu->errorCode = EmuErrorExitedWithErr;
+      int status;
+      const pid_t pid = waitpid(emu->pid, &status, WNOHANG);
+      if (pid > 0) {
+        emu_reap(emu, status);
+        if (!emu->errorCode)
+          emu->errorCode = emu_exit_status_to_error(status);
+      } else if (pid < 0 && errno != EINTR) {
+        syslog(LOG_ERR, "Failed to wait for `%s`: `%s`.", emu->name, strerror(errno));
+        emu->pid = 0;
       }
-    } else if (WIFSIGNALED(status)) {
-      syslog(LOG_ERR, "Child `%s` terminated by signal %d.", terminatedEmu->name, WTERMSIG(status));
-      if (!terminatedEmu->errorCode) terminatedEmu->errorCode = EmuErrorKilled;
     }
 
-    --nChildrenToWait;
-    terminatedEmu->pid = 0;
+    if (emu_manager_count_children(false))
+      usleep(EMU_TERMINATION_POLL_INTERVAL * 1000);
   }
 
-  alarm(0);
-  if (!WaitEmusTermination)
-    syslog(LOG_ERR, "Timeout on emu exit.");
-
+  // 3. Kill the remaining children.
   foreach (emu, Emus)
     if (emu->pathName && emu->pid) {
-      syslog(LOG_ERR, "Sending sigkill to `%s`...", emu->name);
+      syslog(LOG_ERR, "Timeout on exit of `%s`, sending sigkill...", emu->name);
       kill(emu->pid, SIGKILL);
       for (;;) {
-        if (waitpid(emu->pid, NULL, 0) < 0) {
+        int status;
+        if (waitpid(emu->pid, &status, 0) < 0) {
           if (errno == EINTR) continue;
           syslog(LOG_ERR, "Failed to wait for `%s`: `%s`.", emu->name, strerror(errno));
-        }
+          emu->pid = 0;
+        } else
+          emu_reap(emu, status);
         break;
       }
+      emu_close_pid_fd(emu);
     }
 
   syslog(LOG_DEBUG, "All children exited!");
@@ -1031,17 +1690,111 @@ int emu_manager_clean () {
 
   Emu *emu;
   foreach (emu, Emus) {
-    arg_list_free(emu->arguments);
-    emu->arguments = NULL;
-
-    free(emu->progress.result);
+    emu->arguments = (ArgList){ NULL, 0, 0 };
     emu->progress.result = NULL;
+    emu->progress.isResultSent = false;
+  }
+
+  HeartbeatTimerFd = -1;
+  DeadlineTimerFd = -1;
+  ProgressTimerFd = -1;
+  ControlOutputWanted = false;
+  const int ret = reactor_destroy();
+
+  // All the memory of the migration is released at once.
+  ArenaStats stats;
+  arena_get_stats(&stats);
+  if (stats.allocCount)
+    syslog(LOG_INFO, "Arena: %zu allocation(s), %zu bytes used, %zu bytes peak.",
+      stats.allocCount, stats.allocatedBytes, stats.peakBytes
+    );
+  arena_release();
+
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+
+// Shared streams are finished once, see: relay_finish.
+static int emu_manager_finish_relays () {
+  Emu *emu;
+  foreach (emu, Emus)
+    if (emu->stream && emu->stream->relay && relay_finish(emu->stream->relay) < 0) {
+      syslog(LOG_ERR, "Failed to finish relay of `%s`: `%s`.", emu->name, strerror(EmuError));
+      return -1;
+    }
+  return 0;
+}
+
+static void emu_manager_apply_stream_bandwidth () {
+  const int64_t rate = emu_get_stream_rate_limit();
+
+  Emu *emu;
+  foreach (emu, Emus)
+    if (emu->stream && emu->stream->isLimited)
+      relay_set_rate_limit(emu->stream->relay, rate);
+}
+
+static void emu_manager_enter_stop_and_copy () {
+  if (StreamBandwidth.isStopAndCopy)
+    return;
+
+  StreamBandwidth.isStopAndCopy = true;
+  emu_manager_apply_stream_bandwidth();
+}
+
+int emu_manager_set_stream_bandwidth (const char *limits) {
+  char *buf = strdup(limits);
+  if (!buf) {
+    syslog(LOG_ERR, "Failed to copy stream bandwidth limits.");
+    EmuError = errno;
+    return -1;
+  }
+
+  // The stop-and-copy phase is not limited by default: the guest is paused.
+  int64_t values[2] = { 0, 0 };
+  int count = 0;
+  char *savePtr;
+  for (char *str = strtok_r(buf, ",", &savePtr); str; str = strtok_r(NULL, ",", &savePtr)) {
+    bool soFarSoGood;
+    const int value = xcp_str_to_int(str, &soFarSoGood);
+    if (count == XCP_ARRAY_LEN(values) || !soFarSoGood || value < 0) {
+      syslog(LOG_ERR, "Invalid stream bandwidth limits: `%s`.", limits);
+      free(buf);
+      EmuError = EINVAL;
+      return -1;
+    }
+    values[count++] = (int64_t)value * 1024 * 1024;
+  }
+  free(buf);
+
+  if (!count) {
+    syslog(LOG_ERR, "Stream bandwidth limits are empty.");
+    EmuError = EINVAL;
+    return -1;
   }
+
+  syslog(
+    LOG_INFO, "Stream bandwidth limits: %" PRId64 " MiB/s (live), %" PRId64 " MiB/s (stop-and-copy).",
+    values[0] / (1024 * 1024), values[1] / (1024 * 1024)
+  );
+
+  StreamBandwidth.live = values[0];
+  StreamBandwidth.stopAndCopy = values[1];
+  emu_manager_apply_stream_bandwidth();
   return 0;
 }
 
 // -----------------------------------------------------------------------------
 
+// The result of a restored emu is sent once: without it, xenopsd cannot resume the guest.
+static int emu_send_result (Emu *emu) {
+  if (control_send_result(emu->name, emu->progress.result) < 0)
+    return -1;
+  emu->progress.isResultSent = true;
+  return 0;
+}
+
 int emu_manager_restore () {
   EMU_LOG_PHASE();
 
@@ -1059,10 +1812,22 @@ int emu_manager_restore () {
     }
 
     foreach (emu, Emus) {
+      // In post-copy, the result is sent as soon as the emu gives it to resume
+      // the guest while the remaining pages are pulled.
+      if (emu->state == EMU_STATE_POSTCOPY) {
+        emu->phase = EmuPhasePostCopy;
+        if (emu->progress.result && !emu->progress.isResultSent) {
+          syslog(LOG_INFO, "Emu `%s` can be resumed before the end of the restore.", emu->name);
+          if (emu_send_result(emu) < 0)
+            return -1;
+        }
+        continue;
+      }
+
       if (emu->state != EMU_STATE_MIGRATION_DONE)
         continue;
 
-      if (control_send_result(emu->name, emu->progress.result) < 0)
+      if (!emu->progress.isResultSent && emu_send_result(emu) < 0)
         return -1;
 
       emu->state = EMU_STATE_COMPLETED;
@@ -1070,7 +1835,12 @@ int emu_manager_restore () {
     }
   }
 
-  return 0;
+  if (emu_manager_finish_relays() < 0)
+    return -1;
+
+  // The results are queued without blocking: xenopsd must receive them before
+  // the end of the migration.
+  return control_flush_results();
 }
 
 int emu_manager_save (bool live) {
@@ -1085,6 +1855,10 @@ int emu_manager_save (bool live) {
     goto fail;
 
   // 2. Suspend and copy the remaining dirty RAM pages in the last iteration.
+  if (emu_manager_wait_pause_granted() < 0)
+    goto fail;
+
+  emu_manager_enter_stop_and_copy();
   if (
     emu_manager_migrate_pause() < 0 ||
     control_send_suspend() < 0 ||
@@ -1097,7 +1871,14 @@ int emu_manager_save (bool live) {
   if (emu_manager_migrate_non_live() < 0)
     goto fail;
 
-  // 4. Send final migration result to xenopsd.
+  // The guest is not paused anymore on this host.
+  scheduler_release_pause();
+
+  // 4. Forward the end of the relayed streams before reporting success.
+  if (emu_manager_finish_relays() < 0)
+    goto fail;
+
+  // 5. Send final migration result to xenopsd.
   if (control_send_final_result() < 0)
     goto fail;
 
@@ -1112,13 +1893,15 @@ int emu_manager_abort_save () {
 
   Emu *emu;
   foreach (emu, Emus) {
-    if (
-      emu->flags &&
-      emu->type == EmuTypeEmp &&
-      emu->client &&
-      emu->client->fd > -1 &&
-      emu_client_send_emp_cmd(emu->client, cmd_migrate_abort, NULL) < 0
-    ) {
+    if (!emu->flags || emu->type != EmuTypeEmp || !emu->client || emu->client->fd <= -1)
+      continue;
+
+    // The guest keeps running on this host, so it must not stay throttled.
+    // The reply is received before the one of the abort command.
+    if ((emu->throttle || emu->isThrottling) && emu_set_throttle(emu, 0) < 0)
+      syslog(LOG_ERR, "Failed to release throttle of `%s`: `%s`.", emu->name, emu_error_code_to_str(EmuError));
+
+    if (emu_client_send_emp_cmd(emu->client, cmd_migrate_abort, NULL) < 0) {
       syslog(LOG_ERR, "Failed to call cmd_migrate_abort: `%s`.", strerror(EmuError));
       if (!error)
         error = EmuError;
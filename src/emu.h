@@ -21,6 +21,9 @@
 #include <stdbool.h>
 #include <sys/types.h>
 
+#include "arg-list.h"
+#include "convergence.h"
+
 // =============================================================================
 
 // Like a errno variable but used for emu errors.
@@ -53,6 +56,10 @@ extern __thread int EmuError;
 // Emu is migrated directly. More violent than live mode.
 #define EMU_FLAG_MIGRATE_NON_LIVE (1 << 5)
 
+// Emu switches to post-copy after the pause: the guest is resumed on the destination
+// and the remaining dirty pages are pulled on demand. Set during the live stage.
+#define EMU_FLAG_MIGRATE_POSTCOPY (1 << 6)
+
 // =============================================================================
 // Emu states.
 // =============================================================================
@@ -69,11 +76,15 @@ extern __thread int EmuError;
 // Live stage is done. => We can set the pause status on this emu and migrate the remaining dirty pages.
 #define EMU_STATE_LIVE_STAGE_DONE 3
 
+// Post-copy is active. => The guest can run on the destination, the remaining pages
+// are pulled on demand. Only reported by a xenguest with post-copy support.
+#define EMU_STATE_POSTCOPY 4
+
 // Migration is a success. \o/
-#define EMU_STATE_MIGRATION_DONE 4
+#define EMU_STATE_MIGRATION_DONE 5
 
 // Nothing to do after that.
-#define EMU_STATE_COMPLETED 5
+#define EMU_STATE_COMPLETED 6
 
 // =============================================================================
 // Emu.
@@ -91,15 +102,24 @@ typedef enum EmuMode {
   EmuModeRestore
 } EmuMode;
 
+// Current migration step of an emu.
+typedef enum EmuPhase {
+  EmuPhaseNone,
+  EmuPhaseLive,
+  EmuPhaseStopAndCopy,
+  EmuPhaseNonLive,
+  EmuPhasePostCopy
+} EmuPhase;
+
 typedef enum EmuErrorOffset {
   EmuErrorDisconnected = -2,
   EmuErrorKilled = -3,
-  EmuErrorExitedWithErr = -4
+  EmuErrorExitedWithErr = -4,
+  EmuErrorDowntimeBudget = -5
 } EmuErrorOffset;
 
 // -----------------------------------------------------------------------------
 
-typedef struct ArgNode ArgNode;
 typedef struct EmuClient EmuClient;
 typedef struct EmuStream EmuStream;
 
@@ -108,6 +128,7 @@ typedef struct EmuStream EmuStream;
 // Used by source emu-manager when RAM data is transferred.
 typedef struct EmuMigrationProgress {
   char *result; // Result to send via xenopsd. (Progress bar)
+  bool isResultSent; // Restore: the result is forwarded once.
 
   // Data (RAM) sent and remaining data.
   int64_t remaining;
@@ -133,18 +154,36 @@ typedef struct Emu {
   const char *name;
   const char *pathName;
   pid_t pid;
+
+  // Output of a spawned emu, read until "Ready\n".
+  int readyFd;
+  size_t readySize;
+
+  // Readable when the spawned emu exits, -1 without pidfd support.
+  int pidFd;
+  bool hasExited;
+  int exitStatus; // See: waitpid.
+
   int type;
   int flags;
   EmuClient *client;
   EmuStream *stream;
   int state;
+  EmuPhase phase;
 
   int errorCode;
   bool isFirstFailedEmu;
-  ArgNode *arguments;
+  ArgList arguments;
 
   EmuMigrationProgress progress;
 
+  // Dirty and transfer rates model, used to detect the end of the live stage.
+  ConvergenceModel convergence;
+
+  // Guest throttle (%) applied by the auto-converge controller.
+  int throttle;
+  bool isThrottling; // A throttle command is waiting for its reply.
+
   // Only used by QMP libxl emu.
   bool qmpConnectionEstablished;
 } Emu;
@@ -152,6 +191,7 @@ typedef struct Emu {
 // -----------------------------------------------------------------------------
 
 const char *emu_error_code_to_str (int errorCode);
+const char *emu_phase_to_str (EmuPhase phase);
 Emu *emu_from_name (const char *name);
 
 // =============================================================================
@@ -159,30 +199,39 @@ Emu *emu_from_name (const char *name);
 // =============================================================================
 
 typedef struct Emu Emu;
+typedef struct StreamInspectorStats StreamInspectorStats;
 
 int emu_create_stream (Emu *emu, int fd);
 int emu_set_stream_busy (Emu *emu, bool status);
 
+// Returns -1 if the stream of the emu is not inspected, see: stream-inspector.h.
+int emu_get_stream_stats (const Emu *emu, StreamInspectorStats *stats);
+
 // =============================================================================
 // EmuManager.
 // =============================================================================
 
-int emu_manager_configure (bool live, EmuMode mode);
+// Program started as xenguest by the next migrations of the process, NULL to
+// connect to a xenguest already listening on its EMP socket.
+void emu_manager_set_xenguest_path (const char *pathName);
 
-int emu_manager_fork (uint domId);
+int emu_manager_configure (bool live, EmuMode mode);
 
-int emu_manager_connect (uint domId);
+// Spawn, connect and initialize all emus in parallel.
+int emu_manager_start (uint domId);
 
 int emu_manager_disconnect ();
 
-int emu_manager_init ();
-
 int emu_manager_wait_termination ();
 
 int emu_manager_clean ();
 
 int emu_manager_restore ();
 int emu_manager_save (bool live);
+
+// Limits of the relayed save streams: "<live>[,<stop-and-copy>]" in MiB/s,
+// 0 for no limit. Can be changed during the migration.
+int emu_manager_set_stream_bandwidth (const char *limits);
 int emu_manager_abort_save ();
 
 Emu *emu_manager_find_first_failed ();
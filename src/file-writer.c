@@ -0,0 +1,535 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+  #include <linux/io_uring.h>
+  #define FILE_WRITER_HAS_IO_URING
+#endif
+
+#include "emu.h"
+#include "file-writer.h"
+#include "logger.h"
+
+// =============================================================================
+
+// Logical block size of the usual disks, required by O_DIRECT.
+#define FILE_WRITER_ALIGNMENT 4096
+
+#define FILE_WRITER_BUFFER_SIZE (1024 * 1024)
+
+// Max count of buffers in flight.
+#define FILE_WRITER_BUFFERS 8
+
+// Count of queued buffers submitted with one io_uring_enter call.
+#define FILE_WRITER_BATCH 4
+
+#define FILE_WRITER_PREALLOC_SIZE (256 * 1024 * 1024)
+
+#ifdef FILE_WRITER_HAS_IO_URING
+  #ifndef SYS_io_uring_setup
+    #define SYS_io_uring_setup 425
+  #endif
+
+  #ifndef SYS_io_uring_enter
+    #define SYS_io_uring_enter 426
+  #endif
+#endif
+
+typedef struct FileWriterBuffer {
+  char *data;
+  size_t size; // Filled bytes.
+  struct iovec iov; // Range in flight.
+  bool isBusy;
+} FileWriterBuffer;
+
+typedef struct FileWriterRing {
+  int fd; // -1 if io_uring is not used.
+#ifdef FILE_WRITER_HAS_IO_URING
+  void *sqRing;
+  size_t sqRingSize;
+  void *cqRing;
+  size_t cqRingSize;
+  struct io_uring_sqe *sqes;
+  size_t sqesSize;
+
+  unsigned *sqTail;
+  unsigned *sqMask;
+  unsigned *sqArray;
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned *cqMask;
+  struct io_uring_cqe *cqes;
+
+  unsigned pending; // Queued but not submitted.
+#endif
+} FileWriterRing;
+
+struct FileWriter {
+  int fd;
+  int directFd; // Same file with O_DIRECT, -1 if not supported.
+
+  int64_t offset; // End of the submitted data, -1 before the first write.
+  int64_t allocatedEnd;
+  bool canPreallocate;
+
+  FileWriterBuffer buffers[FILE_WRITER_BUFFERS];
+  int current;
+  int inFlight;
+  int error; // Of the completed writes.
+
+  FileWriterRing ring;
+  uint64_t bytes;
+};
+
+// Per migration, see: daemon.c.
+static __thread bool IsEnabled;
+
+// =============================================================================
+
+void file_writer_enable () {
+  IsEnabled = true;
+}
+
+bool file_writer_is_enabled () {
+  return IsEnabled;
+}
+
+// =============================================================================
+// io_uring.
+// =============================================================================
+
+#ifdef FILE_WRITER_HAS_IO_URING
+
+static void *file_writer_ring_map (int fd, size_t size, off_t offset) {
+  void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+  return addr == MAP_FAILED ? NULL : addr;
+}
+
+static void file_writer_ring_destroy (FileWriterRing *ring) {
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqesSize);
+  if (ring->cqRing && ring->cqRing != ring->sqRing)
+    munmap(ring->cqRing, ring->cqRingSize);
+  if (ring->sqRing)
+    munmap(ring->sqRing, ring->sqRingSize);
+  close(ring->fd);
+  ring->fd = -1;
+}
+
+static int file_writer_ring_init (FileWriterRing *ring) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof params);
+  if ((ring->fd = (int)syscall(SYS_io_uring_setup, FILE_WRITER_BUFFERS, &params)) < 0)
+    return -1;
+
+  ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  const bool isSingleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (isSingleMmap && ring->cqRingSize > ring->sqRingSize)
+    ring->sqRingSize = ring->cqRingSize;
+
+  if (!(ring->sqRing = file_writer_ring_map(ring->fd, ring->sqRingSize, IORING_OFF_SQ_RING)))
+    goto fail;
+  ring->cqRing = isSingleMmap ? ring->sqRing : file_writer_ring_map(ring->fd, ring->cqRingSize, IORING_OFF_CQ_RING);
+  if (!ring->cqRing || !(ring->sqes = file_writer_ring_map(ring->fd, ring->sqesSize, IORING_OFF_SQES)))
+    goto fail;
+
+  char *sq = ring->sqRing;
+  ring->sqTail = (unsigned *)(void *)(sq + params.sq_off.tail);
+  ring->sqMask = (unsigned *)(void *)(sq + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned *)(void *)(sq + params.sq_off.array);
+
+  char *cq = ring->cqRing;
+  ring->cqHead = (unsigned *)(void *)(cq + params.cq_off.head);
+  ring->cqTail = (unsigned *)(void *)(cq + params.cq_off.tail);
+  ring->cqMask = (unsigned *)(void *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(void *)(cq + params.cq_off.cqes);
+  return 0;
+
+fail:
+  {
+    const int error = errno;
+    file_writer_ring_destroy(ring);
+    errno = error;
+  }
+  return -1;
+}
+
+static void file_writer_ring_queue (FileWriter *writer, FileWriterBuffer *buffer, int64_t offset) {
+  FileWriterRing *ring = &writer->ring;
+
+  // Never full: there are less buffers than entries.
+  const unsigned tail = *ring->sqTail;
+  const unsigned index = tail & *ring->sqMask;
+
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof *sqe);
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = writer->directFd;
+  sqe->addr = (uint64_t)(uintptr_t)&buffer->iov;
+  sqe->len = 1;
+  sqe->off = (uint64_t)offset;
+  sqe->user_data = (uint64_t)(buffer - writer->buffers);
+
+  ring->sqArray[index] = index;
+  __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+  ++ring->pending;
+}
+
+// Submit the queued buffers and wait for minComplete completions.
+static int file_writer_ring_enter (FileWriter *writer, unsigned minComplete) {
+  FileWriterRing *ring = &writer->ring;
+
+  int ret;
+  do {
+    ret = (int)syscall(
+      SYS_io_uring_enter, ring->fd, ring->pending, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0
+    );
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0)
+    return -1;
+  ring->pending -= (unsigned)ret;
+
+  unsigned head = *ring->cqHead;
+  const unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+    FileWriterBuffer *buffer = &writer->buffers[cqe->user_data];
+    if (!writer->error) {
+      if (cqe->res < 0)
+        writer->error = -cqe->res;
+      else if ((size_t)cqe->res != buffer->iov.iov_len)
+        writer->error = EIO; // Not retried, O_DIRECT writes are only short on fatal errors.
+    }
+    buffer->isBusy = false;
+    --writer->inFlight;
+  }
+  __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+#else
+
+static void file_writer_ring_destroy (FileWriterRing *ring) {
+  (void)ring;
+}
+
+static int file_writer_ring_init (FileWriterRing *ring) {
+  (void)ring;
+  errno = ENOSYS;
+  return -1;
+}
+
+static void file_writer_ring_queue (FileWriter *writer, FileWriterBuffer *buffer, int64_t offset) {
+  (void)writer;
+  (void)buffer;
+  (void)offset;
+}
+
+static int file_writer_ring_enter (FileWriter *writer, unsigned minComplete) {
+  (void)writer;
+  (void)minComplete;
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif // ifdef FILE_WRITER_HAS_IO_URING
+
+// =============================================================================
+// Writes.
+// =============================================================================
+
+// offset < 0 to append.
+static int file_writer_write_all (int fd, const char *data, size_t size, int64_t offset) {
+  while (size) {
+    const ssize_t ret = offset < 0 ? write(fd, data, size) : pwrite(fd, data, size, (off_t)offset);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += ret;
+    size -= (size_t)ret;
+    if (offset >= 0)
+      offset += ret;
+  }
+  return 0;
+}
+
+static int file_writer_drain (FileWriter *writer) {
+  while (writer->inFlight)
+    if (file_writer_ring_enter(writer, 1) < 0)
+      return -1;
+
+  if (writer->error) {
+    errno = writer->error;
+    return -1;
+  }
+  return 0;
+}
+
+// The file grows by large extents to limit its fragmentation. Errors like
+// ENOSPC are reported before the data is written.
+static int file_writer_preallocate (FileWriter *writer, int64_t end) {
+  if (!writer->canPreallocate || end <= writer->allocatedEnd)
+    return 0;
+
+  if (fallocate(writer->fd, FALLOC_FL_KEEP_SIZE, (off_t)writer->allocatedEnd, FILE_WRITER_PREALLOC_SIZE) < 0) {
+    if (errno != EOPNOTSUPP && errno != ENOSYS)
+      return -1;
+    syslog(LOG_INFO, "File stream %d does not support preallocation.", writer->fd);
+    writer->canPreallocate = false;
+    return 0;
+  }
+
+  writer->allocatedEnd += FILE_WRITER_PREALLOC_SIZE;
+  return 0;
+}
+
+// Max size of the current buffer: the first direct write must be aligned.
+// The end of the file is unknown before the first write, the first block is
+// appended through the page cache.
+static size_t file_writer_get_limit (const FileWriter *writer) {
+  if (writer->offset < 0)
+    return FILE_WRITER_ALIGNMENT;
+
+  const size_t misalignment = (size_t)(writer->offset % FILE_WRITER_ALIGNMENT);
+  return writer->directFd >= 0 && misalignment ? FILE_WRITER_ALIGNMENT - misalignment : FILE_WRITER_BUFFER_SIZE;
+}
+
+// Use the page cache once the previous data is written, the stream is in
+// append mode.
+static int file_writer_append (FileWriter *writer, const char *data, size_t size) {
+  if (file_writer_drain(writer) < 0 || file_writer_write_all(writer->fd, data, size, -1) < 0)
+    return -1;
+
+  if (writer->offset >= 0) {
+    writer->offset += (int64_t)size;
+    return 0;
+  }
+
+  // xenopsd appends its own records to the stream between the creation of
+  // the relay and the start of the emu: the direct writes must start at the
+  // end of the first append.
+  struct stat buf;
+  if (fstat(writer->fd, &buf) < 0)
+    return -1;
+  writer->offset = writer->allocatedEnd = buf.st_size;
+  syslog(LOG_INFO, "Writing file stream %d at %" PRId64 ".", writer->fd, writer->offset - (int64_t)size);
+  return 0;
+}
+
+static int file_writer_submit (FileWriter *writer, FileWriterBuffer *buffer) {
+  const size_t size = buffer->size;
+  const int64_t offset = writer->offset;
+  buffer->size = 0;
+
+  // Unaligned range.
+  if (writer->directFd < 0 || offset < 0 || offset % FILE_WRITER_ALIGNMENT || size % FILE_WRITER_ALIGNMENT)
+    return file_writer_append(writer, buffer->data, size);
+
+  if (file_writer_preallocate(writer, offset + (int64_t)size) < 0)
+    return -1;
+
+  if (writer->ring.fd < 0) {
+    if (file_writer_write_all(writer->directFd, buffer->data, size, offset) < 0)
+      return -1;
+    writer->offset += (int64_t)size;
+    return 0;
+  }
+
+  buffer->iov = (struct iovec){ .iov_base = buffer->data, .iov_len = size };
+  buffer->isBusy = true;
+  ++writer->inFlight;
+  file_writer_ring_queue(writer, buffer, offset);
+  writer->offset += (int64_t)size;
+
+#ifdef FILE_WRITER_HAS_IO_URING
+  if (writer->ring.pending >= FILE_WRITER_BATCH)
+    return file_writer_ring_enter(writer, 0);
+#endif
+  return 0;
+}
+
+// =============================================================================
+
+int file_writer_create (FileWriter **writer, int fd) {
+  FileWriter *newWriter = calloc(1, sizeof *newWriter);
+  if (!newWriter)
+    goto fail;
+
+  newWriter->fd = fd;
+  newWriter->directFd = -1;
+  newWriter->ring.fd = -1;
+  newWriter->canPreallocate = true;
+
+  // The data is appended, the offset of the stream is not used.
+  newWriter->offset = newWriter->allocatedEnd = -1;
+
+  for (int i = 0; i < FILE_WRITER_BUFFERS; ++i) {
+    void *data;
+    const int error = posix_memalign(&data, FILE_WRITER_ALIGNMENT, FILE_WRITER_BUFFER_SIZE);
+    if (error) {
+      errno = error;
+      goto fail;
+    }
+    newWriter->buffers[i].data = data;
+  }
+
+  // A new open file description is required to use O_DIRECT without
+  // changing the flags of the stream, which is shared with xenopsd.
+  char path[64];
+  snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+  if ((newWriter->directFd = open(path, O_WRONLY | O_DIRECT | O_CLOEXEC)) < 0)
+    syslog(LOG_INFO, "File stream %d does not support direct I/O: `%s`.", fd, strerror(errno));
+  else if (file_writer_ring_init(&newWriter->ring) < 0)
+    syslog(LOG_INFO, "io_uring is not available for file stream %d: `%s`.", fd, strerror(errno));
+
+  syslog(
+    LOG_INFO, "Created writer of file stream %d (%s).", fd,
+    newWriter->directFd < 0 ? "buffered" : newWriter->ring.fd < 0 ? "direct, pwrite" : "direct, io_uring"
+  );
+  *writer = newWriter;
+  return 0;
+
+fail:
+  syslog(LOG_ERR, "Failed to create writer of file stream %d: `%s`.", fd, strerror(errno));
+  EmuError = errno;
+  if (newWriter)
+    file_writer_destroy(newWriter);
+  return -1;
+}
+
+void file_writer_destroy (FileWriter *writer) {
+  // The kernel can still use the buffers.
+  while (writer->inFlight)
+    if (file_writer_ring_enter(writer, 1) < 0)
+      break;
+
+  if (writer->ring.fd >= 0)
+    file_writer_ring_destroy(&writer->ring);
+  if (writer->directFd >= 0)
+    close(writer->directFd);
+  for (int i = 0; i < FILE_WRITER_BUFFERS; ++i)
+    free(writer->buffers[i].data);
+  free(writer);
+}
+
+char *file_writer_get_buffer (FileWriter *writer, size_t *capacity) {
+  FileWriterBuffer *buffer = &writer->buffers[writer->current];
+  while (buffer->isBusy && !writer->error)
+    if (file_writer_ring_enter(writer, 1) < 0)
+      return NULL;
+
+  if (writer->error) {
+    errno = writer->error;
+    return NULL;
+  }
+
+  *capacity = file_writer_get_limit(writer) - buffer->size;
+  return buffer->data + buffer->size;
+}
+
+int file_writer_commit (FileWriter *writer, size_t size) {
+  FileWriterBuffer *buffer = &writer->buffers[writer->current];
+  buffer->size += size;
+  writer->bytes += size;
+  if (buffer->size < file_writer_get_limit(writer))
+    return 0;
+
+  writer->current = (writer->current + 1) % FILE_WRITER_BUFFERS;
+  return file_writer_submit(writer, buffer);
+}
+
+ssize_t file_writer_write (FileWriter *writer, const char *data, size_t size) {
+  for (size_t written = 0; written < size;) {
+    size_t capacity;
+    char *buf = file_writer_get_buffer(writer, &capacity);
+    if (!buf)
+      return -1;
+
+    const size_t chunkSize = size - written < capacity ? size - written : capacity;
+    memcpy(buf, data + written, chunkSize);
+    if (file_writer_commit(writer, chunkSize) < 0)
+      return -1;
+    written += chunkSize;
+  }
+  return (ssize_t)size;
+}
+
+int file_writer_finish (FileWriter *writer) {
+  FileWriterBuffer *buffer = &writer->buffers[writer->current];
+  if (!buffer->isBusy && buffer->size) {
+    // Aligned part with O_DIRECT, then the tail through the page cache.
+    const char *tail = buffer->data;
+    size_t tailSize = buffer->size;
+    if (
+      writer->directFd >= 0 &&
+      writer->offset >= 0 &&
+      !(writer->offset % FILE_WRITER_ALIGNMENT) &&
+      buffer->size >= FILE_WRITER_ALIGNMENT
+    ) {
+      tailSize = buffer->size % FILE_WRITER_ALIGNMENT;
+      tail += buffer->size - tailSize;
+      buffer->size -= tailSize;
+      if (file_writer_submit(writer, buffer) < 0)
+        return -1;
+    } else
+      buffer->size = 0;
+
+    if (tailSize && file_writer_append(writer, tail, tailSize) < 0)
+      return -1;
+  }
+
+  if (file_writer_drain(writer) < 0)
+    return -1;
+
+  // Release the preallocated blocks after the end of the file. The file is
+  // never truncated below its real size: it may not only contain our data.
+  if (writer->allocatedEnd > writer->offset) {
+    struct stat buf;
+    if (fstat(writer->fd, &buf) < 0)
+      return -1;
+    if (ftruncate(writer->fd, buf.st_size > writer->offset ? buf.st_size : (off_t)writer->offset) < 0)
+      return -1;
+  }
+
+  if (fdatasync(writer->fd) < 0)
+    return -1;
+
+  syslog(LOG_INFO, "Wrote %" PRIu64 " bytes of file stream %d.", writer->bytes, writer->fd);
+  return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _FILE_WRITER_H_
+#define _FILE_WRITER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// =============================================================================
+// Writer of a saved stream in a regular file (suspend case), used by the
+// relay instead of buffered writes. The data is appended with O_DIRECT in
+// large aligned buffers, submitted in batches with io_uring when the kernel
+// supports it, otherwise with pwrite. The file is preallocated as it grows
+// and synced once at the end. The data starts at the end of the file at the
+// time of the first write: xenopsd can append its records before.
+// The unaligned head and tail of the written range use the page cache.
+// Only the relay thread uses a FileWriter.
+// =============================================================================
+
+typedef struct FileWriter FileWriter;
+
+// Per migration, see: daemon.c.
+void file_writer_enable ();
+bool file_writer_is_enabled ();
+
+// fd is the O_APPEND stream, it is not owned by the writer.
+int file_writer_create (FileWriter **writer, int fd);
+void file_writer_destroy (FileWriter *writer);
+
+// Returns the free space of the current buffer, or NULL with errno set if
+// a previous write failed. The data must then be committed.
+char *file_writer_get_buffer (FileWriter *writer, size_t *capacity);
+int file_writer_commit (FileWriter *writer, size_t size);
+
+ssize_t file_writer_write (FileWriter *writer, const char *data, size_t size);
+
+// Write the remaining data, release the unused preallocated space and sync
+// the file.
+int file_writer_finish (FileWriter *writer);
+
+#endif // ifndef _FILE_WRITER_H_
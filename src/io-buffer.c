@@ -0,0 +1,149 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "io-buffer.h"
+#include "monotonic-clock.h"
+
+// =============================================================================
+
+// Bytes that can be read beyond the current capacity by a single readv.
+#define IO_BUFFER_OVERFLOW_SIZE 4096
+
+// Make room for size bytes after the unread ones.
+static int io_buffer_reserve (IoBuffer *buffer, size_t size) {
+  if (buffer->capacity - buffer->end >= size)
+    return 0;
+
+  const size_t used = io_buffer_size(buffer);
+  if (used + size > buffer->maxCapacity) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  // Only the partial message is moved.
+  if (buffer->begin) {
+    memmove(buffer->data, buffer->data + buffer->begin, used);
+    buffer->begin = 0;
+    buffer->end = used;
+    if (buffer->capacity - used >= size)
+      return 0;
+  }
+
+  size_t capacity = buffer->capacity ? buffer->capacity : buffer->initialCapacity;
+  while (capacity < used + size)
+    capacity *= 2;
+  if (capacity > buffer->maxCapacity)
+    capacity = buffer->maxCapacity;
+
+  char *data = realloc(buffer->data, capacity);
+  if (!data)
+    return -1;
+
+  buffer->data = data;
+  buffer->capacity = capacity;
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+void io_buffer_init (IoBuffer *buffer, size_t initialCapacity, size_t maxCapacity) {
+  assert(initialCapacity && initialCapacity <= maxCapacity);
+
+  buffer->data = NULL;
+  buffer->capacity = 0;
+  buffer->initialCapacity = initialCapacity;
+  buffer->maxCapacity = maxCapacity;
+  buffer->begin = buffer->end = 0;
+}
+
+void io_buffer_free (IoBuffer *buffer) {
+  free(buffer->data);
+  io_buffer_init(buffer, buffer->initialCapacity, buffer->maxCapacity);
+}
+
+// -----------------------------------------------------------------------------
+
+int io_buffer_wait_read (IoBuffer *buffer, int fd, int timeout) {
+  if (io_buffer_reserve(buffer, 1) < 0)
+    return -1;
+
+  const int64_t deadline = timeout > 0 ? monotonic_clock_us() / 1000 + timeout : 0;
+  for (;;) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    const int ret = poll(&pfd, 1, timeout);
+    if (ret > 0)
+      break;
+    if (ret == 0) {
+      errno = ETIME;
+      return -1;
+    }
+    if (errno != EINTR)
+      return -1;
+    if (timeout > 0 && (timeout = (int)(deadline - monotonic_clock_us() / 1000)) < 0)
+      timeout = 0;
+  }
+
+  // A burst larger than the free space is received in the same call.
+  char overflow[IO_BUFFER_OVERFLOW_SIZE];
+  const size_t tailSize = buffer->capacity - buffer->end;
+  size_t overflowSize = buffer->maxCapacity - io_buffer_size(buffer) - tailSize;
+  if (overflowSize > sizeof overflow)
+    overflowSize = sizeof overflow;
+
+  struct iovec iov[2] = {
+    { .iov_base = buffer->data + buffer->end, .iov_len = tailSize },
+    { .iov_base = overflow, .iov_len = overflowSize }
+  };
+
+  ssize_t ret;
+  do {
+    ret = readv(fd, iov, overflowSize ? 2 : 1);
+  } while (ret < 0 && errno == EINTR);
+  if (ret <= 0)
+    return (int)ret;
+
+  if ((size_t)ret <= tailSize) {
+    buffer->end += (size_t)ret;
+    return (int)ret;
+  }
+
+  buffer->end = buffer->capacity;
+  overflowSize = (size_t)ret - tailSize;
+  if (io_buffer_reserve(buffer, overflowSize) < 0)
+    return -1;
+  memcpy(buffer->data + buffer->end, overflow, overflowSize);
+  buffer->end += overflowSize;
+
+  return (int)ret;
+}
+
+int io_buffer_append (IoBuffer *buffer, const char *data, size_t size) {
+  if (io_buffer_reserve(buffer, size) < 0)
+    return -1;
+
+  memcpy(buffer->data + buffer->end, data, size);
+  buffer->end += size;
+  return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _IO_BUFFER_H_
+#define _IO_BUFFER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// =============================================================================
+// Byte queue of a stream fd: data is read directly in the free space and
+// parsers get views of the unread bytes. The storage grows on demand up to
+// maxCapacity and is only compacted when a partial message reaches its end.
+// It's also used to queue the bytes that cannot be written yet.
+// =============================================================================
+
+typedef struct IoBuffer {
+  char *data; // Allocated on first read.
+  size_t capacity;
+  size_t initialCapacity;
+  size_t maxCapacity;
+
+  size_t begin; // First unread byte.
+  size_t end;
+} IoBuffer;
+
+void io_buffer_init (IoBuffer *buffer, size_t initialCapacity, size_t maxCapacity);
+void io_buffer_free (IoBuffer *buffer);
+
+// Wait at most timeout ms (-1 for infinite) and read available bytes.
+// Returns the read size, 0 on EOF or -1 with errno set. (ETIME on timeout,
+// EMSGSIZE if the unread bytes already use maxCapacity.)
+int io_buffer_wait_read (IoBuffer *buffer, int fd, int timeout);
+
+// Returns -1 with errno set. (EMSGSIZE if maxCapacity would be exceeded.)
+int io_buffer_append (IoBuffer *buffer, const char *data, size_t size);
+
+static inline char *io_buffer_data (const IoBuffer *buffer) {
+  return buffer->data + buffer->begin;
+}
+
+static inline size_t io_buffer_size (const IoBuffer *buffer) {
+  return buffer->end - buffer->begin;
+}
+
+// True if no more bytes can be received before a consume.
+static inline bool io_buffer_is_full (const IoBuffer *buffer) {
+  return io_buffer_size(buffer) == buffer->maxCapacity;
+}
+
+// Release the size first unread bytes. Views are valid until the next read.
+static inline void io_buffer_consume (IoBuffer *buffer, size_t size) {
+  buffer->begin += size;
+  if (buffer->begin == buffer->end)
+    buffer->begin = buffer->end = 0;
+}
+
+#endif // ifndef _IO_BUFFER_H_
@@ -0,0 +1,55 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "logger.h"
+
+// =============================================================================
+
+#define LOGGER_MESSAGE_SIZE 1024
+
+static __thread char Prefix[16];
+
+// -----------------------------------------------------------------------------
+
+void logger_set_domain (unsigned int domId) {
+  snprintf(Prefix, sizeof Prefix, "[%u] ", domId);
+}
+
+void logger_clear_domain () {
+  *Prefix = '\0';
+}
+
+// -----------------------------------------------------------------------------
+
+void logger_syslog (int priority, const char *format, ...) {
+  // Don't format messages that are filtered anyway.
+  const int mask = setlogmask(0);
+  if (!(mask & LOG_MASK(LOG_PRI(priority))))
+    return;
+
+  char message[LOGGER_MESSAGE_SIZE];
+  va_list ap;
+  va_start(ap, format);
+  vsnprintf(message, sizeof message, format, ap);
+  va_end(ap);
+
+  // The parentheses call the function, not the macro of logger.h.
+  (syslog)(priority, "%s%s", Prefix, message);
+}
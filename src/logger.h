@@ -0,0 +1,38 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LOGGER_H_
+#define _LOGGER_H_
+
+#include <syslog.h>
+
+// =============================================================================
+// The syslog ident is shared by the process: the daemon runs many migrations,
+// so each thread can prefix its messages with the domain it migrates.
+// =============================================================================
+
+// Prefix the messages of the calling thread with "[domId] ".
+void logger_set_domain (unsigned int domId);
+void logger_clear_domain ();
+
+void logger_syslog (int priority, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// Route the syslog calls of the including file through the thread prefix.
+#undef syslog
+#define syslog(...) logger_syslog(__VA_ARGS__)
+
+#endif // ifndef _LOGGER_H_
@@ -17,65 +17,23 @@
 
 #define _GNU_SOURCE
 
-#include <assert.h>
 #include <errno.h>
-#include <getopt.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <syslog.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <xcp-ng/generic.h>
 
-#include "arg-list.h"
-#include "control.h"
+#include "daemon.h"
 #include "emu.h"
+#include "logger.h"
+#include "migration.h"
+#include "scheduler.h"
 
 // =============================================================================
 
-static int Mode = -1;
-
-// -----------------------------------------------------------------------------
-
-static int clean_migration (int error) {
-  if (error && (Mode == EmuModeSave || Mode == EmuModeHvmSave))
-    emu_manager_abort_save(); // Don't update previous error.
-
-  if (emu_manager_disconnect() < 0 && !error)
-    error = EmuError; // Update error only if there is no previous error.
-
-  // Ignore errors of emu_manager_wait_termination.
-  emu_manager_wait_termination();
-  emu_manager_clean();
-
-  if (error == ESHUTDOWN || !error)
-    return 0;
-
-  control_report_error(error);
-  return -1;
-}
-
-// -----------------------------------------------------------------------------
-
-static void usage (const char *progname) {
-  printf("Usage: %s [OPTIONS]\n", progname);
-  puts("  --domid                  domain ID");
-  puts("  --fd                     data descriptor");
-  puts("  --controlinfd            control input descriptor");
-  puts("  --controloutfd           control output descriptor");
-  puts("  --store_port             store port");
-  puts("  --console_port           console port");
-  puts("  --mem_pnode              NUMA node for memory placement");
-  puts("  --live                   enable live migration");
-  puts("  --mode                   migration mode");
-  puts("  --dm                     device model");
-  puts("  --debug                  enable debug logs");
-  puts("  --help                   print this help and exit");
-}
-
-// -----------------------------------------------------------------------------
-
 static void set_crash_handler (XcpCrashHandler handler);
 
 static void crash_handler (int signal) {
@@ -96,7 +54,7 @@ static void crash_handler (int signal) {
   free(strings);
 
   // 2. How to properly crash? Abort migration + clean resources.
-  clean_migration(EmuErrorKilled);
+  migration_clean(EmuErrorKilled);
   _exit(128 + signal);
 }
 
@@ -110,197 +68,38 @@ static void set_crash_handler (XcpCrashHandler handler) {
 
 // -----------------------------------------------------------------------------
 
-#define MAIN_OPT_DEBUG 1
-#define MAIN_OPT_DEVICE_MODEL 2
-#define MAIN_OPT_FORK 3
-#define MAIN_OPT_MEM_PNODE 4
-
 int main (int argc, char *argv[]) {
   openlog(argv[0], LOG_PID, LOG_USER | LOG_MAIL);
   set_crash_handler(crash_handler);
 
-  const struct option longopts[] = {
-    { "domid", 1, NULL, 'd' },
-    { "fd", 1, NULL, 'f' },
-    { "controlinfd", 1, NULL, 'i' },
-    { "controloutfd", 1, NULL, 'o' },
-    { "store_port", 1, NULL, 's' },
-    { "console_port", 1, NULL, 'c' },
-    { "live", 1, NULL, 'l' },
-    { "mode", 1, NULL, 'm' },
-    { "dm", 1, NULL, MAIN_OPT_DEVICE_MODEL },
-    { "fork", 1, NULL, MAIN_OPT_FORK },
-    { "mem_pnode", 1, NULL, MAIN_OPT_MEM_PNODE },
-    { "debug", 0, NULL, MAIN_OPT_DEBUG },
-    { "help", 0, NULL, 'h' },
-    { NULL, 0, 0, 0 }
-  };
-
-  const char *modes[] = {
-    "hvm_save",
-    "save",
-    "hvm_restore",
-    "restore"
-  };
-
-  Emu *xenguestEmu = emu_from_name("xenguest");
-  assert(xenguestEmu);
-
   // 1. Parse arguments.
-  bool soFarSoGood;
-
-  uint domId = (uint)-1;
-  int controlInFd = -1;
-  int controlOutFd = -1;
-  bool live = false;
-
-  bool debugMode = false;
-  #ifdef DEBUG
-    debugMode = true;
-    syslog(LOG_DEBUG, "Force debug mode! (Binary compiled with debug flags.)");
-  #endif // ifdef DEBUG
-
-  int option;
-  int longindex = 0;
-  while ((option = getopt_long_only(argc, argv, "", longopts, &longindex)) != -1) {
-    switch (option) {
-      case 'd':
-        domId = (uint)xcp_str_to_int(optarg, &soFarSoGood);
-        if (!soFarSoGood) {
-          syslog(LOG_ERR, "Unable to convert domId to int.");
-          return EXIT_FAILURE;
-        }
-        break;
-      case 'f': {
-        const int fd = xcp_str_to_int(optarg, &soFarSoGood);
-        if (!soFarSoGood || fd <= -1) {
-          syslog(LOG_ERR, "Unable to convert fd to int. It must be positive or 0.");
-          return EXIT_FAILURE;
-        }
-        if (emu_create_stream(xenguestEmu, fd) < 0)
-          return EXIT_FAILURE;
-      } break;
-      case 'i':
-        controlInFd = xcp_str_to_int(optarg, &soFarSoGood);
-        if (!soFarSoGood) {
-          syslog(LOG_ERR, "Unable to convert control in fd to int.");
-          return EXIT_FAILURE;
-        }
-        break;
-      case 'o':
-        controlOutFd = xcp_str_to_int(optarg, &soFarSoGood);
-        if (!soFarSoGood) {
-          syslog(LOG_ERR, "Unable to convert control out fd to int.");
-          return EXIT_FAILURE;
-        }
-        break;
-      case 's':
-        if (arg_list_append_str(&xenguestEmu->arguments, "store_port", optarg) < 0) {
-          syslog(LOG_ERR, "Failed to add store_port argument: `%s`.", strerror(errno));
-          return EXIT_FAILURE;
-        }
-        break;
-      case 'c':
-        if (arg_list_append_str(&xenguestEmu->arguments, "console_port", optarg) < 0) {
-          syslog(LOG_ERR, "Failed to add console_port argument: `%s`.", strerror(errno));
-          return EXIT_FAILURE;
-        }
-        break;
-      case MAIN_OPT_MEM_PNODE:
-        if (arg_list_append_str(&xenguestEmu->arguments, "mem_pnode", optarg) < 0) {
-          syslog(LOG_ERR, "Failed to add mem_pnode argument: `%s`.", strerror(errno));
-          return EXIT_FAILURE;
-        }
-        break;
-      case 'l':
-        if (!strcmp(optarg, "true"))
-          live = true;
-        else if (!strcmp(optarg, "false"))
-          live = false;
-        else {
-          syslog(LOG_ERR, "Unable to set live argument to unknown value: `%s`. Supported: [true, false].", optarg);
-          return EXIT_FAILURE;
-        }
-        break;
-      case 'm':
-        if ((Mode = (int)xcp_str_arr_index_of(modes, XCP_ARRAY_LEN(modes), optarg)) == -1) {
-          syslog(LOG_ERR, "Unknown mode: `%s`.", optarg);
-          return EXIT_FAILURE;
-        }
-        break;
-      case MAIN_OPT_DEVICE_MODEL: {
-        char *fdStr = strchr(optarg, ':');
-        if (fdStr)
-          *fdStr++ = 0;
-
-        Emu *emu = emu_from_name(optarg);
-        if (!emu) {
-          syslog(LOG_ERR, "Bad dm: `%s`:`%s`", optarg, fdStr);
-          return EXIT_FAILURE;
-        }
-
-        emu->flags |= EMU_FLAG_ENABLED;
-        if (!fdStr) continue;
-
-        if (emu->type == EmuTypeQmpLibxl) {
-          syslog(LOG_ERR, "Cannot create stream on emu `%s`. Unsupported operation.", emu->name);
-          return EXIT_FAILURE;
-        }
-
-        const int fd = xcp_str_to_int(fdStr, &soFarSoGood);
-        if (!soFarSoGood || fd <= -1) {
-          syslog(LOG_ERR, "Unable to convert dm to int. It must be positive or 0.");
-          return EXIT_FAILURE;
-        }
-        if (emu_create_stream(emu, fd) < 0)
-          return EXIT_FAILURE;
-      } break;
-      case MAIN_OPT_FORK:
-        // TODO: Find the fork usage?
-        syslog(LOG_INFO, "Called with fork argument: `--fork %s`.", optarg);
-        break;
-      case MAIN_OPT_DEBUG:
-        debugMode = true;
-        break;
-      case 'h':
-        usage(argv[0]);
-        return EXIT_SUCCESS;
-      case '?':
-        if (optopt == 0)
-          syslog(LOG_ERR, "Unknown option: `%s`.", argv[optind - 1]);
-        else
-          syslog(LOG_ERR, "Error parsing option: `-%c`", optopt);
-        syslog(LOG_ERR, "Try `%s --help` for more information.", *argv);
-        return EXIT_FAILURE;
-    }
-  }
-
-  // 2. Checking and using arguments as config.
-  if (Mode == -1) {
-    syslog(LOG_ERR, "Operation mode is not set!");
-    return EXIT_FAILURE;
-  }
-
-  if (controlInFd == -1 || controlOutFd == -1) {
-    syslog(LOG_ERR, "Control fd(s) not set!");
+  MigrationConfig config = {
+    .domId = (uint)-1,
+    .controlInFd = -1,
+    .controlOutFd = -1,
+    .progressInterval = -1
+  };
+  if (migration_parse_args(&config, argc, argv) < 0)
     return EXIT_FAILURE;
-  }
 
-  if (domId == (uint)-1) {
-    syslog(LOG_ERR, "Domid not set!");
-    return EXIT_FAILURE;
+  if (config.printHelp) {
+    migration_usage(argv[0]);
+    return EXIT_SUCCESS;
   }
 
-  // 3. Open system logger with explicit progname.
-  char progname[256];
-  if (snprintf(progname, sizeof progname, "%s-%u", basename(*argv), domId) < 0) {
-    syslog(LOG_ERR, "Failed to set progname: `%s`.", strerror(errno));
-    return EXIT_FAILURE;
+  // 2. Open system logger with explicit progname.
+  // The daemon keeps the default one: it serves many domains.
+  if (!config.daemonPath) {
+    char progname[256];
+    if (snprintf(progname, sizeof progname, "%s-%u", basename(*argv), config.domId) < 0) {
+      syslog(LOG_ERR, "Failed to set progname: `%s`.", strerror(errno));
+      return EXIT_FAILURE;
+    }
+    openlog(progname, LOG_PID, LOG_USER | LOG_MAIL);
   }
-  openlog(progname, LOG_PID, LOG_USER | LOG_MAIL);
-  setlogmask(LOG_UPTO(debugMode ? LOG_DEBUG : LOG_INFO));
+  setlogmask(LOG_UPTO(config.debugMode ? LOG_DEBUG : LOG_INFO));
 
-  // 4. Ignore SIGPIPE.
+  // 3. Ignore SIGPIPE.
   struct sigaction sigact = { .sa_handler = SIG_IGN };
   sigemptyset(&sigact.sa_mask);
   if (sigaction(SIGPIPE, &sigact, 0) < 0) {
@@ -308,56 +107,9 @@ int main (int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
 
-  // 5. Start restore or save.
-  if (
-    xcp_fd_set_close_on_exec(controlInFd, true) != XCP_ERR_OK ||
-    xcp_fd_set_close_on_exec(controlOutFd, true) != XCP_ERR_OK
-  ) {
-    syslog(LOG_ERR, "Failed to set_cloexec flag for control fds: `%s`.", strerror(errno));
-    return EXIT_FAILURE;
-  }
-
-  syslog(LOG_INFO, "Startup: xenopsd control fds (%d, %d).", controlInFd, controlOutFd);
-  syslog(LOG_INFO, "Startup: domid %u.", domId);
-  syslog(LOG_INFO, "Startup: operation mode (%s, %s).", modes[Mode], live ? "live" : "non-live");
-
-  syslog(LOG_DEBUG, "Configuring xenopsd...");
-  if (control_init(controlInFd, controlOutFd) < 0)
-    return EXIT_FAILURE;
-
-  if (
-    (Mode == EmuModeSave || Mode == EmuModeRestore) &&
-    arg_list_append_str(&xenguestEmu->arguments, "pv", "true") < 0
-  ) {
-    syslog(LOG_ERR, "Failed to add pv argument: `%s`.", strerror(errno));
-    return EXIT_FAILURE;
-  }
-
-  int error = 0;
-
-  if (
-    emu_manager_configure(live, Mode) < 0 ||
-    emu_manager_fork(domId) < 0 ||
-    emu_manager_connect(domId) < 0 ||
-    emu_manager_init() < 0
-  )
-    goto fail;
-
-  if (
-    (Mode == EmuModeHvmRestore || Mode == EmuModeRestore)
-      ? emu_manager_restore() < 0
-      : emu_manager_save(live) < 0
-  )
-    goto fail;
-
-  // Success. \o/
-  goto end;
-
-fail:
-  error = EmuError;
-
-end:
-  if (clean_migration(error) < 0)
-    return EXIT_FAILURE;
-  return EXIT_SUCCESS;
+  // 4. Serve migrations or start restore or save.
+  if (config.daemonPath)
+    return scheduler_configure(config.maxMigrations, config.maxPauses, config.bandwidth) < 0 ||
+      daemon_run(config.daemonPath) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  return migration_run(&config) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,569 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <xcp-ng/generic.h>
+
+#include "arg-list.h"
+#include "compressor.h"
+#include "control.h"
+#include "convergence.h"
+#include "emu.h"
+#include "file-writer.h"
+#include "logger.h"
+#include "migration.h"
+#include "monotonic-clock.h"
+#include "relay.h"
+#include "scheduler.h"
+#include "stream-inspector.h"
+#include "telemetry.h"
+
+// =============================================================================
+
+static __thread int Mode = -1;
+static __thread bool IsRunning;
+
+static const char *Modes[] = {
+  "hvm_save",
+  "save",
+  "hvm_restore",
+  "restore"
+};
+
+// -----------------------------------------------------------------------------
+
+void migration_usage (const char *progname) {
+  printf("Usage: %s [OPTIONS]\n", progname);
+  puts("  --domid                  domain ID");
+  puts("  --fd                     data descriptor, repeat it to stripe the stream");
+  puts("  --controlinfd            control input descriptor");
+  puts("  --controloutfd           control output descriptor");
+  puts("  --store_port             store port");
+  puts("  --console_port           console port");
+  puts("  --mem_pnode              NUMA node for memory placement");
+  puts("  --live                   enable live migration");
+  puts("  --mode                   migration mode");
+  puts("  --dm                     device model");
+  puts("  --convergence            live stage policies (threshold,rate,no-progress)");
+  puts("  --max-downtime-ms        max guest pause duration of a live migration");
+  puts("  --auto-converge          throttle guests that dirty memory too fast");
+  puts("  --telemetry-dir          write migration telemetry in this directory");
+  puts("  --postcopy               switch to post-copy after this count of iterations (xenguest extension)");
+  puts("  --daemon                 serve migrations requested on this UNIX socket");
+  puts("  --max-migrations         daemon: max count of concurrent save migrations");
+  puts("  --max-pauses             daemon: max count of concurrent stop-and-copy phases");
+  puts("  --bandwidth              daemon: aggregate bandwidth of the save migrations (MiB/s)");
+  puts("  --progress-interval-ms   min interval between progress reports to xenopsd");
+  puts("  --extended-progress      also report rates, ETA, iteration and phase of each emu");
+  puts("  --relay                  forward the streams of the emus through emu-manager");
+  puts("  --compression            compress the relayed streams (none, lz4, zlib)");
+  puts("  --compression-threads    count of compression threads");
+  puts("  --stream-bandwidth       limits of the relayed save streams (live[,stop-and-copy] MiB/s)");
+  puts("  --direct-io              write suspend files with O_DIRECT through the relay");
+  puts("  --checksum               add CRC-32C checksums to the relayed streams");
+  puts("  --inspect-stream         count the records and pages of the relayed xenguest stream");
+  puts("  --debug                  enable debug logs");
+  puts("  --help                   print this help and exit");
+}
+
+// -----------------------------------------------------------------------------
+
+// In a daemon request, fd arguments are indexes in the received fds.
+static int migration_get_fd (const MigrationConfig *config, int value) {
+  if (!config->isDaemonRequest)
+    return value;
+
+  if (value < 0 || (size_t)value >= config->fdsCount) {
+    syslog(LOG_ERR, "Invalid fd index %d, only %zu fd(s) received.", value, config->fdsCount);
+    return -1;
+  }
+  return config->fds[value];
+}
+
+static int migration_add_stream (MigrationConfig *config, Emu *emu, int value) {
+  const int fd = migration_get_fd(config, value);
+  if (fd <= -1 || emu_create_stream(emu, fd) < 0)
+    return -1;
+
+  if (config->isDaemonRequest)
+    config->streamFds |= 1u << value;
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+#define MAIN_OPT_DEBUG 1
+#define MAIN_OPT_DEVICE_MODEL 2
+#define MAIN_OPT_FORK 3
+#define MAIN_OPT_MEM_PNODE 4
+#define MAIN_OPT_CONVERGENCE 5
+#define MAIN_OPT_MAX_DOWNTIME 6
+#define MAIN_OPT_AUTO_CONVERGE 7
+#define MAIN_OPT_TELEMETRY_DIR 8
+#define MAIN_OPT_POSTCOPY 9
+#define MAIN_OPT_DAEMON 10
+#define MAIN_OPT_MAX_MIGRATIONS 11
+#define MAIN_OPT_MAX_PAUSES 12
+#define MAIN_OPT_BANDWIDTH 13
+#define MAIN_OPT_PROGRESS_INTERVAL 14
+#define MAIN_OPT_EXTENDED_PROGRESS 15
+#define MAIN_OPT_RELAY 16
+#define MAIN_OPT_COMPRESSION 17
+#define MAIN_OPT_COMPRESSION_THREADS 18
+#define MAIN_OPT_STREAM_BANDWIDTH 19
+#define MAIN_OPT_DIRECT_IO 20
+#define MAIN_OPT_CHECKSUM 21
+#define MAIN_OPT_INSPECT_STREAM 22
+
+int migration_parse_args (MigrationConfig *config, int argc, char *argv[]) {
+  const struct option longopts[] = {
+    { "domid", 1, NULL, 'd' },
+    { "fd", 1, NULL, 'f' },
+    { "controlinfd", 1, NULL, 'i' },
+    { "controloutfd", 1, NULL, 'o' },
+    { "store_port", 1, NULL, 's' },
+    { "console_port", 1, NULL, 'c' },
+    { "live", 1, NULL, 'l' },
+    { "mode", 1, NULL, 'm' },
+    { "dm", 1, NULL, MAIN_OPT_DEVICE_MODEL },
+    { "fork", 1, NULL, MAIN_OPT_FORK },
+    { "mem_pnode", 1, NULL, MAIN_OPT_MEM_PNODE },
+    { "convergence", 1, NULL, MAIN_OPT_CONVERGENCE },
+    { "max-downtime-ms", 1, NULL, MAIN_OPT_MAX_DOWNTIME },
+    { "auto-converge", 0, NULL, MAIN_OPT_AUTO_CONVERGE },
+    { "telemetry-dir", 1, NULL, MAIN_OPT_TELEMETRY_DIR },
+    { "postcopy", 1, NULL, MAIN_OPT_POSTCOPY },
+    { "daemon", 1, NULL, MAIN_OPT_DAEMON },
+    { "max-migrations", 1, NULL, MAIN_OPT_MAX_MIGRATIONS },
+    { "max-pauses", 1, NULL, MAIN_OPT_MAX_PAUSES },
+    { "bandwidth", 1, NULL, MAIN_OPT_BANDWIDTH },
+    { "progress-interval-ms", 1, NULL, MAIN_OPT_PROGRESS_INTERVAL },
+    { "extended-progress", 0, NULL, MAIN_OPT_EXTENDED_PROGRESS },
+    { "relay", 0, NULL, MAIN_OPT_RELAY },
+    { "compression", 1, NULL, MAIN_OPT_COMPRESSION },
+    { "compression-threads", 1, NULL, MAIN_OPT_COMPRESSION_THREADS },
+    { "stream-bandwidth", 1, NULL, MAIN_OPT_STREAM_BANDWIDTH },
+    { "direct-io", 0, NULL, MAIN_OPT_DIRECT_IO },
+    { "checksum", 0, NULL, MAIN_OPT_CHECKSUM },
+    { "inspect-stream", 0, NULL, MAIN_OPT_INSPECT_STREAM },
+    { "debug", 0, NULL, MAIN_OPT_DEBUG },
+    { "help", 0, NULL, 'h' },
+    { NULL, 0, 0, 0 }
+  };
+
+  Emu *xenguestEmu = emu_from_name("xenguest");
+  assert(xenguestEmu);
+
+  bool soFarSoGood;
+
+  #ifdef DEBUG
+    config->debugMode = true;
+    syslog(LOG_DEBUG, "Force debug mode! (Binary compiled with debug flags.)");
+  #endif // ifdef DEBUG
+
+  // Arguments can be parsed many times by the daemon: reset getopt.
+  optind = 0;
+
+  int option;
+  int longindex = 0;
+  while ((option = getopt_long_only(argc, argv, "", longopts, &longindex)) != -1) {
+    switch (option) {
+      case 'd':
+        config->domId = (uint)xcp_str_to_int(optarg, &soFarSoGood);
+        if (!soFarSoGood) {
+          syslog(LOG_ERR, "Unable to convert domId to int.");
+          return -1;
+        }
+        break;
+      case 'f': {
+        const int fd = xcp_str_to_int(optarg, &soFarSoGood);
+        if (!soFarSoGood || fd <= -1) {
+          syslog(LOG_ERR, "Unable to convert fd to int. It must be positive or 0.");
+          return -1;
+        }
+        if (migration_add_stream(config, xenguestEmu, fd) < 0)
+          return -1;
+      } break;
+      case 'i':
+        config->controlInFd = xcp_str_to_int(optarg, &soFarSoGood);
+        if (!soFarSoGood) {
+          syslog(LOG_ERR, "Unable to convert control in fd to int.");
+          return -1;
+        }
+        if ((config->controlInFd = migration_get_fd(config, config->controlInFd)) <= -1)
+          return -1;
+        break;
+      case 'o':
+        config->controlOutFd = xcp_str_to_int(optarg, &soFarSoGood);
+        if (!soFarSoGood) {
+          syslog(LOG_ERR, "Unable to convert control out fd to int.");
+          return -1;
+        }
+        if ((config->controlOutFd = migration_get_fd(config, config->controlOutFd)) <= -1)
+          return -1;
+        break;
+      case 's':
+        if (arg_list_append_str(&xenguestEmu->arguments, "store_port", optarg) < 0) {
+          syslog(LOG_ERR, "Failed to add store_port argument: `%s`.", strerror(errno));
+          return -1;
+        }
+        break;
+      case 'c':
+        if (arg_list_append_str(&xenguestEmu->arguments, "console_port", optarg) < 0) {
+          syslog(LOG_ERR, "Failed to add console_port argument: `%s`.", strerror(errno));
+          return -1;
+        }
+        break;
+      case MAIN_OPT_MEM_PNODE:
+        if (arg_list_append_str(&xenguestEmu->arguments, "mem_pnode", optarg) < 0) {
+          syslog(LOG_ERR, "Failed to add mem_pnode argument: `%s`.", strerror(errno));
+          return -1;
+        }
+        break;
+      case 'l':
+        if (!strcmp(optarg, "true"))
+          config->live = true;
+        else if (!strcmp(optarg, "false"))
+          config->live = false;
+        else {
+          syslog(LOG_ERR, "Unable to set live argument to unknown value: `%s`. Supported: [true, false].", optarg);
+          return -1;
+        }
+        break;
+      case 'm':
+        if ((Mode = (int)xcp_str_arr_index_of(Modes, XCP_ARRAY_LEN(Modes), optarg)) == -1) {
+          syslog(LOG_ERR, "Unknown mode: `%s`.", optarg);
+          return -1;
+        }
+        break;
+      case MAIN_OPT_DEVICE_MODEL: {
+        char *fdStr = strchr(optarg, ':');
+        if (fdStr)
+          *fdStr++ = 0;
+
+        Emu *emu = emu_from_name(optarg);
+        if (!emu) {
+          syslog(LOG_ERR, "Bad dm: `%s`:`%s`", optarg, fdStr);
+          return -1;
+        }
+
+        emu->flags |= EMU_FLAG_ENABLED;
+        if (!fdStr) continue;
+
+        if (emu->type == EmuTypeQmpLibxl) {
+          syslog(LOG_ERR, "Cannot create stream on emu `%s`. Unsupported operation.", emu->name);
+          return -1;
+        }
+
+        const int fd = xcp_str_to_int(fdStr, &soFarSoGood);
+        if (!soFarSoGood || fd <= -1) {
+          syslog(LOG_ERR, "Unable to convert dm to int. It must be positive or 0.");
+          return -1;
+        }
+        if (migration_add_stream(config, emu, fd) < 0)
+          return -1;
+      } break;
+      case MAIN_OPT_FORK:
+        // TODO: Find the fork usage?
+        syslog(LOG_INFO, "Called with fork argument: `--fork %s`.", optarg);
+        break;
+      case MAIN_OPT_CONVERGENCE:
+        if (convergence_set_policies(optarg) < 0)
+          return -1;
+        break;
+      case MAIN_OPT_MAX_DOWNTIME: {
+        const int downtime = xcp_str_to_int(optarg, &soFarSoGood);
+        if (!soFarSoGood) {
+          syslog(LOG_ERR, "Unable to convert max downtime to int.");
+          return -1;
+        }
+        if (convergence_set_max_downtime(downtime) < 0)
+          return -1;
+      } break;
+      case MAIN_OPT_AUTO_CONVERGE:
+        convergence_enable_auto_converge();
+        break;
+      case MAIN_OPT_TELEMETRY_DIR:
+        config->telemetryDir = optarg;
+        break;
+      case MAIN_OPT_POSTCOPY: {
+        const int iterations = xcp_str_to_int(optarg, &soFarSoGood);
+        if (!soFarSoGood) {
+          syslog(LOG_ERR, "Unable to convert post-copy iterations to int.");
+          return -1;
+        }
+        if (convergence_set_postcopy(iterations) < 0)
+          return -1;
+      } break;
+      case MAIN_OPT_DAEMON:
+        if (config->isDaemonRequest) {
+          syslog(LOG_ERR, "Daemon option cannot be used in a daemon request.");
+          return -1;
+        }
+        config->daemonPath = optarg;
+        break;
+      case MAIN_OPT_MAX_MIGRATIONS:
+      case MAIN_OPT_MAX_PAUSES:
+      case MAIN_OPT_BANDWIDTH: {
+        if (config->isDaemonRequest) {
+          syslog(LOG_ERR, "Scheduler options cannot be used in a daemon request.");
+          return -1;
+        }
+
+        const int value = xcp_str_to_int(optarg, &soFarSoGood);
+        if (!soFarSoGood || value < 0) {
+          syslog(LOG_ERR, "Unable to convert scheduler limit to int. It must be positive or 0.");
+          return -1;
+        }
+
+        if (option == MAIN_OPT_MAX_MIGRATIONS)
+          config->maxMigrations = value;
+        else if (option == MAIN_OPT_MAX_PAUSES)
+          config->maxPauses = value;
+        else
+          config->bandwidth = (int64_t)value * 1024 * 1024;
+      } break;
+      case MAIN_OPT_PROGRESS_INTERVAL: {
+        const int interval = xcp_str_to_int(optarg, &soFarSoGood);
+        if (!soFarSoGood || interval < 0) {
+          syslog(LOG_ERR, "Unable to convert progress interval to int. It must be positive or 0.");
+          return -1;
+        }
+        config->progressInterval = interval;
+      } break;
+      case MAIN_OPT_EXTENDED_PROGRESS:
+        config->extendedProgress = true;
+        break;
+      case MAIN_OPT_RELAY:
+        relay_enable();
+        break;
+      case MAIN_OPT_COMPRESSION:
+        if (compressor_set_codec(optarg) < 0)
+          return -1;
+        // The compression is a stage of the relay.
+        if (compressor_get_codec())
+          relay_enable();
+        break;
+      case MAIN_OPT_COMPRESSION_THREADS: {
+        const int threads = xcp_str_to_int(optarg, &soFarSoGood);
+        if (!soFarSoGood) {
+          syslog(LOG_ERR, "Unable to convert compression threads to int.");
+          return -1;
+        }
+        if (compressor_set_threads(threads) < 0)
+          return -1;
+      } break;
+      case MAIN_OPT_STREAM_BANDWIDTH:
+        if (emu_manager_set_stream_bandwidth(optarg) < 0)
+          return -1;
+        // The limiter is a stage of the relay.
+        relay_enable();
+        break;
+      case MAIN_OPT_DIRECT_IO:
+        file_writer_enable();
+        break;
+      case MAIN_OPT_CHECKSUM:
+        // The checksums are added to the frames of the relay.
+        compressor_enable_checksum();
+        relay_enable();
+        break;
+      case MAIN_OPT_INSPECT_STREAM:
+        // The stream is parsed by the relay thread.
+        stream_inspector_enable();
+        relay_enable();
+        break;
+      case MAIN_OPT_DEBUG:
+        // The log mask is shared by all the migrations of the daemon.
+        if (config->isDaemonRequest) {
+          syslog(LOG_ERR, "Debug option cannot be used in a daemon request.");
+          return -1;
+        }
+        config->debugMode = true;
+        break;
+      case 'h':
+        config->printHelp = true;
+        return 0;
+      case '?':
+        if (optopt == 0)
+          syslog(LOG_ERR, "Unknown option: `%s`.", argv[optind - 1]);
+        else
+          syslog(LOG_ERR, "Error parsing option: `-%c`", optopt);
+        syslog(LOG_ERR, "Try `%s --help` for more information.", *argv);
+        return -1;
+    }
+  }
+
+  // Checking arguments. The daemon itself does not run a migration.
+  if (config->daemonPath)
+    return 0;
+
+  if (Mode == -1) {
+    syslog(LOG_ERR, "Operation mode is not set!");
+    return -1;
+  }
+
+  if (config->controlInFd == -1 || config->controlOutFd == -1) {
+    syslog(LOG_ERR, "Control fd(s) not set!");
+    return -1;
+  }
+
+  if (config->domId == (uint)-1) {
+    syslog(LOG_ERR, "Domid not set!");
+    return -1;
+  }
+
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+// Max duration to wait for a slot of the scheduler.
+#define MIGRATION_ADMISSION_TIMEOUT (30 * 60 * 1000)
+
+// The emus are not started yet: only the control messages are processed while
+// the migration is queued, an abort from xenopsd stops the wait.
+static int migration_wait_admission () {
+  const int ret = scheduler_admit();
+  if (ret != 0)
+    return ret < 0 ? -1 : 0;
+
+  struct pollfd fds[] = {
+    { .fd = scheduler_get_admission_fd(), .events = POLLIN },
+    { .fd = control_get_fd_in(), .events = POLLIN }
+  };
+  const int64_t deadline = monotonic_clock_us() / 1000 + MIGRATION_ADMISSION_TIMEOUT;
+  for (;;) {
+    const int64_t timeout = deadline - monotonic_clock_us() / 1000;
+    if (timeout <= 0) {
+      syslog(LOG_ERR, "Failed to get a migration slot because timeout reached.");
+      EmuError = ETIME;
+      return -1;
+    }
+
+    if (poll(fds, XCP_ARRAY_LEN(fds), (int)timeout) < 0) {
+      if (errno == EINTR)
+        continue;
+      syslog(LOG_ERR, "Failed to wait for a migration slot: `%s`.", strerror(errno));
+      EmuError = errno;
+      return -1;
+    }
+
+    if (fds[0].revents) {
+      syslog(LOG_INFO, "Migration is admitted by the scheduler.");
+      return 0;
+    }
+
+    if (fds[1].revents && control_receive_and_process_messages(0) < 0)
+      return -1;
+  }
+}
+
+int migration_run (const MigrationConfig *config) {
+  if (
+    xcp_fd_set_close_on_exec(config->controlInFd, true) != XCP_ERR_OK ||
+    xcp_fd_set_close_on_exec(config->controlOutFd, true) != XCP_ERR_OK
+  ) {
+    syslog(LOG_ERR, "Failed to set_cloexec flag for control fds: `%s`.", strerror(errno));
+    return -1;
+  }
+
+  syslog(LOG_INFO, "Startup: xenopsd control fds (%d, %d).", config->controlInFd, config->controlOutFd);
+  syslog(LOG_INFO, "Startup: domid %u.", config->domId);
+  syslog(LOG_INFO, "Startup: operation mode (%s, %s).", Modes[Mode], config->live ? "live" : "non-live");
+
+  syslog(LOG_DEBUG, "Configuring xenopsd...");
+  if (control_init(config->controlInFd, config->controlOutFd, config->progressInterval, config->extendedProgress) < 0)
+    return -1;
+  IsRunning = true;
+
+  Emu *xenguestEmu = emu_from_name("xenguest");
+  if (
+    (Mode == EmuModeSave || Mode == EmuModeRestore) &&
+    arg_list_append_str(&xenguestEmu->arguments, "pv", "true") < 0
+  ) {
+    syslog(LOG_ERR, "Failed to add pv argument: `%s`.", strerror(errno));
+    return migration_clean(errno);
+  }
+
+  // Telemetry is optional, a failure must not prevent the migration.
+  if (config->telemetryDir)
+    telemetry_open(config->telemetryDir, config->domId);
+
+  int error = 0;
+
+  // Only the save migrations compete for the resources of this host.
+  const bool isSave = Mode == EmuModeSave || Mode == EmuModeHvmSave;
+  if (isSave && migration_wait_admission() < 0)
+    goto fail;
+
+  if (
+    emu_manager_configure(config->live, Mode) < 0 ||
+    emu_manager_start(config->domId) < 0
+  )
+    goto fail;
+
+  if (
+    (Mode == EmuModeHvmRestore || Mode == EmuModeRestore)
+      ? emu_manager_restore() < 0
+      : emu_manager_save(config->live) < 0
+  )
+    goto fail;
+
+  // Success. \o/
+  goto end;
+
+fail:
+  error = EmuError;
+
+end:
+  return migration_clean(error);
+}
+
+int migration_clean (int error) {
+  if (!IsRunning)
+    return error ? -1 : 0;
+  IsRunning = false;
+
+  if (error && (Mode == EmuModeSave || Mode == EmuModeHvmSave))
+    emu_manager_abort_save(); // Don't update previous error.
+
+  if (emu_manager_disconnect() < 0 && !error)
+    error = EmuError; // Update error only if there is no previous error.
+
+  // Ignore errors of emu_manager_wait_termination.
+  emu_manager_wait_termination();
+  emu_manager_clean();
+  telemetry_close();
+  scheduler_leave();
+
+  if (error == ESHUTDOWN || !error) {
+    control_clean();
+    return 0;
+  }
+
+  control_report_error(error);
+  control_clean();
+  return -1;
+}
@@ -0,0 +1,69 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MIGRATION_H_
+#define _MIGRATION_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// =============================================================================
+// A migration is run by the emu-manager process itself or by a thread of the
+// daemon. All its state is local to the running thread.
+// =============================================================================
+
+#define MIGRATION_MAX_FDS 8
+
+typedef struct MigrationConfig {
+  uint domId;
+  int controlInFd;
+  int controlOutFd;
+  bool live;
+  const char *telemetryDir;
+  int progressInterval; // In ms, < 0 for the default.
+  bool extendedProgress;
+
+  bool debugMode;
+  bool printHelp;
+  const char *daemonPath;
+
+  // Scheduler of the daemon, 0 for no limit.
+  int maxMigrations;
+  int maxPauses;
+  int64_t bandwidth; // In bytes/s.
+
+  // Daemon request: fd arguments are indexes in `fds`.
+  bool isDaemonRequest;
+  const int *fds;
+  size_t fdsCount;
+  uint streamFds; // Bitmask of the fds owned by emu streams.
+} MigrationConfig;
+
+// -----------------------------------------------------------------------------
+
+void migration_usage (const char *progname);
+
+int migration_parse_args (MigrationConfig *config, int argc, char *argv[]);
+
+int migration_run (const MigrationConfig *config);
+
+// Abort and clean the migration of the current thread, if any.
+int migration_clean (int error);
+
+#endif // ifndef _MIGRATION_H_
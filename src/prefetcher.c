@@ -0,0 +1,246 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "emu.h"
+#include "logger.h"
+#include "monotonic-clock.h"
+#include "prefetcher.h"
+
+// =============================================================================
+
+#define PREFETCHER_THREADS 4
+#define PREFETCHER_CHUNK_SIZE (2 * 1024 * 1024)
+
+#define PREFETCHER_MIN_WINDOW (8 * 1024 * 1024)
+#define PREFETCHER_MAX_WINDOW (256 * 1024 * 1024)
+
+// In ms, delay to check the consumer position when the window is full.
+#define PREFETCHER_POLL_INTERVAL 10
+
+// In us, min delay between two measures of the consumer rate.
+#define PREFETCHER_RATE_INTERVAL 100000
+
+struct Prefetcher {
+  int fd;
+  int64_t fileSize;
+
+  pthread_t threads[PREFETCHER_THREADS];
+  int threadsCount;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t stopped;
+  bool stop;
+
+  int64_t next; // End of the requested range.
+  int64_t window;
+  double latency; // Average of a chunk read in us.
+
+  int64_t consumerOffset;
+  int64_t consumerTime;
+  double consumerRate; // In bytes/us.
+
+  uint64_t bytes;
+};
+
+// =============================================================================
+
+// Called with the lock. Returns -1 if the stream is not readable anymore.
+static int64_t prefetcher_get_consumer_offset (Prefetcher *prefetcher) {
+  const off_t offset = lseek(prefetcher->fd, 0, SEEK_CUR);
+  if (offset < 0)
+    return -1;
+
+  const int64_t now = monotonic_clock_us();
+  const int64_t elapsed = now - prefetcher->consumerTime;
+  if (elapsed >= PREFETCHER_RATE_INTERVAL) {
+    const double rate = (double)(offset - prefetcher->consumerOffset) / (double)elapsed;
+    prefetcher->consumerRate = 0.5 * prefetcher->consumerRate + 0.5 * rate;
+    prefetcher->consumerOffset = offset;
+    prefetcher->consumerTime = now;
+  }
+
+  return offset;
+}
+
+// Called with the lock. The window must hide the latency of the reads at
+// the consumer rate, with a chunk in flight per thread.
+static void prefetcher_update_window (Prefetcher *prefetcher, int64_t latency) {
+  prefetcher->latency = prefetcher->latency > 0.0
+    ? 0.8 * prefetcher->latency + 0.2 * (double)latency
+    : (double)latency;
+
+  int64_t window = (int64_t)(2.0 * prefetcher->consumerRate * prefetcher->latency) +
+    PREFETCHER_THREADS * PREFETCHER_CHUNK_SIZE;
+  if (window < PREFETCHER_MIN_WINDOW)
+    window = PREFETCHER_MIN_WINDOW;
+  else if (window > PREFETCHER_MAX_WINDOW)
+    window = PREFETCHER_MAX_WINDOW;
+  prefetcher->window = window;
+}
+
+static void prefetcher_wait (Prefetcher *prefetcher) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ts.tv_nsec += PREFETCHER_POLL_INTERVAL * 1000000L;
+  if (ts.tv_nsec >= 1000000000L) {
+    ++ts.tv_sec;
+    ts.tv_nsec -= 1000000000L;
+  }
+  pthread_cond_timedwait(&prefetcher->stopped, &prefetcher->mutex, &ts);
+}
+
+static void *prefetcher_thread (void *userData) {
+  Prefetcher *prefetcher = userData;
+
+  pthread_mutex_lock(&prefetcher->mutex);
+  while (!prefetcher->stop) {
+    const int64_t consumerOffset = prefetcher_get_consumer_offset(prefetcher);
+    if (consumerOffset < 0 || consumerOffset >= prefetcher->fileSize || prefetcher->next >= prefetcher->fileSize)
+      break;
+
+    // The consumer can be faster, do not read behind it.
+    if (prefetcher->next < consumerOffset)
+      prefetcher->next = consumerOffset;
+    if (prefetcher->next - consumerOffset >= prefetcher->window) {
+      prefetcher_wait(prefetcher);
+      continue;
+    }
+
+    const int64_t offset = prefetcher->next;
+    const int64_t remaining = prefetcher->fileSize - offset;
+    const size_t size = remaining < PREFETCHER_CHUNK_SIZE ? (size_t)remaining : PREFETCHER_CHUNK_SIZE;
+    prefetcher->next += (int64_t)size;
+    pthread_mutex_unlock(&prefetcher->mutex);
+
+    // readahead does not copy the data but can return before the end of
+    // the I/O: the last byte is read to measure the real latency.
+    char byte;
+    const int64_t startTime = monotonic_clock_us();
+    const int ret = readahead(prefetcher->fd, (off_t)offset, size) < 0
+      ? -1
+      : (int)pread(prefetcher->fd, &byte, 1, (off_t)offset + (off_t)size - 1);
+    const int64_t latency = monotonic_clock_us() - startTime;
+
+    pthread_mutex_lock(&prefetcher->mutex);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      syslog(LOG_ERR, "Failed to prefetch stream %d: `%s`.", prefetcher->fd, strerror(errno));
+      break;
+    }
+    prefetcher->bytes += size;
+    prefetcher_update_window(prefetcher, latency);
+  }
+  pthread_mutex_unlock(&prefetcher->mutex);
+
+  return NULL;
+}
+
+// =============================================================================
+
+int prefetcher_create (Prefetcher **prefetcher, int fd) {
+  struct stat buf;
+  if (fstat(fd, &buf) < 0) {
+    syslog(LOG_ERR, "Failed to get size of stream %d: `%s`.", fd, strerror(errno));
+    EmuError = errno;
+    return -1;
+  }
+
+  const off_t offset = lseek(fd, 0, SEEK_CUR);
+  if (offset < 0) {
+    syslog(LOG_ERR, "Failed to get offset of stream %d: `%s`.", fd, strerror(errno));
+    EmuError = errno;
+    return -1;
+  }
+
+  Prefetcher *newPrefetcher = calloc(1, sizeof *newPrefetcher);
+  if (!newPrefetcher) {
+    syslog(LOG_ERR, "Failed to allocate prefetcher of stream %d.", fd);
+    EmuError = errno;
+    return -1;
+  }
+
+  newPrefetcher->fd = fd;
+  newPrefetcher->fileSize = buf.st_size;
+  newPrefetcher->next = newPrefetcher->consumerOffset = offset;
+  newPrefetcher->consumerTime = monotonic_clock_us();
+  newPrefetcher->window = PREFETCHER_MIN_WINDOW;
+
+  pthread_mutex_init(&newPrefetcher->mutex, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&newPrefetcher->stopped, &attr);
+  pthread_condattr_destroy(&attr);
+
+  // Not fatal if some threads are missing.
+  for (; newPrefetcher->threadsCount < PREFETCHER_THREADS; ++newPrefetcher->threadsCount) {
+    const int error = pthread_create(
+      &newPrefetcher->threads[newPrefetcher->threadsCount], NULL, prefetcher_thread, newPrefetcher
+    );
+    if (error) {
+      syslog(LOG_ERR, "Failed to create prefetch thread of stream %d: `%s`.", fd, strerror(error));
+      if (!newPrefetcher->threadsCount) {
+        prefetcher_destroy(newPrefetcher);
+        EmuError = error;
+        return -1;
+      }
+      break;
+    }
+  }
+
+  syslog(
+    LOG_INFO, "Prefetching stream %d from %" PRId64 " to %" PRId64 " with %d thread(s).",
+    fd, (int64_t)offset, newPrefetcher->fileSize, newPrefetcher->threadsCount
+  );
+  *prefetcher = newPrefetcher;
+  return 0;
+}
+
+void prefetcher_destroy (Prefetcher *prefetcher) {
+  pthread_mutex_lock(&prefetcher->mutex);
+  prefetcher->stop = true;
+  pthread_cond_broadcast(&prefetcher->stopped);
+  pthread_mutex_unlock(&prefetcher->mutex);
+
+  for (int i = 0; i < prefetcher->threadsCount; ++i)
+    pthread_join(prefetcher->threads[i], NULL);
+
+  if (prefetcher->threadsCount)
+    syslog(
+      LOG_INFO, "Prefetched %" PRIu64 " bytes of stream %d (window: %" PRId64 " KiB, read latency: %.0f us).",
+      prefetcher->bytes, prefetcher->fd, prefetcher->window / 1024, prefetcher->latency
+    );
+
+  pthread_cond_destroy(&prefetcher->stopped);
+  pthread_mutex_destroy(&prefetcher->mutex);
+  free(prefetcher);
+}
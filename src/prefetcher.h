@@ -0,0 +1,37 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _PREFETCHER_H_
+#define _PREFETCHER_H_
+
+// =============================================================================
+// Read-ahead of a restored stream in a regular file (resume case): worker
+// threads fill the page cache in parallel in front of the consumer. The
+// consumer position is the offset of the stream, shared with the emus.
+// The prefetched window is sized from the measured read latency and the
+// consumer rate.
+// =============================================================================
+
+typedef struct Prefetcher Prefetcher;
+
+// fd is not owned by the prefetcher, it must stay open until
+// prefetcher_destroy.
+int prefetcher_create (Prefetcher **prefetcher, int fd);
+void prefetcher_destroy (Prefetcher *prefetcher);
+
+#endif // ifndef _PREFETCHER_H_
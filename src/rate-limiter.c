@@ -0,0 +1,94 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "monotonic-clock.h"
+#include "rate-limiter.h"
+
+// =============================================================================
+
+// Smaller allowances would only cost more syscalls.
+#define RATE_LIMITER_MIN_ALLOWANCE (16 * 1024)
+
+// Tokens are accumulated during 100 ms at most.
+#define RATE_LIMITER_BURST_DIVISOR 10
+
+// Called with the lock.
+static void rate_limiter_refill (RateLimiter *limiter) {
+  const int64_t now = monotonic_clock_us();
+  if (limiter->rate) {
+    limiter->tokens += (double)(now - limiter->lastTime) * (double)limiter->rate / 1e6;
+    if (limiter->tokens > (double)limiter->burst)
+      limiter->tokens = (double)limiter->burst;
+  }
+  limiter->lastTime = now;
+}
+
+// =============================================================================
+
+void rate_limiter_init (RateLimiter *limiter) {
+  pthread_mutex_init(&limiter->mutex, NULL);
+  limiter->rate = 0;
+  limiter->burst = 0;
+  limiter->tokens = 0.0;
+  limiter->lastTime = monotonic_clock_us();
+}
+
+void rate_limiter_destroy (RateLimiter *limiter) {
+  pthread_mutex_destroy(&limiter->mutex);
+}
+
+void rate_limiter_set_rate (RateLimiter *limiter, int64_t rate) {
+  pthread_mutex_lock(&limiter->mutex);
+
+  rate_limiter_refill(limiter);
+  limiter->rate = rate > 0 ? rate : 0;
+  limiter->burst = limiter->rate / RATE_LIMITER_BURST_DIVISOR;
+  if (limiter->burst < RATE_LIMITER_MIN_ALLOWANCE)
+    limiter->burst = RATE_LIMITER_MIN_ALLOWANCE;
+  if (limiter->tokens > (double)limiter->burst)
+    limiter->tokens = (double)limiter->burst;
+
+  pthread_mutex_unlock(&limiter->mutex);
+}
+
+size_t rate_limiter_get_allowance (RateLimiter *limiter, int *delay) {
+  pthread_mutex_lock(&limiter->mutex);
+
+  size_t allowance = SIZE_MAX;
+  if (limiter->rate) {
+    rate_limiter_refill(limiter);
+
+    if (limiter->tokens >= RATE_LIMITER_MIN_ALLOWANCE)
+      allowance = (size_t)limiter->tokens;
+    else {
+      allowance = 0;
+      const double missing = RATE_LIMITER_MIN_ALLOWANCE - limiter->tokens;
+      *delay = (int)(missing * 1000.0 / (double)limiter->rate) + 1;
+    }
+  }
+
+  pthread_mutex_unlock(&limiter->mutex);
+  return allowance;
+}
+
+void rate_limiter_consume (RateLimiter *limiter, size_t size) {
+  pthread_mutex_lock(&limiter->mutex);
+  if (limiter->rate)
+    limiter->tokens -= (double)size;
+  pthread_mutex_unlock(&limiter->mutex);
+}
@@ -0,0 +1,50 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _RATE_LIMITER_H_
+#define _RATE_LIMITER_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// =============================================================================
+// Token bucket. The rate can be changed by any thread, the tokens are only
+// taken by one thread.
+// =============================================================================
+
+typedef struct RateLimiter {
+  pthread_mutex_t mutex;
+  int64_t rate; // In bytes/s, 0 if unlimited.
+  int64_t burst;
+  double tokens;
+  int64_t lastTime;
+} RateLimiter;
+
+void rate_limiter_init (RateLimiter *limiter);
+void rate_limiter_destroy (RateLimiter *limiter);
+
+void rate_limiter_set_rate (RateLimiter *limiter, int64_t rate);
+
+// Returns the count of bytes that can be transferred now, SIZE_MAX if
+// unlimited. If 0, delay is the time to wait in ms.
+size_t rate_limiter_get_allowance (RateLimiter *limiter, int *delay);
+
+void rate_limiter_consume (RateLimiter *limiter, size_t size);
+
+#endif // ifndef _RATE_LIMITER_H_
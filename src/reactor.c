@@ -0,0 +1,268 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <xcp-ng/generic.h>
+
+#include "arena.h"
+#include "emu.h"
+#include "logger.h"
+#include "reactor.h"
+
+// =============================================================================
+
+#define REACTOR_MAX_EVENTS 16
+
+typedef struct ReactorHandler {
+  struct ReactorHandler *next;
+  int fd; // -1 if removed.
+  bool isTimer;
+  ReactorCb cb;
+  void *userData;
+} ReactorHandler;
+
+// One event loop per migration thread, see: daemon.c.
+static __thread struct {
+  int epollFd;
+  ReactorHandler *handlers;
+  ReactorHandler *freeHandlers; // Reused, the memory is owned by the arena.
+
+  // Removed handlers are recycled after the dispatch because
+  // their events can be pending.
+  bool isDispatching;
+} Reactor = {
+  .epollFd = -1
+};
+
+// -----------------------------------------------------------------------------
+
+static ReactorHandler *reactor_find (int fd) {
+  for (ReactorHandler *handler = Reactor.handlers; handler; handler = handler->next)
+    if (handler->fd == fd)
+      return handler;
+  return NULL;
+}
+
+static void reactor_free_removed () {
+  for (ReactorHandler **it = &Reactor.handlers; *it;) {
+    ReactorHandler *handler = *it;
+    if (handler->fd > -1)
+      it = &handler->next;
+    else {
+      *it = handler->next;
+      handler->next = Reactor.freeHandlers;
+      Reactor.freeHandlers = handler;
+    }
+  }
+}
+
+static int reactor_register (int fd, uint32_t events, bool isTimer, ReactorCb cb, void *userData) {
+  assert(Reactor.epollFd > -1);
+  assert(!reactor_find(fd));
+
+  ReactorHandler *handler = Reactor.freeHandlers;
+  if (handler)
+    Reactor.freeHandlers = handler->next;
+  else if (!(handler = arena_alloc(sizeof *handler))) {
+    syslog(LOG_ERR, "Failed to allocate reactor handler.");
+    EmuError = errno;
+    return -1;
+  }
+
+  *handler = (ReactorHandler){
+    .next = Reactor.handlers,
+    .fd = fd,
+    .isTimer = isTimer,
+    .cb = cb,
+    .userData = userData
+  };
+
+  struct epoll_event event = { .events = events, .data.ptr = handler };
+  if (epoll_ctl(Reactor.epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    syslog(LOG_ERR, "Failed to add fd %d to reactor: `%s`.", fd, strerror(errno));
+    EmuError = errno;
+    handler->next = Reactor.freeHandlers;
+    Reactor.freeHandlers = handler;
+    return -1;
+  }
+
+  Reactor.handlers = handler;
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+int reactor_init () {
+  assert(Reactor.epollFd <= -1);
+
+  if ((Reactor.epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    syslog(LOG_ERR, "Failed to create epoll fd: `%s`.", strerror(errno));
+    EmuError = errno;
+    return -1;
+  }
+  return 0;
+}
+
+int reactor_destroy () {
+  if (Reactor.epollFd <= -1)
+    return 0;
+
+  // Timers are owned by the reactor, other fds by the callers.
+  for (ReactorHandler *handler = Reactor.handlers; handler; handler = handler->next) {
+    if (handler->isTimer && handler->fd > -1)
+      xcp_fd_close(handler->fd);
+    handler->fd = -1;
+  }
+  reactor_free_removed();
+  Reactor.freeHandlers = NULL;
+
+  const int fd = Reactor.epollFd;
+  Reactor.epollFd = -1;
+  if (xcp_fd_close(fd) == XCP_ERR_ERRNO) {
+    EmuError = errno;
+    return -1;
+  }
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+int reactor_add (int fd, uint32_t events, ReactorCb cb, void *userData) {
+  return reactor_register(fd, events, false, cb, userData);
+}
+
+int reactor_modify (int fd, uint32_t events) {
+  ReactorHandler *handler = reactor_find(fd);
+  assert(handler);
+
+  struct epoll_event event = { .events = events, .data.ptr = handler };
+  if (epoll_ctl(Reactor.epollFd, EPOLL_CTL_MOD, fd, &event) < 0) {
+    syslog(LOG_ERR, "Failed to modify fd %d in reactor: `%s`.", fd, strerror(errno));
+    EmuError = errno;
+    return -1;
+  }
+  return 0;
+}
+
+int reactor_remove (int fd) {
+  ReactorHandler *handler = reactor_find(fd);
+  if (!handler)
+    return 0;
+
+  handler->fd = -1;
+  if (!Reactor.isDispatching)
+    reactor_free_removed();
+
+  if (epoll_ctl(Reactor.epollFd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+    syslog(LOG_ERR, "Failed to remove fd %d from reactor: `%s`.", fd, strerror(errno));
+    EmuError = errno;
+    return -1;
+  }
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+int reactor_timer_create (ReactorCb cb, void *userData) {
+  const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0) {
+    syslog(LOG_ERR, "Failed to create timer: `%s`.", strerror(errno));
+    EmuError = errno;
+    return -1;
+  }
+
+  if (reactor_register(fd, EPOLLIN, true, cb, userData) < 0) {
+    xcp_fd_close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int reactor_timer_arm (int fd, int timeout, bool periodic) {
+  assert(timeout >= 0);
+
+  const struct timespec value = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L };
+  const struct itimerspec spec = {
+    .it_interval = periodic ? value : (struct timespec){ 0, 0 },
+    .it_value = value
+  };
+  if (timerfd_settime(fd, 0, &spec, NULL) < 0) {
+    syslog(LOG_ERR, "Failed to arm timer %d: `%s`.", fd, strerror(errno));
+    EmuError = errno;
+    return -1;
+  }
+  return 0;
+}
+
+int reactor_timer_destroy (int fd) {
+  if (reactor_remove(fd) < 0)
+    return -1;
+  if (xcp_fd_close(fd) == XCP_ERR_ERRNO) {
+    EmuError = errno;
+    return -1;
+  }
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+int reactor_dispatch (int timeout) {
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+
+  int nEvents;
+  do {
+    nEvents = epoll_wait(Reactor.epollFd, events, REACTOR_MAX_EVENTS, timeout);
+  } while (nEvents < 0 && errno == EINTR);
+
+  if (nEvents < 0) {
+    syslog(LOG_ERR, "Failed to wait for reactor events: `%s`.", strerror(errno));
+    EmuError = errno;
+    return -1;
+  }
+
+  int ret = 0;
+  Reactor.isDispatching = true;
+  for (int i = 0; i < nEvents && !ret; ++i) {
+    ReactorHandler *handler = events[i].data.ptr;
+    if (handler->fd <= -1)
+      continue; // Removed by a previous handler.
+
+    if (handler->isTimer) {
+      uint64_t expirations;
+      if (read(handler->fd, &expirations, sizeof expirations) < 0) {
+        if (errno == EAGAIN)
+          continue; // Disarmed or rearmed by a previous handler.
+        syslog(LOG_ERR, "Failed to read timer %d: `%s`.", handler->fd, strerror(errno));
+        EmuError = errno;
+        ret = -1;
+        break;
+      }
+    }
+
+    if ((*handler->cb)(handler->fd, events[i].events, handler->userData) < 0)
+      ret = -1;
+  }
+  Reactor.isDispatching = false;
+  reactor_free_removed();
+
+  return ret;
+}
@@ -0,0 +1,51 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+// =============================================================================
+// Event loop: fds are registered once with a handler called when they are ready.
+// =============================================================================
+
+// Called with the ready events (EPOLLIN, EPOLLOUT, EPOLLHUP...).
+// Must return -1 and set EmuError on failure.
+typedef int (*ReactorCb)(int fd, uint32_t events, void *userData);
+
+int reactor_init ();
+int reactor_destroy ();
+
+int reactor_add (int fd, uint32_t events, ReactorCb cb, void *userData);
+int reactor_modify (int fd, uint32_t events);
+
+// Can be called in a handler, even for another fd ready in the same dispatch.
+int reactor_remove (int fd);
+
+// Timers are timerfds: the handler is called (with EPOLLIN) when the timer expires.
+int reactor_timer_create (ReactorCb cb, void *userData);
+int reactor_timer_arm (int fd, int timeout, bool periodic); // In ms, 0 to disarm.
+int reactor_timer_destroy (int fd);
+
+// Wait for ready fds and call their handlers. Stop at the first handler error.
+// Timeout in ms, -1 to wait until at least one fd is ready.
+int reactor_dispatch (int timeout);
+
+#endif // ifndef _REACTOR_H_
@@ -0,0 +1,764 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <xcp-ng/generic.h>
+
+#include "arena.h"
+#include "compressor.h"
+#include "emu.h"
+#include "file-writer.h"
+#include "logger.h"
+#include "monotonic-clock.h"
+#include "rate-limiter.h"
+#include "relay.h"
+#include "striper.h"
+
+// =============================================================================
+
+#define RELAY_PIPE_SIZE (1024 * 1024)
+#define RELAY_CHUNK_SIZE (1024 * 1024)
+
+// Used only when splice is not supported, e.g. with an O_APPEND file.
+#define RELAY_BUFFER_SIZE (64 * 1024)
+
+// Max delay to see a request of the migration thread.
+#define RELAY_POLL_INTERVAL 100
+
+typedef enum RelayRequest {
+  RelayRequestNone,
+  RelayRequestFinish,
+  RelayRequestAbort
+} RelayRequest;
+
+struct Relay {
+  RelayDirection direction;
+  RelayHooks hooks;
+
+  int streamFd; // The first one.
+  int streamFds[RELAY_MAX_STREAM_FDS];
+  int streamFlags[RELAY_MAX_STREAM_FDS]; // Restored before closing, the fds can be shared with xenopsd.
+  int streamFdsCount;
+  int pipeFd; // End of the relay thread, closed by it.
+
+  // Descriptors of the relay thread.
+  int inFd;
+  int outFd;
+
+  // Limit of the forwarded bytes, set by the migration thread.
+  RateLimiter limiter;
+  int throttleDelay; // In ms, set when the limit is reached.
+
+  bool useSplice;
+  char *buffer;
+  size_t bufferBegin;
+  size_t bufferEnd;
+
+  // Optional, the stream is then a sequence of frames.
+  Compressor *compressor;
+  char header[CODEC_FRAME_HEADER_SIZE];
+  size_t headerSize;
+
+  // Set if there are several stream fds, requires a compressor.
+  Striper *striper;
+
+  // Save in a regular file, see: file_writer_enable.
+  FileWriter *fileWriter;
+
+  pthread_t thread;
+  bool isJoined;
+  int eventFd; // Readable when the thread fails.
+
+  // Shared with the migration thread.
+  pthread_mutex_t mutex;
+  RelayRequest request;
+  int error;
+  uint64_t bytes;
+  int64_t startTime;
+  int64_t lastTime;
+};
+
+// Per migration, see: daemon.c.
+static __thread bool IsEnabled;
+
+// =============================================================================
+
+void relay_enable () {
+  IsEnabled = true;
+}
+
+bool relay_is_enabled () {
+  return IsEnabled;
+}
+
+// =============================================================================
+// Relay thread.
+// =============================================================================
+
+static RelayRequest relay_get_request (Relay *relay) {
+  pthread_mutex_lock(&relay->mutex);
+  const RelayRequest request = relay->request;
+  pthread_mutex_unlock(&relay->mutex);
+  return request;
+}
+
+static bool relay_pipe_is_empty (const Relay *relay) {
+  int size;
+  return ioctl(relay->pipeFd, FIONREAD, &size) < 0 || size <= 0;
+}
+
+static void relay_inspect (const Relay *relay, const char *data, size_t size) {
+  if (relay->hooks.onData)
+    relay->hooks.onData(relay->hooks.userData, data, size);
+}
+
+static void relay_account (Relay *relay, size_t size) {
+  const int64_t now = monotonic_clock_us();
+
+  rate_limiter_consume(&relay->limiter, size);
+
+  pthread_mutex_lock(&relay->mutex);
+  if (!relay->bytes)
+    relay->startTime = now;
+  relay->bytes += size;
+  relay->lastTime = now;
+  pthread_mutex_unlock(&relay->mutex);
+
+  if (relay->hooks.onTransfer)
+    relay->hooks.onTransfer(relay->hooks.userData, size);
+}
+
+// Returns the max size of the next write, 0 with errno set to EAGAIN
+// if the rate limit is reached.
+static size_t relay_get_allowance (Relay *relay, size_t size) {
+  int delay;
+  const size_t allowance = rate_limiter_get_allowance(&relay->limiter, &delay);
+  if (!allowance) {
+    relay->throttleDelay = delay < RELAY_POLL_INTERVAL ? delay : RELAY_POLL_INTERVAL;
+    errno = EAGAIN;
+    return 0;
+  }
+  return allowance < size ? allowance : size;
+}
+
+// Bounce buffer, the data can stay in it if the output is full.
+static ssize_t relay_copy (Relay *relay, size_t maxSize) {
+  if (!relay->buffer && !(relay->buffer = malloc(RELAY_BUFFER_SIZE)))
+    return -1;
+
+  if (relay->bufferBegin == relay->bufferEnd) {
+    const ssize_t size = read(relay->inFd, relay->buffer, RELAY_BUFFER_SIZE);
+    if (size <= 0)
+      return size;
+    relay->bufferBegin = 0;
+    relay->bufferEnd = (size_t)size;
+    relay_inspect(relay, relay->buffer, (size_t)size);
+  }
+
+  const size_t available = relay->bufferEnd - relay->bufferBegin;
+  const ssize_t size = write(relay->outFd, relay->buffer + relay->bufferBegin, available < maxSize ? available : maxSize);
+  if (size > 0)
+    relay->bufferBegin += (size_t)size;
+  return size;
+}
+
+// The pipe is read directly in the buffers of the writer.
+static ssize_t relay_write_file (Relay *relay, size_t maxSize) {
+  size_t capacity;
+  char *buf = file_writer_get_buffer(relay->fileWriter, &capacity);
+  if (!buf)
+    return -1;
+
+  const ssize_t size = read(relay->inFd, buf, capacity < maxSize ? capacity : maxSize);
+  if (size <= 0)
+    return size;
+
+  relay_inspect(relay, buf, (size_t)size);
+  return file_writer_commit(relay->fileWriter, (size_t)size) < 0 ? -1 : size;
+}
+
+// Returns the count of forwarded bytes, 0 at the end of the input
+// or -1 with errno set to EAGAIN if the input is empty or the output is full.
+static ssize_t relay_transfer (Relay *relay) {
+  const size_t maxSize = relay_get_allowance(relay, RELAY_CHUNK_SIZE);
+  if (!maxSize)
+    return -1;
+
+  if (relay->fileWriter)
+    return relay_write_file(relay, maxSize);
+
+  if (relay->useSplice) {
+    const ssize_t size = splice(
+      relay->inFd, NULL, relay->outFd, NULL, maxSize, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE
+    );
+    if (size >= 0 || errno != EINVAL)
+      return size;
+
+    syslog(LOG_INFO, "Stream %d does not support splice, using a buffer.", relay->streamFd);
+    relay->useSplice = false;
+  }
+
+  return relay_copy(relay, maxSize);
+}
+
+static int relay_run (Relay *relay) {
+  bool waitInput = true;
+  for (;;) {
+    const RelayRequest request = relay_get_request(relay);
+    if (request == RelayRequestAbort)
+      return 0;
+
+    // The emus have completed: in save mode, all their data is in the pipe.
+    if (
+      request == RelayRequestFinish &&
+      (relay->direction == RelayDirectionRestore || (relay->bufferBegin == relay->bufferEnd && relay_pipe_is_empty(relay)))
+    )
+      return 0;
+
+    struct pollfd pfd = waitInput
+      ? (struct pollfd){ .fd = relay->inFd, .events = POLLIN }
+      : (struct pollfd){ .fd = relay->outFd, .events = POLLOUT };
+
+    const int ret = poll(&pfd, 1, RELAY_POLL_INTERVAL);
+    if (ret == 0)
+      continue;
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+
+    ssize_t size;
+    while ((size = relay_transfer(relay)) > 0)
+      relay_account(relay, (size_t)size);
+
+    if (size == 0)
+      return 0; // End of input.
+    if (errno == EINTR)
+      continue;
+    if (errno != EAGAIN)
+      return errno;
+
+    if (relay->throttleDelay) {
+      poll(NULL, 0, relay->throttleDelay);
+      relay->throttleDelay = 0;
+      continue;
+    }
+
+    // One of both sides is not ready, try the other one.
+    waitInput = !waitInput;
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+// The stream is the input on restore and the output on save.
+static ssize_t relay_read_input (Relay *relay, char *buf, size_t size) {
+  return relay->striper && relay->direction == RelayDirectionRestore
+    ? striper_read(relay->striper, buf, size)
+    : read(relay->inFd, buf, size);
+}
+
+static ssize_t relay_write_output (Relay *relay, const char *data, size_t size) {
+  if (!(size = relay_get_allowance(relay, size)))
+    return -1;
+
+  if (relay->fileWriter)
+    return file_writer_write(relay->fileWriter, data, size);
+
+  return relay->striper && relay->direction == RelayDirectionSave
+    ? striper_write(relay->striper, data, size)
+    : write(relay->outFd, data, size);
+}
+
+static nfds_t relay_get_stream_pollfds (const Relay *relay, struct pollfd *pfds) {
+  if (relay->striper)
+    return striper_get_pollfds(relay->striper, pfds);
+
+  *pfds = relay->direction == RelayDirectionSave
+    ? (struct pollfd){ .fd = relay->outFd, .events = POLLOUT }
+    : (struct pollfd){ .fd = relay->inFd, .events = POLLIN };
+  return 1;
+}
+
+static nfds_t relay_get_pipe_pollfd (const Relay *relay, struct pollfd *pfd) {
+  *pfd = (struct pollfd){
+    .fd = relay->pipeFd,
+    .events = relay->direction == RelayDirectionSave ? POLLIN : POLLOUT
+  };
+  return 1;
+}
+
+// Returns 1 when the end frame is read.
+static int relay_read_frames (Relay *relay, bool *isInputEmpty) {
+  Compressor *compressor = relay->compressor;
+  for (;;) {
+    char *buf;
+    size_t capacity;
+    if (!compressor_has_input(compressor)) {
+      buf = relay->header + relay->headerSize;
+      capacity = CODEC_FRAME_HEADER_SIZE - relay->headerSize;
+    } else
+      buf = compressor_get_input(compressor, &capacity);
+
+    if (capacity) {
+      const ssize_t size = relay_read_input(relay, buf, capacity);
+      if (size == 0) {
+        syslog(LOG_ERR, "Compressed stream %d ends before its end frame.", relay->streamFd);
+        return -EPIPE;
+      }
+      if (size < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN) {
+          *isInputEmpty = true;
+          return 0;
+        }
+        return -errno;
+      }
+
+      if (compressor_has_input(compressor)) {
+        compressor_fill(compressor, (size_t)size);
+        continue;
+      }
+      relay->headerSize += (size_t)size;
+      if (relay->headerSize < CODEC_FRAME_HEADER_SIZE)
+        continue;
+    }
+
+    // The header is kept until a chunk is free.
+    if (compressor_is_full(compressor))
+      return 0;
+
+    CodecFrameHeader header;
+    if (codec_read_frame_header(relay->header, &header) < 0) {
+      syslog(LOG_ERR, "Invalid frame header in compressed stream %d.", relay->streamFd);
+      return -EBADMSG;
+    }
+    relay->headerSize = 0;
+
+    if (codec_frame_is_end(&header))
+      return 1;
+    if (compressor_set_frame(compressor, &header) < 0)
+      return -EmuError;
+  }
+}
+
+static int relay_read_chunks (Relay *relay, bool *isInputEmpty) {
+  Compressor *compressor = relay->compressor;
+
+  char *buf;
+  size_t capacity;
+  while ((buf = compressor_get_input(compressor, &capacity))) {
+    const ssize_t size = read(relay->inFd, buf, capacity);
+    if (size == 0)
+      return 1;
+    if (size < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN) {
+        *isInputEmpty = true;
+        return 0;
+      }
+      return -errno;
+    }
+    relay_inspect(relay, buf, (size_t)size);
+    compressor_fill(compressor, (size_t)size);
+  }
+  return 0;
+}
+
+// Same as relay_run with a compressor between the input and the output.
+static int relay_run_compressor (Relay *relay) {
+  Compressor *compressor = relay->compressor;
+  const bool isSave = relay->direction == RelayDirectionSave;
+
+  char endFrame[CODEC_FRAME_HEADER_SIZE];
+  codec_write_frame_header(endFrame, &(CodecFrameHeader){ .codec = CodecIdNone });
+  size_t endFrameBegin = 0;
+
+  bool isInputEnd = false;
+  for (;;) {
+    const RelayRequest request = relay_get_request(relay);
+    if (request == RelayRequestAbort || (request == RelayRequestFinish && !isSave))
+      return 0;
+    if (request == RelayRequestFinish && !isInputEnd && relay_pipe_is_empty(relay)) {
+      isInputEnd = true;
+      compressor_flush(compressor);
+    }
+
+    // 1. Write the processed chunks in order, then the end frame.
+    bool isOutputFull = false;
+    for (;;) {
+      const char *data;
+      size_t size;
+      if (compressor_get_output(compressor, &data, &size) < 0)
+        return EmuError;
+
+      const bool isEndFrame = !data;
+      if (isEndFrame) {
+        if (!isSave || !isInputEnd || !compressor_is_empty(compressor))
+          break;
+
+        if (endFrameBegin == sizeof endFrame) {
+          // Only the striped chunks can remain.
+          if (!relay->striper || striper_flush(relay->striper) == 0)
+            return 0;
+          if (errno != EAGAIN)
+            return errno;
+          isOutputFull = true;
+          break;
+        }
+
+        data = endFrame + endFrameBegin;
+        size = sizeof endFrame - endFrameBegin;
+      }
+
+      const ssize_t ret = relay_write_output(relay, data, size);
+      if (ret < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno != EAGAIN)
+          return errno;
+        isOutputFull = true;
+        break;
+      }
+      relay_account(relay, (size_t)ret);
+
+      if (isEndFrame)
+        endFrameBegin += (size_t)ret;
+      else {
+        if (!isSave)
+          relay_inspect(relay, data, (size_t)ret);
+        compressor_consume_output(compressor, (size_t)ret);
+      }
+    }
+
+    // The striped chunks are not waiting for the next write.
+    if (!isOutputFull && isSave && relay->striper && striper_flush(relay->striper) < 0) {
+      if (errno != EAGAIN)
+        return errno;
+      isOutputFull = true;
+    }
+
+    if (!isSave && isInputEnd && compressor_is_empty(compressor))
+      return 0;
+
+    // 2. Fill the free chunks.
+    bool isInputEmpty = false;
+    if (!isInputEnd) {
+      const int ret = isSave ? relay_read_chunks(relay, &isInputEmpty) : relay_read_frames(relay, &isInputEmpty);
+      if (ret < 0)
+        return -ret;
+      isInputEnd = ret > 0;
+    }
+
+    // Small chunks are sent only if there is nothing else to do,
+    // to keep a good ratio when the emus are faster than the link.
+    if (isSave && (isInputEnd || (isInputEmpty && compressor_is_idle(compressor))))
+      compressor_flush(compressor);
+
+    // 3. Wait for the workers, the input or the output.
+    struct pollfd pfds[RELAY_MAX_STREAM_FDS + 2];
+    nfds_t nfds = 0;
+    pfds[nfds++] = (struct pollfd){ .fd = compressor_get_event_fd(compressor), .events = POLLIN };
+    if (isInputEmpty)
+      nfds += isSave ? relay_get_pipe_pollfd(relay, pfds + nfds) : relay_get_stream_pollfds(relay, pfds + nfds);
+    if (isOutputFull && !relay->throttleDelay)
+      nfds += isSave ? relay_get_stream_pollfds(relay, pfds + nfds) : relay_get_pipe_pollfd(relay, pfds + nfds);
+
+    // Nothing to wait if the workers have just been fed with a flushed chunk
+    // or if the end frame can be written.
+    int timeout = isInputEmpty || isOutputFull || !compressor_is_idle(compressor) ? RELAY_POLL_INTERVAL : 0;
+    if (relay->throttleDelay) {
+      timeout = relay->throttleDelay;
+      relay->throttleDelay = 0;
+    }
+
+    const int ret = poll(pfds, nfds, timeout);
+    if (ret < 0 && errno != EINTR)
+      return errno;
+    if (ret > 0 && (pfds[0].revents & POLLIN))
+      compressor_clear_event(compressor);
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+static void *relay_thread (void *userData) {
+  Relay *relay = userData;
+
+  int error = relay->compressor ? relay_run_compressor(relay) : relay_run(relay);
+  if (
+    !error &&
+    relay->fileWriter &&
+    relay_get_request(relay) != RelayRequestAbort &&
+    file_writer_finish(relay->fileWriter) < 0
+  )
+    error = errno;
+  if (error)
+    syslog(LOG_ERR, "Failed to forward stream %d: `%s`.", relay->streamFd, strerror(error));
+
+  // In save mode, the emus get EPIPE instead of being blocked on a full pipe.
+  if (xcp_fd_close(relay->pipeFd) == XCP_ERR_ERRNO)
+    syslog(LOG_ERR, "Failed to close relay pipe of stream %d: `%s`.", relay->streamFd, strerror(errno));
+
+  free(relay->buffer);
+  relay->buffer = NULL;
+
+  pthread_mutex_lock(&relay->mutex);
+  relay->error = error;
+  pthread_mutex_unlock(&relay->mutex);
+
+  const uint64_t value = 1;
+  if (error && write(relay->eventFd, &value, sizeof value) < 0)
+    syslog(LOG_ERR, "Failed to notify relay error of stream %d: `%s`.", relay->streamFd, strerror(errno));
+
+  return NULL;
+}
+
+// =============================================================================
+// Migration thread.
+// =============================================================================
+
+static int relay_set_nonblocking (int fd) {
+  const int flags = fcntl(fd, F_GETFL);
+  return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+bool relay_can_restore (int count) {
+  return count > 1 || compressor_get_codec() || compressor_is_checksum_enabled();
+}
+
+int relay_create (Relay **relay, const int *streamFds, int count, RelayDirection direction, const RelayHooks *hooks, int *emuFd) {
+  assert(count > 0 && count <= RELAY_MAX_STREAM_FDS);
+  assert(direction == RelayDirectionSave || relay_can_restore(count));
+  const int streamFd = streamFds[0];
+
+  int pipeFds[2];
+  if (pipe2(pipeFds, O_CLOEXEC) < 0) {
+    syslog(LOG_ERR, "Failed to create relay pipe of stream %d: `%s`.", streamFd, strerror(errno));
+    EmuError = errno;
+    return -1;
+  }
+
+  // Not fatal, the default size is only slower.
+  if (fcntl(pipeFds[0], F_SETPIPE_SZ, RELAY_PIPE_SIZE) < 0)
+    syslog(LOG_DEBUG, "Failed to resize relay pipe of stream %d: `%s`.", streamFd, strerror(errno));
+
+  Relay *newRelay = arena_alloc(sizeof *newRelay);
+  if (!newRelay) {
+    syslog(LOG_ERR, "Failed to allocate relay of stream %d.", streamFd);
+    EmuError = errno;
+    xcp_fd_close(pipeFds[0]);
+    xcp_fd_close(pipeFds[1]);
+    return -1;
+  }
+  pthread_mutex_init(&newRelay->mutex, NULL);
+  rate_limiter_init(&newRelay->limiter);
+
+  newRelay->direction = direction;
+  if (hooks)
+    newRelay->hooks = *hooks;
+  newRelay->streamFd = streamFd;
+  newRelay->useSplice = !newRelay->hooks.onData;
+
+  if ((newRelay->eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+    syslog(LOG_ERR, "Failed to create relay event of stream %d: `%s`.", streamFd, strerror(errno));
+    EmuError = errno;
+    goto fail;
+  }
+
+  for (; newRelay->streamFdsCount < count; ++newRelay->streamFdsCount) {
+    const int fd = streamFds[newRelay->streamFdsCount];
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+      syslog(LOG_ERR, "Failed to configure relay of stream %d: `%s`.", fd, strerror(errno));
+      EmuError = errno;
+      goto fail;
+    }
+    newRelay->streamFds[newRelay->streamFdsCount] = fd;
+    newRelay->streamFlags[newRelay->streamFdsCount] = flags;
+  }
+
+  if (direction == RelayDirectionSave) {
+    newRelay->pipeFd = newRelay->inFd = pipeFds[0];
+    newRelay->outFd = streamFd;
+    *emuFd = pipeFds[1];
+  } else {
+    newRelay->inFd = streamFd;
+    newRelay->pipeFd = newRelay->outFd = pipeFds[1];
+    *emuFd = pipeFds[0];
+  }
+
+  if (relay_set_nonblocking(newRelay->pipeFd) < 0) {
+    syslog(LOG_ERR, "Failed to configure relay pipe of stream %d: `%s`.", streamFd, strerror(errno));
+    EmuError = errno;
+    goto fail;
+  }
+
+  // The codec of the restored frames is read from the stream.
+  // Striped chunks and checksums are built by the compressor, so it is
+  // always used with them, if necessary without codec.
+  const Codec *codec = compressor_get_codec();
+  if (!codec && (count > 1 || compressor_is_checksum_enabled()))
+    codec = codec_from_id(CodecIdNone);
+  if (codec && compressor_create(&newRelay->compressor, codec, compressor_get_threads(), direction == RelayDirectionSave) < 0)
+    goto fail;
+
+  if (count > 1 && striper_create(&newRelay->striper, streamFds, count, direction == RelayDirectionSave) < 0)
+    goto fail;
+
+  struct stat buf;
+  if (
+    direction == RelayDirectionSave &&
+    file_writer_is_enabled() &&
+    count == 1 &&
+    fstat(streamFd, &buf) == 0 &&
+    S_ISREG(buf.st_mode) &&
+    file_writer_create(&newRelay->fileWriter, streamFd) < 0
+  )
+    goto fail;
+
+  const int error = pthread_create(&newRelay->thread, NULL, relay_thread, newRelay);
+  if (error) {
+    syslog(LOG_ERR, "Failed to create relay thread of stream %d: `%s`.", streamFd, strerror(error));
+    EmuError = error;
+    goto fail;
+  }
+
+  syslog(LOG_INFO, "Relaying stream %d (%s).", streamFd, direction == RelayDirectionSave ? "save" : "restore");
+  *relay = newRelay;
+  return 0;
+
+fail:
+  if (newRelay->fileWriter)
+    file_writer_destroy(newRelay->fileWriter);
+  if (newRelay->striper)
+    striper_destroy(newRelay->striper);
+  if (newRelay->compressor)
+    compressor_destroy(newRelay->compressor);
+  for (int i = 0; i < newRelay->streamFdsCount; ++i)
+    fcntl(newRelay->streamFds[i], F_SETFL, newRelay->streamFlags[i]);
+  if (newRelay->eventFd > -1)
+    xcp_fd_close(newRelay->eventFd);
+  rate_limiter_destroy(&newRelay->limiter);
+  pthread_mutex_destroy(&newRelay->mutex);
+  xcp_fd_close(pipeFds[0]);
+  xcp_fd_close(pipeFds[1]);
+  return -1;
+}
+
+static void relay_join (Relay *relay, RelayRequest request) {
+  if (relay->isJoined)
+    return;
+
+  pthread_mutex_lock(&relay->mutex);
+  relay->request = request;
+  pthread_mutex_unlock(&relay->mutex);
+
+  pthread_join(relay->thread, NULL);
+  relay->isJoined = true;
+
+  RelayStats stats;
+  relay_get_stats(relay, &stats);
+  syslog(
+    LOG_INFO, "Relayed %" PRIu64 " bytes of stream %d in %" PRId64 " ms (%.1f MiB/s).",
+    stats.bytes, relay->streamFd, stats.duration / 1000, stats.throughput / (1024 * 1024)
+  );
+
+  if (relay->compressor) {
+    CompressorStats compressorStats;
+    compressor_get_stats(relay->compressor, &compressorStats);
+    syslog(
+      LOG_INFO, "Compression of stream %d: %" PRIu64 " frame(s), %" PRIu64 " raw, %" PRIu64 " -> %" PRIu64 " bytes.",
+      relay->streamFd, compressorStats.frames, compressorStats.rawFrames, compressorStats.rawBytes, compressorStats.dataBytes
+    );
+  }
+}
+
+int relay_finish (Relay *relay) {
+  relay_join(relay, RelayRequestFinish);
+
+  if (relay->error) {
+    EmuError = relay->error;
+    return -1;
+  }
+  return 0;
+}
+
+void relay_destroy (Relay *relay) {
+  relay_join(relay, RelayRequestAbort);
+  xcp_fd_close(relay->eventFd);
+  rate_limiter_destroy(&relay->limiter);
+  pthread_mutex_destroy(&relay->mutex);
+  if (relay->compressor)
+    compressor_destroy(relay->compressor);
+  if (relay->striper)
+    striper_destroy(relay->striper);
+  if (relay->fileWriter)
+    file_writer_destroy(relay->fileWriter);
+
+  for (int i = 0; i < relay->streamFdsCount; ++i) {
+    const int fd = relay->streamFds[i];
+    if (fcntl(fd, F_SETFL, relay->streamFlags[i]) < 0)
+      syslog(LOG_ERR, "Failed to restore flags of stream %d: `%s`.", fd, strerror(errno));
+
+    syslog(LOG_DEBUG, "Closing relayed stream %d...", fd);
+    if (xcp_fd_close(fd) == XCP_ERR_ERRNO)
+      syslog(LOG_ERR, "Failed to close relayed stream %d: `%s`.", fd, strerror(errno));
+  }
+}
+
+int relay_get_event_fd (const Relay *relay) {
+  return relay->eventFd;
+}
+
+int relay_get_error (Relay *relay) {
+  pthread_mutex_lock(&relay->mutex);
+  const int error = relay->error;
+  pthread_mutex_unlock(&relay->mutex);
+  return error;
+}
+
+void relay_set_rate_limit (Relay *relay, int64_t rate) {
+  rate_limiter_set_rate(&relay->limiter, rate);
+}
+
+void relay_get_stats (Relay *relay, RelayStats *stats) {
+  pthread_mutex_lock(&relay->mutex);
+  stats->bytes = relay->bytes;
+  stats->duration = relay->lastTime - relay->startTime;
+  pthread_mutex_unlock(&relay->mutex);
+
+  stats->throughput = stats->duration > 0 ? (double)stats->bytes * 1e6 / (double)stats->duration : 0.0;
+}
@@ -0,0 +1,92 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _RELAY_H_
+#define _RELAY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// =============================================================================
+// Optional relay between the emus and a stream fd: the emus use one end of a
+// pipe and a dedicated thread forwards the data to the real stream (save) or
+// from it (restore) with splice(). So emu-manager sees every byte of the
+// migration stream.
+// A restore relay reads the stream up to its end frame, see: codec.h. Without
+// frames, it would read ahead of the emus the data of xenopsd.
+// =============================================================================
+
+// Streams with several fds are striped, see: striper.h.
+#define RELAY_MAX_STREAM_FDS 8
+
+typedef enum RelayDirection {
+  RelayDirectionSave,   // Pipe -> stream.
+  RelayDirectionRestore // Stream -> pipe.
+} RelayDirection;
+
+// Called by the relay thread after each forwarded chunk.
+// onData gets the raw stream, before compression on save and after
+// decompression on restore. splice() is not used with it.
+typedef struct RelayHooks {
+  void (*onTransfer)(void *userData, size_t size);
+  void (*onData)(void *userData, const char *data, size_t size);
+  void *userData;
+} RelayHooks;
+
+typedef struct RelayStats {
+  uint64_t bytes;
+  int64_t duration; // In us, from the first forwarded byte.
+  double throughput; // In bytes/s.
+} RelayStats;
+
+typedef struct Relay Relay;
+
+// -----------------------------------------------------------------------------
+
+// Per migration, see: daemon.c.
+void relay_enable ();
+bool relay_is_enabled ();
+
+// Restore streams can be relayed only if they are framed: compressed, with
+// checksums or striped.
+bool relay_can_restore (int count);
+
+// Take the ownership of the stream fds and start the relay thread.
+// emuFd receives the pipe end to give to the emus.
+int relay_create (Relay **relay, const int *streamFds, int count, RelayDirection direction, const RelayHooks *hooks, int *emuFd);
+
+// Save: wait until all the data written by the emus is forwarded.
+// Restore: stop reading the stream.
+// The emus must have completed their migration.
+int relay_finish (Relay *relay);
+
+// Stop the relay thread if necessary and close the stream.
+void relay_destroy (Relay *relay);
+
+// Readable when the relay thread has failed, see: relay_get_error.
+int relay_get_event_fd (const Relay *relay);
+int relay_get_error (Relay *relay);
+
+// Limit of the forwarded bytes in bytes/s, 0 for no limit.
+// Can be changed while the relay is running.
+void relay_set_rate_limit (Relay *relay, int64_t rate);
+
+void relay_get_stats (Relay *relay, RelayStats *stats);
+
+#endif // ifndef _RELAY_H_
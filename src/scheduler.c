@@ -0,0 +1,276 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <xcp-ng/generic.h>
+
+#include "emu.h"
+#include "logger.h"
+#include "scheduler.h"
+
+// =============================================================================
+
+typedef struct SchedulerSlot {
+  struct SchedulerSlot *nextWaiting; // In the admission queue.
+  struct SchedulerSlot *next; // In the pause queue.
+
+  int admissionFd; // Written when a queued migration is admitted.
+  bool isWaiting;
+  bool isAdmitted;
+
+  int pauseFd; // Written when a queued pause is granted.
+  bool isQueued;
+  bool hasPause;
+} SchedulerSlot;
+
+static struct {
+  bool isEnabled;
+  int maxMigrations;
+  int maxPauses;
+  int64_t bandwidth;
+
+  pthread_mutex_t mutex;
+
+  int migrations;
+  int pauses;
+  SchedulerSlot *admissionQueue; // FIFO.
+  SchedulerSlot *pauseQueue; // FIFO.
+} Scheduler = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+// Slot of the migration run by the current thread.
+static __thread SchedulerSlot *Slot;
+
+// -----------------------------------------------------------------------------
+
+static void scheduler_notify (int fd, const char *label) {
+  const uint64_t value = 1;
+  if (write(fd, &value, sizeof value) < 0)
+    syslog(LOG_ERR, "Failed to notify %s: `%s`.", label, strerror(errno));
+}
+
+static void scheduler_consume (int fd) {
+  uint64_t value;
+  if (read(fd, &value, sizeof value) < 0 && errno != EAGAIN)
+    syslog(LOG_ERR, "Failed to read scheduler eventfd: `%s`.", strerror(errno));
+}
+
+// Must be called with the lock.
+static void scheduler_grant_admissions () {
+  while (
+    Scheduler.admissionQueue &&
+    (!Scheduler.maxMigrations || Scheduler.migrations < Scheduler.maxMigrations)
+  ) {
+    SchedulerSlot *slot = Scheduler.admissionQueue;
+    Scheduler.admissionQueue = slot->nextWaiting;
+
+    slot->nextWaiting = NULL;
+    slot->isWaiting = false;
+    slot->isAdmitted = true;
+    ++Scheduler.migrations;
+
+    scheduler_notify(slot->admissionFd, "admitted migration");
+  }
+}
+
+// Must be called with the lock.
+static void scheduler_grant_pauses () {
+  while (Scheduler.pauseQueue && Scheduler.pauses < Scheduler.maxPauses) {
+    SchedulerSlot *slot = Scheduler.pauseQueue;
+    Scheduler.pauseQueue = slot->next;
+
+    slot->next = NULL;
+    slot->isQueued = false;
+    slot->hasPause = true;
+    ++Scheduler.pauses;
+
+    scheduler_notify(slot->pauseFd, "granted pause");
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+int scheduler_configure (int maxMigrations, int maxPauses, int64_t bandwidth) {
+  if (maxMigrations < 0 || maxPauses < 0 || bandwidth < 0) {
+    syslog(LOG_ERR, "Invalid scheduler limits.");
+    EmuError = EINVAL;
+    return -1;
+  }
+
+  Scheduler.isEnabled = true;
+  Scheduler.maxMigrations = maxMigrations;
+  Scheduler.maxPauses = maxPauses;
+  Scheduler.bandwidth = bandwidth;
+
+  syslog(LOG_INFO, "Scheduler: %d migration(s), %d pause(s), %" PRId64 " bytes/s. (0 = unlimited)",
+    maxMigrations, maxPauses, bandwidth
+  );
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+int scheduler_admit () {
+  if (!Scheduler.isEnabled)
+    return 1;
+  assert(!Slot);
+
+  SchedulerSlot *slot = calloc(1, sizeof *slot);
+  if (!slot) {
+    syslog(LOG_ERR, "Failed to allocate scheduler slot.");
+    EmuError = errno;
+    return -1;
+  }
+
+  if ((slot->admissionFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+    syslog(LOG_ERR, "Failed to create admission eventfd: `%s`.", strerror(errno));
+    EmuError = errno;
+    free(slot);
+    return -1;
+  }
+
+  if ((slot->pauseFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+    syslog(LOG_ERR, "Failed to create pause eventfd: `%s`.", strerror(errno));
+    EmuError = errno;
+    xcp_fd_close(slot->admissionFd);
+    free(slot);
+    return -1;
+  }
+
+  pthread_mutex_lock(&Scheduler.mutex);
+
+  SchedulerSlot **it = &Scheduler.admissionQueue;
+  while (*it)
+    it = &(*it)->nextWaiting;
+  *it = slot;
+  slot->isWaiting = true;
+  scheduler_grant_admissions();
+
+  const bool isAdmitted = slot->isAdmitted;
+  if (!isAdmitted)
+    syslog(LOG_INFO, "Waiting for a migration slot... (%d running)", Scheduler.migrations);
+  pthread_mutex_unlock(&Scheduler.mutex);
+
+  // Consume the notification, the migration is admitted now.
+  if (isAdmitted)
+    scheduler_consume(slot->admissionFd);
+
+  Slot = slot;
+  return isAdmitted;
+}
+
+int scheduler_get_admission_fd () {
+  assert(Slot);
+  return Slot->admissionFd;
+}
+
+void scheduler_leave () {
+  if (!Slot)
+    return;
+
+  scheduler_release_pause();
+
+  pthread_mutex_lock(&Scheduler.mutex);
+  if (Slot->isWaiting) {
+    SchedulerSlot **it = &Scheduler.admissionQueue;
+    while (*it != Slot)
+      it = &(*it)->nextWaiting;
+    *it = Slot->nextWaiting;
+  } else if (Slot->isAdmitted) {
+    --Scheduler.migrations;
+    scheduler_grant_admissions();
+  }
+  pthread_mutex_unlock(&Scheduler.mutex);
+
+  xcp_fd_close(Slot->admissionFd);
+  xcp_fd_close(Slot->pauseFd);
+  free(Slot);
+  Slot = NULL;
+}
+
+// -----------------------------------------------------------------------------
+
+int64_t scheduler_get_bandwidth () {
+  if (!Slot || !Slot->isAdmitted || !Scheduler.bandwidth)
+    return 0;
+
+  pthread_mutex_lock(&Scheduler.mutex);
+  const int64_t bandwidth = Scheduler.bandwidth / Scheduler.migrations;
+  pthread_mutex_unlock(&Scheduler.mutex);
+
+  return bandwidth;
+}
+
+// -----------------------------------------------------------------------------
+
+int scheduler_request_pause () {
+  if (!Slot || !Scheduler.maxPauses)
+    return 1;
+  assert(!Slot->isQueued && !Slot->hasPause);
+
+  pthread_mutex_lock(&Scheduler.mutex);
+
+  SchedulerSlot **it = &Scheduler.pauseQueue;
+  while (*it)
+    it = &(*it)->next;
+  *it = Slot;
+  Slot->isQueued = true;
+  scheduler_grant_pauses();
+
+  const bool hasPause = Slot->hasPause;
+  pthread_mutex_unlock(&Scheduler.mutex);
+
+  // Consume the notification, the pause is granted now.
+  if (hasPause)
+    scheduler_consume(Slot->pauseFd);
+
+  return hasPause;
+}
+
+int scheduler_get_pause_fd () {
+  assert(Slot);
+  return Slot->pauseFd;
+}
+
+void scheduler_release_pause () {
+  if (!Slot)
+    return;
+
+  pthread_mutex_lock(&Scheduler.mutex);
+  if (Slot->isQueued) {
+    SchedulerSlot **it = &Scheduler.pauseQueue;
+    while (*it != Slot)
+      it = &(*it)->next;
+    *it = Slot->next;
+    Slot->next = NULL;
+    Slot->isQueued = false;
+  } else if (Slot->hasPause) {
+    Slot->hasPause = false;
+    --Scheduler.pauses;
+    scheduler_grant_pauses();
+  }
+  pthread_mutex_unlock(&Scheduler.mutex);
+}
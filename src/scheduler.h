@@ -0,0 +1,52 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// =============================================================================
+// Host-level scheduling of the save migrations run by the daemon:
+// - A bounded count of migrations is admitted at once.
+// - The aggregate bandwidth is split across the admitted migrations.
+// - Pause phases (stop-and-copy) are staggered to bound the concurrent guest downtimes.
+//
+// Without configuration (one migration per process), all calls succeed immediately.
+// =============================================================================
+
+// 0 for no limit.
+int scheduler_configure (int maxMigrations, int maxPauses, int64_t bandwidth);
+
+// Called by the migration thread. Returns 1 if the migration is admitted, 0 if
+// it's queued: the admission fd is readable when a slot is free.
+// The slot is released by scheduler_leave, even if the migration is not admitted.
+int scheduler_admit ();
+int scheduler_get_admission_fd ();
+void scheduler_leave ();
+
+// Bandwidth share of the current migration in bytes/s, 0 if unlimited.
+int64_t scheduler_get_bandwidth ();
+
+// Returns 1 if the pause is granted, 0 if it's queued: the pause fd is readable
+// when it's granted.
+int scheduler_request_pause ();
+int scheduler_get_pause_fd ();
+void scheduler_release_pause ();
+
+#endif // ifndef _SCHEDULER_H_
@@ -0,0 +1,513 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "byte-order.h"
+#include "emu.h"
+#include "logger.h"
+#include "stream-inspector.h"
+
+// =============================================================================
+
+#define STREAM_IMAGE_HEADER_SIZE 24
+#define STREAM_DOMAIN_HEADER_SIZE 16
+#define STREAM_RECORD_HEADER_SIZE 8
+#define STREAM_BATCH_HEADER_SIZE 8
+#define STREAM_P2M_FRAMES_HEADER_SIZE 8
+
+#define STREAM_IMAGE_ID 0x58454E46 // "XENF"
+#define STREAM_IMAGE_OPTION_BIG_ENDIAN (1 << 0)
+
+#define STREAM_RECORD_OPTIONAL 0x80000000u
+
+// Bits 60-63 of a PAGE_DATA pfn: XEN_DOMCTL_PFINFO_* >> 28.
+#define STREAM_PFN_MASK 0x000FFFFFFFFFFFFFull
+#define STREAM_PFN_TYPE_SHIFT 60
+#define STREAM_PFN_TYPE_BROKEN 0xD
+#define STREAM_PFN_TYPE_XALLOC 0xE
+#define STREAM_PFN_TYPE_XTAB 0xF
+
+// libxc sends at most 1024 pfns per batch.
+#define STREAM_MAX_BATCH_SIZE (64 * 1024)
+
+// Bitmap of the sent pfns used to count the duplicates, 32 MiB with 1 TiB of
+// guest memory. Greater pfns are counted as unique.
+#define STREAM_MAX_TRACKED_PFNS (1ull << 28)
+
+// In bytes, granularity of the early exit of the zero page check.
+#define STREAM_ZERO_CHECK_BLOCK 256
+
+typedef enum StreamInspectorState {
+  StreamInspectorStateImageHeader,
+  StreamInspectorStateDomainHeader,
+  StreamInspectorStateRecordHeader,
+  StreamInspectorStateBatchHeader,
+  StreamInspectorStatePfns,
+  StreamInspectorStatePages,
+  StreamInspectorStateP2mFrames,
+  StreamInspectorStateBody, // Skipped, padding included.
+  StreamInspectorStateEnd // After the END record or an invalid record.
+} StreamInspectorState;
+
+struct StreamInspector {
+  int fd;
+  StreamInspectorState state;
+
+  // Fixed-size part being read: a header or the pfns of a batch.
+  char header[STREAM_IMAGE_HEADER_SIZE];
+  char *part;
+  size_t partSize;
+  size_t partOffset;
+
+  int recordSlot; // Index in recordBytes, -1 outside of the records.
+  uint32_t recordLength;
+  uint64_t recordRemaining; // Padding included.
+
+  // Current batch.
+  char *pfns;
+  size_t pfnsCapacity;
+  uint32_t pagesRemaining;
+  uint32_t pageOffset;
+  bool isZeroPage;
+
+  uint64_t *sentPfns;
+  uint64_t sentPfnsWords;
+
+  StreamInspectorStats stats; // Owned by the feeding thread.
+
+  pthread_mutex_t mutex;
+  StreamInspectorStats sharedStats;
+};
+
+// See: xg_sr_stream_format.h in Xen.
+static const char *RecordTypes[STREAM_RECORD_TYPES_COUNT] = {
+  "END",
+  "PAGE_DATA",
+  "X86_PV_INFO",
+  "X86_PV_P2M_FRAMES",
+  "X86_PV_VCPU_BASIC",
+  "X86_PV_VCPU_EXTENDED",
+  "X86_PV_VCPU_XSAVE",
+  "SHARED_INFO",
+  "X86_TSC_INFO",
+  "HVM_CONTEXT",
+  "HVM_PARAMS",
+  "TOOLSTACK",
+  "X86_PV_VCPU_MSRS",
+  "VERIFY",
+  "CHECKPOINT",
+  "CHECKPOINT_DIRTY_PFN_LIST",
+  "STATIC_DATA_END",
+  "X86_CPUID_POLICY",
+  "X86_MSR_POLICY",
+  "unknown"
+};
+
+// Per migration, see: daemon.c.
+static __thread bool IsEnabled;
+
+// =============================================================================
+
+void stream_inspector_enable () {
+  IsEnabled = true;
+}
+
+bool stream_inspector_is_enabled () {
+  return IsEnabled;
+}
+
+const char *stream_inspector_record_type_to_str (int type) {
+  return type >= 0 && type < STREAM_RECORD_TYPES_COUNT ? RecordTypes[type] : RecordTypes[STREAM_RECORD_TYPES_COUNT - 1];
+}
+
+// -----------------------------------------------------------------------------
+
+static inline uint32_t stream_read_be32 (const char *buf) {
+  const unsigned char *bytes = (const unsigned char *)buf;
+  return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+}
+
+// The broken, unallocated and invalid pfns of a batch have no page.
+static inline bool stream_pfn_has_data (uint64_t pfn) {
+  const uint64_t type = pfn >> STREAM_PFN_TYPE_SHIFT;
+  return type != STREAM_PFN_TYPE_BROKEN && type != STREAM_PFN_TYPE_XALLOC && type != STREAM_PFN_TYPE_XTAB;
+}
+
+static bool stream_is_zero (const char *data, size_t size) {
+  size_t i = 0;
+  while (i + STREAM_ZERO_CHECK_BLOCK <= size) {
+    uint64_t value = 0;
+    for (size_t end = i + STREAM_ZERO_CHECK_BLOCK; i < end; i += sizeof value) {
+      uint64_t word;
+      memcpy(&word, data + i, sizeof word);
+      value |= word;
+    }
+    if (value)
+      return false;
+  }
+
+  for (; i < size; ++i)
+    if (data[i])
+      return false;
+  return true;
+}
+
+static void stream_inspector_stop (StreamInspector *inspector, const char *reason) {
+  syslog(LOG_WARNING, "Stream %d: %s, the remaining data is not inspected.", inspector->fd, reason);
+  inspector->state = StreamInspectorStateEnd;
+  inspector->recordSlot = -1;
+}
+
+static void stream_inspector_read_part (StreamInspector *inspector, StreamInspectorState state, char *part, size_t size) {
+  inspector->state = state;
+  inspector->part = part;
+  inspector->partSize = size;
+  inspector->partOffset = 0;
+}
+
+static void stream_inspector_skip_record (StreamInspector *inspector) {
+  inspector->state = StreamInspectorStateBody;
+}
+
+// Returns false if the pfn was already sent.
+static bool stream_inspector_mark_pfn (StreamInspector *inspector, uint64_t pfn) {
+  if (pfn >= STREAM_MAX_TRACKED_PFNS)
+    return true;
+
+  const uint64_t word = pfn / 64;
+  if (word >= inspector->sentPfnsWords) {
+    uint64_t count = inspector->sentPfnsWords ? inspector->sentPfnsWords : 1024;
+    while (count <= word)
+      count *= 2;
+
+    uint64_t *sentPfns = realloc(inspector->sentPfns, count * sizeof *sentPfns);
+    if (!sentPfns)
+      return true;
+    memset(sentPfns + inspector->sentPfnsWords, 0, (count - inspector->sentPfnsWords) * sizeof *sentPfns);
+    inspector->sentPfns = sentPfns;
+    inspector->sentPfnsWords = count;
+  }
+
+  const uint64_t bit = 1ull << (pfn % 64);
+  const bool isNew = !(inspector->sentPfns[word] & bit);
+  inspector->sentPfns[word] |= bit;
+  return isNew;
+}
+
+// -----------------------------------------------------------------------------
+
+static void stream_inspector_parse_image_header (StreamInspector *inspector) {
+  const char *header = inspector->header;
+  const uint32_t version = stream_read_be32(header + 12);
+  const uint32_t options = (uint32_t)((unsigned char)header[16] << 8 | (unsigned char)header[17]);
+  if (
+    byte_order_read_le64(header) != UINT64_MAX ||
+    stream_read_be32(header + 8) != STREAM_IMAGE_ID ||
+    version < 2 || version > 3
+  ) {
+    stream_inspector_stop(inspector, "not a libxc migration-v2 stream");
+    return;
+  }
+  if (options & STREAM_IMAGE_OPTION_BIG_ENDIAN) {
+    stream_inspector_stop(inspector, "big-endian stream");
+    return;
+  }
+
+  stream_inspector_read_part(inspector, StreamInspectorStateDomainHeader, inspector->header, STREAM_DOMAIN_HEADER_SIZE);
+}
+
+static void stream_inspector_parse_domain_header (StreamInspector *inspector) {
+  const uint32_t pageShift = byte_order_read_le32(inspector->header + 4) & 0xFFFF;
+  if (pageShift < 12 || pageShift > 21) {
+    stream_inspector_stop(inspector, "invalid page size");
+    return;
+  }
+
+  inspector->stats.pageSize = 1u << pageShift;
+  stream_inspector_read_part(inspector, StreamInspectorStateRecordHeader, inspector->header, STREAM_RECORD_HEADER_SIZE);
+}
+
+static void stream_inspector_parse_record_header (StreamInspector *inspector) {
+  StreamInspectorStats *stats = &inspector->stats;
+
+  const uint32_t type = byte_order_read_le32(inspector->header) & ~STREAM_RECORD_OPTIONAL;
+  const uint32_t length = byte_order_read_le32(inspector->header + 4);
+
+  // The header is counted in the record.
+  const int slot = type < STREAM_RECORD_TYPES_COUNT - 1 ? (int)type : STREAM_RECORD_TYPES_COUNT - 1;
+  stats->otherBytes -= STREAM_RECORD_HEADER_SIZE;
+  stats->recordBytes[slot] += STREAM_RECORD_HEADER_SIZE;
+
+  inspector->recordSlot = slot;
+  inspector->recordLength = length;
+  inspector->recordRemaining = ((uint64_t)length + 7) & ~(uint64_t)7;
+
+  if (type == STREAM_RECORD_END) {
+    stats->isComplete = true;
+    inspector->state = StreamInspectorStateEnd;
+    inspector->recordSlot = -1;
+  } else if (type == STREAM_RECORD_PAGE_DATA) {
+    if (length < STREAM_BATCH_HEADER_SIZE)
+      stream_inspector_stop(inspector, "truncated PAGE_DATA record");
+    else
+      stream_inspector_read_part(inspector, StreamInspectorStateBatchHeader, inspector->header, STREAM_BATCH_HEADER_SIZE);
+  } else if (type == STREAM_RECORD_X86_PV_P2M_FRAMES && length >= STREAM_P2M_FRAMES_HEADER_SIZE)
+    stream_inspector_read_part(inspector, StreamInspectorStateP2mFrames, inspector->header, STREAM_P2M_FRAMES_HEADER_SIZE);
+  else
+    stream_inspector_skip_record(inspector);
+}
+
+static void stream_inspector_parse_batch_header (StreamInspector *inspector) {
+  const uint32_t count = byte_order_read_le32(inspector->header);
+  if (
+    !count ||
+    count > STREAM_MAX_BATCH_SIZE ||
+    STREAM_BATCH_HEADER_SIZE + (uint64_t)count * sizeof(uint64_t) > inspector->recordLength
+  ) {
+    stream_inspector_stop(inspector, "invalid PAGE_DATA record");
+    return;
+  }
+
+  const size_t size = count * sizeof(uint64_t);
+  if (size > inspector->pfnsCapacity) {
+    char *pfns = realloc(inspector->pfns, size);
+    if (!pfns) {
+      stream_inspector_stop(inspector, "cannot allocate pfns");
+      return;
+    }
+    inspector->pfns = pfns;
+    inspector->pfnsCapacity = size;
+  }
+
+  stream_inspector_read_part(inspector, StreamInspectorStatePfns, inspector->pfns, size);
+}
+
+static void stream_inspector_parse_pfns (StreamInspector *inspector) {
+  StreamInspectorStats *stats = &inspector->stats;
+  const uint32_t count = (uint32_t)(inspector->partSize / sizeof(uint64_t));
+
+  uint32_t pages = 0;
+  for (uint32_t i = 0; i < count; ++i)
+    pages += stream_pfn_has_data(byte_order_read_le64(inspector->pfns + i * sizeof(uint64_t)));
+
+  // The pfns of an invalid batch are not marked as sent.
+  if (STREAM_BATCH_HEADER_SIZE + inspector->partSize + (uint64_t)pages * stats->pageSize != inspector->recordLength) {
+    stream_inspector_stop(inspector, "invalid PAGE_DATA record length");
+    return;
+  }
+
+  for (uint32_t i = 0; i < count; ++i) {
+    const uint64_t pfn = byte_order_read_le64(inspector->pfns + i * sizeof(uint64_t));
+    if (!stream_pfn_has_data(pfn))
+      continue;
+
+    if (stream_inspector_mark_pfn(inspector, pfn & STREAM_PFN_MASK))
+      ++stats->uniquePages;
+    else
+      ++stats->duplicatePages;
+  }
+
+  int bucket = 0;
+  for (uint32_t size = count; size > 1 && bucket < STREAM_BATCH_BUCKETS_COUNT - 1; size >>= 1)
+    ++bucket;
+  ++stats->batches;
+  ++stats->batchBuckets[bucket];
+
+  inspector->pagesRemaining = pages;
+  inspector->pageOffset = 0;
+  inspector->isZeroPage = true;
+  if (pages)
+    inspector->state = StreamInspectorStatePages;
+  else
+    stream_inspector_skip_record(inspector);
+}
+
+static void stream_inspector_parse_p2m_frames (StreamInspector *inspector) {
+  StreamInspectorStats *stats = &inspector->stats;
+
+  // The frames are sent in several records, each one with its range of pfns.
+  const uint64_t end = (uint64_t)byte_order_read_le32(inspector->header + 4) + 1;
+  if (end > stats->p2mPages)
+    stats->p2mPages = end;
+
+  stream_inspector_skip_record(inspector);
+}
+
+// -----------------------------------------------------------------------------
+
+static size_t stream_inspector_read_pages (StreamInspector *inspector, const char *data, size_t size) {
+  StreamInspectorStats *stats = &inspector->stats;
+
+  const size_t pageSize = stats->pageSize;
+  size_t used = 0;
+  while (used < size && inspector->pagesRemaining) {
+    size_t n = pageSize - inspector->pageOffset;
+    if (n > size - used)
+      n = size - used;
+
+    if (inspector->isZeroPage)
+      inspector->isZeroPage = stream_is_zero(data + used, n);
+    used += n;
+
+    inspector->pageOffset += (uint32_t)n;
+    if (inspector->pageOffset == pageSize) {
+      ++stats->pages;
+      if (inspector->isZeroPage)
+        ++stats->zeroPages;
+      --inspector->pagesRemaining;
+      inspector->pageOffset = 0;
+      inspector->isZeroPage = true;
+    }
+  }
+
+  if (!inspector->pagesRemaining)
+    stream_inspector_skip_record(inspector);
+  return used;
+}
+
+static size_t stream_inspector_read_part_data (StreamInspector *inspector, const char *data, size_t size) {
+  size_t n = inspector->partSize - inspector->partOffset;
+  if (n > size)
+    n = size;
+  memcpy(inspector->part + inspector->partOffset, data, n);
+  inspector->partOffset += n;
+  if (inspector->partOffset < inspector->partSize)
+    return n;
+
+  switch (inspector->state) {
+    case StreamInspectorStateImageHeader:
+      stream_inspector_parse_image_header(inspector);
+      break;
+    case StreamInspectorStateDomainHeader:
+      stream_inspector_parse_domain_header(inspector);
+      break;
+    case StreamInspectorStateRecordHeader:
+      stream_inspector_parse_record_header(inspector);
+      break;
+    case StreamInspectorStateBatchHeader:
+      stream_inspector_parse_batch_header(inspector);
+      break;
+    case StreamInspectorStatePfns:
+      stream_inspector_parse_pfns(inspector);
+      break;
+    case StreamInspectorStateP2mFrames:
+      stream_inspector_parse_p2m_frames(inspector);
+      break;
+    default:
+      assert(false);
+  }
+  return n;
+}
+
+// -----------------------------------------------------------------------------
+
+int stream_inspector_create (StreamInspector **inspector, int fd) {
+  StreamInspector *newInspector = calloc(1, sizeof *newInspector);
+  if (!newInspector) {
+    syslog(LOG_ERR, "Failed to allocate inspector of stream %d.", fd);
+    EmuError = errno;
+    return -1;
+  }
+
+  newInspector->fd = fd;
+  newInspector->recordSlot = -1;
+  stream_inspector_read_part(newInspector, StreamInspectorStateImageHeader, newInspector->header, STREAM_IMAGE_HEADER_SIZE);
+  pthread_mutex_init(&newInspector->mutex, NULL);
+
+  *inspector = newInspector;
+  return 0;
+}
+
+void stream_inspector_destroy (StreamInspector *inspector) {
+  const StreamInspectorStats *stats = &inspector->stats;
+
+  syslog(
+    LOG_INFO, "Stream %d: %" PRIu64 " bytes, %" PRIu64 " pages in %" PRIu64 " batches, %" PRIu64 " zero, %" PRIu64 " duplicate%s.",
+    inspector->fd, stats->bytes, stats->pages, stats->batches, stats->zeroPages, stats->duplicatePages,
+    stats->isComplete ? "" : ", END record not reached"
+  );
+  for (int i = 0; i < STREAM_RECORD_TYPES_COUNT; ++i)
+    if (stats->recordBytes[i])
+      syslog(LOG_INFO, "Stream %d: %s records: %" PRIu64 " bytes.", inspector->fd, RecordTypes[i], stats->recordBytes[i]);
+  if (stats->otherBytes)
+    syslog(LOG_INFO, "Stream %d: headers and other data: %" PRIu64 " bytes.", inspector->fd, stats->otherBytes);
+  for (int i = 0; i < STREAM_BATCH_BUCKETS_COUNT; ++i)
+    if (stats->batchBuckets[i])
+      syslog(LOG_DEBUG, "Stream %d: %" PRIu64 " batches of %d+ pages.", inspector->fd, stats->batchBuckets[i], 1 << i);
+
+  pthread_mutex_destroy(&inspector->mutex);
+  free(inspector->sentPfns);
+  free(inspector->pfns);
+  free(inspector);
+}
+
+void stream_inspector_feed (StreamInspector *inspector, const char *data, size_t size) {
+  StreamInspectorStats *stats = &inspector->stats;
+  stats->bytes += size;
+
+  while (size) {
+    // The bytes are counted in the record being read before they are parsed.
+    const int slot = inspector->recordSlot;
+
+    size_t used;
+    switch (inspector->state) {
+      case StreamInspectorStatePages:
+        used = stream_inspector_read_pages(inspector, data, size);
+        break;
+      case StreamInspectorStateBody:
+        used = inspector->recordRemaining < size ? (size_t)inspector->recordRemaining : size;
+        break;
+      case StreamInspectorStateEnd:
+        used = size;
+        break;
+      default:
+        used = stream_inspector_read_part_data(inspector, data, size);
+    }
+
+    if (slot >= 0) {
+      stats->recordBytes[slot] += used;
+      inspector->recordRemaining -= used;
+    } else
+      stats->otherBytes += used;
+
+    if (inspector->state == StreamInspectorStateBody && !inspector->recordRemaining) {
+      inspector->recordSlot = -1;
+      stream_inspector_read_part(inspector, StreamInspectorStateRecordHeader, inspector->header, STREAM_RECORD_HEADER_SIZE);
+    }
+
+    data += used;
+    size -= used;
+  }
+
+  pthread_mutex_lock(&inspector->mutex);
+  inspector->sharedStats = *stats;
+  pthread_mutex_unlock(&inspector->mutex);
+}
+
+void stream_inspector_get_stats (StreamInspector *inspector, StreamInspectorStats *stats) {
+  pthread_mutex_lock(&inspector->mutex);
+  *stats = inspector->sharedStats;
+  pthread_mutex_unlock(&inspector->mutex);
+}
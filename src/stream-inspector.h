@@ -0,0 +1,83 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _STREAM_INSPECTOR_H_
+#define _STREAM_INSPECTOR_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// =============================================================================
+// Passive parser of the libxc migration-v2 stream written by xenguest, see:
+// docs/specs/libxc-migration-stream.pandoc in Xen. It is fed by the relay
+// thread with the raw stream and counts where the bytes go. The stream is
+// never modified: once a record is not understood, the remaining bytes are
+// only counted as unparsed.
+// =============================================================================
+
+// Known record types, the last slot counts the others.
+#define STREAM_RECORD_TYPES_COUNT 20
+
+#define STREAM_RECORD_END 0
+#define STREAM_RECORD_PAGE_DATA 1
+#define STREAM_RECORD_X86_PV_P2M_FRAMES 3
+
+// Batches of 1, 2-3, 4-7... and 512 pages or more.
+#define STREAM_BATCH_BUCKETS_COUNT 11
+
+typedef struct StreamInspectorStats {
+  uint64_t bytes; // Parsed or not.
+  uint64_t otherBytes; // Image and domain headers, unparsed bytes and data after the END record.
+  uint64_t recordBytes[STREAM_RECORD_TYPES_COUNT]; // Headers and padding included.
+
+  // PAGE_DATA records.
+  uint64_t batches;
+  uint64_t batchBuckets[STREAM_BATCH_BUCKETS_COUNT];
+  uint64_t pages; // With data.
+  uint64_t zeroPages;
+  uint64_t duplicatePages; // Already sent, e.g. dirtied during the live stage.
+  uint64_t uniquePages;
+
+  uint64_t p2mPages; // Size of the guest (PV only), 0 if unknown.
+  uint32_t pageSize;
+  bool isComplete; // The END record is parsed.
+} StreamInspectorStats;
+
+typedef struct StreamInspector StreamInspector;
+
+// -----------------------------------------------------------------------------
+
+// Per migration, see: daemon.c.
+void stream_inspector_enable ();
+bool stream_inspector_is_enabled ();
+
+// fd is only used in logs.
+int stream_inspector_create (StreamInspector **inspector, int fd);
+
+// Logs the stats.
+void stream_inspector_destroy (StreamInspector *inspector);
+
+// Only called by one thread, with the stream data in order.
+void stream_inspector_feed (StreamInspector *inspector, const char *data, size_t size);
+
+// Can be called by any thread.
+void stream_inspector_get_stats (StreamInspector *inspector, StreamInspectorStats *stats);
+
+const char *stream_inspector_record_type_to_str (int type);
+
+#endif // ifndef _STREAM_INSPECTOR_H_
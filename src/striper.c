@@ -0,0 +1,308 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "byte-order.h"
+#include "emu.h"
+#include "logger.h"
+#include "striper.h"
+
+// =============================================================================
+
+#define STRIPER_MAGIC "EMS1"
+#define STRIPER_HEADER_SIZE 16
+
+#define STRIPER_CHUNK_SIZE (512 * 1024)
+
+// Max chunk accepted by the restore side.
+#define STRIPER_MAX_CHUNK_SIZE (4 * 1024 * 1024)
+
+typedef struct StriperFd {
+  int fd;
+
+  // Header and payload of the chunk being sent or received.
+  char *buf;
+  size_t capacity;
+  size_t size; // Of the payload.
+  size_t begin;
+
+  // Restore only.
+  uint64_t seq;
+  bool isComplete;
+  bool isClosed;
+  size_t delivered;
+} StriperFd;
+
+struct Striper {
+  bool isSave;
+  StriperFd fds[STRIPER_MAX_FDS];
+  int count;
+  int next; // Save: first fd tried by the next write.
+  uint64_t seq; // Of the next chunk to send or to deliver.
+};
+
+// =============================================================================
+
+static int striper_reserve (StriperFd *striperFd, size_t size) {
+  if (striperFd->capacity >= size)
+    return 0;
+
+  char *buf = realloc(striperFd->buf, size);
+  if (!buf)
+    return -1;
+  striperFd->buf = buf;
+  striperFd->capacity = size;
+  return 0;
+}
+
+int striper_create (Striper **striper, const int *fds, int count, bool isSave) {
+  assert(count > 0 && count <= STRIPER_MAX_FDS);
+
+  Striper *newStriper = calloc(1, sizeof *newStriper);
+  if (!newStriper)
+    goto fail;
+
+  newStriper->isSave = isSave;
+  newStriper->count = count;
+  for (int i = 0; i < count; ++i) {
+    newStriper->fds[i].fd = fds[i];
+    if (striper_reserve(&newStriper->fds[i], STRIPER_HEADER_SIZE + (isSave ? STRIPER_CHUNK_SIZE : 0)) < 0)
+      goto fail;
+  }
+
+  syslog(LOG_INFO, "Striping stream %d over %d fd(s).", fds[0], count);
+  *striper = newStriper;
+  return 0;
+
+fail:
+  syslog(LOG_ERR, "Failed to create striper: `%s`.", strerror(errno));
+  EmuError = errno;
+  if (newStriper)
+    striper_destroy(newStriper);
+  return -1;
+}
+
+void striper_destroy (Striper *striper) {
+  for (int i = 0; i < striper->count; ++i)
+    free(striper->fds[i].buf);
+  free(striper);
+}
+
+// =============================================================================
+// Save.
+// =============================================================================
+
+// Returns 0 if the chunk is sent or if the fd is busy.
+static int striper_send (StriperFd *striperFd) {
+  const size_t size = STRIPER_HEADER_SIZE + striperFd->size;
+  while (striperFd->begin < size) {
+    const ssize_t ret = write(striperFd->fd, striperFd->buf + striperFd->begin, size - striperFd->begin);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno == EAGAIN ? 0 : -1;
+    }
+    striperFd->begin += (size_t)ret;
+  }
+
+  striperFd->begin = 0;
+  striperFd->size = 0;
+  return 0;
+}
+
+static int striper_send_pending (Striper *striper) {
+  for (int i = 0; i < striper->count; ++i)
+    if (striper->fds[i].size && striper_send(&striper->fds[i]) < 0)
+      return -1;
+  return 0;
+}
+
+ssize_t striper_write (Striper *striper, const char *data, size_t size) {
+  assert(striper->isSave && size);
+
+  if (striper_send_pending(striper) < 0)
+    return -1;
+
+  // The fastest connections are free more often, so they get more chunks.
+  for (int i = 0; i < striper->count; ++i) {
+    const int index = (striper->next + i) % striper->count;
+    StriperFd *striperFd = &striper->fds[index];
+    if (striperFd->size)
+      continue;
+
+    const size_t chunkSize = size < STRIPER_CHUNK_SIZE ? size : STRIPER_CHUNK_SIZE;
+    memcpy(striperFd->buf, STRIPER_MAGIC, 4);
+    byte_order_write_le32(striperFd->buf + 4, (uint32_t)chunkSize);
+    byte_order_write_le64(striperFd->buf + 8, striper->seq++);
+    memcpy(striperFd->buf + STRIPER_HEADER_SIZE, data, chunkSize);
+    striperFd->size = chunkSize;
+
+    striper->next = (index + 1) % striper->count;
+    return striper_send(striperFd) < 0 ? -1 : (ssize_t)chunkSize;
+  }
+
+  errno = EAGAIN;
+  return -1;
+}
+
+int striper_flush (Striper *striper) {
+  if (striper_send_pending(striper) < 0)
+    return -1;
+
+  for (int i = 0; i < striper->count; ++i)
+    if (striper->fds[i].size) {
+      errno = EAGAIN;
+      return -1;
+    }
+  return 0;
+}
+
+// =============================================================================
+// Restore.
+// =============================================================================
+
+static int striper_read_header (StriperFd *striperFd) {
+  if (memcmp(striperFd->buf, STRIPER_MAGIC, 4)) {
+    syslog(LOG_ERR, "Invalid chunk header on striped fd %d.", striperFd->fd);
+    errno = EBADMSG;
+    return -1;
+  }
+
+  const size_t size = byte_order_read_le32(striperFd->buf + 4);
+  if (size == 0 || size > STRIPER_MAX_CHUNK_SIZE) {
+    syslog(LOG_ERR, "Invalid chunk size on striped fd %d: %zu.", striperFd->fd, size);
+    errno = EBADMSG;
+    return -1;
+  }
+
+  if (striper_reserve(striperFd, STRIPER_HEADER_SIZE + size) < 0)
+    return -1;
+
+  striperFd->size = size;
+  striperFd->seq = byte_order_read_le64(striperFd->buf + 8);
+  return 0;
+}
+
+// Read until a chunk is complete or the fd is empty.
+static int striper_receive (StriperFd *striperFd) {
+  while (!striperFd->isComplete && !striperFd->isClosed) {
+    const size_t size = striperFd->begin < STRIPER_HEADER_SIZE
+      ? STRIPER_HEADER_SIZE
+      : STRIPER_HEADER_SIZE + striperFd->size;
+
+    const ssize_t ret = read(striperFd->fd, striperFd->buf + striperFd->begin, size - striperFd->begin);
+    if (ret == 0) {
+      if (striperFd->begin) {
+        syslog(LOG_ERR, "Striped fd %d is closed in the middle of a chunk.", striperFd->fd);
+        errno = EPIPE;
+        return -1;
+      }
+      striperFd->isClosed = true;
+      return 0;
+    }
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno == EAGAIN ? 0 : -1;
+    }
+
+    striperFd->begin += (size_t)ret;
+    if (striperFd->begin == STRIPER_HEADER_SIZE && striper_read_header(striperFd) < 0)
+      return -1;
+    if (striperFd->begin == STRIPER_HEADER_SIZE + striperFd->size) {
+      striperFd->isComplete = true;
+      striperFd->delivered = 0;
+    }
+  }
+  return 0;
+}
+
+static size_t striper_deliver (Striper *striper, char *buf, size_t size) {
+  for (int i = 0; i < striper->count; ++i) {
+    StriperFd *striperFd = &striper->fds[i];
+    if (!striperFd->isComplete || striperFd->seq != striper->seq)
+      continue;
+
+    const size_t remaining = striperFd->size - striperFd->delivered;
+    const size_t chunkSize = size < remaining ? size : remaining;
+    memcpy(buf, striperFd->buf + STRIPER_HEADER_SIZE + striperFd->delivered, chunkSize);
+
+    if ((striperFd->delivered += chunkSize) == striperFd->size) {
+      striperFd->isComplete = false;
+      striperFd->begin = 0;
+      striperFd->size = 0;
+      ++striper->seq;
+    }
+    return chunkSize;
+  }
+  return 0;
+}
+
+ssize_t striper_read (Striper *striper, char *buf, size_t size) {
+  assert(!striper->isSave && size);
+
+  size_t ret = striper_deliver(striper, buf, size);
+  if (ret)
+    return (ssize_t)ret;
+
+  for (int i = 0; i < striper->count; ++i)
+    if (striper_receive(&striper->fds[i]) < 0)
+      return -1;
+
+  if ((ret = striper_deliver(striper, buf, size)))
+    return (ssize_t)ret;
+
+  // Each fd keeps at most one received chunk, it is enough because the
+  // sequence numbers are increasing on each fd.
+  bool isOpen = false;
+  bool hasChunk = false;
+  for (int i = 0; i < striper->count; ++i) {
+    isOpen |= !striper->fds[i].isClosed && !striper->fds[i].isComplete;
+    hasChunk |= striper->fds[i].isComplete;
+  }
+
+  if (isOpen) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if (hasChunk) {
+    syslog(LOG_ERR, "Chunk %" PRIu64 " of striped stream is missing.", striper->seq);
+    errno = EPIPE;
+    return -1;
+  }
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+nfds_t striper_get_pollfds (const Striper *striper, struct pollfd *pfds) {
+  nfds_t nfds = 0;
+  for (int i = 0; i < striper->count; ++i) {
+    const StriperFd *striperFd = &striper->fds[i];
+    if (striper->isSave ? striperFd->size != 0 : !striperFd->isComplete && !striperFd->isClosed)
+      pfds[nfds++] = (struct pollfd){ .fd = striperFd->fd, .events = striper->isSave ? POLLOUT : POLLIN };
+  }
+  return nfds;
+}
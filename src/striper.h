@@ -0,0 +1,58 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _STRIPER_H_
+#define _STRIPER_H_
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// =============================================================================
+// Striping of a relayed stream over several connections: the stream is cut
+// in sequenced chunks sent on the first writable fd. The restore side
+// reorders them. Each chunk starts with a 16-byte little-endian header:
+// "EMS1", payload size, sequence number (64 bits).
+// The fds must be non-blocking. Only the relay thread uses a Striper.
+// =============================================================================
+
+#define STRIPER_MAX_FDS 8
+
+typedef struct Striper Striper;
+
+int striper_create (Striper **striper, const int *fds, int count, bool isSave);
+void striper_destroy (Striper *striper);
+
+// Save: returns the count of accepted bytes or -1 with errno set to EAGAIN
+// if all the fds are busy.
+ssize_t striper_write (Striper *striper, const char *data, size_t size);
+
+// Save: returns -1 with errno set to EAGAIN while accepted chunks are not
+// completely written.
+int striper_flush (Striper *striper);
+
+// Restore: returns the count of read bytes in the stream order, 0 if all
+// the fds are closed or -1 with errno set to EAGAIN if the next chunk is
+// not received.
+ssize_t striper_read (Striper *striper, char *buf, size_t size);
+
+// Fill the fds to wait to continue a striper_write/flush or a striper_read.
+nfds_t striper_get_pollfds (const Striper *striper, struct pollfd *pfds);
+
+#endif // ifndef _STRIPER_H_
@@ -0,0 +1,149 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Print per-iteration throughput and dirty rate curves of a telemetry file,
+// with the pages of the inspected streams.
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "telemetry.h"
+
+// =============================================================================
+
+#define MAX_EMUS 8
+
+// See: EmuPhase.
+static const char *Phases[] = {
+  "none",
+  "live",
+  "stop-and-copy",
+  "non-live",
+  "post-copy"
+};
+
+typedef struct IterationStats {
+  char emu[sizeof ((TelemetryRecord *)0)->emu + 1];
+  TelemetryRecord first;
+  TelemetryRecord last;
+} IterationStats;
+
+// -----------------------------------------------------------------------------
+
+// The iteration ends at the `end` sample: the last one or the first sample of the next iteration.
+static void print_iteration (const IterationStats *stats, const TelemetryRecord *end, int64_t origin) {
+  const TelemetryRecord *first = &stats->first;
+  const TelemetryRecord *last = &stats->last;
+
+  const int64_t duration = end->timestamp - first->timestamp;
+  const int64_t sent = end->sent >= first->sent ? end->sent - first->sent : end->sent;
+  const int phase = last->phase;
+
+  // The stream counts are cumulative.
+  const int64_t pages = end->pages - first->pages;
+  const int64_t batches = end->batches - first->batches;
+
+  printf("%-12s %5d %-14s %10.3f %10.3f %14" PRId64 " %14" PRId64 " %14" PRId64 " %14" PRId64 " %10" PRId64 " %10" PRId64 " %10" PRId64 " %8.1f\n",
+    stats->emu,
+    last->iteration,
+    phase >= 0 && (size_t)phase < sizeof Phases / sizeof *Phases ? Phases[phase] : "?",
+    (double)(first->timestamp - origin) / 1e6,
+    (double)duration / 1e6,
+    sent,
+    last->remaining,
+    duration > 0 ? (int64_t)((double)sent * 1e6 / (double)duration) : last->transferRate,
+    last->dirtyRate,
+    pages,
+    end->zeroPages - first->zeroPages,
+    end->duplicatePages - first->duplicatePages,
+    batches > 0 ? (double)pages / (double)batches : 0.0
+  );
+}
+
+// -----------------------------------------------------------------------------
+
+int main (int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <telemetry file>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  FILE *file = fopen(argv[1], "rb");
+  if (!file) {
+    fprintf(stderr, "Failed to open `%s`: `%s`.\n", argv[1], strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  // The fields of the version 1 records are unchanged, the stream counts
+  // are 0 like when the stream is not inspected.
+  TelemetryHeader header;
+  if (
+    fread(&header, sizeof header, 1, file) != 1 ||
+    memcmp(header.magic, TELEMETRY_MAGIC, sizeof header.magic) ||
+    (header.version == 1 && header.recordSize != TELEMETRY_V1_RECORD_SIZE) ||
+    (header.version == TELEMETRY_VERSION && header.recordSize != sizeof(TelemetryRecord)) ||
+    (header.version != 1 && header.version != TELEMETRY_VERSION)
+  ) {
+    fprintf(stderr, "`%s` is not a supported telemetry file.\n", argv[1]);
+    fclose(file);
+    return EXIT_FAILURE;
+  }
+
+  printf("Domain %u (version %u)\n", header.domId, header.version);
+  printf("%-12s %5s %-14s %10s %10s %14s %14s %14s %14s %10s %10s %10s %8s\n",
+    "emu", "iter", "phase", "start (s)", "duration", "sent", "remaining", "throughput/s", "dirty/s",
+    "pages", "zero", "duplicate", "pg/batch"
+  );
+
+  IterationStats stats[MAX_EMUS];
+  size_t nEmus = 0;
+  int64_t origin = -1;
+
+  TelemetryRecord record = { 0 };
+  while (fread(&record, header.recordSize, 1, file) == 1) {
+    if (origin < 0)
+      origin = record.timestamp;
+
+    size_t i = 0;
+    for (; i < nEmus && strncmp(stats[i].emu, record.emu, sizeof record.emu); ++i);
+    if (i == nEmus) {
+      if (nEmus == MAX_EMUS) {
+        fprintf(stderr, "Too many emus in telemetry file.\n");
+        break;
+      }
+      memset(&stats[i], 0, sizeof stats[i]);
+      memcpy(stats[i].emu, record.emu, sizeof record.emu);
+      stats[i].first = record;
+      ++nEmus;
+    } else if (record.iteration != stats[i].last.iteration || record.phase != stats[i].last.phase) {
+      print_iteration(&stats[i], &record, origin);
+      stats[i].first = record;
+    }
+    stats[i].last = record;
+  }
+
+  for (size_t i = 0; i < nEmus; ++i)
+    print_iteration(&stats[i], &stats[i].last, origin);
+
+  const int error = ferror(file);
+  fclose(file);
+
+  return error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,195 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <xcp-ng/generic.h>
+
+#include "emu.h"
+#include "logger.h"
+#include "monotonic-clock.h"
+#include "stream-inspector.h"
+#include "telemetry.h"
+
+// =============================================================================
+
+static __thread int TelemetryFd = -1;
+
+// -----------------------------------------------------------------------------
+
+// Returns 1 if the header is the one of this version, 0 if not.
+static int telemetry_check_header (int fd, uint domId) {
+  TelemetryHeader header;
+  const ssize_t ret = pread(fd, &header, sizeof header, 0);
+  if (ret < 0) {
+    syslog(LOG_ERR, "Failed to read telemetry header: `%s`.", strerror(errno));
+    EmuError = errno;
+    return -1;
+  }
+
+  return
+    (size_t)ret == sizeof header &&
+    !memcmp(header.magic, TELEMETRY_MAGIC, sizeof header.magic) &&
+    header.version == TELEMETRY_VERSION &&
+    header.recordSize == sizeof(TelemetryRecord) &&
+    header.domId == domId;
+}
+
+static int telemetry_write_header (int fd, uint domId) {
+  TelemetryHeader header = {
+    .version = TELEMETRY_VERSION,
+    .recordSize = sizeof(TelemetryRecord),
+    .domId = domId
+  };
+  memcpy(header.magic, TELEMETRY_MAGIC, sizeof header.magic);
+
+  size_t offset;
+  if (xcp_fd_write_all(fd, &header, sizeof header, &offset) == XCP_ERR_ERRNO) {
+    syslog(LOG_ERR, "Failed to write telemetry header: `%s`.", strerror(errno));
+    EmuError = errno;
+    return -1;
+  }
+
+  return 0;
+}
+
+// Rename the file to `<path>.old` and create a new one.
+static int telemetry_rotate (const char *path) {
+  char oldPath[PATH_MAX];
+  const int ret = snprintf(oldPath, sizeof oldPath, "%s.old", path);
+  if (ret < 0 || (size_t)ret >= sizeof oldPath) {
+    syslog(LOG_ERR, "Failed to format old telemetry path.");
+    EmuError = ret < 0 ? errno : ENAMETOOLONG;
+    return -1;
+  }
+
+  if (rename(path, oldPath) < 0) {
+    syslog(LOG_ERR, "Failed to rename telemetry file `%s`: `%s`.", path, strerror(errno));
+    EmuError = errno;
+    return -1;
+  }
+  syslog(LOG_INFO, "Telemetry file `%s` has another format, renamed to `%s`.", path, oldPath);
+
+  const int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    syslog(LOG_ERR, "Failed to create telemetry file `%s`: `%s`.", path, strerror(errno));
+    EmuError = errno;
+  }
+  return fd;
+}
+
+// -----------------------------------------------------------------------------
+
+int telemetry_open (const char *dir, uint domId) {
+  char path[PATH_MAX];
+  const int ret = snprintf(path, sizeof path, "%s/emu-manager-%u.telemetry", dir, domId);
+  if (ret < 0 || (size_t)ret >= sizeof path) {
+    syslog(LOG_ERR, "Failed to format telemetry path.");
+    EmuError = ret < 0 ? errno : ENAMETOOLONG;
+    return -1;
+  }
+
+  // Read to check the header of an existing file.
+  int fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    syslog(LOG_ERR, "Failed to open telemetry file `%s`: `%s`.", path, strerror(errno));
+    EmuError = errno;
+    return -1;
+  }
+
+  struct stat buf;
+  if (fstat(fd, &buf) < 0) {
+    EmuError = errno;
+    goto fail;
+  }
+
+  if (buf.st_size) {
+    const int ret = telemetry_check_header(fd, domId);
+    if (ret < 0)
+      goto fail;
+
+    // Written by another version: the file is kept for its reader and the
+    // records of this version are written in a new one.
+    if (!ret) {
+      xcp_fd_close(fd);
+      if ((fd = telemetry_rotate(path)) < 0)
+        return -1;
+      buf.st_size = 0;
+    }
+  }
+
+  if (!buf.st_size && telemetry_write_header(fd, domId) < 0)
+    goto fail;
+
+  syslog(LOG_INFO, "Writing migration telemetry in `%s`.", path);
+  TelemetryFd = fd;
+  return 0;
+
+fail:
+  xcp_fd_close(fd);
+  return -1;
+}
+
+void telemetry_close () {
+  if (TelemetryFd > -1) {
+    xcp_fd_close(TelemetryFd);
+    TelemetryFd = -1;
+  }
+}
+
+void telemetry_write (const Emu *emu) {
+  if (TelemetryFd <= -1)
+    return;
+
+  const ConvergenceModel *model = &emu->convergence;
+  TelemetryRecord record = {
+    .timestamp = monotonic_clock_us(),
+    .sent = emu->progress.sentMidIteration,
+    .remaining = model->remaining,
+    .transferRate = (int64_t)model->transferRate,
+    .dirtyRate = (int64_t)model->dirtyRate,
+    .iteration = model->iteration,
+    .phase = (int32_t)emu->phase
+  };
+  strncpy(record.emu, emu->name, sizeof record.emu - 1);
+
+  StreamInspectorStats stats;
+  if (emu_get_stream_stats(emu, &stats) == 0) {
+    record.streamBytes = (int64_t)stats.bytes;
+    record.pageDataBytes = (int64_t)stats.recordBytes[STREAM_RECORD_PAGE_DATA];
+    record.pages = (int64_t)stats.pages;
+    record.uniquePages = (int64_t)stats.uniquePages;
+    record.zeroPages = (int64_t)stats.zeroPages;
+    record.duplicatePages = (int64_t)stats.duplicatePages;
+    record.batches = (int64_t)stats.batches;
+    record.p2mPages = (int64_t)stats.p2mPages;
+  }
+
+  // A record is small enough to be written atomically in append mode.
+  size_t offset;
+  if (xcp_fd_write_all(TelemetryFd, &record, sizeof record, &offset) == XCP_ERR_ERRNO) {
+    syslog(LOG_ERR, "Failed to write telemetry record, disabling telemetry: `%s`.", strerror(errno));
+    telemetry_close();
+  }
+}
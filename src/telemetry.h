@@ -0,0 +1,79 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// =============================================================================
+// Migration telemetry: one fixed-size record per MIGRATION event, appended
+// to a file per domain. Values are in host byte order.
+// =============================================================================
+
+#define TELEMETRY_MAGIC "EMTL"
+#define TELEMETRY_VERSION 2
+
+// Version 1 records end before the counts of the inspected stream.
+#define TELEMETRY_V1_RECORD_SIZE offsetof(TelemetryRecord, streamBytes)
+
+typedef struct TelemetryHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t recordSize;
+  uint32_t domId;
+} TelemetryHeader;
+
+typedef struct TelemetryRecord {
+  int64_t timestamp; // Monotonic, in us.
+  int64_t sent;
+  int64_t remaining;
+  int64_t transferRate; // Per second, same unit as sent.
+  int64_t dirtyRate; // Per second, same unit as remaining.
+  int32_t iteration;
+  int32_t phase; // See EmuPhase.
+  char emu[16];
+
+  // Counts of the inspected stream, 0 if it is not, see: stream-inspector.h.
+  int64_t streamBytes;
+  int64_t pageDataBytes; // PAGE_DATA records.
+  int64_t pages;
+  int64_t uniquePages;
+  int64_t zeroPages;
+  int64_t duplicatePages;
+  int64_t batches;
+  int64_t p2mPages;
+} TelemetryRecord;
+
+_Static_assert(sizeof(TelemetryRecord) == 128, "Unexpected telemetry record size");
+
+// -----------------------------------------------------------------------------
+
+typedef struct Emu Emu;
+
+// Open (or create) the telemetry file of a domain in the given directory. A
+// file written by another version is renamed with the `.old` suffix.
+int telemetry_open (const char *dir, uint domId);
+void telemetry_close ();
+
+// Append the current state of an emu. Never fails: telemetry is disabled
+// on write error.
+void telemetry_write (const Emu *emu);
+
+#endif // ifndef _TELEMETRY_H_
@@ -0,0 +1,71 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "crc32c.h"
+#include "monotonic-clock.h"
+#include "test.h"
+
+// =============================================================================
+// Throughput of the CRC-32C implementations supported by the CPU, for the
+// sizes of the small and the large stream frames.
+// Usage: bench-crc32c [MiB]
+// =============================================================================
+
+#define BENCH_DEFAULT_SIZE 4096
+#define BENCH_MAX_BLOCK_SIZE (1024 * 1024)
+
+static unsigned char Data[BENCH_MAX_BLOCK_SIZE];
+
+static void bench_implementation (const char *name, size_t blockSize, int mebibytes) {
+  CHECK(crc32c_set_implementation(name) == 0);
+
+  const size_t count = (size_t)mebibytes * 1024 * 1024 / blockSize;
+  uint32_t crc = 0;
+  const int64_t start = monotonic_clock_us();
+  for (size_t i = 0; i < count; ++i)
+    crc = crc32c(crc, Data, blockSize);
+  const int64_t duration = monotonic_clock_us() - start;
+
+  // The result is used.
+  CHECK(crc != 0);
+
+  char label[64];
+  snprintf(label, sizeof label, "%s (%zu B)", name, blockSize);
+  bench_print_rate(label, (double)count * (double)blockSize / (1024 * 1024), "MiB", duration);
+}
+
+int main (int argc, char *argv[]) {
+  const int mebibytes = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_SIZE;
+  CHECK(mebibytes > 0);
+
+  unsigned seed = 42;
+  for (size_t i = 0; i < sizeof Data; ++i)
+    Data[i] = (unsigned char)rand_r(&seed);
+
+  printf("%d MiB per implementation and size, selected: %s.\n", mebibytes, crc32c_get_implementation());
+
+  static const size_t blockSizes[] = { 64, 256, 4096, 65536, BENCH_MAX_BLOCK_SIZE };
+  const char *const *names = crc32c_get_implementations();
+  // The first implementation is the table: 8 times less data.
+  for (size_t i = 0; i < sizeof blockSizes / sizeof blockSizes[0]; ++i)
+    for (int j = 0; names[j]; ++j)
+      bench_implementation(names[j], blockSizes[i], j ? mebibytes : mebibytes / 8 + 1);
+
+  return EXIT_SUCCESS;
+}
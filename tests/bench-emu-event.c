@@ -0,0 +1,128 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "emu-event.h"
+#include "monotonic-clock.h"
+#include "test.h"
+
+// =============================================================================
+// Events/s of the in-place parser and of the json-c fallback, on a stream of
+// MIGRATION progress events and command replies like the one of xenguest:
+// its progress events have no status, see: emu_client_event_cb_emp.
+// Usage: bench-emu-event [passes]
+// =============================================================================
+
+#define BENCH_MESSAGES 1024
+#define BENCH_DEFAULT_PASSES 1000
+
+static char Stream[BENCH_MESSAGES * 128];
+static size_t StreamSize;
+
+static void fill_stream () {
+  for (int i = 0; i < BENCH_MESSAGES; ++i) {
+    const int len = i % 16
+      ? snprintf(
+        Stream + StreamSize, sizeof Stream - StreamSize,
+        "{\"event\":\"MIGRATION\",\"data\":{\"sent\":%d,\"remaining\":%d,\"iteration\":%d}}\n",
+        i * 4096, (BENCH_MESSAGES - i) * 4096, i / 64
+      )
+      : snprintf(Stream + StreamSize, sizeof Stream - StreamSize, "{\"return\":{}}\n");
+    CHECK(len > 0 && (size_t)len < sizeof Stream - StreamSize);
+    StreamSize += (size_t)len;
+  }
+}
+
+// Skip the separators between messages, like the EMP client.
+static size_t skip_spaces (size_t offset) {
+  while (offset < StreamSize && (Stream[offset] == '\n' || Stream[offset] == ' '))
+    ++offset;
+  return offset;
+}
+
+// -----------------------------------------------------------------------------
+
+static void bench_in_place (int passes) {
+  int64_t checksum = 0;
+  const int64_t start = monotonic_clock_us();
+  for (int pass = 0; pass < passes; ++pass)
+    for (size_t offset = skip_spaces(0); offset < StreamSize; ) {
+      EmuMessage message;
+      const int size = emu_event_parse(Stream + offset, StreamSize - offset, &message);
+      CHECK(size > 0);
+      checksum += message.event.sent;
+      offset = skip_spaces(offset + (size_t)size);
+    }
+  const int64_t duration = monotonic_clock_us() - start;
+
+  CHECK(checksum != 0);
+  bench_print_rate("in place", (double)passes * BENCH_MESSAGES, "events", duration);
+}
+
+static void bench_json_c (int passes) {
+  json_tokener *tokener = json_tokener_new();
+  CHECK(tokener);
+
+  int64_t checksum = 0;
+  const int64_t start = monotonic_clock_us();
+  for (int pass = 0; pass < passes; ++pass)
+    for (size_t offset = skip_spaces(0); offset < StreamSize; ) {
+      json_tokener_reset(tokener);
+      json_object *obj = json_tokener_parse_ex(tokener, Stream + offset, (int)(StreamSize - offset));
+      if (!obj) {
+        printf("%-32s unavailable: `%s`\n", "json-c", json_tokener_error_desc(json_tokener_get_error(tokener)));
+        json_tokener_free(tokener);
+        return;
+      }
+
+      // Same lookups as emu_client_process_json.
+      const json_object *eventType = NULL;
+      const json_object *data = NULL;
+      for (const struct lh_entry *entry = json_object_get_object(obj)->head; entry; entry = entry->next) {
+        if (!strcmp(entry->k, "event"))
+          eventType = entry->v;
+        else if (!strcmp(entry->k, "data"))
+          data = entry->v;
+      }
+
+      if (eventType) {
+        EmuEvent event;
+        emu_event_from_json(&event, json_object_get_string((json_object *)eventType), data);
+        checksum += event.sent;
+      }
+      json_object_put(obj);
+      offset = skip_spaces(offset + (size_t)tokener->char_offset);
+    }
+  const int64_t duration = monotonic_clock_us() - start;
+  json_tokener_free(tokener);
+
+  CHECK(checksum != 0);
+  bench_print_rate("json-c", (double)passes * BENCH_MESSAGES, "events", duration);
+}
+
+int main (int argc, char *argv[]) {
+  const int passes = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_PASSES;
+  CHECK(passes > 0);
+
+  fill_stream();
+  printf("%d messages of %zu bytes on average, %d passes.\n", BENCH_MESSAGES, StreamSize / BENCH_MESSAGES, passes);
+
+  bench_in_place(passes);
+  bench_json_c(passes);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "compressor.h"
+#include "monotonic-clock.h"
+#include "relay.h"
+#include "test.h"
+
+// =============================================================================
+// Throughput of a save stream written in a socketpair by the emu directly and
+// through the stages of the relay.
+// Usage: bench-relay [MiB]
+// =============================================================================
+
+#define BENCH_DEFAULT_SIZE 1024
+#define BENCH_CHUNK_SIZE (1024 * 1024)
+
+// Half random, half zero pages: like a guest with free memory.
+static char Data[BENCH_CHUNK_SIZE];
+
+typedef struct Sink {
+  int fd;
+  uint64_t size;
+  pthread_t thread;
+} Sink;
+
+static void *sink_thread (void *userData) {
+  Sink *sink = userData;
+
+  char *buf = malloc(BENCH_CHUNK_SIZE);
+  CHECK(buf);
+
+  ssize_t ret;
+  while ((ret = read(sink->fd, buf, BENCH_CHUNK_SIZE)) > 0)
+    sink->size += (size_t)ret;
+  CHECK(ret == 0);
+
+  free(buf);
+  return NULL;
+}
+
+static void fill_data () {
+  unsigned seed = 42;
+  for (size_t offset = 0; offset < sizeof Data; offset += 8192)
+    for (size_t i = 0; i < 4096; ++i)
+      Data[offset + i] = (char)rand_r(&seed);
+}
+
+static void on_data (void *userData, const char *data, size_t size) {
+  (void)userData;
+  (void)data;
+  (void)size;
+}
+
+// -----------------------------------------------------------------------------
+
+static void bench_stream (const char *label, int chunks, bool isRelayed, const RelayHooks *hooks) {
+  int streamFds[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, streamFds) == 0);
+
+  Sink sink = { .fd = streamFds[1] };
+  CHECK(pthread_create(&sink.thread, NULL, sink_thread, &sink) == 0);
+
+  int fd = streamFds[0];
+  Relay *relay = NULL;
+  if (isRelayed)
+    CHECK(relay_create(&relay, streamFds, 1, RelayDirectionSave, hooks, &fd) == 0);
+
+  const int64_t start = monotonic_clock_us();
+  for (int i = 0; i < chunks; ++i)
+    for (size_t offset = 0; offset < sizeof Data; ) {
+      const ssize_t ret = write(fd, Data + offset, sizeof Data - offset);
+      CHECK(ret > 0);
+      offset += (size_t)ret;
+    }
+  close(fd);
+
+  // The stream is closed by the relay.
+  if (relay) {
+    CHECK(relay_finish(relay) == 0);
+    relay_destroy(relay);
+    arena_release();
+  }
+  pthread_join(sink.thread, NULL);
+  const int64_t duration = monotonic_clock_us() - start;
+  close(streamFds[1]);
+
+  // The compressed size is not the one of the emu stream.
+  CHECK(sink.size > 0);
+  bench_print_rate(label, (double)chunks * BENCH_CHUNK_SIZE / (1024 * 1024), "MiB", duration);
+}
+
+int main (int argc, char *argv[]) {
+  const int chunks = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_SIZE;
+  CHECK(chunks > 0);
+
+  fill_data();
+  printf("%d MiB per stream.\n", chunks);
+
+  const RelayHooks inspectHooks = { .onData = on_data };
+  bench_stream("direct", chunks, false, NULL);
+  bench_stream("relay (splice)", chunks, true, NULL);
+  bench_stream("relay (copy)", chunks, true, &inspectHooks);
+
+  CHECK(compressor_set_codec("lz4") == 0);
+  bench_stream("relay (lz4)", chunks, true, NULL);
+  CHECK(compressor_set_codec("none") == 0);
+
+  compressor_enable_checksum();
+  bench_stream("relay (checksum)", chunks, true, NULL);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,111 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "compressor.h"
+#include "monotonic-clock.h"
+#include "relay.h"
+#include "stand-in.h"
+#include "test.h"
+
+// =============================================================================
+// Throughput of a stream striped over 1 to RELAY_MAX_STREAM_FDS socketpairs,
+// from the fd of a saving emu to the fd of a restoring emu. Every stream goes
+// through a save relay and a restore relay, with checksums: a single fd can be
+// relayed on restore only if it is framed.
+// Usage: bench-striper [MiB]
+// =============================================================================
+
+#define BENCH_DEFAULT_SIZE 1024
+#define BENCH_CHUNK_SIZE (1024 * 1024)
+
+static char Data[BENCH_CHUNK_SIZE];
+
+typedef struct Source {
+  int fd;
+  int chunks;
+  pthread_t thread;
+} Source;
+
+static void *source_thread (void *userData) {
+  Source *source = userData;
+
+  for (int i = 0; i < source->chunks; ++i)
+    for (size_t offset = 0; offset < sizeof Data; ) {
+      const ssize_t ret = write(source->fd, Data + offset, sizeof Data - offset);
+      CHECK(ret > 0);
+      offset += (size_t)ret;
+    }
+  close(source->fd);
+
+  return NULL;
+}
+
+static void fill_data () {
+  unsigned seed = 42;
+  for (size_t i = 0; i < sizeof Data; ++i)
+    Data[i] = (char)rand_r(&seed);
+}
+
+// -----------------------------------------------------------------------------
+
+static void bench_stream (int count, int chunks) {
+  StandInStripedStream stream;
+  stand_in_striped_stream_create(&stream, count);
+
+  char *buf = malloc(BENCH_CHUNK_SIZE);
+  CHECK(buf);
+
+  const int64_t start = monotonic_clock_us();
+  Source source = { .fd = stream.saveFd, .chunks = chunks };
+  CHECK(pthread_create(&source.thread, NULL, source_thread, &source) == 0);
+
+  uint64_t size = 0;
+  ssize_t ret;
+  while ((ret = read(stream.restoreFd, buf, BENCH_CHUNK_SIZE)) > 0)
+    size += (size_t)ret;
+  CHECK(ret == 0);
+  const int64_t duration = monotonic_clock_us() - start;
+
+  pthread_join(source.thread, NULL);
+  CHECK(size == (uint64_t)chunks * BENCH_CHUNK_SIZE);
+  free(buf);
+
+  stand_in_striped_stream_destroy(&stream);
+
+  char label[32];
+  snprintf(label, sizeof label, "%d fd%s", count, count > 1 ? "s" : "");
+  bench_print_rate(label, (double)chunks * BENCH_CHUNK_SIZE / (1024 * 1024), "MiB", duration);
+}
+
+int main (int argc, char *argv[]) {
+  const int chunks = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_SIZE;
+  CHECK(chunks > 0);
+
+  fill_data();
+  compressor_enable_checksum();
+  printf("%d MiB per stream.\n", chunks);
+
+  for (int count = 1; count <= RELAY_MAX_STREAM_FDS; count *= 2)
+    bench_stream(count, chunks);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,531 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <libempserver.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "migration.h"
+#include "monotonic-clock.h"
+#include "relay.h"
+#include "stand-in.h"
+#include "test.h"
+
+// =============================================================================
+
+#define STAND_IN_ACCEPT_TIMEOUT 30000
+
+static void stand_in_write (int fd, const char *buf, size_t size) {
+  while (size) {
+    const ssize_t ret = send(fd, buf, size, MSG_NOSIGNAL);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      return; // The peer is gone, it's checked by the test.
+    }
+    buf += ret;
+    size -= (size_t)ret;
+  }
+}
+
+// =============================================================================
+// Emu.
+// =============================================================================
+
+// Size of the JSON object at the start of buf, 0 if it's not complete.
+static size_t stand_in_emp_get_object_size (const char *buf, size_t size) {
+  int depth = 0;
+  bool inString = false;
+  for (size_t i = 0; i < size; ++i) {
+    const char c = buf[i];
+    if (inString) {
+      if (c == '\\') ++i;
+      else if (c == '"') inString = false;
+    } else if (c == '"')
+      inString = true;
+    else if (c == '{')
+      ++depth;
+    else if (c == '}' && --depth == 0)
+      return i + 1;
+  }
+  return 0;
+}
+
+// Position of the value of a key in a JSON object, NULL if it's missing.
+static const char *stand_in_emp_find_value (const char *object, const char *key) {
+  char pattern[128];
+  snprintf(pattern, sizeof pattern, "\"%s\"", key);
+
+  const char *value = strstr(object, pattern);
+  if (!value)
+    return NULL;
+
+  value += strlen(pattern);
+  value += strspn(value, " ");
+  if (*value++ != ':')
+    return NULL;
+  return value + strspn(value, " ");
+}
+
+static void stand_in_emp_parse_cmd (StandInEmp *emp, const char *object) {
+  *emp->cmd = '\0';
+  *emp->args = '\0';
+
+  const char *name = stand_in_emp_find_value(object, "execute");
+  if (name && *name == '"') {
+    const size_t len = strcspn(++name, "\"");
+    snprintf(emp->cmd, sizeof emp->cmd, "%.*s", (int)len, name);
+  }
+
+  const char *args = stand_in_emp_find_value(object, "arguments");
+  if (args && *args == '{') {
+    const size_t len = stand_in_emp_get_object_size(args, strlen(args));
+    if (len >= 2)
+      snprintf(emp->args, sizeof emp->args, "%.*s", (int)(len - 2), args + 1);
+  }
+}
+
+static int stand_in_emp_receive (StandInEmp *emp) {
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = {
+    .iov_base = emp->buf + emp->bufSize,
+    .iov_len = sizeof emp->buf - emp->bufSize - 1
+  };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = sizeof control.buf
+  };
+
+  ssize_t ret;
+  do {
+    ret = recvmsg(emp->fd, &msg, MSG_CMSG_CLOEXEC);
+  } while (ret < 0 && errno == EINTR);
+  if (ret <= 0)
+    return -1;
+
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      if (emp->streamFd > -1)
+        close(emp->streamFd);
+      memcpy(&emp->streamFd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+  emp->bufSize += (size_t)ret;
+  emp->buf[emp->bufSize] = '\0';
+  return 0;
+}
+
+static void *stand_in_emp_thread (void *userData) {
+  StandInEmp *emp = userData;
+
+  struct pollfd pfd = { .fd = emp->listenFd, .events = POLLIN };
+  if (poll(&pfd, 1, STAND_IN_ACCEPT_TIMEOUT) == 1)
+    emp->fd = accept4(emp->listenFd, NULL, NULL, SOCK_CLOEXEC);
+
+  close(emp->listenFd);
+  unlink(emp->path);
+
+  if (emp->fd > -1) {
+    (*emp->main)(emp);
+    close(emp->fd);
+  }
+  if (emp->streamFd > -1)
+    close(emp->streamFd);
+
+  return NULL;
+}
+
+// -----------------------------------------------------------------------------
+
+int stand_in_emp_start (StandInEmp *emp, const char *emuName, unsigned domId, StandInEmpMain main, void *userData) {
+  emp->fd = -1;
+  emp->streamFd = -1;
+  emp->bufSize = 0;
+  emp->main = main;
+  emp->userData = userData;
+
+  const int len = emp_get_default_path(emp->path, sizeof emp->path, emuName, (int)domId);
+  if (len < 0 || (size_t)len >= sizeof emp->path) {
+    fprintf(stderr, "Cannot get EMP socket path of `%s`.\n", emuName);
+    return TEST_SKIP;
+  }
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  strcpy(addr.sun_path, emp->path);
+
+  unlink(emp->path);
+  CHECK((emp->listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) > -1);
+  if (bind(emp->listenFd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(emp->listenFd, 1) < 0) {
+    fprintf(stderr, "Cannot listen on `%s`: %s.\n", emp->path, strerror(errno));
+    close(emp->listenFd);
+    return TEST_SKIP;
+  }
+
+  CHECK(pthread_create(&emp->thread, NULL, stand_in_emp_thread, emp) == 0);
+  return 0;
+}
+
+void stand_in_emp_join (StandInEmp *emp) {
+  pthread_join(emp->thread, NULL);
+}
+
+// -----------------------------------------------------------------------------
+
+int stand_in_emp_next_cmd (StandInEmp *emp, int timeout) {
+  const int64_t deadline = monotonic_clock_us() / 1000 + timeout;
+  for (;;) {
+    const size_t size = stand_in_emp_get_object_size(emp->buf, emp->bufSize);
+    if (size) {
+      const char c = emp->buf[size];
+      emp->buf[size] = '\0';
+      stand_in_emp_parse_cmd(emp, emp->buf);
+      emp->buf[size] = c;
+
+      emp->bufSize -= size;
+      memmove(emp->buf, emp->buf + size, emp->bufSize);
+      emp->buf[emp->bufSize] = '\0';
+      return 1;
+    }
+
+    const int64_t remaining = deadline - monotonic_clock_us() / 1000;
+    struct pollfd pfd = { .fd = emp->fd, .events = POLLIN };
+    const int ret = poll(&pfd, 1, remaining > 0 ? (int)remaining : 0);
+    if (ret == 0)
+      return 0;
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (stand_in_emp_receive(emp) < 0)
+      return -1;
+  }
+}
+
+bool stand_in_emp_cmd_is (const StandInEmp *emp, const char *name) {
+  return !strcmp(emp->cmd, name);
+}
+
+const char *stand_in_emp_get_arg (const StandInEmp *emp, const char *key, char *buf, size_t size) {
+  const char *value = stand_in_emp_find_value(emp->args, key);
+  if (!value)
+    return NULL;
+
+  const size_t len = *value == '"' ? strcspn(++value, "\"") : strcspn(value, ", }");
+  snprintf(buf, size, "%.*s", (int)len, value);
+  return buf;
+}
+
+void stand_in_emp_reply (StandInEmp *emp) {
+  static const char reply[] = "{\"return\":{}}\n";
+  stand_in_write(emp->fd, reply, sizeof reply - 1);
+}
+
+void stand_in_emp_send_event (StandInEmp *emp, const char *format, ...) {
+  char data[512];
+  va_list ap;
+  va_start(ap, format);
+  vsnprintf(data, sizeof data, format, ap);
+  va_end(ap);
+
+  char buf[1024];
+  const int len = snprintf(buf, sizeof buf, "{\"event\":\"MIGRATION\",\"data\":{%s}}\n", data);
+  stand_in_write(emp->fd, buf, (size_t)len);
+}
+
+void stand_in_emp_serve (StandInEmp *emp) {
+  int ret;
+  while ((ret = stand_in_emp_next_cmd(emp, STAND_IN_ACCEPT_TIMEOUT)) > 0)
+    stand_in_emp_reply(emp);
+}
+
+// =============================================================================
+// Xenopsd.
+// =============================================================================
+
+static void stand_in_xenopsd_process (StandInXenopsd *xenopsd, const char *message) {
+  if (!strncmp(message, "prepare:", sizeof "prepare:" - 1) || !strncmp(message, "suspend:", sizeof "suspend:" - 1))
+    stand_in_write(xenopsd->fd, "done\n", sizeof "done\n" - 1);
+}
+
+static void *stand_in_xenopsd_thread (void *userData) {
+  StandInXenopsd *xenopsd = userData;
+
+  if (xenopsd->restoreEmu) {
+    char buf[128];
+    const int len = snprintf(buf, sizeof buf, "restore:%s\n", xenopsd->restoreEmu);
+    stand_in_write(xenopsd->fd, buf, (size_t)len);
+  }
+
+  if (xenopsd->readDelay)
+    usleep((useconds_t)xenopsd->readDelay * 1000);
+
+  char buf[4096];
+  for (;;) {
+    const ssize_t ret = read(xenopsd->fd, buf, sizeof buf);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      break;
+
+    pthread_mutex_lock(&xenopsd->mutex);
+    CHECK(xenopsd->messagesSize + (size_t)ret < sizeof xenopsd->messages);
+    memcpy(xenopsd->messages + xenopsd->messagesSize, buf, (size_t)ret);
+    xenopsd->messagesSize += (size_t)ret;
+    xenopsd->messages[xenopsd->messagesSize] = '\0';
+
+    char *end;
+    while ((end = strchr(xenopsd->messages + xenopsd->processedSize, '\n'))) {
+      *end = '\0';
+      stand_in_xenopsd_process(xenopsd, xenopsd->messages + xenopsd->processedSize);
+      *end = '\n';
+      xenopsd->processedSize = (size_t)(end - xenopsd->messages) + 1;
+    }
+    pthread_cond_broadcast(&xenopsd->received);
+    pthread_mutex_unlock(&xenopsd->mutex);
+  }
+
+  return NULL;
+}
+
+static const char *stand_in_xenopsd_find_locked (const StandInXenopsd *xenopsd, const char *prefix) {
+  const size_t len = strlen(prefix);
+  for (size_t offset = 0; offset < xenopsd->processedSize; ) {
+    const char *message = xenopsd->messages + offset;
+    if (!strncmp(message, prefix, len))
+      return message;
+    offset += (size_t)(strchr(message, '\n') - message) + 1;
+  }
+  return NULL;
+}
+
+// -----------------------------------------------------------------------------
+
+int stand_in_xenopsd_start (StandInXenopsd *xenopsd) {
+  int fds[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0);
+  xenopsd->emuFd = fds[1];
+  return stand_in_xenopsd_attach(xenopsd, fds[0]);
+}
+
+int stand_in_xenopsd_attach (StandInXenopsd *xenopsd, int fd) {
+  xenopsd->fd = fd;
+  xenopsd->messagesSize = 0;
+  xenopsd->processedSize = 0;
+  *xenopsd->messages = '\0';
+  pthread_mutex_init(&xenopsd->mutex, NULL);
+  pthread_cond_init(&xenopsd->received, NULL);
+  CHECK(pthread_create(&xenopsd->thread, NULL, stand_in_xenopsd_thread, xenopsd) == 0);
+  return 0;
+}
+
+int stand_in_xenopsd_request (StandInXenopsd *xenopsd, const char *path, const char *const *args, const int *fds, size_t fdsCount) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  CHECK(strlen(path) < sizeof addr.sun_path);
+  strcpy(addr.sun_path, path);
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  CHECK(fd > -1);
+
+  // The socket file is created before the listen call of the daemon.
+  for (int i = 0; connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0; ++i) {
+    CHECK((errno == ECONNREFUSED || errno == ENOENT) && i < 1000);
+    usleep(10000);
+  }
+
+  char buf[4096];
+  size_t size = 0;
+  for (; *args; ++args) {
+    const size_t len = strlen(*args) + 1;
+    CHECK(size + len < sizeof buf);
+    memcpy(buf + size, *args, len);
+    size += len;
+  }
+  buf[size++] = '\0';
+
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * 8)];
+    struct cmsghdr align;
+  } control;
+  CHECK(fdsCount <= 8);
+
+  struct iovec iov = { .iov_base = buf, .iov_len = size };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+  if (fdsCount) {
+    memset(&control, 0, sizeof control);
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fdsCount);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fdsCount);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fdsCount);
+  }
+  CHECK(sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)size);
+
+  xenopsd->emuFd = -1;
+  return stand_in_xenopsd_attach(xenopsd, fd);
+}
+
+void stand_in_xenopsd_send (StandInXenopsd *xenopsd, const char *message) {
+  stand_in_write(xenopsd->fd, message, strlen(message));
+}
+
+void stand_in_xenopsd_join (StandInXenopsd *xenopsd) {
+  if (xenopsd->emuFd > -1) {
+    close(xenopsd->emuFd);
+    xenopsd->emuFd = -1;
+  }
+  pthread_join(xenopsd->thread, NULL);
+  close(xenopsd->fd);
+  pthread_cond_destroy(&xenopsd->received);
+  pthread_mutex_destroy(&xenopsd->mutex);
+}
+
+bool stand_in_xenopsd_wait (StandInXenopsd *xenopsd, const char *prefix, int timeout) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout / 1000;
+  deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    ++deadline.tv_sec;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&xenopsd->mutex);
+  const char *message;
+  while (
+    !(message = stand_in_xenopsd_find_locked(xenopsd, prefix)) &&
+    pthread_cond_timedwait(&xenopsd->received, &xenopsd->mutex, &deadline) == 0
+  );
+  pthread_mutex_unlock(&xenopsd->mutex);
+  return message;
+}
+
+const char *stand_in_xenopsd_find (const StandInXenopsd *xenopsd, const char *prefix) {
+  return stand_in_xenopsd_find_locked(xenopsd, prefix);
+}
+
+size_t stand_in_xenopsd_count (const StandInXenopsd *xenopsd, const char *prefix) {
+  size_t count = 0;
+  const size_t len = strlen(prefix);
+  for (size_t offset = 0; offset < xenopsd->processedSize; ) {
+    const char *message = xenopsd->messages + offset;
+    if (!strncmp(message, prefix, len))
+      ++count;
+    offset += (size_t)(strchr(message, '\n') - message) + 1;
+  }
+  return count;
+}
+
+bool stand_in_xenopsd_is_message (const char *message, const char *expected) {
+  const size_t len = strlen(expected);
+  return message && !strncmp(message, expected, len) && message[len] == '\n';
+}
+
+// =============================================================================
+// Striped stream.
+// =============================================================================
+
+void stand_in_striped_stream_create (StandInStripedStream *stream, int count) {
+  CHECK(count > 0 && count <= RELAY_MAX_STREAM_FDS && relay_can_restore(count));
+
+  int saveFds[RELAY_MAX_STREAM_FDS];
+  int restoreFds[RELAY_MAX_STREAM_FDS];
+  for (int i = 0; i < count; ++i) {
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0);
+    saveFds[i] = fds[0];
+    restoreFds[i] = fds[1];
+  }
+
+  // The relays own the socketpairs.
+  CHECK(relay_create(&stream->save, saveFds, count, RelayDirectionSave, NULL, &stream->saveFd) == 0);
+  CHECK(relay_create(&stream->restore, restoreFds, count, RelayDirectionRestore, NULL, &stream->restoreFd) == 0);
+}
+
+void stand_in_striped_stream_destroy (StandInStripedStream *stream) {
+  CHECK(relay_finish(stream->save) == 0);
+  CHECK(relay_finish(stream->restore) == 0);
+  relay_destroy(stream->save);
+  relay_destroy(stream->restore);
+  close(stream->restoreFd);
+
+  // The relays are allocated like in a migration.
+  arena_release();
+}
+
+// =============================================================================
+// Migration.
+// =============================================================================
+
+// getopt is not reentrant.
+static pthread_mutex_t ParseMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *stand_in_migration_thread (void *userData) {
+  StandInMigration *migration = userData;
+
+  MigrationConfig config = {
+    .domId = (uint)-1,
+    .controlInFd = -1,
+    .controlOutFd = -1,
+    .progressInterval = -1
+  };
+
+  pthread_mutex_lock(&ParseMutex);
+  migration->ret = migration_parse_args(&config, migration->argc, (char **)migration->argv);
+  pthread_mutex_unlock(&ParseMutex);
+
+  if (migration->ret == 0)
+    migration->ret = migration_run(&config);
+  return NULL;
+}
+
+void stand_in_migration_start (StandInMigration *migration, const char *const *args) {
+  migration->argc = 0;
+  migration->argv[migration->argc++] = "emu-manager";
+  for (; *args; ++args) {
+    CHECK(migration->argc < STAND_IN_MAX_ARGS - 1);
+    migration->argv[migration->argc++] = *args;
+  }
+  migration->argv[migration->argc] = NULL;
+
+  CHECK(pthread_create(&migration->thread, NULL, stand_in_migration_thread, migration) == 0);
+}
+
+int stand_in_migration_join (StandInMigration *migration) {
+  pthread_join(migration->thread, NULL);
+  return migration->ret;
+}
+
+int stand_in_run_migration (const char *const *args) {
+  StandInMigration migration;
+  stand_in_migration_start(&migration, args);
+  return stand_in_migration_join(&migration);
+}
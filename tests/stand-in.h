@@ -0,0 +1,172 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _STAND_IN_H_
+#define _STAND_IN_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/un.h>
+
+// =============================================================================
+// Local peers of emu-manager used by the tests. Each one is run by a thread of
+// the test process.
+// =============================================================================
+
+// -----------------------------------------------------------------------------
+// Emu: EMP server listening on the default socket of an emu.
+// -----------------------------------------------------------------------------
+
+typedef struct StandInEmp StandInEmp;
+
+// Script of the emu, called when emu-manager is connected.
+typedef void (*StandInEmpMain)(StandInEmp *emp);
+
+struct StandInEmp {
+  int listenFd;
+  int fd; // Connection of emu-manager.
+  char path[sizeof ((struct sockaddr_un *)0)->sun_path];
+
+  // Received with migrate_init, -1 before.
+  int streamFd;
+
+  char buf[8192];
+  size_t bufSize;
+
+  // Last received command and the content of its arguments object.
+  char cmd[64];
+  char args[1024];
+
+  StandInEmpMain main;
+  void *userData;
+  pthread_t thread;
+};
+
+// Returns TEST_SKIP if the EMP socket cannot be created, e.g. missing rights.
+int stand_in_emp_start (StandInEmp *emp, const char *emuName, unsigned domId, StandInEmpMain main, void *userData);
+void stand_in_emp_join (StandInEmp *emp);
+
+// Wait for the next command: 1 if received, 0 on timeout (in ms) and -1 when
+// emu-manager is disconnected.
+int stand_in_emp_next_cmd (StandInEmp *emp, int timeout);
+bool stand_in_emp_cmd_is (const StandInEmp *emp, const char *name);
+
+// Value of an argument of the last command, NULL if it's missing.
+const char *stand_in_emp_get_arg (const StandInEmp *emp, const char *key, char *buf, size_t size);
+
+void stand_in_emp_reply (StandInEmp *emp);
+
+// Send a MIGRATION event, the format gives the content of the data object.
+void stand_in_emp_send_event (StandInEmp *emp, const char *format, ...)
+  __attribute__((format(printf, 2, 3)));
+
+// Acknowledge all commands until emu-manager is disconnected.
+void stand_in_emp_serve (StandInEmp *emp);
+
+// -----------------------------------------------------------------------------
+// Xenopsd: control channel of a migration.
+// -----------------------------------------------------------------------------
+
+typedef struct StandInXenopsd {
+  int fd;
+  int emuFd; // Other end of the control channel, -1 if not owned.
+
+  // Emu restored at start, NULL in save mode.
+  const char *restoreEmu;
+
+  // Delay of the first read (ms): the messages of emu-manager are queued.
+  int readDelay;
+
+  // Received messages separated by new line chars.
+  char messages[64 * 1024];
+  size_t messagesSize;
+  size_t processedSize; // Complete messages.
+
+  pthread_mutex_t mutex;
+  pthread_cond_t received;
+  pthread_t thread;
+} StandInXenopsd;
+
+// Create the control channel: `emuFd` must be given to emu-manager.
+int stand_in_xenopsd_start (StandInXenopsd *xenopsd);
+
+// Serve an existing channel, e.g. a daemon request connection.
+int stand_in_xenopsd_attach (StandInXenopsd *xenopsd, int fd);
+
+// Request a migration to the daemon listening on path, see: daemon.h.
+// The request connection is the control channel.
+int stand_in_xenopsd_request (StandInXenopsd *xenopsd, const char *path, const char *const *args, const int *fds, size_t fdsCount);
+
+// Send a message to emu-manager, e.g. "abort\n".
+void stand_in_xenopsd_send (StandInXenopsd *xenopsd, const char *message);
+
+// Close the emu-manager end if owned and wait for the end of the channel.
+void stand_in_xenopsd_join (StandInXenopsd *xenopsd);
+
+// Wait for a message starting with prefix. Returns false on timeout (ms).
+bool stand_in_xenopsd_wait (StandInXenopsd *xenopsd, const char *prefix, int timeout);
+
+// First received message starting with prefix, NULL if none. Only valid after join.
+const char *stand_in_xenopsd_find (const StandInXenopsd *xenopsd, const char *prefix);
+size_t stand_in_xenopsd_count (const StandInXenopsd *xenopsd, const char *prefix);
+
+// True if a message returned by stand_in_xenopsd_find is expected.
+bool stand_in_xenopsd_is_message (const char *message, const char *expected);
+
+// -----------------------------------------------------------------------------
+// Striped stream: a save relay linked to a restore relay by socketpairs.
+// -----------------------------------------------------------------------------
+
+typedef struct Relay Relay;
+
+typedef struct StandInStripedStream {
+  int saveFd; // Written like by a saving emu, it must be closed at the end.
+  int restoreFd; // Read like by a restoring emu until the end of the stream.
+
+  Relay *save;
+  Relay *restore;
+} StandInStripedStream;
+
+// count must be in [1, RELAY_MAX_STREAM_FDS]. A single fd is not striped:
+// it must be framed by a codec or checksums, see: relay_can_restore.
+void stand_in_striped_stream_create (StandInStripedStream *stream, int count);
+
+// Called after the end of the stream by the creator thread.
+void stand_in_striped_stream_destroy (StandInStripedStream *stream);
+
+// -----------------------------------------------------------------------------
+// Migration run by a new thread: its emus and config are not shared with the
+// previous migrations of the process.
+// -----------------------------------------------------------------------------
+
+#define STAND_IN_MAX_ARGS 32
+
+typedef struct StandInMigration {
+  const char *argv[STAND_IN_MAX_ARGS];
+  int argc;
+  int ret;
+  pthread_t thread;
+} StandInMigration;
+
+// Arguments of emu-manager terminated by NULL, without the program name.
+void stand_in_migration_start (StandInMigration *migration, const char *const *args);
+int stand_in_migration_join (StandInMigration *migration);
+
+int stand_in_run_migration (const char *const *args);
+
+#endif // ifndef _STAND_IN_H_
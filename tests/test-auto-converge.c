@@ -0,0 +1,275 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <xcp-ng/generic.h>
+
+#include "monotonic-clock.h"
+#include "stand-in.h"
+#include "test.h"
+
+// =============================================================================
+// Auto-converge: a stand-in xenguest simulates a guest dirtying its memory at
+// a fixed rate, reduced by the throttle sent by emu-manager. The dirty set of
+// an iteration is sent in the next one at the link rate.
+// =============================================================================
+
+#define MAX_THROTTLES 32
+
+typedef struct DirtyingGuest {
+  // Rates in units/ms.
+  double linkRate;
+  double dirtyRate;
+  int64_t memory;
+
+  int throttles[MAX_THROTTLES];
+  int throttlesCount;
+  int throttle;
+  bool isReleased; // Throttle removed after the pause.
+  bool isCompleted;
+  bool isDisconnected; // During the live stage.
+} DirtyingGuest;
+
+static int64_t now_ms () {
+  return monotonic_clock_us() / 1000;
+}
+
+// Returns false when the guest is paused.
+static bool dirtying_guest_process_cmd (StandInEmp *emp, DirtyingGuest *guest) {
+  bool isRunning = true;
+  if (stand_in_emp_cmd_is(emp, "migrate_throttle")) {
+    char buf[16];
+    CHECK(stand_in_emp_get_arg(emp, "percentage", buf, sizeof buf));
+    guest->throttle = atoi(buf);
+    CHECK(guest->throttlesCount < MAX_THROTTLES);
+    guest->throttles[guest->throttlesCount++] = guest->throttle;
+  } else if (stand_in_emp_cmd_is(emp, "migrate_pause"))
+    isRunning = false;
+  stand_in_emp_reply(emp);
+  return isRunning;
+}
+
+static void dirtying_guest_main (StandInEmp *emp) {
+  DirtyingGuest *guest = emp->userData;
+
+  // 1. Setup until the live stage.
+  while (stand_in_emp_next_cmd(emp, 10000) > 0) {
+    stand_in_emp_reply(emp);
+    if (stand_in_emp_cmd_is(emp, "migrate_live"))
+      break;
+  }
+  CHECK(stand_in_emp_cmd_is(emp, "migrate_live"));
+  CHECK(emp->streamFd > -1);
+
+  // 2. Live stage.
+  static const char page[512];
+  int64_t sent = 0;
+  int64_t remaining = guest->memory;
+  bool isRunning = true;
+  for (int iteration = 0; isRunning; ++iteration) {
+    stand_in_emp_send_event(emp, "\"sent\":%" PRId64 ",\"remaining\":%" PRId64 ",\"iteration\":%d",
+      sent, remaining, iteration
+    );
+    CHECK(write(emp->streamFd, page, sizeof page) == sizeof page);
+
+    int64_t duration = (int64_t)((double)remaining / guest->linkRate);
+    if (duration < 1)
+      duration = 1;
+
+    const int64_t end = now_ms() + duration;
+    for (int64_t left; isRunning && (left = end - now_ms()) > 0; ) {
+      const int ret = stand_in_emp_next_cmd(emp, (int)left);
+      if (ret < 0) {
+        guest->isDisconnected = true;
+        return;
+      }
+      if (ret)
+        isRunning = dirtying_guest_process_cmd(emp, guest);
+    }
+
+    sent += remaining;
+    remaining = (int64_t)(guest->dirtyRate * (100 - guest->throttle) / 100 * (double)duration);
+  }
+
+  // 3. Stop-and-copy, the throttle must be released before the end.
+  while (stand_in_emp_next_cmd(emp, 10000) > 0) {
+    if (stand_in_emp_cmd_is(emp, "migrate_throttle")) {
+      char buf[16];
+      CHECK(stand_in_emp_get_arg(emp, "percentage", buf, sizeof buf));
+      guest->isReleased = atoi(buf) == 0;
+    }
+    stand_in_emp_reply(emp);
+
+    if (stand_in_emp_cmd_is(emp, "migrate_paused")) {
+      stand_in_emp_send_event(emp, "\"status\":\"completed\"");
+      guest->isCompleted = true;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+static void *drain_stream (void *userData) {
+  const int fd = *(int *)userData;
+  char buf[4096];
+  while (read(fd, buf, sizeof buf) > 0);
+  return NULL;
+}
+
+// Returns the result of the migration, or TEST_SKIP.
+static int run_save (DirtyingGuest *guest, const char *maxDowntime, StandInXenopsd *xenopsd) {
+  StandInEmp emp;
+  const int ret = stand_in_emp_start(&emp, "xenguest", test_get_dom_id(), dirtying_guest_main, guest);
+  if (ret)
+    return ret;
+
+  *xenopsd = (StandInXenopsd){ 0 };
+  stand_in_xenopsd_start(xenopsd);
+
+  int streamFds[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, streamFds) == 0);
+  pthread_t drainThread;
+  CHECK(pthread_create(&drainThread, NULL, drain_stream, &streamFds[0]) == 0);
+
+  char domId[16];
+  char streamFd[16];
+  char controlFd[16];
+  snprintf(domId, sizeof domId, "%u", test_get_dom_id());
+  snprintf(streamFd, sizeof streamFd, "%d", streamFds[1]);
+  snprintf(controlFd, sizeof controlFd, "%d", xenopsd->emuFd);
+
+  // Without a budget, the live stage is ended by the throttle.
+  const char *args[] = {
+    "--mode", "hvm_save",
+    "--live", "true",
+    "--domid", domId,
+    "--fd", streamFd,
+    "--controlinfd", controlFd,
+    "--controloutfd", controlFd,
+    "--convergence", "no-progress",
+    "--auto-converge",
+    NULL,
+    NULL
+  };
+  if (maxDowntime) {
+    args[XCP_ARRAY_LEN(args) - 3] = "--max-downtime-ms";
+    args[XCP_ARRAY_LEN(args) - 2] = maxDowntime;
+  }
+  const int result = stand_in_run_migration(args);
+
+  stand_in_xenopsd_join(xenopsd);
+  stand_in_emp_join(&emp);
+  pthread_join(drainThread, NULL);
+  close(streamFds[0]);
+  return result;
+}
+
+static int run_converging_save (DirtyingGuest *guest) {
+  StandInXenopsd xenopsd;
+  const int ret = run_save(guest, NULL, &xenopsd);
+  if (ret == TEST_SKIP)
+    return ret;
+  CHECK_INT_EQ(ret, 0);
+
+  CHECK(stand_in_xenopsd_find(&xenopsd, "result:0 0"));
+  CHECK(!stand_in_xenopsd_find(&xenopsd, "error:"));
+  CHECK(guest->isCompleted);
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+// The guest dirties its memory faster than the link: the throttle is
+// increased at each overrun iteration and it's released at pause.
+static int test_fast_dirtying_guest () {
+  DirtyingGuest guest = {
+    .linkRate = 1000,
+    .dirtyRate = 2200,
+    .memory = 5000
+  };
+  const int ret = run_converging_save(&guest);
+  if (ret)
+    return ret;
+
+  CHECK(guest.throttlesCount >= 2);
+  CHECK_INT_EQ(guest.throttles[0], 20);
+  for (int i = 1; i < guest.throttlesCount; ++i)
+    CHECK_INT_EQ(guest.throttles[i], guest.throttles[i - 1] + 10);
+
+  // The last throttle stopped the overrun.
+  const int throttle = guest.throttles[guest.throttlesCount - 1];
+  CHECK(guest.dirtyRate * (100 - throttle) / 100 < guest.linkRate);
+  CHECK(guest.isReleased);
+  return 0;
+}
+
+// The link is faster than the guest: no throttle.
+static int test_slow_dirtying_guest () {
+  DirtyingGuest guest = {
+    .linkRate = 1000,
+    .dirtyRate = 300,
+    .memory = 5000
+  };
+  const int ret = run_converging_save(&guest);
+  if (ret)
+    return ret;
+
+  CHECK_INT_EQ(guest.throttlesCount, 0);
+  CHECK(!guest.isReleased);
+  return 0;
+}
+
+// The predicted downtime stays over the budget until the last iteration: the
+// migration fails with a distinct error.
+static int test_downtime_budget () {
+  DirtyingGuest guest = {
+    .linkRate = 1000,
+    .dirtyRate = 1500,
+    .memory = 5000
+  };
+  StandInXenopsd xenopsd;
+  const int ret = run_save(&guest, "1", &xenopsd);
+  if (ret == TEST_SKIP)
+    return ret;
+  CHECK(ret != 0);
+
+  CHECK(stand_in_xenopsd_is_message(
+    stand_in_xenopsd_find(&xenopsd, "error:"), "error:xenguest cannot meet the downtime budget"
+  ));
+  CHECK(!stand_in_xenopsd_find(&xenopsd, "result:"));
+  CHECK(!guest.isCompleted);
+  return 0;
+}
+
+int main () {
+  test_init("test-auto-converge");
+
+  int ret;
+  if (
+    (ret = test_fast_dirtying_guest()) ||
+    (ret = test_slow_dirtying_guest()) ||
+    (ret = test_downtime_budget())
+  )
+    return ret;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,486 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "codec.h"
+#include "compressor.h"
+#include "emu.h"
+#include "monotonic-clock.h"
+#include "relay.h"
+#include "stand-in.h"
+#include "test.h"
+
+// =============================================================================
+// Compressed streams: the data of a saving emu goes through a save relay, its
+// frames are captured and given to a restore relay, followed by the data of
+// xenopsd. The restoring emu must read the same bytes and the data of xenopsd
+// must be left on the stream.
+// =============================================================================
+
+#define FRAME_SIZE (256 * 1024)
+
+// Incompressible, then compressible: the compression is bypassed, then
+// resumed, see: compressor_update_bypass.
+#define RANDOM_SIZE (40 * FRAME_SIZE)
+#define PATTERN_SIZE (128 * FRAME_SIZE)
+#define STREAM_SIZE (RANDOM_SIZE + PATTERN_SIZE)
+
+// Slower than the codecs, so the compression of the pattern pays.
+#define LINK_RATE (32 * 1024 * 1024)
+
+// While bypassed, a frame out of COMPRESSOR_PROBE_INTERVAL is compressed.
+#define RESUMED_FRAMES 4
+
+static const char XenopsdRecord[] = "XENOPSD RECORD";
+
+static char *Data;
+
+typedef struct Writer {
+  int fd;
+  const char *data;
+  size_t size;
+  bool closeFd;
+  bool isCut; // The reader may stop before the end of the data.
+  pthread_t thread;
+} Writer;
+
+static void *writer_thread (void *userData) {
+  Writer *writer = userData;
+
+  for (size_t offset = 0; offset < writer->size; ) {
+    const ssize_t ret = write(writer->fd, writer->data + offset, writer->size - offset);
+    if (ret < 0 && errno == EPIPE && writer->isCut)
+      break;
+    CHECK(ret > 0);
+    offset += (size_t)ret;
+  }
+  if (writer->closeFd)
+    close(writer->fd);
+
+  return NULL;
+}
+
+static void writer_start (Writer *writer, int fd, const char *data, size_t size, bool closeFd, bool isCut) {
+  *writer = (Writer){ .fd = fd, .data = data, .size = size, .closeFd = closeFd, .isCut = isCut };
+  CHECK(pthread_create(&writer->thread, NULL, writer_thread, writer) == 0);
+}
+
+static void read_full (int fd, char *buf, size_t size) {
+  for (size_t offset = 0; offset < size; ) {
+    const ssize_t ret = read(fd, buf + offset, size - offset);
+    CHECK(ret > 0);
+    offset += (size_t)ret;
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+typedef struct Wire {
+  char *data;
+  size_t size;
+  size_t capacity;
+} Wire;
+
+static char *wire_reserve (Wire *wire, size_t size) {
+  if (wire->size + size > wire->capacity) {
+    wire->capacity = (wire->size + size) * 2;
+    CHECK((wire->data = realloc(wire->data, wire->capacity)));
+  }
+  char *buf = wire->data + wire->size;
+  wire->size += size;
+  return buf;
+}
+
+// Append the next frame of a save relay to the wire. Returns false at the end frame.
+static bool capture_frame (int fd, Wire *wire, CodecFrameHeader *header) {
+  char *buf = wire_reserve(wire, CODEC_FRAME_HEADER_SIZE);
+  read_full(fd, buf, CODEC_FRAME_HEADER_SIZE);
+
+  CHECK(codec_read_frame_header(buf, header) == 0);
+  if (codec_frame_is_end(header))
+    return false;
+
+  const size_t payloadSize = codec_frame_get_payload_size(header);
+  read_full(fd, wire_reserve(wire, payloadSize), payloadSize);
+  return true;
+}
+
+// Read the frames up to the end frame and check the bypass of the codec.
+static void capture_save_stream (int fd, const Codec *codec, Wire *wire) {
+  size_t rawOffset = 0;
+  int bypassedFrames = 0;
+  int compressedFrames = 0; // In a row, after a bypassed frame.
+  bool isResumed = false;
+
+  CodecFrameHeader header;
+  while (capture_frame(fd, wire, &header)) {
+    CHECK(header.codec == CodecIdNone || header.codec == codec->id);
+    CHECK(!(header.flags & CODEC_FRAME_FLAG_CHECKSUM));
+
+    if (rawOffset >= RANDOM_SIZE) {
+      if (header.codec == CodecIdNone) {
+        ++bypassedFrames;
+        compressedFrames = 0;
+      } else if (bypassedFrames && ++compressedFrames == RESUMED_FRAMES)
+        isResumed = true;
+    }
+    rawOffset += header.rawSize;
+  }
+  CHECK_INT_EQ(rawOffset, STREAM_SIZE);
+
+  // The pattern is sent raw until the probes show that the codec is worth it.
+  CHECK(bypassedFrames > 0);
+  CHECK(isResumed);
+}
+
+static void check_restored_stream (int fd) {
+  char *buf = malloc(FRAME_SIZE);
+  CHECK(buf);
+
+  size_t offset = 0;
+  ssize_t ret;
+  while ((ret = read(fd, buf, FRAME_SIZE)) > 0) {
+    CHECK(offset + (size_t)ret <= STREAM_SIZE);
+    CHECK(!memcmp(buf, Data + offset, (size_t)ret));
+    offset += (size_t)ret;
+  }
+  CHECK(ret == 0);
+  CHECK_INT_EQ(offset, STREAM_SIZE);
+
+  free(buf);
+}
+
+static void test_compression_round_trip (const char *codecName) {
+  CHECK(compressor_set_codec(codecName) == 0);
+  const Codec *codec = compressor_get_codec();
+  CHECK(codec);
+
+  // 1. Save.
+  int saveFds[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, saveFds) == 0);
+
+  Relay *save;
+  int emuFd;
+  CHECK(relay_create(&save, &saveFds[0], 1, RelayDirectionSave, NULL, &emuFd) == 0);
+  relay_set_rate_limit(save, LINK_RATE);
+
+  Writer emu;
+  writer_start(&emu, emuFd, Data, STREAM_SIZE, true, false);
+
+  Wire wire = { 0 };
+  capture_save_stream(saveFds[1], codec, &wire);
+  pthread_join(emu.thread, NULL);
+  CHECK(relay_finish(save) == 0);
+  relay_destroy(save);
+  close(saveFds[1]);
+
+  // 2. Restore, the stream is shared with xenopsd.
+  memcpy(wire_reserve(&wire, sizeof XenopsdRecord), XenopsdRecord, sizeof XenopsdRecord);
+
+  int restoreFds[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, restoreFds) == 0);
+  int streamFd = dup(restoreFds[1]);
+  CHECK(streamFd > -1);
+
+  Writer sender;
+  writer_start(&sender, restoreFds[0], wire.data, wire.size, false, false);
+
+  Relay *restore;
+  CHECK(relay_create(&restore, &streamFd, 1, RelayDirectionRestore, NULL, &emuFd) == 0);
+  check_restored_stream(emuFd);
+  close(emuFd);
+  pthread_join(sender.thread, NULL);
+  CHECK(relay_finish(restore) == 0);
+  relay_destroy(restore);
+
+  // 3. The data after the end frame is not read.
+  char buf[sizeof XenopsdRecord + 1];
+  struct pollfd pfd = { .fd = restoreFds[1], .events = POLLIN };
+  CHECK(poll(&pfd, 1, 1000) == 1);
+  CHECK_INT_EQ(read(restoreFds[1], buf, sizeof buf), sizeof XenopsdRecord);
+  CHECK(!memcmp(buf, XenopsdRecord, sizeof XenopsdRecord));
+
+  close(restoreFds[0]);
+  close(restoreFds[1]);
+  free(wire.data);
+  arena_release();
+}
+
+// -----------------------------------------------------------------------------
+
+static void write_header (char *buf, CodecId codec, int flags, uint32_t rawSize, uint32_t dataSize) {
+  codec_write_frame_header(buf, &(CodecFrameHeader){ codec, flags, rawSize, dataSize });
+}
+
+static void test_frame_headers () {
+  char buf[CODEC_FRAME_HEADER_SIZE];
+  CodecFrameHeader header;
+
+  write_header(buf, CodecIdLz4, CODEC_FRAME_FLAG_CHECKSUM, CODEC_FRAME_MAX_SIZE, 100);
+  CHECK(codec_read_frame_header(buf, &header) == 0);
+  CHECK(header.codec == CodecIdLz4);
+  CHECK_INT_EQ(header.flags, CODEC_FRAME_FLAG_CHECKSUM);
+  CHECK_INT_EQ(header.rawSize, CODEC_FRAME_MAX_SIZE);
+  CHECK_INT_EQ(header.dataSize, 100);
+  CHECK_INT_EQ(codec_frame_get_payload_size(&header), 100 + CODEC_FRAME_CHECKSUM_SIZE);
+
+  write_header(buf, CodecIdNone, 0, 0, 0);
+  CHECK(codec_read_frame_header(buf, &header) == 0);
+  CHECK(codec_frame_is_end(&header));
+
+  // Bad magic, unknown codec or flags.
+  write_header(buf, CodecIdNone, 0, 100, 100);
+  CHECK(codec_read_frame_header(buf, &header) == 0);
+  buf[3] = '2';
+  CHECK(codec_read_frame_header(buf, &header) < 0);
+  write_header(buf, (CodecId)3, 0, 100, 100);
+  CHECK(codec_read_frame_header(buf, &header) < 0);
+  write_header(buf, CodecIdNone, CODEC_FRAME_FLAG_CHECKSUM << 1, 100, 100);
+  CHECK(codec_read_frame_header(buf, &header) < 0);
+
+  // End frames have no payload.
+  write_header(buf, CodecIdNone, 0, 0, 1);
+  CHECK(codec_read_frame_header(buf, &header) < 0);
+  write_header(buf, CodecIdLz4, 0, 0, 0);
+  CHECK(codec_read_frame_header(buf, &header) < 0);
+  write_header(buf, CodecIdNone, CODEC_FRAME_FLAG_CHECKSUM, 0, 0);
+  CHECK(codec_read_frame_header(buf, &header) < 0);
+
+  // Sizes.
+  write_header(buf, CodecIdNone, 0, CODEC_FRAME_MAX_SIZE + 1, 100);
+  CHECK(codec_read_frame_header(buf, &header) < 0);
+  write_header(buf, CodecIdZlib, 0, 100, 0);
+  CHECK(codec_read_frame_header(buf, &header) < 0);
+  write_header(buf, CodecIdNone, 0, 100, 101);
+  CHECK(codec_read_frame_header(buf, &header) < 0);
+  const size_t bound = codec_from_id(CodecIdZlib)->get_bound(100);
+  write_header(buf, CodecIdZlib, 0, 100, (uint32_t)bound);
+  CHECK(codec_read_frame_header(buf, &header) == 0);
+  write_header(buf, CodecIdZlib, 0, 100, (uint32_t)bound + 1);
+  CHECK(codec_read_frame_header(buf, &header) < 0);
+}
+
+// A restore relay stops at an invalid header or at a truncated stream.
+static void test_broken_streams () {
+  CHECK(compressor_set_codec("zlib") == 0);
+
+  for (int i = 0; i < 2; ++i) {
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0);
+
+    Relay *restore;
+    int emuFd;
+    CHECK(relay_create(&restore, &fds[1], 1, RelayDirectionRestore, NULL, &emuFd) == 0);
+
+    char buf[CODEC_FRAME_HEADER_SIZE + 10] = { 0 };
+    int expectedError;
+    if (i == 0) {
+      write_header(buf, (CodecId)3, 0, 100, 100);
+      expectedError = EBADMSG;
+    } else {
+      write_header(buf, CodecIdNone, 0, 100, 100);
+      expectedError = EPIPE;
+    }
+    CHECK(write(fds[0], buf, sizeof buf) == (ssize_t)sizeof buf);
+    close(fds[0]);
+
+    struct pollfd pfd = { .fd = relay_get_event_fd(restore), .events = POLLIN };
+    CHECK(poll(&pfd, 1, 5000) == 1);
+    CHECK_INT_EQ(relay_get_error(restore), expectedError);
+
+    // The emu is not blocked.
+    char c;
+    CHECK(read(emuFd, &c, 1) == 0);
+    close(emuFd);
+
+    CHECK(relay_finish(restore) < 0);
+    CHECK_INT_EQ(EmuError, expectedError);
+    relay_destroy(restore);
+  }
+  arena_release();
+}
+
+// -----------------------------------------------------------------------------
+// Checksums: a restore with --checksum must stop at the first altered frame or
+// at the first frame without checksum, instead of giving them to the emu.
+// -----------------------------------------------------------------------------
+
+#define CHECKSUM_STREAM_SIZE (8 * FRAME_SIZE)
+
+// Save the start of the pattern with the current config of the relays. Returns
+// the offset of a byte in the payload of the last frame.
+static size_t save_stream (Wire *wire, bool hasChecksums) {
+  int fds[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0);
+
+  Relay *save;
+  int emuFd;
+  CHECK(relay_create(&save, &fds[0], 1, RelayDirectionSave, NULL, &emuFd) == 0);
+
+  Writer emu;
+  writer_start(&emu, emuFd, Data + RANDOM_SIZE, CHECKSUM_STREAM_SIZE, true, false);
+
+  size_t rawSize = 0;
+  size_t payloadOffset = 0;
+  CodecFrameHeader header;
+  for (size_t offset = 0; capture_frame(fds[1], wire, &header); offset = wire->size) {
+    CHECK(!!(header.flags & CODEC_FRAME_FLAG_CHECKSUM) == hasChecksums);
+    rawSize += header.rawSize;
+    payloadOffset = offset + CODEC_FRAME_HEADER_SIZE + header.dataSize / 2;
+  }
+  CHECK_INT_EQ(rawSize, CHECKSUM_STREAM_SIZE);
+
+  pthread_join(emu.thread, NULL);
+  CHECK(relay_finish(save) == 0);
+  relay_destroy(save);
+  close(fds[1]);
+  arena_release();
+
+  return payloadOffset;
+}
+
+static void checksum_destination_main (StandInEmp *emp) {
+  while (stand_in_emp_next_cmd(emp, 10000) > 0) {
+    stand_in_emp_reply(emp);
+    if (stand_in_emp_cmd_is(emp, "restore"))
+      break;
+  }
+  CHECK(stand_in_emp_cmd_is(emp, "restore"));
+  CHECK(emp->streamFd > -1);
+
+  // The relay closes the stream of the emu when it fails.
+  char buf[64 * 1024];
+  size_t size = 0;
+  ssize_t ret;
+  while ((ret = read(emp->streamFd, buf, sizeof buf)) > 0)
+    size += (size_t)ret;
+  CHECK(ret == 0);
+  CHECK(size < CHECKSUM_STREAM_SIZE);
+
+  // Not completed: emu-manager must abort the migration by itself.
+  stand_in_emp_serve(emp);
+}
+
+static int test_checksum_restore (const Wire *wire) {
+  const unsigned domId = test_get_dom_id();
+
+  StandInEmp emp;
+  int ret = stand_in_emp_start(&emp, "xenguest", domId, checksum_destination_main, NULL);
+  if (ret)
+    return ret;
+
+  StandInXenopsd xenopsd = { .restoreEmu = "xenguest" };
+  stand_in_xenopsd_start(&xenopsd);
+
+  int streamFds[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, streamFds) == 0);
+  const int emuStreamFd = dup(streamFds[1]);
+  CHECK(emuStreamFd > -1);
+
+  Writer sender;
+  writer_start(&sender, streamFds[0], wire->data, wire->size, false, true);
+
+  char args[3][16];
+  snprintf(args[0], sizeof args[0], "%u", domId);
+  snprintf(args[1], sizeof args[1], "%d", emuStreamFd);
+  snprintf(args[2], sizeof args[2], "%d", xenopsd.emuFd);
+
+  const char *const restoreArgs[] = {
+    "--mode", "hvm_restore",
+    "--domid", args[0],
+    "--fd", args[1],
+    "--controlinfd", args[2],
+    "--controloutfd", args[2],
+    "--checksum",
+    NULL
+  };
+  const int64_t start = monotonic_clock_us();
+  CHECK(stand_in_run_migration(restoreArgs) != 0);
+  CHECK(monotonic_clock_us() - start < 5000000);
+
+  stand_in_xenopsd_join(&xenopsd);
+  stand_in_emp_join(&emp);
+  CHECK(!stand_in_xenopsd_find(&xenopsd, "result:"));
+  const char *error = stand_in_xenopsd_find(&xenopsd, "error:");
+  CHECK(error);
+  CHECK(stand_in_xenopsd_is_message(error, "error:Bad message"));
+
+  // The rest of the stream is not read by the relay.
+  close(streamFds[1]);
+  pthread_join(sender.thread, NULL);
+  close(streamFds[0]);
+  return 0;
+}
+
+static int test_checksums () {
+  // 1. Frames without checksum.
+  CHECK(compressor_set_codec("zlib") == 0);
+  Wire wire = { 0 };
+  save_stream(&wire, false);
+
+  int ret = test_checksum_restore(&wire);
+  free(wire.data);
+  if (ret)
+    return ret;
+
+  // 2. A byte altered in transit.
+  CHECK(compressor_set_codec("none") == 0);
+  compressor_enable_checksum();
+  wire = (Wire){ 0 };
+  const size_t offset = save_stream(&wire, true);
+  wire.data[offset] ^= 1;
+
+  ret = test_checksum_restore(&wire);
+  free(wire.data);
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+
+int main () {
+  test_init("test-compression");
+
+  CHECK((Data = malloc(STREAM_SIZE)));
+  unsigned seed = 42;
+  for (size_t i = 0; i < RANDOM_SIZE; ++i)
+    Data[i] = (char)rand_r(&seed);
+  for (size_t i = RANDOM_SIZE; i < STREAM_SIZE; ++i)
+    Data[i] = test_pattern_at(i);
+
+  // Few workers: the bypass is decided for the next chunks only.
+  CHECK(compressor_set_threads(2) == 0);
+
+  test_frame_headers();
+  test_compression_round_trip("lz4");
+  test_compression_round_trip("zlib");
+  test_broken_streams();
+  const int ret = test_checksums();
+
+  free(Data);
+  return ret ? ret : EXIT_SUCCESS;
+}
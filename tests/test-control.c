@@ -0,0 +1,145 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "stand-in.h"
+#include "test.h"
+
+// =============================================================================
+// Control channel of a restore: xenopsd is slow to read and the output pipe is
+// full when the result is sent. The result must be received before the end of
+// the migration and the flags of the fd must be restored.
+// =============================================================================
+
+typedef struct SlowReader {
+  int fd;
+  char buf[256 * 1024];
+  size_t size;
+  pthread_t thread;
+} SlowReader;
+
+static void *slow_reader_thread (void *userData) {
+  SlowReader *reader = userData;
+
+  usleep(200000);
+
+  ssize_t ret;
+  while ((ret = read(reader->fd, reader->buf + reader->size, sizeof reader->buf - 1 - reader->size)) > 0)
+    reader->size += (size_t)ret;
+  CHECK(ret == 0);
+  reader->buf[reader->size] = '\0';
+  return NULL;
+}
+
+static void destination_main (StandInEmp *emp) {
+  while (stand_in_emp_next_cmd(emp, 10000) > 0) {
+    stand_in_emp_reply(emp);
+    if (stand_in_emp_cmd_is(emp, "restore"))
+      break;
+  }
+  CHECK(stand_in_emp_cmd_is(emp, "restore"));
+  CHECK(emp->streamFd > -1);
+
+  char c;
+  CHECK(read(emp->streamFd, &c, 1) == 1 && c == 'E');
+  CHECK(read(emp->streamFd, &c, 1) == 0);
+
+  stand_in_emp_send_event(emp, "\"status\":\"completed\",\"result\":\"7 8\"");
+  stand_in_emp_serve(emp);
+}
+
+// -----------------------------------------------------------------------------
+
+static int test_control_restore_result () {
+  const unsigned domId = test_get_dom_id();
+
+  StandInEmp emp;
+  const int ret = stand_in_emp_start(&emp, "xenguest", domId, destination_main, NULL);
+  if (ret)
+    return ret;
+
+  int streamFds[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, streamFds) == 0);
+  CHECK(write(streamFds[0], "E", 1) == 1);
+  close(streamFds[0]);
+
+  int controlInFds[2];
+  int controlOutFds[2];
+  CHECK(pipe2(controlInFds, O_CLOEXEC) == 0);
+  CHECK(pipe2(controlOutFds, O_CLOEXEC) == 0);
+  CHECK(write(controlInFds[1], "restore:xenguest\n", sizeof "restore:xenguest\n" - 1) > 0);
+
+  // Messages of emu-manager are queued from the start.
+  const int pipeSize = fcntl(controlOutFds[1], F_GETPIPE_SZ);
+  CHECK(pipeSize > 0);
+  char *filler = malloc((size_t)pipeSize);
+  CHECK(filler);
+  memset(filler, 'x', (size_t)pipeSize);
+  CHECK(write(controlOutFds[1], filler, (size_t)pipeSize) == pipeSize);
+  free(filler);
+
+  SlowReader reader = { .fd = controlOutFds[0] };
+  CHECK(pthread_create(&reader.thread, NULL, slow_reader_thread, &reader) == 0);
+
+  const int flags = fcntl(controlOutFds[1], F_GETFL);
+
+  char args[3][16];
+  snprintf(args[0], sizeof args[0], "%u", domId);
+  snprintf(args[1], sizeof args[1], "%d", streamFds[1]);
+  snprintf(args[2], sizeof args[2], "%d", controlInFds[0]);
+  char controlOutFd[16];
+  snprintf(controlOutFd, sizeof controlOutFd, "%d", controlOutFds[1]);
+
+  const char *const restoreArgs[] = {
+    "--mode", "hvm_restore",
+    "--domid", args[0],
+    "--fd", args[1],
+    "--controlinfd", args[2],
+    "--controloutfd", controlOutFd,
+    NULL
+  };
+  CHECK_INT_EQ(stand_in_run_migration(restoreArgs), 0);
+  stand_in_emp_join(&emp);
+
+  CHECK_INT_EQ(fcntl(controlOutFds[1], F_GETFL), flags);
+
+  close(controlOutFds[1]);
+  pthread_join(reader.thread, NULL);
+  close(controlOutFds[0]);
+  close(controlInFds[0]);
+  close(controlInFds[1]);
+
+  CHECK(reader.size > (size_t)pipeSize);
+  const char *messages = reader.buf + pipeSize;
+  CHECK(strstr(messages, "result:xenguest 7 8\n"));
+  CHECK(!strstr(messages, "error:"));
+  return 0;
+}
+
+int main () {
+  test_init("test-control");
+
+  const int ret = test_control_restore_result();
+  return ret ? ret : EXIT_SUCCESS;
+}
@@ -0,0 +1,81 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32c.h"
+#include "test.h"
+
+// =============================================================================
+// All the implementations supported by the CPU must give the CRC of the table.
+// =============================================================================
+
+#define TEST_SIZE (64 * 1024 + 123)
+
+static unsigned char Data[TEST_SIZE + 64];
+
+static void check_implementation (const char *name) {
+  CHECK(crc32c_set_implementation(name) == 0);
+  CHECK(!strcmp(crc32c_get_implementation(), name));
+
+  // Known value.
+  CHECK_INT_EQ(crc32c(0, "123456789", 9), 0xE3069283);
+  CHECK_INT_EQ(crc32c(0, "", 0), 0);
+
+  // Sizes around the blocks of each implementation, at each alignment.
+  uint32_t expected[64][64];
+  CHECK(crc32c_set_implementation("table") == 0);
+  for (size_t size = 0; size < 64 * 64; size += 64)
+    for (size_t offset = 0; offset < 64; ++offset)
+      expected[size / 64][offset] = crc32c(0x12345678, Data + offset, size + offset % 17);
+
+  CHECK(crc32c_set_implementation(name) == 0);
+  for (size_t size = 0; size < 64 * 64; size += 64)
+    for (size_t offset = 0; offset < 64; ++offset)
+      CHECK_INT_EQ(crc32c(0x12345678, Data + offset, size + offset % 17), expected[size / 64][offset]);
+
+  // Chained calls.
+  CHECK(crc32c_set_implementation("table") == 0);
+  const uint32_t crc = crc32c(0, Data, TEST_SIZE);
+  CHECK(crc32c_set_implementation(name) == 0);
+  CHECK_INT_EQ(crc32c(0, Data, TEST_SIZE), crc);
+  CHECK_INT_EQ(crc32c(crc32c(crc32c(0, Data, 1000), Data + 1000, 3), Data + 1003, TEST_SIZE - 1003), crc);
+}
+
+int main () {
+  test_init("test-crc32c");
+
+  unsigned seed = 42;
+  for (size_t i = 0; i < sizeof Data; ++i)
+    Data[i] = (unsigned char)rand_r(&seed);
+
+  // The selected implementation is the last one. The 512-bit lanes are never
+  // used for all the sizes: they're chosen by the auto implementation.
+  const char *const *names = crc32c_get_implementations();
+  const char *selected = crc32c_get_implementation();
+  int count = 0;
+  for (; names[count]; ++count)
+    check_implementation(names[count]);
+  CHECK(count > 0);
+  CHECK(!strcmp(names[count - 1], selected));
+  CHECK(strcmp(selected, "avx512-vpclmulqdq"));
+  if (!strcmp(selected, "auto"))
+    CHECK(count > 2 && !strcmp(names[count - 2], "avx512-vpclmulqdq"));
+
+  CHECK(crc32c_set_implementation("unknown") < 0);
+  return EXIT_SUCCESS;
+}
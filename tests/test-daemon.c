@@ -0,0 +1,210 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "stand-in.h"
+#include "test.h"
+
+// =============================================================================
+// Daemon: a stand-in xenopsd requests a save and a restore of two domains to
+// the same daemon. Their stream is a socketpair given with the requests.
+// =============================================================================
+
+static char DaemonDir[] = "/tmp/emu-manager-test-XXXXXX";
+static char DaemonPath[sizeof DaemonDir + 16];
+
+static void *daemon_thread (void *userData) {
+  (void)userData;
+  daemon_run(DaemonPath);
+  return NULL;
+}
+
+// -----------------------------------------------------------------------------
+
+static void source_main (StandInEmp *emp) {
+  while (stand_in_emp_next_cmd(emp, 10000) > 0) {
+    stand_in_emp_reply(emp);
+    if (stand_in_emp_cmd_is(emp, "migrate_live"))
+      break;
+  }
+  CHECK(stand_in_emp_cmd_is(emp, "migrate_live"));
+  CHECK(emp->streamFd > -1);
+
+  int ret = 0;
+  for (int iteration = 0; !ret; ++iteration) {
+    stand_in_emp_send_event(emp, "\"sent\":%d,\"remaining\":1000,\"iteration\":%d", iteration * 1000, iteration);
+    CHECK(write(emp->streamFd, "L", 1) == 1);
+    CHECK((ret = stand_in_emp_next_cmd(emp, 5)) > -1);
+    if (ret)
+      stand_in_emp_reply(emp);
+  }
+  CHECK(stand_in_emp_cmd_is(emp, "migrate_pause"));
+
+  while (stand_in_emp_next_cmd(emp, 10000) > 0) {
+    stand_in_emp_reply(emp);
+    if (!stand_in_emp_cmd_is(emp, "migrate_paused"))
+      continue;
+
+    CHECK(write(emp->streamFd, "E", 1) == 1);
+    close(emp->streamFd);
+    emp->streamFd = -1;
+    stand_in_emp_send_event(emp, "\"status\":\"completed\"");
+  }
+}
+
+static void destination_main (StandInEmp *emp) {
+  while (stand_in_emp_next_cmd(emp, 10000) > 0) {
+    stand_in_emp_reply(emp);
+    if (stand_in_emp_cmd_is(emp, "restore"))
+      break;
+  }
+  CHECK(stand_in_emp_cmd_is(emp, "restore"));
+  CHECK(emp->streamFd > -1);
+
+  char buf[256];
+  char last = 0;
+  ssize_t ret;
+  while ((ret = read(emp->streamFd, buf, sizeof buf)) > 0)
+    last = buf[ret - 1];
+  CHECK(ret == 0);
+  CHECK(last == 'E');
+
+  stand_in_emp_send_event(emp, "\"status\":\"completed\",\"result\":\"5 6\"");
+  stand_in_emp_serve(emp);
+}
+
+// -----------------------------------------------------------------------------
+
+// Two migrations are served at the same time by the daemon threads.
+static int test_daemon_migrations () {
+  const unsigned sourceDomId = test_get_dom_id();
+  const unsigned destinationDomId = sourceDomId + 1;
+
+  StandInEmp sourceEmp;
+  StandInEmp destinationEmp;
+  int ret = stand_in_emp_start(&sourceEmp, "xenguest", sourceDomId, source_main, NULL);
+  if (ret)
+    return ret;
+  if ((ret = stand_in_emp_start(&destinationEmp, "xenguest", destinationDomId, destination_main, NULL)))
+    return ret;
+
+  int streamFds[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, streamFds) == 0);
+
+  char domIds[2][16];
+  snprintf(domIds[0], sizeof domIds[0], "%u", sourceDomId);
+  snprintf(domIds[1], sizeof domIds[1], "%u", destinationDomId);
+
+  // Fd arguments are indexes in the fds of the request.
+  const char *const sourceArgs[] = {
+    "--mode", "hvm_save",
+    "--live", "true",
+    "--domid", domIds[0],
+    "--fd", "0",
+    "--convergence", "no-progress",
+    NULL
+  };
+  const char *const destinationArgs[] = {
+    "--mode", "hvm_restore",
+    "--domid", domIds[1],
+    "--fd", "0",
+    NULL
+  };
+
+  StandInXenopsd sourceXenopsd = { 0 };
+  StandInXenopsd destinationXenopsd = { .restoreEmu = "xenguest" };
+  stand_in_xenopsd_request(&destinationXenopsd, DaemonPath, destinationArgs, &streamFds[1], 1);
+  stand_in_xenopsd_request(&sourceXenopsd, DaemonPath, sourceArgs, &streamFds[0], 1);
+  close(streamFds[0]);
+  close(streamFds[1]);
+
+  // The daemon closes the request connections at the end of the migrations.
+  stand_in_xenopsd_join(&sourceXenopsd);
+  stand_in_xenopsd_join(&destinationXenopsd);
+  stand_in_emp_join(&sourceEmp);
+  stand_in_emp_join(&destinationEmp);
+
+  CHECK(!stand_in_xenopsd_find(&sourceXenopsd, "error:"));
+  CHECK(!stand_in_xenopsd_find(&destinationXenopsd, "error:"));
+  CHECK(stand_in_xenopsd_is_message(stand_in_xenopsd_find(&sourceXenopsd, "result:"), "result:0 0"));
+  CHECK(stand_in_xenopsd_is_message(stand_in_xenopsd_find(&destinationXenopsd, "result:"), "result:xenguest 5 6"));
+  return 0;
+}
+
+// Invalid requests are closed without starting a migration.
+static int test_daemon_invalid_requests () {
+  char domId[16];
+  snprintf(domId, sizeof domId, "%u", test_get_dom_id());
+
+  const char *const daemonArgs[] = {
+    "--mode", "hvm_save", "--domid", domId, "--fd", "0", "--daemon", DaemonPath, NULL
+  };
+  const char *const schedulerArgs[] = {
+    "--mode", "hvm_save", "--domid", domId, "--fd", "0", "--max-migrations", "1", NULL
+  };
+  const char *const fdIndexArgs[] = {
+    "--mode", "hvm_save", "--domid", domId, "--fd", "1", NULL
+  };
+  const char *const debugArgs[] = {
+    "--mode", "hvm_save", "--domid", domId, "--fd", "0", "--debug", NULL
+  };
+  const char *const *requests[] = { daemonArgs, schedulerArgs, fdIndexArgs, debugArgs };
+
+  for (size_t i = 0; i < sizeof requests / sizeof requests[0]; ++i) {
+    int streamFds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, streamFds) == 0);
+
+    StandInXenopsd xenopsd = { 0 };
+    stand_in_xenopsd_request(&xenopsd, DaemonPath, requests[i], &streamFds[0], 1);
+    close(streamFds[0]);
+    stand_in_xenopsd_join(&xenopsd);
+
+    // The received fd is closed by the daemon.
+    char c;
+    CHECK(read(streamFds[1], &c, 1) == 0);
+    close(streamFds[1]);
+
+    CHECK_INT_EQ(xenopsd.messagesSize, 0);
+  }
+  return 0;
+}
+
+int main () {
+  test_init("test-daemon");
+
+  CHECK(mkdtemp(DaemonDir));
+  snprintf(DaemonPath, sizeof DaemonPath, "%s/daemon", DaemonDir);
+
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, daemon_thread, NULL) == 0);
+  CHECK(pthread_detach(thread) == 0);
+
+  int ret = test_daemon_migrations();
+  if (!ret)
+    ret = test_daemon_invalid_requests();
+
+  unlink(DaemonPath);
+  rmdir(DaemonDir);
+  return ret ? ret : EXIT_SUCCESS;
+}
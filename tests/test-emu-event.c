@@ -0,0 +1,257 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include <xcp-ng/generic.h>
+
+#include "emu-event.h"
+#include "test.h"
+
+// =============================================================================
+// emu_event_parse: the usual EMP messages are decoded in place, even when they
+// are received byte by byte. The others are left to json-c, which must decode
+// them like the EMP client does, see: emu_client_process_json.
+// =============================================================================
+
+typedef struct TestMessage {
+  const char *json;
+  bool isReturn;
+
+  // Expected event, decoded in place or by json-c.
+  int fields;
+  const char *status;
+  const char *result;
+  int64_t sent;
+  int64_t remaining;
+  int iteration;
+} TestMessage;
+
+#define NO_PROGRESS .sent = -1, .remaining = -1, .iteration = -1
+
+static const TestMessage SupportedMessages[] = {
+  { "{\"return\":{}}", .isReturn = true, NO_PROGRESS },
+  { "{\"return\":{\"a\":[1,-2,true,false,null,\"x\",{}],\"b\":[]}}", .isReturn = true, NO_PROGRESS },
+  { "{\"event\":\"MIGRATION\"}", NO_PROGRESS },
+  {
+    "{\"event\":\"MIGRATION\",\"data\":{\"sent\":4096,\"remaining\":8192,\"iteration\":3}}",
+    .fields = EMU_EVENT_FIELD_SENT | EMU_EVENT_FIELD_REMAINING | EMU_EVENT_FIELD_ITERATION,
+    .sent = 4096, .remaining = 8192, .iteration = 3
+  },
+  {
+    " { \"event\" : \"MIGRATION\" ,\n\t\"data\" : { \"status\" : \"completed\" , \"result\" : \"5 6\" } }",
+    .fields = EMU_EVENT_FIELD_STATUS | EMU_EVENT_FIELD_RESULT,
+    .status = "completed", .result = "5 6", NO_PROGRESS
+  },
+  {
+    "{\"event\":\"MIGRATION\",\"data\":{\"sent\":9223372036854775807,\"remaining\":-9223372036854775807,\"iteration\":2147483647}}",
+    .fields = EMU_EVENT_FIELD_SENT | EMU_EVENT_FIELD_REMAINING | EMU_EVENT_FIELD_ITERATION,
+    .sent = INT64_MAX, .remaining = -INT64_MAX, .iteration = INT32_MAX
+  },
+  {
+    "{\"data\":{\"iteration\":-2147483648,\"status\":\"\"},\"event\":\"MIGRATION\"}",
+    .fields = EMU_EVENT_FIELD_ITERATION | EMU_EVENT_FIELD_STATUS,
+    .status = "", .sent = -1, .remaining = -1, .iteration = INT32_MIN
+  }
+};
+
+// Decoded by json-c only.
+static const TestMessage UnsupportedMessages[] = {
+  // Escaped strings.
+  {
+    "{\"event\":\"MIGRATION\",\"data\":{\"status\":\"comp\\u006ceted\",\"result\":\"5\\\"6\"}}",
+    .fields = EMU_EVENT_FIELD_STATUS | EMU_EVENT_FIELD_RESULT,
+    .status = "completed", .result = "5\"6", NO_PROGRESS
+  },
+
+  // Floats.
+  {
+    "{\"event\":\"MIGRATION\",\"data\":{\"sent\":1.5}}",
+    .fields = EMU_EVENT_FIELD_UNKNOWN, NO_PROGRESS
+  },
+  {
+    "{\"event\":\"MIGRATION\",\"data\":{\"remaining\":1e3}}",
+    .fields = EMU_EVENT_FIELD_UNKNOWN, NO_PROGRESS
+  },
+
+  // Unknown keys.
+  {
+    "{\"event\":\"MIGRATION\",\"data\":{\"sent\":1,\"unknown\":2}}",
+    .fields = EMU_EVENT_FIELD_SENT | EMU_EVENT_FIELD_UNKNOWN,
+    .sent = 1, .remaining = -1, .iteration = -1
+  },
+  {
+    "{\"timestamp\":{\"seconds\":1,\"microseconds\":2},\"event\":\"MIGRATION\"}",
+    NO_PROGRESS
+  },
+
+  // Duplicate keys: json-c keeps the last value.
+  {
+    "{\"event\":\"MIGRATION\",\"data\":{\"sent\":1,\"sent\":2}}",
+    .fields = EMU_EVENT_FIELD_SENT,
+    .sent = 2, .remaining = -1, .iteration = -1
+  },
+  {
+    "{\"event\":\"UNKNOWN\",\"event\":\"MIGRATION\"}",
+    NO_PROGRESS
+  },
+
+  // Out of range integers: json-c saturates them.
+  {
+    "{\"event\":\"MIGRATION\",\"data\":{\"sent\":9223372036854775808}}",
+    .fields = EMU_EVENT_FIELD_SENT,
+    .sent = INT64_MAX, .remaining = -1, .iteration = -1
+  },
+  {
+    "{\"event\":\"MIGRATION\",\"data\":{\"remaining\":99999999999999999999}}",
+    .fields = EMU_EVENT_FIELD_REMAINING,
+    .sent = -1, .remaining = INT64_MAX, .iteration = -1
+  },
+  {
+    "{\"event\":\"MIGRATION\",\"data\":{\"iteration\":2147483648}}",
+    .fields = EMU_EVENT_FIELD_ITERATION,
+    .sent = -1, .remaining = -1, .iteration = INT32_MAX
+  },
+  {
+    "{\"event\":\"MIGRATION\",\"data\":{\"iteration\":-2147483649}}",
+    .fields = EMU_EVENT_FIELD_ITERATION,
+    .sent = -1, .remaining = -1, .iteration = INT32_MIN
+  }
+};
+
+// Rejected by the EMP client, see: emu_client_process_json.
+static const char *const InvalidMessages[] = {
+  "{\"return\":{},\"event\":\"MIGRATION\"}",
+  "{\"data\":{\"sent\":1}}",
+  "{\"return\":{},\"return\":{}}",
+  "{\"event\":1}",
+  "{\"event\":\"MIGRATION\"]"
+};
+
+// -----------------------------------------------------------------------------
+
+static void check_event (const EmuEvent *event, const TestMessage *expected) {
+  CHECK_INT_EQ(event->fields, expected->fields);
+  if (expected->fields & EMU_EVENT_FIELD_STATUS)
+    CHECK(emu_event_string_equals(&event->status, expected->status));
+  if (expected->fields & EMU_EVENT_FIELD_RESULT)
+    CHECK(emu_event_string_equals(&event->result, expected->result));
+  CHECK_INT_EQ(event->sent, expected->sent);
+  CHECK_INT_EQ(event->remaining, expected->remaining);
+  CHECK_INT_EQ(event->iteration, expected->iteration);
+}
+
+static void check_in_place (const TestMessage *expected) {
+  const size_t len = strlen(expected->json);
+
+  // Split at every byte: nothing is decoded before the end of the message.
+  EmuMessage message;
+  for (size_t size = 0; size < len; ++size)
+    CHECK_INT_EQ(emu_event_parse(expected->json, size, &message), 0);
+
+  // The next message is not read.
+  char buf[256];
+  const int size = snprintf(buf, sizeof buf, "%s\n{\"retu", expected->json);
+  CHECK(size > 0 && (size_t)size < sizeof buf);
+  CHECK_INT_EQ(emu_event_parse(buf, (size_t)size, &message), len);
+
+  CHECK(message.isReturn == expected->isReturn);
+  CHECK(message.isEvent == !expected->isReturn);
+  if (message.isEvent) {
+    CHECK(emu_event_string_equals(&message.event.name, "MIGRATION"));
+    check_event(&message.event, expected);
+  }
+}
+
+static void check_unsupported (const char *json) {
+  const size_t len = strlen(json);
+
+  // Incomplete or unsupported, but never decoded.
+  EmuMessage message;
+  for (size_t size = 0; size < len; ++size) {
+    const int ret = emu_event_parse(json, size, &message);
+    CHECK(ret == 0 || ret == -1);
+  }
+  CHECK_INT_EQ(emu_event_parse(json, len, &message), -1);
+}
+
+// Same lookups as emu_client_process_json. Returns false if json-c cannot
+// parse the message.
+static bool check_json_c (const TestMessage *expected) {
+  json_tokener *tokener = json_tokener_new();
+  CHECK(tokener);
+  json_object *obj = json_tokener_parse_ex(tokener, expected->json, (int)strlen(expected->json));
+  json_tokener_free(tokener);
+  if (!obj)
+    return false;
+
+  const json_object *eventType = NULL;
+  const json_object *data = NULL;
+  bool isReturn = false;
+  for (const struct lh_entry *entry = json_object_get_object(obj)->head; entry; entry = entry->next) {
+    if (!strcmp(entry->k, "event"))
+      eventType = entry->v;
+    else if (!strcmp(entry->k, "data"))
+      data = entry->v;
+    else if (!strcmp(entry->k, "return"))
+      isReturn = true;
+  }
+
+  CHECK(isReturn == expected->isReturn);
+  CHECK(!eventType == expected->isReturn);
+  if (eventType) {
+    CHECK(!strcmp(json_object_get_string((json_object *)eventType), "MIGRATION"));
+    EmuEvent event;
+    emu_event_from_json(&event, "MIGRATION", data);
+    check_event(&event, expected);
+  }
+
+  json_object_put(obj);
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+
+int main () {
+  test_init("test-emu-event");
+
+  const TestMessage *message;
+  foreach (message, SupportedMessages)
+    check_in_place(message);
+  foreach (message, UnsupportedMessages)
+    check_unsupported(message->json);
+
+  const char *const *json;
+  foreach (json, InvalidMessages)
+    check_unsupported(*json);
+
+  // Both decoders must agree on the supported messages.
+  bool hasJsonC = true;
+  foreach (message, SupportedMessages)
+    if (!(hasJsonC = check_json_c(message)))
+      break;
+  foreach (message, UnsupportedMessages)
+    if (hasJsonC)
+      CHECK(check_json_c(message));
+
+  if (!hasJsonC) {
+    fprintf(stderr, "json-c cannot parse the test messages, fallback not checked.\n");
+    return TEST_SKIP;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,110 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file-writer.h"
+#include "test.h"
+
+// =============================================================================
+// Suspend image written by a FileWriter while xenopsd appends its own records
+// to the same file.
+// =============================================================================
+
+// On a disk rather than in a tmpfs to use O_DIRECT.
+#define TEST_FILE_TEMPLATE "/var/tmp/emu-manager-test-XXXXXX"
+
+static void append_pattern (int fd, size_t offset, size_t size) {
+  char *buf = malloc(size);
+  CHECK(buf);
+  for (size_t i = 0; i < size; ++i)
+    buf[i] = test_pattern_at(offset + i);
+  CHECK(write(fd, buf, size) == (ssize_t)size);
+  free(buf);
+}
+
+static void check_pattern (int fd, size_t size) {
+  struct stat buf;
+  CHECK(fstat(fd, &buf) == 0);
+  CHECK_INT_EQ(buf.st_size, size);
+
+  char *data = malloc(size);
+  CHECK(data);
+  CHECK(pread(fd, data, size, 0) == (ssize_t)size);
+  for (size_t i = 0; i < size; ++i)
+    CHECK(data[i] == test_pattern_at(i));
+  free(data);
+}
+
+// -----------------------------------------------------------------------------
+
+// The file contains headerSize bytes at the creation of the writer, then
+// xenopsd appends appendedSize bytes before the first write of the emu stream.
+static void test_file_writer (size_t headerSize, size_t appendedSize, size_t streamSize) {
+  char path[] = TEST_FILE_TEMPLATE;
+  const int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  CHECK(unlink(path) == 0);
+  CHECK(fcntl(fd, F_SETFL, O_APPEND) == 0);
+
+  append_pattern(fd, 0, headerSize);
+
+  FileWriter *writer;
+  CHECK(file_writer_create(&writer, fd) == 0);
+
+  append_pattern(fd, headerSize, appendedSize);
+
+  // Written in irregular chunks like the relay.
+  size_t offset = headerSize + appendedSize;
+  const size_t end = offset + streamSize;
+  char *buf = malloc(100000);
+  CHECK(buf);
+  for (size_t size = 1; offset < end; size = size * 7 % 100000 + 1) {
+    if (size > end - offset)
+      size = end - offset;
+    for (size_t i = 0; i < size; ++i)
+      buf[i] = test_pattern_at(offset + i);
+    CHECK(file_writer_write(writer, buf, size) == (ssize_t)size);
+    offset += size;
+  }
+  free(buf);
+
+  CHECK(file_writer_finish(writer) == 0);
+  file_writer_destroy(writer);
+
+  check_pattern(fd, end);
+  close(fd);
+}
+
+int main () {
+  test_init("test-file-writer");
+
+  test_file_writer(0, 0, 10 * 1024 * 1024 + 123);
+  test_file_writer(4096, 0, 10 * 1024 * 1024);
+  test_file_writer(0, 5000, 10 * 1024 * 1024 + 123);
+  test_file_writer(4096, 5000, 10 * 1024 * 1024 + 4095);
+  test_file_writer(100, 4096 * 3 - 100, 10 * 1024 * 1024);
+  test_file_writer(100, 200, 300);
+  test_file_writer(100, 200, 0);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,239 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "stand-in.h"
+#include "test.h"
+
+// =============================================================================
+// Post-copy: a save and a restore are run at the same time with stand-in
+// xenguests that support post-copy. Their stream is a socketpair.
+//
+// Stream of the stand-ins: 'L' live pages, 'S' guest state then 'P' post-copy
+// pages, or 'E' end of a pre-copy.
+// =============================================================================
+
+typedef struct Source {
+  bool isPostcopy;
+  bool isPaused;
+} Source;
+
+typedef struct Destination {
+  const char *postcopyResult; // NULL if it's only given at the end.
+  const char *result;
+  StandInXenopsd *xenopsd;
+
+  bool isPostcopy;
+  bool isResumedEarly; // Result received by xenopsd before the end.
+} Destination;
+
+static void write_stream (int fd, char c, size_t count) {
+  char buf[256];
+  memset(buf, c, count);
+  CHECK(write(fd, buf, count) == (ssize_t)count);
+}
+
+static void source_main (StandInEmp *emp) {
+  Source *source = emp->userData;
+
+  while (stand_in_emp_next_cmd(emp, 10000) > 0) {
+    stand_in_emp_reply(emp);
+    if (stand_in_emp_cmd_is(emp, "migrate_live"))
+      break;
+  }
+  CHECK(stand_in_emp_cmd_is(emp, "migrate_live"));
+  CHECK(emp->streamFd > -1);
+
+  // 1. The guest dirties as many pages as sent: pre-copy cannot converge.
+  int ret = 0;
+  for (int iteration = 0; !ret; ++iteration) {
+    stand_in_emp_send_event(emp, "\"sent\":%d,\"remaining\":1000,\"iteration\":%d", iteration * 1000, iteration);
+    write_stream(emp->streamFd, 'L', 64);
+    CHECK((ret = stand_in_emp_next_cmd(emp, 5)) > -1);
+    if (ret)
+      stand_in_emp_reply(emp);
+  }
+  CHECK(stand_in_emp_cmd_is(emp, "migrate_pause"));
+
+  // 2. Stop-and-copy or post-copy.
+  while (stand_in_emp_next_cmd(emp, 10000) > 0) {
+    stand_in_emp_reply(emp);
+
+    if (stand_in_emp_cmd_is(emp, "migrate_postcopy")) {
+      source->isPostcopy = true;
+      write_stream(emp->streamFd, 'S', 1);
+      write_stream(emp->streamFd, 'P', 256);
+    } else if (stand_in_emp_cmd_is(emp, "migrate_paused")) {
+      source->isPaused = true;
+      write_stream(emp->streamFd, 'E', 1);
+    } else
+      continue;
+
+    close(emp->streamFd);
+    emp->streamFd = -1;
+    stand_in_emp_send_event(emp, "\"status\":\"completed\"");
+  }
+}
+
+static void destination_main (StandInEmp *emp) {
+  Destination *destination = emp->userData;
+
+  while (stand_in_emp_next_cmd(emp, 10000) > 0) {
+    stand_in_emp_reply(emp);
+    if (stand_in_emp_cmd_is(emp, "restore"))
+      break;
+  }
+  CHECK(stand_in_emp_cmd_is(emp, "restore"));
+  CHECK(emp->streamFd > -1);
+
+  char buf[256];
+  ssize_t ret;
+  while ((ret = read(emp->streamFd, buf, sizeof buf)) > 0) {
+    if (destination->isPostcopy || !memchr(buf, 'S', (size_t)ret))
+      continue;
+
+    // The guest state is received: it can be resumed.
+    destination->isPostcopy = true;
+    if (!destination->postcopyResult) {
+      stand_in_emp_send_event(emp, "\"status\":\"postcopy\"");
+      continue;
+    }
+
+    stand_in_emp_send_event(emp, "\"status\":\"postcopy\",\"result\":\"%s\"", destination->postcopyResult);
+    destination->isResumedEarly = stand_in_xenopsd_wait(destination->xenopsd, "result:xenguest", 10000);
+  }
+  CHECK(ret == 0);
+
+  stand_in_emp_send_event(emp, "\"status\":\"completed\",\"result\":\"%s\"", destination->result);
+  stand_in_emp_serve(emp);
+}
+
+// -----------------------------------------------------------------------------
+
+static int run_postcopy (Source *source, Destination *destination) {
+  const unsigned sourceDomId = test_get_dom_id();
+  const unsigned destinationDomId = sourceDomId + 1;
+
+  StandInXenopsd sourceXenopsd = { 0 };
+  StandInXenopsd destinationXenopsd = { .restoreEmu = "xenguest" };
+  destination->xenopsd = &destinationXenopsd;
+
+  StandInEmp sourceEmp;
+  StandInEmp destinationEmp;
+  int ret = stand_in_emp_start(&sourceEmp, "xenguest", sourceDomId, source_main, source);
+  if (ret)
+    return ret;
+  if ((ret = stand_in_emp_start(&destinationEmp, "xenguest", destinationDomId, destination_main, destination)))
+    return ret;
+
+  stand_in_xenopsd_start(&sourceXenopsd);
+  stand_in_xenopsd_start(&destinationXenopsd);
+
+  int streamFds[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, streamFds) == 0);
+
+  char args[6][16];
+  snprintf(args[0], sizeof args[0], "%u", sourceDomId);
+  snprintf(args[1], sizeof args[1], "%d", streamFds[0]);
+  snprintf(args[2], sizeof args[2], "%d", sourceXenopsd.emuFd);
+  snprintf(args[3], sizeof args[3], "%u", destinationDomId);
+  snprintf(args[4], sizeof args[4], "%d", streamFds[1]);
+  snprintf(args[5], sizeof args[5], "%d", destinationXenopsd.emuFd);
+
+  const char *const sourceArgs[] = {
+    "--mode", "hvm_save",
+    "--live", "true",
+    "--domid", args[0],
+    "--fd", args[1],
+    "--controlinfd", args[2],
+    "--controloutfd", args[2],
+    "--convergence", "no-progress",
+    "--postcopy", "2",
+    NULL
+  };
+  const char *const destinationArgs[] = {
+    "--mode", "hvm_restore",
+    "--domid", args[3],
+    "--fd", args[4],
+    "--controlinfd", args[5],
+    "--controloutfd", args[5],
+    NULL
+  };
+
+  StandInMigration sourceMigration;
+  StandInMigration destinationMigration;
+  stand_in_migration_start(&destinationMigration, destinationArgs);
+  stand_in_migration_start(&sourceMigration, sourceArgs);
+  CHECK_INT_EQ(stand_in_migration_join(&sourceMigration), 0);
+  CHECK_INT_EQ(stand_in_migration_join(&destinationMigration), 0);
+
+  stand_in_xenopsd_join(&sourceXenopsd);
+  stand_in_xenopsd_join(&destinationXenopsd);
+  stand_in_emp_join(&sourceEmp);
+  stand_in_emp_join(&destinationEmp);
+
+  CHECK(stand_in_xenopsd_is_message(stand_in_xenopsd_find(&sourceXenopsd, "result:"), "result:0 0"));
+  CHECK(source->isPostcopy);
+  CHECK(!source->isPaused);
+  CHECK(destination->isPostcopy);
+
+  // The result of the restore is forwarded once, never empty.
+  CHECK_INT_EQ(stand_in_xenopsd_count(&destinationXenopsd, "result:"), 1);
+  CHECK(!stand_in_xenopsd_find(&destinationXenopsd, "error:"));
+  CHECK(stand_in_xenopsd_is_message(
+    stand_in_xenopsd_find(&destinationXenopsd, "result:"),
+    destination->postcopyResult ? "result:xenguest 11 22" : "result:xenguest 33 44"
+  ));
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+// The guest is resumed on the destination before the end of the stream.
+static int test_postcopy_early_result () {
+  Source source = { 0 };
+  Destination destination = { .postcopyResult = "11 22", .result = "11 22" };
+  const int ret = run_postcopy(&source, &destination);
+  if (ret)
+    return ret;
+
+  CHECK(destination.isResumedEarly);
+  return 0;
+}
+
+// Without result in the post-copy event, the result of the end is forwarded.
+static int test_postcopy_late_result () {
+  Source source = { 0 };
+  Destination destination = { .result = "33 44" };
+  return run_postcopy(&source, &destination);
+}
+
+int main () {
+  test_init("test-postcopy");
+
+  int ret;
+  if ((ret = test_postcopy_early_result()) || (ret = test_postcopy_late_result()))
+    return ret;
+  return EXIT_SUCCESS;
+}
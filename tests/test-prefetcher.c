@@ -0,0 +1,174 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "emu.h"
+#include "monotonic-clock.h"
+#include "prefetcher.h"
+#include "test.h"
+
+// =============================================================================
+// Read-ahead of a suspend image: the prefetched pages must be in the page
+// cache in front of the consumer, the stream must not be changed.
+// =============================================================================
+
+// On a disk rather than in a tmpfs to drop the page cache.
+#define TEST_FILE_TEMPLATE "/var/tmp/emu-manager-test-XXXXXX"
+
+#define TEST_FILE_SIZE (64 * 1024 * 1024)
+#define TEST_HEADER_SIZE (4 * 1024 * 1024)
+
+// See: prefetcher.c.
+#define TEST_MIN_WINDOW (8 * 1024 * 1024)
+
+// The kernel can also read ahead after the last byte of a chunk.
+#define TEST_READAHEAD_MARGIN (4 * 1024 * 1024)
+
+static size_t PageSize;
+
+static int create_file () {
+  char path[] = TEST_FILE_TEMPLATE;
+  const int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  CHECK(unlink(path) == 0);
+
+  char *buf = malloc(TEST_FILE_SIZE);
+  CHECK(buf);
+  for (size_t i = 0; i < TEST_FILE_SIZE; ++i)
+    buf[i] = test_pattern_at(i);
+  CHECK(write(fd, buf, TEST_FILE_SIZE) == TEST_FILE_SIZE);
+  free(buf);
+
+  CHECK(fdatasync(fd) == 0);
+  return fd;
+}
+
+// Returns the count of cached bytes in [begin, end).
+static size_t get_cached_size (int fd, size_t begin, size_t end) {
+  void *addr = mmap(NULL, TEST_FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  CHECK(addr != MAP_FAILED);
+
+  unsigned char vec[TEST_FILE_SIZE / 4096];
+  CHECK(TEST_FILE_SIZE / PageSize <= sizeof vec);
+  CHECK(mincore(addr, TEST_FILE_SIZE, vec) == 0);
+  munmap(addr, TEST_FILE_SIZE);
+
+  size_t size = 0;
+  for (size_t page = begin / PageSize; page < end / PageSize; ++page)
+    if (vec[page] & 1)
+      size += PageSize;
+  return size;
+}
+
+static bool drop_cache (int fd) {
+  CHECK(posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0);
+  return get_cached_size(fd, 0, TEST_FILE_SIZE) == 0;
+}
+
+// -----------------------------------------------------------------------------
+
+// The consumer does not read: the prefetcher stops at the min window.
+static void test_prefetcher_window (int fd) {
+  CHECK(lseek(fd, TEST_HEADER_SIZE, SEEK_SET) == TEST_HEADER_SIZE);
+
+  Prefetcher *prefetcher;
+  CHECK(prefetcher_create(&prefetcher, fd) == 0);
+
+  const size_t windowEnd = TEST_HEADER_SIZE + TEST_MIN_WINDOW;
+  const int64_t end = monotonic_clock_us() + 10000000;
+  while (get_cached_size(fd, TEST_HEADER_SIZE, windowEnd) < TEST_MIN_WINDOW) {
+    CHECK(monotonic_clock_us() < end);
+    usleep(10000);
+  }
+  usleep(100000);
+
+  CHECK_INT_EQ(get_cached_size(fd, 0, TEST_HEADER_SIZE), 0);
+  CHECK_INT_EQ(get_cached_size(fd, windowEnd + TEST_READAHEAD_MARGIN, TEST_FILE_SIZE), 0);
+
+  // The threads are waiting for the consumer.
+  const int64_t start = monotonic_clock_us();
+  prefetcher_destroy(prefetcher);
+  CHECK(monotonic_clock_us() - start < 1000000);
+
+  CHECK(lseek(fd, 0, SEEK_CUR) == TEST_HEADER_SIZE);
+}
+
+// The consumer reads the stream until its end.
+static void test_prefetcher_consumer (int fd) {
+  CHECK(lseek(fd, TEST_HEADER_SIZE, SEEK_SET) == TEST_HEADER_SIZE);
+
+  Prefetcher *prefetcher;
+  CHECK(prefetcher_create(&prefetcher, fd) == 0);
+
+  char buf[65536];
+  size_t offset = TEST_HEADER_SIZE;
+  ssize_t ret;
+  while ((ret = read(fd, buf, sizeof buf)) > 0) {
+    for (ssize_t i = 0; i < ret; ++i)
+      CHECK(buf[i] == test_pattern_at(offset + (size_t)i));
+    offset += (size_t)ret;
+
+    // Slower than the disk.
+    if (!(offset % (1024 * 1024)))
+      usleep(5000);
+  }
+  CHECK_INT_EQ(ret, 0);
+  CHECK_INT_EQ(offset, TEST_FILE_SIZE);
+
+  prefetcher_destroy(prefetcher);
+}
+
+// The prefetcher requires a seekable stream.
+static void test_prefetcher_pipe () {
+  int fds[2];
+  CHECK(pipe(fds) == 0);
+
+  Prefetcher *prefetcher;
+  CHECK(prefetcher_create(&prefetcher, fds[0]) < 0);
+  CHECK_INT_EQ(EmuError, ESPIPE);
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+int main () {
+  test_init("test-prefetcher");
+  PageSize = (size_t)sysconf(_SC_PAGESIZE);
+
+  test_prefetcher_pipe();
+
+  const int fd = create_file();
+  if (!drop_cache(fd)) {
+    fprintf(stderr, "Cannot drop the page cache of the test file.\n");
+    close(fd);
+    return TEST_SKIP;
+  }
+
+  test_prefetcher_window(fd);
+  CHECK(drop_cache(fd));
+  test_prefetcher_consumer(fd);
+
+  close(fd);
+  return EXIT_SUCCESS;
+}
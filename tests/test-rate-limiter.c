@@ -0,0 +1,324 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "monotonic-clock.h"
+#include "rate-limiter.h"
+#include "relay.h"
+#include "stand-in.h"
+#include "test.h"
+
+// =============================================================================
+// Token bucket: the allowances must follow the rate with a burst of 100 ms at
+// most, and a rate limited relay must not be faster. Only the upper bounds are
+// checked: a loaded host can always be slower.
+// =============================================================================
+
+#define TEST_RATE (8 * 1024 * 1024)
+
+// Returns the count of transferred bytes during duration (in us), the
+// allowances are taken like by a relay.
+static int64_t transfer (RateLimiter *limiter, int64_t duration) {
+  int64_t size = 0;
+  const int64_t end = monotonic_clock_us() + duration;
+  while (monotonic_clock_us() < end) {
+    int delay = -1;
+    size_t allowance = rate_limiter_get_allowance(limiter, &delay);
+    if (allowance == 0) {
+      CHECK(delay > 0 && delay <= 1000);
+      usleep((useconds_t)delay * 1000);
+      continue;
+    }
+
+    // Like a partial write.
+    if (allowance > 64 * 1024)
+      allowance = 64 * 1024;
+    rate_limiter_consume(limiter, allowance);
+    size += (int64_t)allowance;
+  }
+  return size;
+}
+
+static void check_rate (int64_t size, int64_t rate, int64_t duration) {
+  const double expected = (double)rate * (double)duration / 1e6;
+  // The burst and the last allowance can be taken in advance.
+  CHECK((double)size <= expected + (double)rate / 10 + 64 * 1024);
+}
+
+// -----------------------------------------------------------------------------
+
+static void test_rate_limiter_unlimited () {
+  RateLimiter limiter;
+  rate_limiter_init(&limiter);
+
+  int delay = -1;
+  CHECK(rate_limiter_get_allowance(&limiter, &delay) == SIZE_MAX);
+  rate_limiter_consume(&limiter, 1024 * 1024 * 1024);
+  CHECK(rate_limiter_get_allowance(&limiter, &delay) == SIZE_MAX);
+  CHECK_INT_EQ(delay, -1);
+
+  // Back to unlimited after a limit.
+  rate_limiter_set_rate(&limiter, TEST_RATE);
+  rate_limiter_set_rate(&limiter, 0);
+  CHECK(rate_limiter_get_allowance(&limiter, &delay) == SIZE_MAX);
+
+  rate_limiter_destroy(&limiter);
+}
+
+static void test_rate_limiter_rate () {
+  RateLimiter limiter;
+  rate_limiter_init(&limiter);
+  rate_limiter_set_rate(&limiter, TEST_RATE);
+
+  // No tokens at start.
+  int delay = -1;
+  CHECK(rate_limiter_get_allowance(&limiter, &delay) == 0);
+  CHECK(delay > 0 && delay <= 10);
+
+  check_rate(transfer(&limiter, 500000), TEST_RATE, 500000);
+
+  // The rate is changed during a transfer.
+  rate_limiter_set_rate(&limiter, TEST_RATE / 4);
+  check_rate(transfer(&limiter, 500000), TEST_RATE / 4, 500000);
+
+  rate_limiter_destroy(&limiter);
+}
+
+static void test_rate_limiter_burst () {
+  RateLimiter limiter;
+  rate_limiter_init(&limiter);
+  rate_limiter_set_rate(&limiter, TEST_RATE);
+
+  // Tokens are not accumulated beyond 100 ms.
+  usleep(300000);
+  int delay;
+  size_t allowance = rate_limiter_get_allowance(&limiter, &delay);
+  CHECK(allowance > 0 && allowance <= TEST_RATE / 10);
+
+  // And a lower rate lowers the burst.
+  rate_limiter_set_rate(&limiter, TEST_RATE / 4);
+  allowance = rate_limiter_get_allowance(&limiter, &delay);
+  CHECK(allowance > 0 && allowance <= TEST_RATE / 40);
+
+  rate_limiter_destroy(&limiter);
+}
+
+// -----------------------------------------------------------------------------
+
+typedef struct Sink {
+  int fd;
+  int64_t size;
+  pthread_t thread;
+} Sink;
+
+static void *sink_thread (void *userData) {
+  Sink *sink = userData;
+
+  char buf[65536];
+  ssize_t ret;
+  while ((ret = read(sink->fd, buf, sizeof buf)) > 0)
+    sink->size += ret;
+  CHECK(ret == 0);
+
+  return NULL;
+}
+
+// A save stream is written through a relay limited to TEST_RATE.
+static void test_rate_limiter_relay () {
+  int streamFds[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, streamFds) == 0);
+
+  Sink sink = { .fd = streamFds[1] };
+  CHECK(pthread_create(&sink.thread, NULL, sink_thread, &sink) == 0);
+
+  int fd;
+  Relay *relay;
+  CHECK(relay_create(&relay, streamFds, 1, RelayDirectionSave, NULL, &fd) == 0);
+  relay_set_rate_limit(relay, TEST_RATE);
+
+  static char data[4 * 1024 * 1024];
+  const int64_t start = monotonic_clock_us();
+  for (size_t offset = 0; offset < sizeof data; ) {
+    const ssize_t ret = write(fd, data + offset, sizeof data - offset);
+    CHECK(ret > 0);
+    offset += (size_t)ret;
+  }
+  close(fd);
+
+  CHECK(relay_finish(relay) == 0);
+  relay_destroy(relay);
+  arena_release();
+  pthread_join(sink.thread, NULL);
+  const int64_t duration = monotonic_clock_us() - start;
+  close(streamFds[1]);
+
+  CHECK_INT_EQ(sink.size, sizeof data);
+  check_rate((int64_t)sizeof data, TEST_RATE, duration);
+}
+
+// -----------------------------------------------------------------------------
+
+// Limits sent by xenopsd in MiB/s: the stop-and-copy one is the lowest, so
+// the stream of a paused guest is slower only if the limit is switched.
+#define LIVE_RATE (8 * 1024 * 1024)
+#define STOP_AND_COPY_RATE (2 * 1024 * 1024)
+static const char BandwidthMessage[] = "bandwidth:8,2\n";
+
+#define LIVE_SIZE (4 * 1024 * 1024)
+#define STOP_AND_COPY_SIZE (1024 * 1024)
+
+// Bytes written by the guest in each stage, received by the sink.
+typedef struct StageSink {
+  int fd;
+  int64_t sizes[2];
+  int64_t firstTimes[2];
+  int64_t lastTimes[2];
+  pthread_t thread;
+} StageSink;
+
+static void *stage_sink_thread (void *userData) {
+  StageSink *sink = userData;
+
+  char buf[65536];
+  ssize_t ret;
+  while ((ret = read(sink->fd, buf, sizeof buf)) > 0) {
+    const int64_t now = monotonic_clock_us();
+    for (ssize_t i = 0; i < ret; ++i) {
+      CHECK(buf[i] == 'L' || buf[i] == 'S');
+      const int stage = buf[i] == 'S';
+      if (!sink->sizes[stage]++)
+        sink->firstTimes[stage] = now;
+      sink->lastTimes[stage] = now;
+    }
+  }
+  CHECK(ret == 0);
+
+  return NULL;
+}
+
+static void write_stage (int fd, char c, size_t size) {
+  static char data[64 * 1024];
+  memset(data, c, sizeof data);
+  for (size_t offset = 0; offset < size; ) {
+    const size_t chunkSize = size - offset < sizeof data ? size - offset : sizeof data;
+    const ssize_t ret = write(fd, data, chunkSize);
+    CHECK(ret > 0);
+    offset += (size_t)ret;
+  }
+}
+
+static void source_main (StandInEmp *emp) {
+  while (stand_in_emp_next_cmd(emp, 10000) > 0) {
+    stand_in_emp_reply(emp);
+    if (stand_in_emp_cmd_is(emp, "migrate_live"))
+      break;
+  }
+  CHECK(stand_in_emp_cmd_is(emp, "migrate_live"));
+  CHECK(emp->streamFd > -1);
+
+  write_stage(emp->streamFd, 'L', LIVE_SIZE);
+
+  // No progress: the live stage ends.
+  int ret = 0;
+  for (int iteration = 0; !ret; ++iteration) {
+    stand_in_emp_send_event(emp, "\"sent\":%d,\"remaining\":1000,\"iteration\":%d", iteration * 1000, iteration);
+    CHECK((ret = stand_in_emp_next_cmd(emp, 5)) > -1);
+    if (ret)
+      stand_in_emp_reply(emp);
+  }
+  CHECK(stand_in_emp_cmd_is(emp, "migrate_pause"));
+
+  write_stage(emp->streamFd, 'S', STOP_AND_COPY_SIZE);
+
+  while (stand_in_emp_next_cmd(emp, 10000) > 0) {
+    stand_in_emp_reply(emp);
+    if (!stand_in_emp_cmd_is(emp, "migrate_paused"))
+      continue;
+
+    close(emp->streamFd);
+    emp->streamFd = -1;
+    stand_in_emp_send_event(emp, "\"status\":\"completed\"");
+  }
+}
+
+// The limits of a relayed save are given by xenopsd, the stop-and-copy one
+// is applied when the guest is paused.
+static int test_rate_limiter_bandwidth_message () {
+  const unsigned domId = test_get_dom_id();
+
+  StandInEmp emp;
+  const int ret = stand_in_emp_start(&emp, "xenguest", domId, source_main, NULL);
+  if (ret)
+    return ret;
+
+  StandInXenopsd xenopsd = { 0 };
+  stand_in_xenopsd_start(&xenopsd);
+  stand_in_xenopsd_send(&xenopsd, BandwidthMessage);
+
+  int streamFds[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, streamFds) == 0);
+  StageSink sink = { .fd = streamFds[0] };
+  CHECK(pthread_create(&sink.thread, NULL, stage_sink_thread, &sink) == 0);
+
+  char args[3][16];
+  snprintf(args[0], sizeof args[0], "%u", domId);
+  snprintf(args[1], sizeof args[1], "%d", streamFds[1]);
+  snprintf(args[2], sizeof args[2], "%d", xenopsd.emuFd);
+
+  const char *const saveArgs[] = {
+    "--mode", "hvm_save",
+    "--live", "true",
+    "--domid", args[0],
+    "--fd", args[1],
+    "--controlinfd", args[2],
+    "--controloutfd", args[2],
+    "--convergence", "no-progress",
+    "--relay",
+    NULL
+  };
+  CHECK_INT_EQ(stand_in_run_migration(saveArgs), 0);
+  stand_in_xenopsd_join(&xenopsd);
+  stand_in_emp_join(&emp);
+  pthread_join(sink.thread, NULL);
+  close(streamFds[0]);
+
+  CHECK(stand_in_xenopsd_find(&xenopsd, "result:0 0"));
+  CHECK_INT_EQ(sink.sizes[0], LIVE_SIZE);
+  CHECK_INT_EQ(sink.sizes[1], STOP_AND_COPY_SIZE);
+  check_rate(sink.sizes[0], LIVE_RATE, sink.lastTimes[0] - sink.firstTimes[0]);
+  check_rate(sink.sizes[1], STOP_AND_COPY_RATE, sink.lastTimes[1] - sink.firstTimes[1]);
+  return 0;
+}
+
+int main () {
+  test_init("test-rate-limiter");
+
+  test_rate_limiter_unlimited();
+  test_rate_limiter_rate();
+  test_rate_limiter_burst();
+  test_rate_limiter_relay();
+
+  const int ret = test_rate_limiter_bandwidth_message();
+  return ret ? ret : EXIT_SUCCESS;
+}
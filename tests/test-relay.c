@@ -0,0 +1,119 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "stand-in.h"
+#include "test.h"
+
+// =============================================================================
+// Relayed streams.
+// =============================================================================
+
+#define XENGUEST_STREAM_SIZE 4096
+
+static const char QemuRecord[] = "QEVMRECORD";
+
+static void destination_main (StandInEmp *emp) {
+  while (stand_in_emp_next_cmd(emp, 10000) > 0) {
+    stand_in_emp_reply(emp);
+    if (stand_in_emp_cmd_is(emp, "restore"))
+      break;
+  }
+  CHECK(stand_in_emp_cmd_is(emp, "restore"));
+  CHECK(emp->streamFd > -1);
+
+  // Like xenguest: only its stream is read.
+  char buf[XENGUEST_STREAM_SIZE];
+  for (size_t size = 0; size < sizeof buf; ) {
+    const ssize_t ret = read(emp->streamFd, buf + size, sizeof buf - size);
+    CHECK(ret > 0);
+    size += (size_t)ret;
+  }
+
+  // A restore is not completed in the reply of its command.
+  usleep(100000);
+  stand_in_emp_send_event(emp, "\"status\":\"completed\",\"result\":\"1 2\"");
+  stand_in_emp_serve(emp);
+}
+
+// The stream of a restore is shared with xenopsd: the data after the one of
+// xenguest must not be read by emu-manager, even with --relay.
+static int test_relay_restore_shared_stream () {
+  const unsigned domId = test_get_dom_id();
+
+  StandInEmp emp;
+  int ret = stand_in_emp_start(&emp, "xenguest", domId, destination_main, NULL);
+  if (ret)
+    return ret;
+
+  StandInXenopsd xenopsd = { .restoreEmu = "xenguest" };
+  stand_in_xenopsd_start(&xenopsd);
+
+  int streamFds[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, streamFds) == 0);
+
+  char buf[XENGUEST_STREAM_SIZE];
+  memset(buf, 'X', sizeof buf);
+  CHECK(write(streamFds[0], buf, sizeof buf) == (ssize_t)sizeof buf);
+  CHECK(write(streamFds[0], QemuRecord, sizeof QemuRecord) == (ssize_t)sizeof QemuRecord);
+
+  // xenopsd keeps its own fd.
+  const int emuStreamFd = dup(streamFds[1]);
+  CHECK(emuStreamFd > -1);
+
+  char args[3][16];
+  snprintf(args[0], sizeof args[0], "%u", domId);
+  snprintf(args[1], sizeof args[1], "%d", emuStreamFd);
+  snprintf(args[2], sizeof args[2], "%d", xenopsd.emuFd);
+
+  const char *const restoreArgs[] = {
+    "--mode", "hvm_restore",
+    "--domid", args[0],
+    "--fd", args[1],
+    "--controlinfd", args[2],
+    "--controloutfd", args[2],
+    "--relay",
+    NULL
+  };
+  CHECK_INT_EQ(stand_in_run_migration(restoreArgs), 0);
+  stand_in_xenopsd_join(&xenopsd);
+  stand_in_emp_join(&emp);
+  CHECK(stand_in_xenopsd_find(&xenopsd, "result:xenguest 1 2"));
+
+  struct pollfd pfd = { .fd = streamFds[1], .events = POLLIN };
+  CHECK(poll(&pfd, 1, 1000) == 1);
+  CHECK_INT_EQ(read(streamFds[1], buf, sizeof buf), sizeof QemuRecord);
+  CHECK(!memcmp(buf, QemuRecord, sizeof QemuRecord));
+
+  close(streamFds[0]);
+  close(streamFds[1]);
+  return 0;
+}
+
+int main () {
+  test_init("test-relay");
+
+  const int ret = test_relay_restore_shared_stream();
+  return ret ? ret : EXIT_SUCCESS;
+}
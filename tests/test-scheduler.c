@@ -0,0 +1,231 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "monotonic-clock.h"
+#include "scheduler.h"
+#include "stand-in.h"
+#include "test.h"
+
+// =============================================================================
+// Scheduler: one save migration is admitted at once with an aggregate bandwidth.
+// The first guest is held in its live stage while other saves are queued.
+// =============================================================================
+
+#define SCHEDULER_BANDWIDTH (4 * 1024 * 1024)
+
+typedef struct Guest {
+  int releaseFd; // If set, the live stage is held until it's readable.
+  size_t streamSize; // Written at the start of the live stage.
+  int64_t writeTime; // In us.
+  atomic_bool isConnected;
+} Guest;
+
+typedef struct StreamReader {
+  int fd;
+  size_t size;
+  int64_t endTime; // In us, when the last byte is received.
+  pthread_t thread;
+} StreamReader;
+
+static void *stream_reader_thread (void *userData) {
+  StreamReader *reader = userData;
+
+  char buf[64 * 1024];
+  ssize_t ret;
+  while ((ret = read(reader->fd, buf, sizeof buf)) > 0) {
+    reader->size += (size_t)ret;
+    reader->endTime = monotonic_clock_us();
+  }
+  CHECK(ret == 0);
+  return NULL;
+}
+
+// -----------------------------------------------------------------------------
+
+static void guest_main (StandInEmp *emp) {
+  Guest *guest = emp->userData;
+  guest->isConnected = true;
+
+  while (stand_in_emp_next_cmd(emp, 10000) > 0) {
+    stand_in_emp_reply(emp);
+    if (stand_in_emp_cmd_is(emp, "migrate_live"))
+      break;
+  }
+  CHECK(stand_in_emp_cmd_is(emp, "migrate_live"));
+  CHECK(emp->streamFd > -1);
+
+  char buf[64 * 1024];
+  memset(buf, 'L', sizeof buf);
+  guest->writeTime = monotonic_clock_us();
+  for (size_t size = 0; size < guest->streamSize; size += sizeof buf)
+    CHECK(write(emp->streamFd, buf, sizeof buf) == (ssize_t)sizeof buf);
+
+  char c;
+  if (guest->releaseFd > -1)
+    CHECK(read(guest->releaseFd, &c, 1) == 1);
+
+  int ret = 0;
+  for (int iteration = 0; !ret; ++iteration) {
+    stand_in_emp_send_event(emp, "\"sent\":%d,\"remaining\":1000,\"iteration\":%d", iteration * 1000, iteration);
+    CHECK((ret = stand_in_emp_next_cmd(emp, 5)) > -1);
+    if (ret)
+      stand_in_emp_reply(emp);
+  }
+  CHECK(stand_in_emp_cmd_is(emp, "migrate_pause"));
+
+  while (stand_in_emp_next_cmd(emp, 10000) > 0) {
+    stand_in_emp_reply(emp);
+    if (!stand_in_emp_cmd_is(emp, "migrate_paused"))
+      continue;
+
+    close(emp->streamFd);
+    emp->streamFd = -1;
+    stand_in_emp_send_event(emp, "\"status\":\"completed\"");
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+typedef struct Save {
+  char domId[16];
+  char streamFd[16];
+  char controlFd[16];
+  StandInXenopsd xenopsd;
+  StreamReader reader;
+  StandInMigration migration;
+} Save;
+
+static void save_start (Save *save, unsigned domId) {
+  snprintf(save->domId, sizeof save->domId, "%u", domId);
+
+  int streamFds[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, streamFds) == 0);
+  snprintf(save->streamFd, sizeof save->streamFd, "%d", streamFds[0]);
+  save->reader = (StreamReader){ .fd = streamFds[1] };
+  CHECK(pthread_create(&save->reader.thread, NULL, stream_reader_thread, &save->reader) == 0);
+
+  save->xenopsd = (StandInXenopsd){ 0 };
+  stand_in_xenopsd_start(&save->xenopsd);
+  snprintf(save->controlFd, sizeof save->controlFd, "%d", save->xenopsd.emuFd);
+
+  const char *const args[] = {
+    "--mode", "hvm_save",
+    "--live", "true",
+    "--domid", save->domId,
+    "--fd", save->streamFd,
+    "--controlinfd", save->controlFd,
+    "--controloutfd", save->controlFd,
+    "--convergence", "no-progress",
+    NULL
+  };
+  stand_in_migration_start(&save->migration, args);
+}
+
+static int save_join (Save *save) {
+  const int ret = stand_in_migration_join(&save->migration);
+  stand_in_xenopsd_join(&save->xenopsd);
+
+  // The stream is closed by emu-manager.
+  pthread_join(save->reader.thread, NULL);
+  close(save->reader.fd);
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+
+static int test_scheduler () {
+  const unsigned domId = test_get_dom_id();
+
+  int releaseFds[2];
+  CHECK(pipe2(releaseFds, O_CLOEXEC) == 0);
+
+  Guest first = { .releaseFd = releaseFds[0], .streamSize = 1024 * 1024 };
+  Guest second = { .releaseFd = -1 };
+
+  StandInEmp firstEmp;
+  StandInEmp secondEmp;
+  int ret = stand_in_emp_start(&firstEmp, "xenguest", domId, guest_main, &first);
+  if (ret)
+    return ret;
+  if ((ret = stand_in_emp_start(&secondEmp, "xenguest", domId + 1, guest_main, &second)))
+    return ret;
+
+  Save firstSave;
+  save_start(&firstSave, domId);
+  CHECK(stand_in_xenopsd_wait(&firstSave.xenopsd, "prepare:xenguest", 10000));
+
+  // 1. No slot for the other saves. The third one has no emu: it's aborted by
+  // xenopsd before its admission.
+  Save secondSave;
+  Save thirdSave;
+  save_start(&secondSave, domId + 1);
+  save_start(&thirdSave, domId + 2);
+
+  usleep(200000);
+  CHECK(!second.isConnected);
+
+  stand_in_xenopsd_send(&thirdSave.xenopsd, "abort\n");
+  CHECK_INT_EQ(save_join(&thirdSave), 0);
+  CHECK(!stand_in_xenopsd_find(&thirdSave.xenopsd, "result:"));
+  CHECK(!stand_in_xenopsd_find(&thirdSave.xenopsd, "error:"));
+  CHECK(!stand_in_xenopsd_find(&thirdSave.xenopsd, "prepare:"));
+  CHECK(!second.isConnected);
+
+  // 2. The end of the first save admits the second one.
+  CHECK(write(releaseFds[1], "R", 1) == 1);
+  CHECK_INT_EQ(save_join(&firstSave), 0);
+  CHECK_INT_EQ(save_join(&secondSave), 0);
+  stand_in_emp_join(&firstEmp);
+  stand_in_emp_join(&secondEmp);
+  close(releaseFds[0]);
+  close(releaseFds[1]);
+
+  CHECK(stand_in_xenopsd_is_message(stand_in_xenopsd_find(&firstSave.xenopsd, "result:"), "result:0 0"));
+  CHECK(stand_in_xenopsd_is_message(stand_in_xenopsd_find(&secondSave.xenopsd, "result:"), "result:0 0"));
+  CHECK(second.isConnected);
+
+  // 3. The bandwidth of the host is applied by the relay of the first save.
+  // The bucket allows a burst of 1/10 s.
+  CHECK_INT_EQ(firstSave.reader.size, first.streamSize);
+  const int64_t minDuration = (int64_t)(first.streamSize - SCHEDULER_BANDWIDTH / 10) * 1000000 / SCHEDULER_BANDWIDTH;
+  const int64_t duration = firstSave.reader.endTime - first.writeTime;
+  if (duration < minDuration * 9 / 10) {
+    fprintf(stderr, "Stream of the first save is not limited: %lld us < %lld us.\n", (long long)duration, (long long)minDuration);
+    return EXIT_FAILURE;
+  }
+
+  return 0;
+}
+
+int main () {
+  test_init("test-scheduler");
+
+  // Like the daemon: the scheduler is shared by the migrations of the process.
+  CHECK(scheduler_configure(1, 0, SCHEDULER_BANDWIDTH) == 0);
+
+  const int ret = test_scheduler();
+  return ret ? ret : EXIT_SUCCESS;
+}
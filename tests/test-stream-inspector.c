@@ -0,0 +1,597 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "byte-order.h"
+#include "stand-in.h"
+#include "stream-inspector.h"
+#include "test.h"
+
+// =============================================================================
+// Stream inspector: synthetic migration-v2 streams are fed in random pieces,
+// every counter must match the records written in the stream.
+// =============================================================================
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+
+#define IMAGE_HEADER_SIZE 24
+#define DOMAIN_HEADER_SIZE 16
+#define RECORD_HEADER_SIZE 8
+#define BATCH_HEADER_SIZE 8
+
+#define IMAGE_ID 0x58454E46 // "XENF"
+#define IMAGE_OPTION_BIG_ENDIAN (1 << 0)
+
+#define RECORD_X86_PV_INFO 2
+#define RECORD_X86_TSC_INFO 8
+#define RECORD_TOOLSTACK 11
+#define RECORD_OPTIONAL 0x80000000u
+#define RECORD_UNKNOWN 100
+
+// XEN_DOMCTL_PFINFO_* in the bits 60-63 of the pfns.
+#define PFN_L1TAB (0x1ull << 60)
+#define PFN_BROKEN (0xDull << 60)
+#define PFN_XALLOC (0xEull << 60)
+#define PFN_XTAB (0xFull << 60)
+#define PFN_MASK 0x000FFFFFFFFFFFFFull
+
+#define MAX_PFNS 4096
+
+// Stream and the stats expected from its inspection.
+typedef struct TestStream {
+  char *data;
+  size_t size;
+  size_t capacity;
+
+  StreamInspectorStats stats;
+  bool sentPfns[MAX_PFNS];
+} TestStream;
+
+static void write_be32 (char *buf, uint32_t value) {
+  buf[0] = (char)(value >> 24);
+  buf[1] = (char)(value >> 16);
+  buf[2] = (char)(value >> 8);
+  buf[3] = (char)value;
+}
+
+static char *stream_reserve (TestStream *stream, size_t size) {
+  if (stream->size + size > stream->capacity) {
+    stream->capacity = (stream->size + size) * 2;
+    CHECK((stream->data = realloc(stream->data, stream->capacity)));
+  }
+  char *buf = stream->data + stream->size;
+  memset(buf, 0, size);
+  stream->size += size;
+  stream->stats.bytes += size;
+  return buf;
+}
+
+static void add_image_header (TestStream *stream, uint32_t version, uint32_t options) {
+  char *buf = stream_reserve(stream, IMAGE_HEADER_SIZE);
+  memset(buf, 0xFF, 8);
+  write_be32(buf + 8, IMAGE_ID);
+  write_be32(buf + 12, version);
+  write_be32(buf + 16, options << 16);
+  stream->stats.otherBytes += IMAGE_HEADER_SIZE;
+}
+
+static void add_domain_header (TestStream *stream, uint32_t pageShift) {
+  char *buf = stream_reserve(stream, DOMAIN_HEADER_SIZE);
+  byte_order_write_le32(buf, 2); // x86 HVM.
+  byte_order_write_le32(buf + 4, pageShift);
+  byte_order_write_le32(buf + 8, 4);
+  byte_order_write_le32(buf + 12, 17);
+  stream->stats.otherBytes += DOMAIN_HEADER_SIZE;
+  stream->stats.pageSize = 1u << pageShift;
+}
+
+// Returns the body of the record, its padding is not zeroed.
+static char *add_record (TestStream *stream, uint32_t type, uint32_t length) {
+  const size_t paddedLength = ((size_t)length + 7) & ~(size_t)7;
+  char *buf = stream_reserve(stream, RECORD_HEADER_SIZE + paddedLength);
+  byte_order_write_le32(buf, type);
+  byte_order_write_le32(buf + 4, length);
+  memset(buf + RECORD_HEADER_SIZE + length, 0x5A, paddedLength - length);
+
+  type &= ~RECORD_OPTIONAL;
+  const int slot = type < STREAM_RECORD_TYPES_COUNT - 1 ? (int)type : STREAM_RECORD_TYPES_COUNT - 1;
+  stream->stats.recordBytes[slot] += RECORD_HEADER_SIZE + paddedLength;
+  return buf + RECORD_HEADER_SIZE;
+}
+
+// Skipped by the inspector.
+static void add_opaque_record (TestStream *stream, uint32_t type, uint32_t length) {
+  char *body = add_record(stream, type, length);
+  for (uint32_t i = 0; i < length; ++i)
+    body[i] = (char)(i * 7 + 1);
+}
+
+static void add_p2m_frames (TestStream *stream, uint32_t startPfn, uint32_t endPfn) {
+  // A frame holds the entries of 512 pfns.
+  const uint32_t frames = (endPfn - startPfn) / 512 + 1;
+  char *body = add_record(stream, STREAM_RECORD_X86_PV_P2M_FRAMES, 8 + frames * 8);
+  byte_order_write_le32(body, startPfn);
+  byte_order_write_le32(body + 4, endPfn);
+  for (uint32_t i = 0; i < frames; ++i)
+    byte_order_write_le64(body + 8 + i * 8, 0x1000 + i);
+
+  if (endPfn + 1 > stream->stats.p2mPages)
+    stream->stats.p2mPages = endPfn + 1;
+}
+
+static bool pfn_has_data (uint64_t pfn) {
+  const uint64_t type = pfn & ~PFN_MASK;
+  return type != PFN_BROKEN && type != PFN_XALLOC && type != PFN_XTAB;
+}
+
+// A page out of 5 is zero, the others have one byte set at an offset given by
+// their pfn.
+static bool page_is_zero (uint64_t pfn) {
+  return pfn % 5 == 0;
+}
+
+static void add_page_data (TestStream *stream, const uint64_t *pfns, uint32_t count) {
+  StreamInspectorStats *stats = &stream->stats;
+  const uint32_t pageSize = stats->pageSize;
+
+  uint32_t pages = 0;
+  for (uint32_t i = 0; i < count; ++i)
+    pages += pfn_has_data(pfns[i]);
+
+  char *body = add_record(stream, STREAM_RECORD_PAGE_DATA, BATCH_HEADER_SIZE + count * 8 + pages * pageSize);
+  byte_order_write_le32(body, count);
+
+  char *page = body + BATCH_HEADER_SIZE + count * 8;
+  for (uint32_t i = 0; i < count; ++i) {
+    byte_order_write_le64(body + BATCH_HEADER_SIZE + i * 8, pfns[i]);
+    if (!pfn_has_data(pfns[i]))
+      continue;
+
+    const uint64_t pfn = pfns[i] & PFN_MASK;
+    CHECK(pfn < MAX_PFNS);
+    ++stats->pages;
+    if (page_is_zero(pfn))
+      ++stats->zeroPages;
+    else
+      page[(pfn * 131) % pageSize] = 1;
+    page += pageSize;
+
+    if (stream->sentPfns[pfn])
+      ++stats->duplicatePages;
+    else
+      ++stats->uniquePages;
+    stream->sentPfns[pfn] = true;
+  }
+
+  int bucket = 0;
+  for (uint32_t size = count; size > 1 && bucket < STREAM_BATCH_BUCKETS_COUNT - 1; size >>= 1)
+    ++bucket;
+  ++stats->batches;
+  ++stats->batchBuckets[bucket];
+}
+
+// Pfns from first, with a type every step pfns if step is not 0.
+static void add_page_data_range (TestStream *stream, uint64_t first, uint32_t count, uint64_t type, uint32_t step) {
+  uint64_t *pfns = malloc(count * sizeof *pfns);
+  CHECK(pfns);
+  for (uint32_t i = 0; i < count; ++i)
+    pfns[i] = (first + i) | (step && i % step == 0 ? type : 0);
+  add_page_data(stream, pfns, count);
+  free(pfns);
+}
+
+static void add_end (TestStream *stream) {
+  add_record(stream, STREAM_RECORD_END, 0);
+  stream->stats.isComplete = true;
+}
+
+// Not parsed, e.g. the record of qemu after the one of xenguest.
+static void add_other_data (TestStream *stream, size_t size) {
+  memset(stream_reserve(stream, size), 'Q', size);
+  stream->stats.otherBytes += size;
+}
+
+// -----------------------------------------------------------------------------
+
+static void check_stats (const StreamInspectorStats *stats, const StreamInspectorStats *expected) {
+  CHECK_INT_EQ(stats->bytes, expected->bytes);
+  CHECK_INT_EQ(stats->otherBytes, expected->otherBytes);
+  uint64_t recordBytes = 0;
+  for (int i = 0; i < STREAM_RECORD_TYPES_COUNT; ++i) {
+    CHECK_INT_EQ(stats->recordBytes[i], expected->recordBytes[i]);
+    recordBytes += stats->recordBytes[i];
+  }
+  CHECK_INT_EQ(stats->otherBytes + recordBytes, stats->bytes);
+
+  CHECK_INT_EQ(stats->batches, expected->batches);
+  for (int i = 0; i < STREAM_BATCH_BUCKETS_COUNT; ++i)
+    CHECK_INT_EQ(stats->batchBuckets[i], expected->batchBuckets[i]);
+  CHECK_INT_EQ(stats->pages, expected->pages);
+  CHECK_INT_EQ(stats->zeroPages, expected->zeroPages);
+  CHECK_INT_EQ(stats->duplicatePages, expected->duplicatePages);
+  CHECK_INT_EQ(stats->uniquePages, expected->uniquePages);
+
+  CHECK_INT_EQ(stats->p2mPages, expected->p2mPages);
+  CHECK_INT_EQ(stats->pageSize, expected->pageSize);
+  CHECK(stats->isComplete == expected->isComplete);
+}
+
+// Mostly small pieces: the headers and the pfns are split between the calls.
+static void feed_in_pieces (const TestStream *stream, unsigned seed, StreamInspectorStats *stats) {
+  StreamInspector *inspector;
+  CHECK(stream_inspector_create(&inspector, 0) == 0);
+
+  for (size_t offset = 0; offset < stream->size; ) {
+    const size_t maxSize = rand_r(&seed) % 4 ? 16 : 3 * PAGE_SIZE;
+    size_t size = (size_t)rand_r(&seed) % maxSize + 1;
+    if (size > stream->size - offset)
+      size = stream->size - offset;
+    stream_inspector_feed(inspector, stream->data + offset, size);
+    offset += size;
+  }
+
+  stream_inspector_get_stats(inspector, stats);
+  stream_inspector_destroy(inspector);
+}
+
+static void check_stream (const TestStream *stream, const StreamInspectorStats *expected) {
+  StreamInspectorStats stats;
+
+  StreamInspector *inspector;
+  CHECK(stream_inspector_create(&inspector, 0) == 0);
+  stream_inspector_feed(inspector, stream->data, stream->size);
+  stream_inspector_get_stats(inspector, &stats);
+  stream_inspector_destroy(inspector);
+  check_stats(&stats, expected);
+
+  for (unsigned seed = 1; seed <= 20; ++seed) {
+    feed_in_pieces(stream, seed, &stats);
+    check_stats(&stats, expected);
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+static void test_stream_inspector_records () {
+  TestStream stream = { 0 };
+  add_image_header(&stream, 3, 0);
+  add_domain_header(&stream, PAGE_SHIFT);
+  add_opaque_record(&stream, RECORD_X86_PV_INFO, 8);
+
+  // The size of the guest is the end of the last P2M range. A record without
+  // range is skipped.
+  add_p2m_frames(&stream, 0, 1023);
+  add_p2m_frames(&stream, 1024, 2047);
+  add_p2m_frames(&stream, 0, 511);
+  add_opaque_record(&stream, STREAM_RECORD_X86_PV_P2M_FRAMES, 4);
+
+  // Pages without data and typed pages with data.
+  const uint64_t pfns[] = {
+    10, 11 | PFN_XTAB, 12 | PFN_BROKEN, 13 | PFN_XALLOC, 14 | PFN_L1TAB, 15, 16 | PFN_XTAB, 20
+  };
+  add_page_data(&stream, pfns, sizeof pfns / sizeof pfns[0]);
+  add_page_data_range(&stream, 100, 1, 0, 0);
+  add_page_data_range(&stream, 200, 300, PFN_BROKEN, 7);
+
+  // Pages sent again, e.g. dirtied during the live stage.
+  add_page_data_range(&stream, 150, 100, PFN_XTAB, 3);
+  add_page_data_range(&stream, 10, 11, 0, 0);
+
+  // Batches without pages, the last bucket is for 512+ pfns.
+  add_page_data_range(&stream, 1000, 1024, PFN_XTAB, 1);
+  add_page_data_range(&stream, 3000, 2, PFN_XALLOC, 1);
+
+  // Padding, optional and unknown records.
+  add_opaque_record(&stream, RECORD_TOOLSTACK, 13);
+  add_opaque_record(&stream, RECORD_X86_TSC_INFO | RECORD_OPTIONAL, 24);
+  add_opaque_record(&stream, RECORD_UNKNOWN, 5);
+  add_opaque_record(&stream, RECORD_UNKNOWN + 1, 0);
+
+  add_page_data_range(&stream, 2040, 8, 0, 0);
+  add_end(&stream);
+  add_other_data(&stream, 100);
+
+  CHECK_INT_EQ(stream.stats.p2mPages, 2048);
+  CHECK(stream.stats.duplicatePages > 0 && stream.stats.zeroPages > 0);
+  check_stream(&stream, &stream.stats);
+
+  free(stream.data);
+
+  // Version 2, large pages and no END record.
+  stream = (TestStream){ 0 };
+  add_image_header(&stream, 2, 0);
+  add_domain_header(&stream, 21);
+  add_page_data_range(&stream, 0, 2, 0, 0);
+  add_page_data_range(&stream, 1, 1, 0, 0);
+  check_stream(&stream, &stream.stats);
+  free(stream.data);
+}
+
+// The data after an invalid header is not parsed.
+static void test_stream_inspector_invalid_headers () {
+  for (int i = 0; i < 5; ++i) {
+    TestStream stream = { 0 };
+    if (i == 0) {
+      add_image_header(&stream, 3, 0);
+      stream.data[0] = 0;
+    } else if (i == 1) {
+      add_image_header(&stream, 3, 0);
+      write_be32(stream.data + 8, IMAGE_ID + 1);
+    } else if (i == 2)
+      add_image_header(&stream, 4, 0);
+    else if (i == 3)
+      add_image_header(&stream, 3, IMAGE_OPTION_BIG_ENDIAN);
+    else {
+      add_image_header(&stream, 3, 0);
+      add_domain_header(&stream, 22);
+    }
+    if (i < 4)
+      add_domain_header(&stream, PAGE_SHIFT);
+    add_page_data_range(&stream, 0, 4, 0, 0);
+    add_end(&stream);
+
+    const StreamInspectorStats expected = { .bytes = stream.size, .otherBytes = stream.size };
+    check_stream(&stream, &expected);
+    free(stream.data);
+  }
+}
+
+// An invalid PAGE_DATA record stops the inspection: the parsed part of its
+// record is counted, the pfns of its batch are not.
+static void test_stream_inspector_invalid_page_data () {
+  for (int i = 0; i < 4; ++i) {
+    TestStream stream = { 0 };
+    add_image_header(&stream, 3, 0);
+    add_domain_header(&stream, PAGE_SHIFT);
+    add_page_data_range(&stream, 0, 4, 0, 0);
+
+    StreamInspectorStats expected = stream.stats;
+    const size_t offset = stream.size;
+
+    uint32_t count = 4;
+    uint32_t length = BATCH_HEADER_SIZE + count * 8 + count * PAGE_SIZE;
+    size_t parsedSize = RECORD_HEADER_SIZE + BATCH_HEADER_SIZE;
+    if (i == 0) {
+      length = 4;
+      parsedSize = RECORD_HEADER_SIZE;
+    } else if (i == 1)
+      count = 0;
+    else if (i == 2)
+      length = BATCH_HEADER_SIZE + count * 8 - 8;
+    else {
+      // One page is missing.
+      length -= PAGE_SIZE;
+      parsedSize += count * 8;
+    }
+
+    char *record = stream_reserve(&stream, RECORD_HEADER_SIZE + length);
+    byte_order_write_le32(record, STREAM_RECORD_PAGE_DATA);
+    byte_order_write_le32(record + 4, length);
+    if (length >= BATCH_HEADER_SIZE)
+      byte_order_write_le32(record + RECORD_HEADER_SIZE, count);
+    for (uint32_t j = 0; j < count && BATCH_HEADER_SIZE + (j + 1) * 8 <= length; ++j)
+      byte_order_write_le64(record + RECORD_HEADER_SIZE + BATCH_HEADER_SIZE + j * 8, 100 + j);
+
+    // Not parsed.
+    add_page_data_range(&stream, 200, 4, 0, 0);
+    add_end(&stream);
+
+    expected.bytes = stream.size;
+    expected.recordBytes[STREAM_RECORD_PAGE_DATA] += parsedSize;
+    expected.otherBytes += stream.size - offset - parsedSize;
+    check_stream(&stream, &expected);
+    free(stream.data);
+  }
+}
+
+// =============================================================================
+// Progress of a save without progress events, see: emu_get_stream_progress.
+// The pages of a PV stream are compared to the size of the guest in its P2M
+// records. A HVM stream has no P2M record: the fake total is used, the
+// progress is only given at the end.
+// =============================================================================
+
+#define BATCH_PAGES 256
+#define GUEST_PAGES (4 * BATCH_PAGES)
+
+static const char PvProgress[] = "info:\\b\\b\\b\\b25";
+static const char HvmProgress[] = "info:\\b\\b\\b\\b0";
+static const char ProgressPrefix[] = "info:\\b\\b\\b\\b";
+
+typedef struct ProgressTest {
+  TestStream stream;
+  size_t firstPartSize; // Headers and first batch.
+  const char *progress; // Sent by emu-manager after the first batch.
+  StandInXenopsd *xenopsd;
+
+  // Relayed stream, compared with the written one.
+  int sinkFd;
+  size_t sinkSize;
+  pthread_mutex_t mutex;
+  pthread_cond_t received;
+  pthread_t sinkThread;
+} ProgressTest;
+
+static void *progress_sink_thread (void *userData) {
+  ProgressTest *test = userData;
+
+  char buf[65536];
+  ssize_t ret;
+  while ((ret = read(test->sinkFd, buf, sizeof buf)) > 0) {
+    pthread_mutex_lock(&test->mutex);
+    CHECK(test->sinkSize + (size_t)ret <= test->stream.size);
+    CHECK(!memcmp(buf, test->stream.data + test->sinkSize, (size_t)ret));
+    test->sinkSize += (size_t)ret;
+    pthread_cond_broadcast(&test->received);
+    pthread_mutex_unlock(&test->mutex);
+  }
+  CHECK(ret == 0);
+
+  return NULL;
+}
+
+// The data received by the sink is inspected: it's given to the inspector
+// before being forwarded.
+static void progress_wait_sink (ProgressTest *test, size_t size) {
+  pthread_mutex_lock(&test->mutex);
+  while (test->sinkSize < size)
+    pthread_cond_wait(&test->received, &test->mutex);
+  pthread_mutex_unlock(&test->mutex);
+}
+
+static void progress_write (int fd, const char *data, size_t size) {
+  for (size_t offset = 0; offset < size; ) {
+    const ssize_t ret = write(fd, data + offset, size - offset);
+    CHECK(ret > 0);
+    offset += (size_t)ret;
+  }
+}
+
+static void progress_source_main (StandInEmp *emp) {
+  ProgressTest *test = emp->userData;
+
+  while (stand_in_emp_next_cmd(emp, 10000) > 0) {
+    stand_in_emp_reply(emp);
+    if (stand_in_emp_cmd_is(emp, "migrate_nonlive"))
+      break;
+  }
+  CHECK(stand_in_emp_cmd_is(emp, "migrate_nonlive"));
+  CHECK(emp->streamFd > -1);
+
+  progress_write(emp->streamFd, test->stream.data, test->firstPartSize);
+  progress_wait_sink(test, test->firstPartSize);
+
+  // Each event wakes emu-manager up: the progress is computed again. The
+  // events have no progress, so the stream is used.
+  int wakeUps = 0;
+  do {
+    CHECK(wakeUps++ < 100);
+    stand_in_emp_send_event(emp, "\"sent\":0");
+  } while (!stand_in_xenopsd_wait(test->xenopsd, test->progress, 100) || wakeUps < 3);
+
+  progress_write(emp->streamFd, test->stream.data + test->firstPartSize, test->stream.size - test->firstPartSize);
+  progress_wait_sink(test, test->stream.size);
+  close(emp->streamFd);
+  emp->streamFd = -1;
+
+  stand_in_emp_send_event(emp, "\"status\":\"completed\"");
+  stand_in_emp_serve(emp);
+}
+
+// Progress values sent to xenopsd, in order.
+static void check_progress_values (const StandInXenopsd *xenopsd, bool isFallback) {
+  const size_t len = strlen(ProgressPrefix);
+  int last = -1;
+  for (const char *message = xenopsd->messages; (message = strstr(message, ProgressPrefix)); ) {
+    message += len;
+    const int progress = atoi(message);
+    CHECK(progress >= last && progress <= 100);
+    CHECK(!isFallback || progress == 0 || progress == 100);
+    last = progress;
+  }
+  CHECK(last > -1);
+}
+
+static int test_stream_inspector_progress (bool isPv) {
+  const unsigned domId = test_get_dom_id();
+
+  StandInXenopsd xenopsd = { 0 };
+  ProgressTest test = {
+    .progress = isPv ? PvProgress : HvmProgress,
+    .xenopsd = &xenopsd
+  };
+  add_image_header(&test.stream, 3, 0);
+  add_domain_header(&test.stream, PAGE_SHIFT);
+  if (isPv)
+    add_p2m_frames(&test.stream, 0, GUEST_PAGES - 1);
+  add_page_data_range(&test.stream, 0, BATCH_PAGES, 0, 0);
+  test.firstPartSize = test.stream.size;
+  for (uint32_t pfn = BATCH_PAGES; pfn < GUEST_PAGES; pfn += BATCH_PAGES)
+    add_page_data_range(&test.stream, pfn, BATCH_PAGES, 0, 0);
+  add_end(&test.stream);
+
+  StandInEmp emp;
+  int ret = stand_in_emp_start(&emp, "xenguest", domId, progress_source_main, &test);
+  if (ret) {
+    free(test.stream.data);
+    return ret;
+  }
+  stand_in_xenopsd_start(&xenopsd);
+
+  int streamFds[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, streamFds) == 0);
+  test.sinkFd = streamFds[0];
+  pthread_mutex_init(&test.mutex, NULL);
+  pthread_cond_init(&test.received, NULL);
+  CHECK(pthread_create(&test.sinkThread, NULL, progress_sink_thread, &test) == 0);
+
+  char args[3][16];
+  snprintf(args[0], sizeof args[0], "%u", domId);
+  snprintf(args[1], sizeof args[1], "%d", streamFds[1]);
+  snprintf(args[2], sizeof args[2], "%d", xenopsd.emuFd);
+
+  const char *const saveArgs[] = {
+    "--mode", isPv ? "save" : "hvm_save",
+    "--live", "false",
+    "--domid", args[0],
+    "--fd", args[1],
+    "--controlinfd", args[2],
+    "--controloutfd", args[2],
+    "--progress-interval-ms", "0",
+    "--inspect-stream",
+    NULL
+  };
+  CHECK_INT_EQ(stand_in_run_migration(saveArgs), 0);
+  stand_in_xenopsd_join(&xenopsd);
+  stand_in_emp_join(&emp);
+  pthread_join(test.sinkThread, NULL);
+  close(streamFds[0]);
+
+  CHECK(stand_in_xenopsd_find(&xenopsd, "result:"));
+  CHECK(stand_in_xenopsd_find(&xenopsd, test.progress));
+  check_progress_values(&xenopsd, !isPv);
+  CHECK_INT_EQ(test.sinkSize, test.stream.size);
+
+  pthread_cond_destroy(&test.received);
+  pthread_mutex_destroy(&test.mutex);
+  free(test.stream.data);
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+int main () {
+  test_init("test-stream-inspector");
+
+  test_stream_inspector_records();
+  test_stream_inspector_invalid_headers();
+  test_stream_inspector_invalid_page_data();
+
+  int ret = test_stream_inspector_progress(true);
+  if (!ret)
+    ret = test_stream_inspector_progress(false);
+  return ret ? ret : EXIT_SUCCESS;
+}
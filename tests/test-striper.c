@@ -0,0 +1,256 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "byte-order.h"
+#include "stand-in.h"
+#include "striper.h"
+#include "test.h"
+
+// =============================================================================
+// Striper: the chunks of a stream are sent over socketpairs and must be
+// delivered in order by the restore side.
+// =============================================================================
+
+static void create_socketpairs (int count, int *saveFds, int *restoreFds) {
+  for (int i = 0; i < count; ++i) {
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) == 0);
+    saveFds[i] = fds[0];
+    restoreFds[i] = fds[1];
+  }
+}
+
+static void close_fds (int count, const int *fds) {
+  for (int i = 0; i < count; ++i)
+    close(fds[i]);
+}
+
+// Returns the size of the read data, -1 with errno set to EAGAIN if the next
+// chunk is not received.
+static ssize_t read_and_check (Striper *restore, size_t offset) {
+  char buf[100000];
+  const ssize_t ret = striper_read(restore, buf, sizeof buf);
+  for (ssize_t i = 0; i < ret; ++i)
+    CHECK(buf[i] == test_pattern_at(offset + (size_t)i));
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+
+// Writes of random sizes, both sides are run by the same thread.
+static void test_striper_round_trip (int count) {
+  int saveFds[STRIPER_MAX_FDS];
+  int restoreFds[STRIPER_MAX_FDS];
+  create_socketpairs(count, saveFds, restoreFds);
+
+  Striper *save;
+  Striper *restore;
+  CHECK(striper_create(&save, saveFds, count, true) == 0);
+  CHECK(striper_create(&restore, restoreFds, count, false) == 0);
+
+  const size_t size = 8 * 1024 * 1024;
+  char *data = malloc(size);
+  CHECK(data);
+  for (size_t i = 0; i < size; ++i)
+    data[i] = test_pattern_at(i);
+
+  unsigned seed = (unsigned)count;
+  size_t written = 0;
+  size_t received = 0;
+  bool isClosed = false;
+  for (;;) {
+    if (written < size) {
+      size_t chunkSize = (size_t)rand_r(&seed) % (1024 * 1024) + 1;
+      if (chunkSize > size - written)
+        chunkSize = size - written;
+
+      const ssize_t ret = striper_write(save, data + written, chunkSize);
+      if (ret > 0)
+        written += (size_t)ret;
+      else
+        CHECK(errno == EAGAIN);
+    } else if (!isClosed) {
+      if (striper_flush(save) == 0) {
+        close_fds(count, saveFds);
+        isClosed = true;
+      } else
+        CHECK(errno == EAGAIN);
+    }
+
+    const ssize_t ret = read_and_check(restore, received);
+    if (ret == 0)
+      break;
+    if (ret > 0)
+      received += (size_t)ret;
+    else
+      CHECK(errno == EAGAIN);
+  }
+
+  CHECK(isClosed);
+  CHECK_INT_EQ(received, size);
+
+  free(data);
+  striper_destroy(save);
+  striper_destroy(restore);
+  close_fds(count, restoreFds);
+}
+
+// -----------------------------------------------------------------------------
+
+static void send_chunk (int fd, uint64_t seq, size_t offset, size_t size) {
+  char buf[16 + 4096];
+  CHECK(size <= sizeof buf - 16);
+
+  memcpy(buf, "EMS1", 4);
+  byte_order_write_le32(buf + 4, (uint32_t)size);
+  byte_order_write_le64(buf + 8, seq);
+  for (size_t i = 0; i < size; ++i)
+    buf[16 + i] = test_pattern_at(offset + i);
+  CHECK(write(fd, buf, 16 + size) == (ssize_t)(16 + size));
+}
+
+// The chunks are received in the reverse order.
+static void test_striper_reorder () {
+  int saveFds[3];
+  int restoreFds[3];
+  create_socketpairs(3, saveFds, restoreFds);
+
+  Striper *restore;
+  CHECK(striper_create(&restore, restoreFds, 3, false) == 0);
+
+  send_chunk(saveFds[2], 2, 200, 100);
+  CHECK(read_and_check(restore, 0) < 0 && errno == EAGAIN);
+  send_chunk(saveFds[1], 1, 100, 100);
+  CHECK(read_and_check(restore, 0) < 0 && errno == EAGAIN);
+  send_chunk(saveFds[0], 0, 0, 100);
+  close_fds(3, saveFds);
+
+  size_t received = 0;
+  ssize_t ret;
+  while ((ret = read_and_check(restore, received)) > 0)
+    received += (size_t)ret;
+  CHECK_INT_EQ(ret, 0);
+  CHECK_INT_EQ(received, 300);
+
+  striper_destroy(restore);
+  close_fds(3, restoreFds);
+}
+
+// A missing chunk, a truncated chunk or a bad header is an error.
+static void test_striper_broken_streams () {
+  for (int i = 0; i < 3; ++i) {
+    int saveFds[2];
+    int restoreFds[2];
+    create_socketpairs(2, saveFds, restoreFds);
+
+    Striper *restore;
+    CHECK(striper_create(&restore, restoreFds, 2, false) == 0);
+
+    int expectedError;
+    if (i == 0) {
+      send_chunk(saveFds[1], 1, 100, 100);
+      expectedError = EPIPE;
+    } else if (i == 1) {
+      send_chunk(saveFds[0], 0, 0, 100);
+      CHECK(write(saveFds[1], "EMS1", 4) == 4);
+      expectedError = EPIPE;
+    } else {
+      CHECK(write(saveFds[0], "BAD!0123456789AB", 16) == 16);
+      expectedError = EBADMSG;
+    }
+    close_fds(2, saveFds);
+
+    size_t received = 0;
+    ssize_t ret;
+    while ((ret = read_and_check(restore, received)) > 0)
+      received += (size_t)ret;
+    CHECK(ret < 0);
+    CHECK_INT_EQ(errno, expectedError);
+
+    striper_destroy(restore);
+    close_fds(2, restoreFds);
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+typedef struct Writer {
+  int fd;
+  size_t size;
+  pthread_t thread;
+} Writer;
+
+static void *writer_thread (void *userData) {
+  Writer *writer = userData;
+
+  char buf[65536];
+  for (size_t offset = 0; offset < writer->size; ) {
+    size_t size = writer->size - offset < sizeof buf ? writer->size - offset : sizeof buf;
+    for (size_t i = 0; i < size; ++i)
+      buf[i] = test_pattern_at(offset + i);
+
+    const ssize_t ret = write(writer->fd, buf, size);
+    CHECK(ret > 0);
+    offset += (size_t)ret;
+  }
+  close(writer->fd);
+  return NULL;
+}
+
+// A save relay and a restore relay linked by striped socketpairs.
+static void test_striper_relays (int count) {
+  StandInStripedStream stream;
+  stand_in_striped_stream_create(&stream, count);
+
+  Writer writer = { .fd = stream.saveFd, .size = 32 * 1024 * 1024 + 123 };
+  CHECK(pthread_create(&writer.thread, NULL, writer_thread, &writer) == 0);
+
+  char buf[65536];
+  size_t received = 0;
+  ssize_t ret;
+  while ((ret = read(stream.restoreFd, buf, sizeof buf)) > 0) {
+    for (ssize_t i = 0; i < ret; ++i)
+      CHECK(buf[i] == test_pattern_at(received + (size_t)i));
+    received += (size_t)ret;
+  }
+  CHECK_INT_EQ(ret, 0);
+  CHECK_INT_EQ(received, writer.size);
+
+  pthread_join(writer.thread, NULL);
+  stand_in_striped_stream_destroy(&stream);
+}
+
+int main () {
+  test_init("test-striper");
+
+  for (int count = 1; count <= STRIPER_MAX_FDS; ++count)
+    test_striper_round_trip(count);
+  test_striper_reorder();
+  test_striper_broken_streams();
+  test_striper_relays(2);
+  test_striper_relays(STRIPER_MAX_FDS);
+
+  return EXIT_SUCCESS;
+}
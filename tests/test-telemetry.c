@@ -0,0 +1,164 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "emu.h"
+#include "telemetry.h"
+#include "test.h"
+
+// =============================================================================
+// Telemetry files of the current version and of the version 1, which has no
+// stream counts. The reader is given by EMU_MANAGER_TELEMETRY, see:
+// tests/CMakeLists.txt.
+// =============================================================================
+
+static char TelemetryDir[] = "/tmp/emu-manager-test-XXXXXX";
+
+static void get_path (char *path, size_t size, unsigned domId, const char *suffix) {
+  const int ret = snprintf(path, size, "%s/emu-manager-%u.telemetry%s", TelemetryDir, domId, suffix);
+  CHECK(ret > 0 && (size_t)ret < size);
+}
+
+static off_t get_file_size (const char *path) {
+  struct stat buf;
+  CHECK(stat(path, &buf) == 0);
+  return buf.st_size;
+}
+
+static void check_header (const char *path, unsigned domId, uint32_t version, uint32_t recordSize) {
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  CHECK(fd >= 0);
+
+  TelemetryHeader header;
+  CHECK(read(fd, &header, sizeof header) == sizeof header);
+  CHECK(!memcmp(header.magic, TELEMETRY_MAGIC, sizeof header.magic));
+  CHECK_INT_EQ(header.version, version);
+  CHECK_INT_EQ(header.recordSize, recordSize);
+  CHECK_INT_EQ(header.domId, domId);
+
+  close(fd);
+}
+
+// Returns the exit status of the reader, -1 if it is not available.
+static int run_reader (const char *path) {
+  const char *reader = getenv("EMU_MANAGER_TELEMETRY");
+  if (!reader)
+    return -1;
+
+  char command[2 * PATH_MAX];
+  const int ret = snprintf(command, sizeof command, "%s %s > /dev/null", reader, path);
+  CHECK(ret > 0 && (size_t)ret < sizeof command);
+
+  const int status = system(command);
+  CHECK(status != -1 && WIFEXITED(status));
+  return WEXITSTATUS(status);
+}
+
+static void write_records (unsigned domId, int count) {
+  Emu emu = {
+    .name = "xenguest",
+    .type = EmuTypeEmp,
+    .phase = EmuPhaseLive
+  };
+
+  CHECK(telemetry_open(TelemetryDir, domId) == 0);
+  for (int i = 0; i < count; ++i) {
+    emu.convergence.iteration = i;
+    telemetry_write(&emu);
+  }
+  telemetry_close();
+}
+
+// -----------------------------------------------------------------------------
+
+// The records are appended to an existing file of the current version.
+static void test_telemetry_append (unsigned domId) {
+  char path[PATH_MAX];
+  get_path(path, sizeof path, domId, "");
+
+  write_records(domId, 2);
+  write_records(domId, 3);
+
+  check_header(path, domId, TELEMETRY_VERSION, sizeof(TelemetryRecord));
+  CHECK_INT_EQ(get_file_size(path), sizeof(TelemetryHeader) + 5 * sizeof(TelemetryRecord));
+
+  const int ret = run_reader(path);
+  CHECK(ret == -1 || ret == EXIT_SUCCESS);
+}
+
+// A file of the version 1 is kept for the reader.
+static void test_telemetry_v1 (unsigned domId) {
+  char path[PATH_MAX];
+  get_path(path, sizeof path, domId, "");
+  char oldPath[PATH_MAX];
+  get_path(oldPath, sizeof oldPath, domId, ".old");
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  CHECK(fd >= 0);
+
+  TelemetryHeader header = { .version = 1, .recordSize = TELEMETRY_V1_RECORD_SIZE, .domId = domId };
+  memcpy(header.magic, TELEMETRY_MAGIC, sizeof header.magic);
+  CHECK(write(fd, &header, sizeof header) == sizeof header);
+
+  for (int i = 0; i < 4; ++i) {
+    TelemetryRecord record = { .timestamp = i * 100000, .sent = i * 4096, .iteration = i, .phase = EmuPhaseLive };
+    strcpy(record.emu, "xenguest");
+    CHECK(write(fd, &record, TELEMETRY_V1_RECORD_SIZE) == (ssize_t)TELEMETRY_V1_RECORD_SIZE);
+  }
+  close(fd);
+  const off_t oldSize = get_file_size(path);
+
+  write_records(domId, 1);
+
+  CHECK_INT_EQ(get_file_size(oldPath), oldSize);
+  check_header(oldPath, domId, 1, TELEMETRY_V1_RECORD_SIZE);
+  check_header(path, domId, TELEMETRY_VERSION, sizeof(TelemetryRecord));
+  CHECK_INT_EQ(get_file_size(path), sizeof(TelemetryHeader) + sizeof(TelemetryRecord));
+
+  int ret = run_reader(oldPath);
+  CHECK(ret == -1 || ret == EXIT_SUCCESS);
+
+  // The header of an unknown version is rejected.
+  CHECK((fd = open(oldPath, O_WRONLY | O_CLOEXEC)) >= 0);
+  header.version = TELEMETRY_VERSION + 1;
+  CHECK(write(fd, &header, sizeof header) == sizeof header);
+  close(fd);
+  ret = run_reader(oldPath);
+  CHECK(ret == -1 || ret == EXIT_FAILURE);
+}
+
+int main () {
+  test_init("test-telemetry");
+  CHECK(mkdtemp(TelemetryDir));
+
+  const unsigned domId = test_get_dom_id();
+  test_telemetry_append(domId);
+  test_telemetry_v1(domId + 1);
+
+  char command[PATH_MAX];
+  snprintf(command, sizeof command, "rm -rf %s", TelemetryDir);
+  CHECK(system(command) == 0);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,55 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <signal.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "emu.h"
+#include "test.h"
+
+// =============================================================================
+
+void test_init (const char *name) {
+  const bool verbose = getenv("TEST_VERBOSE");
+  openlog(name, LOG_PID | LOG_PERROR, LOG_USER);
+  setlogmask(LOG_UPTO(verbose ? LOG_DEBUG : LOG_ERR));
+
+  struct sigaction sigact = { .sa_handler = SIG_IGN };
+  sigemptyset(&sigact.sa_mask);
+  sigaction(SIGPIPE, &sigact, 0);
+
+  // The stand-in emus are run by the test, they are not started.
+  emu_manager_set_xenguest_path(NULL);
+}
+
+void bench_print_rate (const char *label, double count, const char *unit, int64_t duration) {
+  const double seconds = (double)(duration > 0 ? duration : 1) / 1e6;
+  printf("%-32s %12.1f %s/s (%.3f s)\n", label, count / seconds, unit, seconds);
+}
+
+unsigned test_get_dom_id () {
+  // Unique EMP sockets when tests are run in parallel.
+  return 30000 + (unsigned)getpid() % 2000;
+}
+
+char test_pattern_at (size_t offset) {
+  return (char)(offset * 31 + offset / 4096);
+}
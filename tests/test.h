@@ -0,0 +1,64 @@
+/*
+ * xcp-emu-manager
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TEST_H_
+#define _TEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// =============================================================================
+// Minimal test helpers: a failed check exits the test with an error.
+// =============================================================================
+
+// See: SKIP_RETURN_CODE in tests/CMakeLists.txt.
+#define TEST_SKIP 77
+
+#define CHECK(COND) \
+  do { \
+    if (!(COND)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #COND); \
+      exit(EXIT_FAILURE); \
+    } \
+  } while (0)
+
+#define CHECK_INT_EQ(A, B) \
+  do { \
+    const long long _a = (long long)(A); \
+    const long long _b = (long long)(B); \
+    if (_a != _b) { \
+      fprintf(stderr, "%s:%d: check failed: %s == %s (%lld != %lld)\n", __FILE__, __LINE__, #A, #B, _a, _b); \
+      exit(EXIT_FAILURE); \
+    } \
+  } while (0)
+
+// Log to stderr if TEST_VERBOSE is set and ignore SIGPIPE like main.
+void test_init (const char *name);
+
+// Domain id of the migrations run by the current test process.
+unsigned test_get_dom_id ();
+
+// Byte at offset of the streams written by the tests: not periodic within a
+// page, it changes with the page.
+char test_pattern_at (size_t offset);
+
+// Benchmarks: print the rate of count units processed in duration (us).
+void bench_print_rate (const char *label, double count, const char *unit, int64_t duration);
+
+#endif // ifndef _TEST_H_